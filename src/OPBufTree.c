@@ -353,6 +353,11 @@ void _bad_Mindex_error(int ret_code)
 {
 	if (ret_code == BAD_SUBSCRIPT_TYPE)
 		error("matrix subscript (M-index) must be a numeric matrix");
+	if (ret_code == SUBSCRIPT_IS_TOO_LONG)
+		error("matrix subscript (M-index) is too long");
+	if (ret_code == MAX_OPBUF_LEN_REACHED)
+		error("too many rows in the matrix subscript (M-index) hit the "
+		      "same leaf in the Sparse Vector Tree representation");
 	if (ret_code == SUBSCRIPT_ELT_IS_LESS_THAN_ONE ||
 	    ret_code == SUBSCRIPT_ELT_IS_BEYOND_MAX)
 		error("matrix subscript (M-index) contains "
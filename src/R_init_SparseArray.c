@@ -18,8 +18,14 @@
 #include "SparseArray_Complex_methods.h"
 #include "SparseArray_misc_methods.h"
 #include "SparseArray_matrixStats.h"
+#include "SparseArray_cumulate.h"
+#include "SparseArray_topK.h"
 #include "rowsum_methods.h"
 #include "SparseMatrix_mult.h"
+#include "SparseVec_dotprod.h"  /* for _init_SIMD_dispatch() */
+#include "SparseMatrix_chol.h"
+#include "SparseMatrix_cg.h"
+#include "SparseMatrix_ranks.h"
 #include "randomSparseArray.h"
 #include "readSparseCSV.h"
 #include "test.h"
@@ -76,6 +82,7 @@ static const R_CallMethodDef callMethods[] = {
 /* SparseArray_subassignment.c */
 	CALLMETHOD_DEF(C_subassign_SVT_by_Lindex, 6),
 	CALLMETHOD_DEF(C_subassign_SVT_by_Mindex, 5),
+	CALLMETHOD_DEF(C_subassign_index_shape, 3),
 	CALLMETHOD_DEF(C_subassign_SVT_with_short_Rvector, 5),
 	CALLMETHOD_DEF(C_subassign_SVT_with_Rarray, 5),
 	CALLMETHOD_DEF(C_subassign_SVT_with_SVT, 7),
@@ -88,7 +95,7 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(C_abind_SVT_SparseArray_objects, 4),
 
 /* SparseArray_summarization.c */
-	CALLMETHOD_DEF(C_summarize_SVT, 6),
+	CALLMETHOD_DEF(C_summarize_SVT, 7),
 
 /* SparseArray_Ops_methods.c */
 	CALLMETHOD_DEF(C_unary_minus_SVT, 3),
@@ -110,18 +117,47 @@ static const R_CallMethodDef callMethods[] = {
 /* SparseArray_matrixStats.c */
 	CALLMETHOD_DEF(C_colStats_SVT, 8),
 	CALLMETHOD_DEF(C_rowStats_SVT, 8),
+	CALLMETHOD_DEF(C_colSummaries_SVT, 6),
+	CALLMETHOD_DEF(C_rowSummaries_SVT, 6),
+	CALLMETHOD_DEF(C_colOrderStats_SVT, 10),
+	CALLMETHOD_DEF(C_rowOrderStats_SVT, 10),
+	CALLMETHOD_DEF(C_groupSummaries_SVT, 8),
+
+/* SparseArray_cumulate.c */
+	CALLMETHOD_DEF(C_cumulate_SVT, 7),
+
+/* SparseArray_topK.c */
+	CALLMETHOD_DEF(C_topK_SVT, 6),
 
 /* rowsum_methods.c */
-	CALLMETHOD_DEF(C_rowsum_SVT, 6),
+	CALLMETHOD_DEF(C_rowsum_SVT, 7),
 	CALLMETHOD_DEF(C_rowsum_dgCMatrix, 4),
-	CALLMETHOD_DEF(C_colsum_SVT, 6),
+	CALLMETHOD_DEF(C_colsum_SVT, 7),
 	CALLMETHOD_DEF(C_colsum_dgCMatrix, 4),
+	CALLMETHOD_DEF(C_colWeightedMeans_SVT, 5),
+	CALLMETHOD_DEF(C_rowWeightedMeans_SVT, 5),
 
 /* SparseMatrix_mult.c */
 	CALLMETHOD_DEF(C_crossprod2_SVT_mat, 7),
 	CALLMETHOD_DEF(C_crossprod2_mat_SVT, 7),
 	CALLMETHOD_DEF(C_crossprod2_SVT_SVT, 8),
 	CALLMETHOD_DEF(C_crossprod1_SVT, 5),
+	CALLMETHOD_DEF(C_estimate_SpGEMM_density, 6),
+	CALLMETHOD_DEF(C_SpGEMM_SVT_SVT, 6),
+	CALLMETHOD_DEF(C_sparse_crossprod1_SVT, 7),
+	CALLMETHOD_DEF(C_SpMM_SVT, 7),
+
+/* SparseMatrix_chol.c */
+	CALLMETHOD_DEF(C_mindeg_order_SVT, 2),
+	CALLMETHOD_DEF(C_chol_SVT, 4),
+	CALLMETHOD_DEF(C_backsolve_SVT, 5),
+	CALLMETHOD_DEF(C_is_symmetric_SVT, 3),
+
+/* SparseMatrix_cg.c */
+	CALLMETHOD_DEF(C_cg_SVT, 8),
+
+/* SparseMatrix_ranks.c */
+	CALLMETHOD_DEF(C_colRanks_SVT, 6),
 
 /* randomSparseArray.c */
 	CALLMETHOD_DEF(C_simple_rpois, 2),
@@ -140,6 +176,7 @@ void R_init_SparseArray(DllInfo *info)
 {
 	R_registerRoutines(info, NULL, callMethods, NULL, NULL);
 	R_useDynamicSymbols(info, 0);
+	_init_SIMD_dispatch();
 	return;
 }
 
@@ -126,7 +126,11 @@ void _init_SummarizeResult(const SummarizeOp *summarize_op,
 		return;
 	    case CENTERED_X2_SUM_OPCODE: case VAR1_OPCODE: case SD1_OPCODE:
 		res->out_Rtype = REALSXP;
-		res->outbuf.one_double[0] = 0.0;
+		/* When 'summarize_op->center' is NA, 'outbuf' is used to
+		   store the running (centered X2 sum, mean, count) triplet.
+		   See moments_ints() and moments_doubles() below. */
+		res->outbuf.three_doubles[0] = res->outbuf.three_doubles[1] =
+		res->outbuf.three_doubles[2] = 0.0;
 		return;
 	    case SUM_X_X2_OPCODE: case VAR2_OPCODE: case SD2_OPCODE:
 		res->out_Rtype = REALSXP;
@@ -673,6 +677,109 @@ static inline int centered_X2_sum_doubles(const double *x, int n,
 	return OUTBUF_IS_SET;
 }
 
+/* Merges the (centered X2 sum, mean, count) triplet of a group of 'n2'
+   values into the running triplet stored in 'outbuf', using the pairwise
+   update formula from Chan, Golub & LeVeque (1979). 'n2' must be > 0. */
+static inline void merge_moments(double outbuf[3],
+		double M2, double mean, double n2)
+{
+	double n1 = outbuf[2];
+	if (n1 == 0.0) {
+		outbuf[0] = M2;
+		outbuf[1] = mean;
+		outbuf[2] = n2;
+		return;
+	}
+	double n = n1 + n2;
+	double delta = mean - outbuf[1];
+	outbuf[0] += M2 + delta * delta * (n1 * n2 / n);
+	outbuf[1] += delta * (n2 / n);
+	outbuf[2] = n;
+	return;
+}
+
+/* 'outbuf' initialized by _init_SummarizeResult() above.
+   Single-pass alternative to centered_X2_sum_ints() used when the center
+   is the mean. The mean and centered X2 sum of the 'n' values in 'x' are
+   computed locally (2 passes on 'x', which is typically small enough to
+   stay in cache), then merged into the running triplet in 'outbuf'. */
+static inline int moments_ints(const int *x, int n,
+		int na_rm, R_xlen_t *nacount,
+		double outbuf[3])
+{
+	double sum = 0.0;
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (x[i] == NA_INTEGER) {
+			if (na_rm) {
+				(*nacount)++;
+				continue;
+			}
+			/* Bail out early. */
+			outbuf[0] = NA_REAL;
+			return OUTBUF_IS_SET_WITH_BREAKING_VALUE;
+		}
+		sum += (double) x[i];
+		count++;
+	}
+	if (count == 0)
+		return OUTBUF_IS_SET;
+	double mean = sum / count, M2 = 0.0;
+	for (int i = 0; i < n; i++) {
+		if (x[i] == NA_INTEGER)
+			continue;
+		double delta = (double) x[i] - mean;
+		M2 += delta * delta;
+	}
+	merge_moments(outbuf, M2, mean, (double) count);
+	return OUTBUF_IS_SET;
+}
+
+/* 'outbuf' initialized by _init_SummarizeResult() above.
+   See moments_ints() above. */
+static inline int moments_doubles(const double *x, int n,
+		int na_rm, R_xlen_t *nacount,
+		double outbuf[3])
+{
+	double out0 = outbuf[0];
+	double sum = 0.0;
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		double xx = x[i];
+		if (ISNAN(xx)) {  // True for *both* NA and NaN
+			if (na_rm) {
+				(*nacount)++;
+				continue;
+			}
+			if (R_IsNA(xx)) {
+				/* Bail out early. */
+				outbuf[0] = NA_REAL;
+				return OUTBUF_IS_SET_WITH_BREAKING_VALUE;
+			}
+			out0 = xx;
+			continue;
+		}
+		sum += xx;
+		count++;
+	}
+	if (R_IsNaN(out0)) {
+		outbuf[0] = out0;
+		return OUTBUF_IS_SET;
+	}
+	if (count == 0)
+		return OUTBUF_IS_SET;
+	double mean = sum / count, M2 = 0.0;
+	for (int i = 0; i < n; i++) {
+		double xx = x[i];
+		if (ISNAN(xx))
+			continue;
+		double delta = xx - mean;
+		M2 += delta * delta;
+	}
+	merge_moments(outbuf, M2, mean, (double) count);
+	return OUTBUF_IS_SET;
+}
+
 /* 'outbuf' initialized by _init_SummarizeResult() above. */
 static inline int sum_X_X2_ints(const int *x, int n,
 		int na_rm, R_xlen_t *nacount,
@@ -810,13 +917,19 @@ static int summarize_ones(SEXPTYPE x_Rtype, int x_len,
 	    case PROD_OPCODE:
 		return OUTBUF_IS_SET;
 	    case CENTERED_X2_SUM_OPCODE: case VAR1_OPCODE: case SD1_OPCODE: {
+		if (ISNAN(center)) {
+			if (!R_IsNaN(res->outbuf.three_doubles[0]))
+				merge_moments(res->outbuf.three_doubles,
+					      0.0, 1.0, (double) x_len);
+			return OUTBUF_IS_SET;
+		}
 		double delta = 1.0 - center;
 		res->outbuf.one_double[0] += delta * delta * x_len;
 		return OUTBUF_IS_SET;
 	    }
 	    case SUM_X_X2_OPCODE: case VAR2_OPCODE: case SD2_OPCODE:
-		res->outbuf.two_doubles[0] += 1.0;
-		res->outbuf.two_doubles[1] += 1.0;
+		res->outbuf.two_doubles[0] += (double) x_len;
+		res->outbuf.two_doubles[1] += (double) x_len;
 		return OUTBUF_IS_SET;
 	}
 	error("SparseArray internal error in summarize_ones():\n"
@@ -855,6 +968,9 @@ static int summarize_ints(const int *x, int x_len,
 		return prod_ints(x, x_len, na_rm, nacount_p,
 				res->outbuf.one_double);
 	    case CENTERED_X2_SUM_OPCODE: case VAR1_OPCODE: case SD1_OPCODE:
+		if (ISNAN(center))
+			return moments_ints(x, x_len, na_rm, nacount_p,
+					res->outbuf.three_doubles);
 		return centered_X2_sum_ints(x, x_len, na_rm,
 				center, nacount_p,
 				res->outbuf.one_double);
@@ -892,6 +1008,9 @@ static int summarize_doubles(const double *x, int x_len,
 		return prod_doubles(x, x_len, na_rm, nacount_p,
 				res->outbuf.one_double);
 	    case CENTERED_X2_SUM_OPCODE: case VAR1_OPCODE: case SD1_OPCODE:
+		if (ISNAN(center))
+			return moments_doubles(x, x_len, na_rm, nacount_p,
+					res->outbuf.three_doubles);
 		return centered_X2_sum_doubles(x, x_len, na_rm,
 				center, nacount_p,
 				res->outbuf.one_double);
@@ -997,6 +1116,171 @@ void _summarize_Rvector(SEXP x, const SummarizeOp *summarize_op,
 }
 
 
+/****************************************************************************
+ * _merge_SummarizeResults()
+ *
+ * Merges 'res2' into 'res1'. Both must have been obtained with the same
+ * 'summarize_op' and must not be postprocessed yet. 'res2' is assumed to
+ * summarize a virtual vector that comes AFTER the virtual vector summarized
+ * by 'res1'. This matters only when both results are NaNs, in which case
+ * the NaN in 'res2' is kept, like when summarizing the concatenation of the
+ * two vectors in one go.
+ * Note that a result with a breaking value absorbs anything it's merged
+ * with. This is safe because, for a given operation, the breaking value is
+ * always the same (e.g. NA for min() or sum(), TRUE for any() or anyNA()).
+ */
+
+static inline void merge_sums(double *out, double x)
+{
+	if (R_IsNaN(x)) {
+		*out = x;
+	} else if (!R_IsNaN(*out)) {
+		*out += x;
+	}
+	return;
+}
+
+static inline void merge_prods(double *out, double x)
+{
+	if (R_IsNaN(x)) {
+		*out = x;
+	} else if (!R_IsNaN(*out)) {
+		*out *= x;
+	}
+	return;
+}
+
+static inline void merge_mins(double *out, double x)
+{
+	if (R_IsNaN(x)) {
+		*out = x;
+	} else if (!R_IsNaN(*out) && x < *out) {
+		*out = x;
+	}
+	return;
+}
+
+static inline void merge_maxs(double *out, double x)
+{
+	if (R_IsNaN(x)) {
+		*out = x;
+	} else if (!R_IsNaN(*out) && x > *out) {
+		*out = x;
+	}
+	return;
+}
+
+static void merge_int_outbufs(int opcode,
+		SummarizeResult *res1, const SummarizeResult *res2)
+{
+	if (res2->outbuf_status == OUTBUF_IS_NOT_SET)
+		return;
+	if (res1->outbuf_status == OUTBUF_IS_NOT_SET) {
+		res1->outbuf = res2->outbuf;
+		res1->outbuf_status = res2->outbuf_status;
+		return;
+	}
+	int *out1 = res1->outbuf.two_ints;
+	const int *out2 = res2->outbuf.two_ints;
+	switch (opcode) {
+	    case MIN_OPCODE:
+		if (out2[0] < out1[0])
+			out1[0] = out2[0];
+		return;
+	    case MAX_OPCODE:
+		if (out2[0] > out1[0])
+			out1[0] = out2[0];
+		return;
+	    case RANGE_OPCODE:
+		if (out2[0] < out1[0])
+			out1[0] = out2[0];
+		if (out2[1] > out1[1])
+			out1[1] = out2[1];
+		return;
+	}
+	return;
+}
+
+void _merge_SummarizeResults(const SummarizeOp *summarize_op,
+		SummarizeResult *res1, const SummarizeResult *res2)
+{
+	if (res1->outbuf_status == OUTBUF_IS_SET_WITH_BREAKING_VALUE)
+		return;
+	if (res2->outbuf_status == OUTBUF_IS_SET_WITH_BREAKING_VALUE) {
+		*res1 = *res2;
+		return;
+	}
+	res1->in_length += res2->in_length;
+	res1->in_nzcount += res2->in_nzcount;
+	res1->in_nacount += res2->in_nacount;
+	SummarizeOutbuf *out1 = &(res1->outbuf);
+	const SummarizeOutbuf *out2 = &(res2->outbuf);
+	int opcode = summarize_op->opcode;
+	switch (opcode) {
+	    case ANYNA_OPCODE:
+		return;  /* both outbufs are set to FALSE */
+	    case ANY_OPCODE: case ALL_OPCODE:
+		/* Each outbuf is set to NA or to the initial value. */
+		if (out2->one_int[0] == NA_INTEGER)
+			out1->one_int[0] = NA_INTEGER;
+		return;
+	    case COUNTNAS_OPCODE:
+		out1->one_double[0] += out2->one_double[0];
+		return;
+	    case MIN_OPCODE: case MAX_OPCODE: case RANGE_OPCODE:
+		if (res1->out_Rtype == INTSXP) {
+			merge_int_outbufs(opcode, res1, res2);
+			return;
+		}
+		if (opcode == MIN_OPCODE) {
+			merge_mins(out1->one_double, out2->one_double[0]);
+		} else if (opcode == MAX_OPCODE) {
+			merge_maxs(out1->one_double, out2->one_double[0]);
+		} else if (R_IsNaN(out2->two_doubles[0])) {
+			out1->two_doubles[0] = out2->two_doubles[0];
+			out1->two_doubles[1] = out2->two_doubles[1];
+		} else if (!R_IsNaN(out1->two_doubles[0])) {
+			merge_mins(out1->two_doubles, out2->two_doubles[0]);
+			merge_maxs(out1->two_doubles + 1, out2->two_doubles[1]);
+		}
+		return;
+	    case CENTERED_X2_SUM_OPCODE: case VAR1_OPCODE: case SD1_OPCODE:
+		if (ISNAN(summarize_op->center)) {
+			if (R_IsNaN(out2->three_doubles[0])) {
+				out1->three_doubles[0] = out2->three_doubles[0];
+			} else if (!R_IsNaN(out1->three_doubles[0]) &&
+				   out2->three_doubles[2] != 0.0) {
+				merge_moments(out1->three_doubles,
+					      out2->three_doubles[0],
+					      out2->three_doubles[1],
+					      out2->three_doubles[2]);
+			}
+			return;
+		}
+		merge_sums(out1->one_double, out2->one_double[0]);
+		return;
+	    case SUM_OPCODE: case MEAN_OPCODE:
+		merge_sums(out1->one_double, out2->one_double[0]);
+		return;
+	    case PROD_OPCODE:
+		merge_prods(out1->one_double, out2->one_double[0]);
+		return;
+	    case SUM_X_X2_OPCODE: case VAR2_OPCODE: case SD2_OPCODE:
+		if (R_IsNaN(out2->two_doubles[0])) {
+			out1->two_doubles[0] = out2->two_doubles[0];
+			out1->two_doubles[1] = out2->two_doubles[1];
+		} else if (!R_IsNaN(out1->two_doubles[0])) {
+			out1->two_doubles[0] += out2->two_doubles[0];
+			out1->two_doubles[1] += out2->two_doubles[1];
+		}
+		return;
+	}
+	error("SparseArray internal error in _merge_SummarizeResults():\n"
+	      "    unsupported 'opcode'");
+	return;  /* will never reach this */
+}
+
+
 /****************************************************************************
  * _postprocess_SummarizeResult()
  */
@@ -1084,7 +1368,15 @@ void _postprocess_SummarizeResult(const SummarizeOp *summarize_op,
 	    }
 	    case CENTERED_X2_SUM_OPCODE: case VAR1_OPCODE: case SD1_OPCODE: {
 		double center = summarize_op->center;
-		res->outbuf.one_double[0] += center * center * zerocount;
+		if (!ISNAN(center)) {
+			res->outbuf.one_double[0] += center * center * zerocount;
+		} else if (zerocount != 0 &&
+			   !R_IsNaN(res->outbuf.three_doubles[0]))
+		{
+			/* Account for the zeros analytically. */
+			merge_moments(res->outbuf.three_doubles,
+				      0.0, 0.0, (double) zerocount);
+		}
 		if (opcode == CENTERED_X2_SUM_OPCODE)
 			return;
 		if (effective_len <= 1) {
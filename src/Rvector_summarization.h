@@ -25,6 +25,8 @@
 /* Other "summarize" operations */
 #define	MEAN_OPCODE             10  /* Interface 2 */
 #define	CENTERED_X2_SUM_OPCODE  11  /* Interface 3, supports VAR1_OPCODE */
+/* When 'center' is NA, ops CENTERED_X2_SUM, VAR1, and SD1 center around
+   the mean, which is computed on the fly (i.e. in the same pass). */
 #define	SUM_X_X2_OPCODE         12  /* Interface 2, supports VAR2_OPCODE  */
 #define	VAR1_OPCODE             13  /* Interface 3, supports SD1_OPCODE  */
 #define	VAR2_OPCODE             14  /* Interface 2, supports SD2_OPCODE  */
@@ -43,6 +45,7 @@ typedef union summarize_outbuf_t {
 	double one_double[1];
 	int two_ints[2];
 	double two_doubles[2];
+	double three_doubles[3];
 	Rcomplex one_Rcomplex[1];  // not used yet
 } SummarizeOutbuf;
 
@@ -91,6 +94,12 @@ void _summarize_Rvector(
 	SummarizeResult *res
 );
 
+void _merge_SummarizeResults(
+	const SummarizeOp *summarize_op,
+	SummarizeResult *res1,
+	const SummarizeResult *res2
+);
+
 void _postprocess_SummarizeResult(
 	const SummarizeOp *summarize_op,
 	SummarizeResult *res
@@ -7,13 +7,14 @@
 #include "SparseVec.h"
 #include "SparseVec_Math.h"
 #include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads() */
 
 
-static SEXP Math_leaf(MathFUN fun, SEXP leaf, double digits, int dim0,
+static SEXP Math_leaf(int opcode, SEXP leaf, double digits, int dim0,
 		double *nzvals_buf, int *nzoffs_buf, int *newNaNs)
 {
 	const SparseVec sv = leaf2SV(leaf, REALSXP, dim0);
-	int buf_len = _Math_doubleSV(fun, &sv, digits,
+	int buf_len = _Math_doubleSV(opcode, &sv, digits,
 				     nzvals_buf, nzoffs_buf, newNaNs);
 	if (buf_len == PROPAGATE_NZOFFS)
 		return _make_leaf_with_single_shared_nzval(
@@ -25,31 +26,87 @@ static SEXP Math_leaf(MathFUN fun, SEXP leaf, double digits, int dim0,
 
 
 /*****************************************************************************
- * Recursive tree traversal
+ * Parallel processing of the leaves
+ *
+ * C_Math_SVT() works in 3 passes:
+ *   1. A serial pass walks the tree and builds the skeleton of the result.
+ *      Each regular input leaf gets an output leaf with a freshly allocated
+ *      (uninitialized) 'nzvals' vector and the same 'nzoffs' vector as the
+ *      input leaf (shared, not copied). Lacunar leaves are processed on the
+ *      fly (there's only one value to compute).
+ *   2. A parallel pass fills the 'nzvals' vectors of the output leaves.
+ *      This doesn't use the R API.
+ *   3. A serial pass removes the zeros produced by the 2nd pass (if any),
+ *      and replaces the output leaves that end up with no nonzero values
+ *      with NULLs.
  */
 
-static SEXP REC_Math_SVT(MathFUN fun, SEXP SVT, double digits,
-			 const int *dim, int ndim,
-			 double *nzvals_buf, int *nzoffs_buf, int *newNaNs)
+typedef struct math_job_t {
+	const double *in_nzvals;
+	double *out_nzvals;
+	int nzcount;
+	SEXP parent;  /* the list that contains the output leaf */
+	int idx;      /* the position of the output leaf in 'parent' */
+	int nzeros;   /* set by the 2nd pass */
+} MathJob;
+
+static int REC_count_leaves(SEXP SVT, int ndim)
 {
 	if (SVT == R_NilValue)
-		return R_NilValue;
+		return 0;
+	if (ndim == 1)
+		return 1;
+	int n = 0, SVT_len = LENGTH(SVT);
+	for (int i = 0; i < SVT_len; i++)
+		n += REC_count_leaves(VECTOR_ELT(SVT, i), ndim - 1);
+	return n;
+}
 
-	if (ndim == 1) {
-		/* 'SVT' is a leaf (i.e. 1D SVT). */
-		return Math_leaf(fun, SVT, digits, dim[0],
+/* Returns the output leaf. Adds a job to 'jobs' if the leaf is a regular
+   leaf. */
+static SEXP prepare_Math_leaf(int opcode, SEXP leaf, double digits, int dim0,
+		SEXP parent, int idx, MathJob *jobs, int *njob,
+		double *nzvals_buf, int *nzoffs_buf, int *newNaNs)
+{
+	SEXP nzvals, nzoffs;
+	int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
+	if (nzvals == R_NilValue)  /* lacunar leaf */
+		return Math_leaf(opcode, leaf, digits, dim0,
 				 nzvals_buf, nzoffs_buf, newNaNs);
-	}
+	SEXP ans_nzvals = PROTECT(NEW_NUMERIC(nzcount));
+	SEXP ans = zip_leaf(ans_nzvals, nzoffs, 0);
+	MathJob *job = jobs + (*njob)++;
+	job->in_nzvals = REAL(nzvals);
+	job->out_nzvals = REAL(ans_nzvals);
+	job->nzcount = nzcount;
+	job->parent = parent;
+	job->idx = idx;
+	UNPROTECT(1);
+	return ans;
+}
 
+static SEXP REC_prepare_Math_SVT(int opcode, SEXP SVT, double digits,
+		const int *dim, int ndim, MathJob *jobs, int *njob,
+		double *nzvals_buf, int *nzoffs_buf, int *newNaNs)
+{
 	/* 'SVT' is a list. */
 	int ans_len = dim[ndim - 1];  /* same as 'LENGTH(SVT)' */
 	SEXP ans = PROTECT(NEW_LIST(ans_len));
 	int is_empty = 1;
 	for (int i = 0; i < ans_len; i++) {
 		SEXP subSVT = VECTOR_ELT(SVT, i);
-		SEXP ans_elt = REC_Math_SVT(fun, subSVT, digits,
-					    dim, ndim - 1,
-					    nzvals_buf, nzoffs_buf, newNaNs);
+		if (subSVT == R_NilValue)
+			continue;
+		SEXP ans_elt;
+		if (ndim == 2) {
+			ans_elt = prepare_Math_leaf(opcode, subSVT, digits,
+					dim[0], ans, i, jobs, njob,
+					nzvals_buf, nzoffs_buf, newNaNs);
+		} else {
+			ans_elt = REC_prepare_Math_SVT(opcode, subSVT, digits,
+					dim, ndim - 1, jobs, njob,
+					nzvals_buf, nzoffs_buf, newNaNs);
+		}
 		if (ans_elt != R_NilValue) {
 			PROTECT(ans_elt);
 			SET_VECTOR_ELT(ans, i, ans_elt);
@@ -61,6 +118,65 @@ static SEXP REC_Math_SVT(MathFUN fun, SEXP SVT, double digits,
 	return is_empty ? R_NilValue : ans;
 }
 
+static int run_Math_jobs(int opcode, MathJob *jobs, int njob, double digits)
+{
+	int newNaNs = 0;
+	int nthread = _get_max_threads();
+	if (nthread > njob)
+		nthread = njob;
+	if (nthread < 1)
+		nthread = 1;
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(nthread) \
+		reduction(|:newNaNs)
+	for (int j = 0; j < njob; j++) {
+		MathJob *job = jobs + j;
+		int job_newNaNs = 0;
+		job->nzeros = _Math_doubles(opcode, job->in_nzvals,
+					    job->nzcount, digits,
+					    job->out_nzvals, &job_newNaNs);
+		newNaNs |= job_newNaNs;
+	}
+	return newNaNs;
+}
+
+/* Returns 1 if some output leaves were replaced with NULLs. */
+static int finalize_Math_leaves(const MathJob *jobs, int njob,
+		int *selection_buf)
+{
+	int has_new_NULLs = 0;
+	for (int j = 0; j < njob; j++) {
+		const MathJob *job = jobs + j;
+		SEXP leaf = VECTOR_ELT(job->parent, job->idx);
+		if (job->nzeros == job->nzcount) {
+			SET_VECTOR_ELT(job->parent, job->idx, R_NilValue);
+			has_new_NULLs = 1;
+		} else if (job->nzeros != 0) {
+			_INPLACE_remove_zeros_from_leaf(leaf, selection_buf);
+		} else {
+			_INPLACE_turn_into_lacunar_leaf_if_all_ones(leaf);
+		}
+	}
+	return has_new_NULLs;
+}
+
+/* Replaces the lists that contain only NULLs with NULLs. */
+static SEXP REC_drop_empty_lists(SEXP SVT, int ndim)
+{
+	if (SVT == R_NilValue || ndim == 1)
+		return SVT;
+	int SVT_len = LENGTH(SVT);
+	int is_empty = 1;
+	for (int i = 0; i < SVT_len; i++) {
+		SEXP subSVT = VECTOR_ELT(SVT, i);
+		SEXP new_subSVT = REC_drop_empty_lists(subSVT, ndim - 1);
+		if (new_subSVT != subSVT)
+			SET_VECTOR_ELT(SVT, i, new_subSVT);
+		if (new_subSVT != R_NilValue)
+			is_empty = 0;
+	}
+	return is_empty ? R_NilValue : SVT;
+}
+
 
 /*****************************************************************************
  * C_Math_SVT()
@@ -70,29 +186,38 @@ static SEXP REC_Math_SVT(MathFUN fun, SEXP SVT, double digits,
 SEXP C_Math_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT, SEXP op, SEXP digits)
 {
 	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
-	if (x_Rtype == 0)
-		error("SparseArray internal error in C_Math_SVT():\n"
-		      "    invalid 'x_type' value");
-
-	if (!IS_CHARACTER(op) || LENGTH(op) != 1)
-		error("SparseArray internal error in C_Math_SVT():\n"
-		      "    'op' must be a single string");
-	op = STRING_ELT(op, 0);
-	if (op == NA_STRING)
+	if (x_Rtype != REALSXP)
 		error("SparseArray internal error in C_Math_SVT():\n"
-		      "    'op' cannot be NA");
+		      "    'x_type' must be \"double\"");
 
-	MathFUN fun = _get_MathFUN(CHAR(op));
+	int opcode = _get_Math_opcode(op);
 	double digits0 = REAL(digits)[0];
 
-	double *nzvals_buf = (double *)
-		R_alloc(INTEGER(x_dim)[0], sizeof(double));
-	int *nzoffs_buf = (int *)
-		R_alloc(INTEGER(x_dim)[0], sizeof(int));
+	int dim0 = INTEGER(x_dim)[0];
+	int ndim = LENGTH(x_dim);
+	double *nzvals_buf = (double *) R_alloc(dim0, sizeof(double));
+	int *nzoffs_buf = (int *) R_alloc(dim0, sizeof(int));
 	int newNaNs = 0;
-	SEXP ans = REC_Math_SVT(fun, x_SVT, digits0,
-				INTEGER(x_dim), LENGTH(x_dim),
+	SEXP ans;
+	if (x_SVT == R_NilValue) {
+		ans = R_NilValue;
+	} else if (ndim == 1) {
+		ans = Math_leaf(opcode, x_SVT, digits0, dim0,
 				nzvals_buf, nzoffs_buf, &newNaNs);
+	} else {
+		int max_njob = REC_count_leaves(x_SVT, ndim);
+		MathJob *jobs = (MathJob *) R_alloc(max_njob, sizeof(MathJob));
+		int njob = 0;
+		ans = REC_prepare_Math_SVT(opcode, x_SVT, digits0,
+					   INTEGER(x_dim), ndim, jobs, &njob,
+					   nzvals_buf, nzoffs_buf, &newNaNs);
+		PROTECT(ans);
+		if (run_Math_jobs(opcode, jobs, njob, digits0))
+			newNaNs = 1;
+		if (finalize_Math_leaves(jobs, njob, nzoffs_buf))
+			ans = REC_drop_empty_lists(ans, ndim);
+		UNPROTECT(1);
+	}
 	if (newNaNs) {
 		PROTECT(ans);
 		warning("NaNs produced");
@@ -100,4 +225,3 @@ SEXP C_Math_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT, SEXP op, SEXP digits)
 	}
 	return ans;
 }
-
@@ -0,0 +1,733 @@
+/****************************************************************************
+ *     Cumulative sums, cumulative products, and lagged differences of      *
+ *           SVT_SparseArray objects along any of their dimensions          *
+ ****************************************************************************/
+#include "SparseArray_cumulate.h"
+
+#include "Rvector_utils.h"
+#include "SparseVec.h"
+#include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads(), _get_thread_num() */
+
+#include <limits.h>  /* for INT_MAX */
+#include <string.h>  /* for strcmp() */
+
+
+/****************************************************************************
+ * Operations and output formats
+ */
+
+#define	CUMSUM_OP	1
+#define	CUMPROD_OP	2
+#define	DIFF_OP		3
+
+#define	ARRAY_OUTPUT	1  /* ordinary array */
+#define	SVT_OUTPUT	2  /* SVT */
+#define	RLE_OUTPUT	3  /* run values and run lengths */
+
+static int get_cumulate_op(SEXP op)
+{
+	if (!IS_CHARACTER(op) || LENGTH(op) != 1 ||
+	    STRING_ELT(op, 0) == NA_STRING)
+		error("SparseArray internal error in get_cumulate_op():\n"
+		      "    'op' must be a single string");
+	const char *s = CHAR(STRING_ELT(op, 0));
+	if (strcmp(s, "cumsum") == 0)
+		return CUMSUM_OP;
+	if (strcmp(s, "cumprod") == 0)
+		return CUMPROD_OP;
+	if (strcmp(s, "diff") == 0)
+		return DIFF_OP;
+	error("SparseArray internal error in get_cumulate_op():\n"
+	      "    unsupported operation: \"%s\"", s);
+	return 0;  /* will never reach this */
+}
+
+static int get_output_format(SEXP output)
+{
+	if (!IS_CHARACTER(output) || LENGTH(output) != 1 ||
+	    STRING_ELT(output, 0) == NA_STRING)
+		error("SparseArray internal error in get_output_format():\n"
+		      "    'output' must be a single string");
+	const char *s = CHAR(STRING_ELT(output, 0));
+	if (strcmp(s, "array") == 0)
+		return ARRAY_OUTPUT;
+	if (strcmp(s, "SparseArray") == 0)
+		return SVT_OUTPUT;
+	if (strcmp(s, "Rle") == 0)
+		return RLE_OUTPUT;
+	error("SparseArray internal error in get_output_format():\n"
+	      "    unsupported output format: \"%s\"", s);
+	return 0;  /* will never reach this */
+}
+
+
+/****************************************************************************
+ * Low-level helpers
+ */
+
+/* Same as what R does for 'x - y' when 'x' and 'y' are integers, except
+   that 'x' and 'y' are passed as doubles (with NA_REAL representing
+   NA_integer_). */
+static inline double int_minus(double x, double y, int *overflow)
+{
+	if (ISNAN(x) || ISNAN(y))
+		return NA_REAL;
+	double z = x - y;
+	if (z > INT_MAX || z < -INT_MAX) {
+		*overflow = 1;
+		return NA_REAL;
+	}
+	return z;
+}
+
+
+/****************************************************************************
+ * Run generators
+ *
+ * Each output column (i.e. 1D slice of the result along its 1st dimension)
+ * is produced as a sequence of runs stored in 'vals' and 'lens'. The run
+ * values are doubles, even when the result is of type "integer" (NA_REAL
+ * represents NA_integer_ in that case). An output column never has more
+ * runs than elements.
+ *
+ * When cumulating along the 1st dimension, the runs are computed straight
+ * from the nonzero values and their offsets, without expanding the leaf:
+ * the cumulative sum of a leaf is a step function with at most one step
+ * per nonzero value.
+ */
+
+typedef struct runs_t {
+	double *vals;
+	int *lens;
+	int nrun;
+} Runs;
+
+static inline void append_run(Runs *runs, double val, int len)
+{
+	runs->vals[runs->nrun] = val;
+	runs->lens[runs->nrun] = len;
+	runs->nrun++;
+}
+
+/* Cumulative sum of 'sv'. Follows base::cumsum() semantic: for integer
+   input, the first NA or integer overflow turns the rest of the output
+   into NAs. */
+static void cumsum_SV_runs(const SparseVec *sv, int int_mode,
+		Runs *runs, int *overflow)
+{
+	runs->nrun = 0;
+	long double sum = 0.0;
+	double cur = 0.0;
+	int is_na = 0, pos = 0;
+	for (int k = 0; k < sv->nzcount; k++) {
+		int off = sv->nzoffs[k];
+		if (off > pos)
+			append_run(runs, cur, off - pos);
+		double v = get_SV_nzval_as_double(sv, k);
+		if (!int_mode) {
+			sum += v;
+			cur = (double) sum;
+		} else if (!is_na) {
+			if (ISNAN(v)) {
+				is_na = 1;
+			} else {
+				sum += v;
+				if (sum > INT_MAX || sum < -INT_MAX) {
+					*overflow = 1;
+					is_na = 1;
+				}
+			}
+			cur = is_na ? NA_REAL : (double) sum;
+		}
+		append_run(runs, cur, 1);
+		pos = off + 1;
+	}
+	if (pos < sv->len)
+		append_run(runs, cur, sv->len - pos);
+	return;
+}
+
+/* Cumulative product of 'sv'. Always produces doubles. */
+static void cumprod_SV_runs(const SparseVec *sv, Runs *runs)
+{
+	runs->nrun = 0;
+	long double prod = 1.0;
+	int pos = 0;
+	for (int k = 0; k < sv->nzcount; k++) {
+		int off = sv->nzoffs[k];
+		if (off > pos) {
+			/* Multiplying more than once by zero doesn't change
+			   the result. */
+			prod *= 0.0;
+			append_run(runs, (double) prod, off - pos);
+		}
+		prod *= get_SV_nzval_as_double(sv, k);
+		append_run(runs, (double) prod, 1);
+		pos = off + 1;
+	}
+	if (pos < sv->len) {
+		prod *= 0.0;
+		append_run(runs, (double) prod, sv->len - pos);
+	}
+	return;
+}
+
+/* Computes 'x[i + shift] - y[i]' for 'i' in '[0, n)', where 'x' and 'y'
+   are the dense forms of 'sv1' and 'sv2'. This is a merge of the offsets
+   of the two SparseVecs so zeros are never visited. */
+static void diff_SVs_runs(const SparseVec *sv1, int shift,
+		const SparseVec *sv2, int n, int int_mode,
+		Runs *runs, int *overflow)
+{
+	runs->nrun = 0;
+	int k1 = 0, k2 = 0, pos = 0;
+	while (k1 < sv1->nzcount && sv1->nzoffs[k1] < shift)
+		k1++;
+	while (1) {
+		int off1 = k1 < sv1->nzcount ? sv1->nzoffs[k1] - shift : n;
+		int off2 = k2 < sv2->nzcount ? sv2->nzoffs[k2] : n;
+		int off = off1 < off2 ? off1 : off2;
+		if (off >= n)
+			break;
+		if (off > pos)
+			append_run(runs, 0.0, off - pos);
+		double x = 0.0, y = 0.0;
+		if (off1 == off)
+			x = get_SV_nzval_as_double(sv1, k1++);
+		if (off2 == off)
+			y = get_SV_nzval_as_double(sv2, k2++);
+		double v = int_mode ? int_minus(x, y, overflow) : x - y;
+		append_run(runs, v, 1);
+		pos = off + 1;
+	}
+	if (pos < n)
+		append_run(runs, 0.0, n - pos);
+	return;
+}
+
+/* Turns the 'n' accumulators in 'acc' into runs, merging consecutive
+   identical values. */
+static void acc_to_runs(const long double *acc, int n, Runs *runs)
+{
+	runs->nrun = 0;
+	for (int i = 0; i < n; i++) {
+		double v = (double) acc[i];
+		if (runs->nrun != 0 && runs->vals[runs->nrun - 1] == v) {
+			runs->lens[runs->nrun - 1]++;
+		} else {
+			append_run(runs, v, 1);
+		}
+	}
+	return;
+}
+
+/* Adds 'sv' to the accumulators of a cumulative sum along a dimension
+   other than the 1st one. */
+static void add_SV_to_acc(const SparseVec *sv, int int_mode,
+		long double *acc, int *overflow)
+{
+	for (int k = 0; k < sv->nzcount; k++) {
+		int i = sv->nzoffs[k];
+		double v = get_SV_nzval_as_double(sv, k);
+		if (!int_mode) {
+			acc[i] += v;
+			continue;
+		}
+		if (ISNAN((double) acc[i]))
+			continue;
+		if (ISNAN(v)) {
+			acc[i] = NA_REAL;
+			continue;
+		}
+		acc[i] += v;
+		if (acc[i] > INT_MAX || acc[i] < -INT_MAX) {
+			*overflow = 1;
+			acc[i] = NA_REAL;
+		}
+	}
+	return;
+}
+
+/* Multiplies the accumulators of a cumulative product along a dimension
+   other than the 1st one by the dense form of 'sv'. */
+static void mult_acc_by_SV(const SparseVec *sv, long double *acc)
+{
+	int i = 0;
+	for (int k = 0; k < sv->nzcount; k++) {
+		int off = sv->nzoffs[k];
+		for (; i < off; i++)
+			acc[i] *= 0.0;
+		acc[i++] *= get_SV_nzval_as_double(sv, k);
+	}
+	for (; i < sv->len; i++)
+		acc[i] *= 0.0;
+	return;
+}
+
+
+/****************************************************************************
+ * Output emitters
+ *
+ * The runs of each output column are written to the result in one of 3
+ * ways, depending on the output format:
+ *   - ARRAY_OUTPUT: The runs are expanded into the ordinary array.
+ *   - SVT_OUTPUT: A 1st pass counts the nonzero values of each output
+ *     column. The leaves are then allocated, and a 2nd pass fills them.
+ *   - RLE_OUTPUT: A 1st pass counts the runs of each output column. The
+ *     run values and run lengths vectors are then allocated, and a 2nd
+ *     pass fills them.
+ * None of this uses the R API so the output columns can be processed in
+ * parallel.
+ */
+
+#define	COUNT_PASS	1
+#define	FILL_PASS	2
+
+typedef struct emitter_t {
+	int format;
+	int pass;
+	SEXPTYPE Rtype;      /* INTSXP or REALSXP */
+	int out_nrow;
+	void *array;         /* ARRAY_OUTPUT */
+	int *counts;         /* SVT_OUTPUT and RLE_OUTPUT, 1st pass */
+	void **nzvals_ps;    /* SVT_OUTPUT, 2nd pass */
+	int **nzoffs_ps;     /* SVT_OUTPUT, 2nd pass */
+	R_xlen_t *starts;    /* RLE_OUTPUT, 2nd pass */
+	void *run_vals;      /* RLE_OUTPUT, 2nd pass */
+	int *run_lens;       /* RLE_OUTPUT, 2nd pass */
+} Emitter;
+
+static inline int double2int(double v)
+{
+	return ISNAN(v) ? NA_INTEGER : (int) v;
+}
+
+static void emit_runs(const Emitter *em, R_xlen_t oc, const Runs *runs)
+{
+	if (em->format == ARRAY_OUTPUT) {
+		R_xlen_t i = oc * em->out_nrow;
+		for (int r = 0; r < runs->nrun; r++) {
+			double v = runs->vals[r];
+			int len = runs->lens[r];
+			if (em->Rtype == INTSXP) {
+				int *out = (int *) em->array + i;
+				int iv = double2int(v);
+				for (int j = 0; j < len; j++)
+					out[j] = iv;
+			} else {
+				double *out = (double *) em->array + i;
+				for (int j = 0; j < len; j++)
+					out[j] = v;
+			}
+			i += len;
+		}
+		return;
+	}
+	if (em->format == RLE_OUTPUT) {
+		if (em->pass == COUNT_PASS) {
+			em->counts[oc] = runs->nrun;
+			return;
+		}
+		R_xlen_t start = em->starts[oc];
+		for (int r = 0; r < runs->nrun; r++) {
+			double v = runs->vals[r];
+			R_xlen_t i = start + r;
+			if (em->Rtype == INTSXP) {
+				((int *) em->run_vals)[i] = double2int(v);
+			} else {
+				((double *) em->run_vals)[i] = v;
+			}
+			em->run_lens[start + r] = runs->lens[r];
+		}
+		return;
+	}
+	/* SVT_OUTPUT */
+	if (em->pass == COUNT_PASS) {
+		int nzcount = 0;
+		for (int r = 0; r < runs->nrun; r++) {
+			if (runs->vals[r] != 0.0)  /* TRUE for NA and NaN */
+				nzcount += runs->lens[r];
+		}
+		em->counts[oc] = nzcount;
+		return;
+	}
+	if (em->counts[oc] == 0)
+		return;
+	void *nzvals_p = em->nzvals_ps[oc];
+	int *nzoffs_p = em->nzoffs_ps[oc];
+	int i = 0, k = 0;
+	for (int r = 0; r < runs->nrun; r++) {
+		double v = runs->vals[r];
+		int len = runs->lens[r];
+		if (v != 0.0) {
+			for (int j = 0; j < len; j++, k++) {
+				if (em->Rtype == INTSXP) {
+					((int *) nzvals_p)[k] = double2int(v);
+				} else {
+					((double *) nzvals_p)[k] = v;
+				}
+				nzoffs_p[k] = i + j;
+			}
+		}
+		i += len;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * Processing units
+ *
+ * A processing unit is the smallest piece of work that can be done
+ * independently of the others:
+ *   - When operating along the 1st dimension, or when computing lagged
+ *     differences, a unit produces a single output column.
+ *   - When cumulating along another dimension, a unit produces all the
+ *     output columns that share the same indices along the dimensions
+ *     other than the 1st one and the cumulating dimension. These output
+ *     columns must be computed in order, from the accumulators.
+ */
+
+typedef struct cumulate_spec_t {
+	int op;
+	int along;           /* 0-based */
+	int lag;
+	int int_mode;        /* integer input semantic */
+	SEXPTYPE x_Rtype;
+	int x_nrow;
+	int out_nrow;
+	int along_len;       /* length of 'x' along 'along' */
+	int out_along_len;   /* length of the result along 'along' */
+	R_xlen_t n_mid;      /* nb of leaves between 2 consecutive elements
+				along 'along' */
+	const SEXP *leaves;
+} CumulateSpec;
+
+static R_xlen_t get_nunit(const CumulateSpec *spec, R_xlen_t n_oc)
+{
+	if (spec->along == 0 || spec->op == DIFF_OP)
+		return n_oc;
+	return spec->along_len == 0 ? 0 : n_oc / spec->along_len;
+}
+
+static void process_unit(const CumulateSpec *spec, R_xlen_t u,
+		const Emitter *em, Runs *runs, long double *acc, int *overflow)
+{
+	SEXPTYPE Rtype = spec->x_Rtype;
+	if (spec->along == 0) {
+		SparseVec sv = leaf_or_NULL_to_SV(spec->leaves[u], Rtype,
+						  spec->x_nrow);
+		switch (spec->op) {
+		    case CUMSUM_OP:
+			cumsum_SV_runs(&sv, spec->int_mode, runs, overflow);
+			break;
+		    case CUMPROD_OP:
+			cumprod_SV_runs(&sv, runs);
+			break;
+		    case DIFF_OP:
+			diff_SVs_runs(&sv, spec->lag, &sv, spec->out_nrow,
+				      spec->int_mode, runs, overflow);
+			break;
+		}
+		emit_runs(em, u, runs);
+		return;
+	}
+	R_xlen_t n_mid = spec->n_mid;
+	R_xlen_t c_inner = u % n_mid;
+	if (spec->op == DIFF_OP) {
+		R_xlen_t q = u / n_mid;
+		int a = (int) (q % spec->out_along_len);
+		R_xlen_t c_outer = q / spec->out_along_len;
+		R_xlen_t i0 = c_inner + n_mid *
+			      (a + (R_xlen_t) spec->along_len * c_outer);
+		SparseVec sv1 = leaf_or_NULL_to_SV(
+				spec->leaves[i0 + n_mid * spec->lag],
+				Rtype, spec->x_nrow);
+		SparseVec sv2 = leaf_or_NULL_to_SV(spec->leaves[i0],
+						   Rtype, spec->x_nrow);
+		diff_SVs_runs(&sv1, 0, &sv2, spec->out_nrow,
+			      spec->int_mode, runs, overflow);
+		emit_runs(em, u, runs);
+		return;
+	}
+	R_xlen_t c_outer = u / n_mid;
+	long double init = spec->op == CUMSUM_OP ? 0.0 : 1.0;
+	for (int i = 0; i < spec->x_nrow; i++)
+		acc[i] = init;
+	for (int a = 0; a < spec->along_len; a++) {
+		R_xlen_t oc = c_inner + n_mid *
+			      (a + (R_xlen_t) spec->along_len * c_outer);
+		SparseVec sv = leaf_or_NULL_to_SV(spec->leaves[oc], Rtype,
+						  spec->x_nrow);
+		if (spec->op == CUMSUM_OP) {
+			add_SV_to_acc(&sv, spec->int_mode, acc, overflow);
+		} else {
+			mult_acc_by_SV(&sv, acc);
+		}
+		acc_to_runs(acc, spec->x_nrow, runs);
+		emit_runs(em, oc, runs);
+	}
+	return;
+}
+
+/* Returns the nb of runs the run buffer of a thread must be able to hold.
+   When cumulating along the 1st dimension, the output column of a leaf
+   with 'nzcount' nonzero values has at most '4 * nzcount + 1' runs (the
+   worst case is diff(), where each nonzero value can produce 2 nonzero
+   output values), so we don't need buffers as long as the columns. This
+   matters for very long columns like genomic tracks. Must be called on
+   the main thread. */
+static int get_run_buf_len(const CumulateSpec *spec, R_xlen_t nunit)
+{
+	if (spec->x_nrow <= 0)
+		return 1;
+	if (spec->along != 0)
+		return spec->x_nrow;
+	R_xlen_t max_nrun = 1;
+	for (R_xlen_t u = 0; u < nunit; u++) {
+		SEXP leaf = spec->leaves[u];
+		if (leaf == R_NilValue)
+			continue;
+		R_xlen_t nrun = 4 * (R_xlen_t) get_leaf_nzcount(leaf) + 1;
+		if (nrun >= spec->x_nrow)
+			return spec->x_nrow;
+		if (nrun > max_nrun)
+			max_nrun = nrun;
+	}
+	return (int) max_nrun;
+}
+
+/* Returns 1 if an integer overflow occurred. */
+static int run_pass(const CumulateSpec *spec, R_xlen_t nunit,
+		const Emitter *em)
+{
+	int nthread = _get_max_threads();
+	int buf_len = get_run_buf_len(spec, nunit);
+	double *vals_bufs = (double *)
+		R_alloc((R_xlen_t) buf_len * nthread, sizeof(double));
+	int *lens_bufs = (int *)
+		R_alloc((R_xlen_t) buf_len * nthread, sizeof(int));
+	long double *acc_bufs = NULL;
+	if (spec->along != 0 && spec->op != DIFF_OP)
+		acc_bufs = (long double *) R_alloc(
+				(R_xlen_t) buf_len * nthread,
+				sizeof(long double));
+	int overflow = 0;
+	#pragma omp parallel num_threads(nthread) reduction(|:overflow)
+	{
+		int t = _get_thread_num();
+		Runs runs;
+		runs.vals = vals_bufs + (R_xlen_t) buf_len * t;
+		runs.lens = lens_bufs + (R_xlen_t) buf_len * t;
+		long double *acc = acc_bufs == NULL ? NULL
+				: acc_bufs + (R_xlen_t) buf_len * t;
+		#pragma omp for schedule(dynamic, 16)
+		for (R_xlen_t u = 0; u < nunit; u++)
+			process_unit(spec, u, em, &runs, acc, &overflow);
+	}
+	return overflow;
+}
+
+
+/****************************************************************************
+ * Building the SVT of the result
+ */
+
+/* 'leaves' is a list of 'nleaf' leaves (or NULLs). */
+static SEXP REC_build_SVT_from_leaves(SEXP leaves, R_xlen_t offset,
+		const int *dim, int ndim, R_xlen_t nleaf)
+{
+	if (ndim == 1)
+		return VECTOR_ELT(leaves, offset);
+	int ans_len = dim[ndim - 1];
+	R_xlen_t inc = nleaf / ans_len;
+	SEXP ans = PROTECT(NEW_LIST(ans_len));
+	int is_empty = 1;
+	for (int i = 0; i < ans_len; i++) {
+		SEXP ans_elt = REC_build_SVT_from_leaves(leaves,
+				offset + inc * i, dim, ndim - 1, inc);
+		if (ans_elt != R_NilValue) {
+			PROTECT(ans_elt);
+			SET_VECTOR_ELT(ans, i, ans_elt);
+			UNPROTECT(1);
+			is_empty = 0;
+		}
+	}
+	UNPROTECT(1);
+	return is_empty ? R_NilValue : ans;
+}
+
+static SEXP alloc_result_leaves(SEXPTYPE Rtype, const int *counts,
+		R_xlen_t n_oc, void **nzvals_ps, int **nzoffs_ps)
+{
+	SEXP leaves = PROTECT(NEW_LIST(n_oc));
+	for (R_xlen_t oc = 0; oc < n_oc; oc++) {
+		if (counts[oc] == 0)
+			continue;
+		SEXP nzvals, nzoffs;
+		SEXP leaf = _alloc_and_unzip_leaf(Rtype, counts[oc],
+						  &nzvals, &nzoffs);
+		SET_VECTOR_ELT(leaves, oc, leaf);
+		nzvals_ps[oc] = DATAPTR(nzvals);
+		nzoffs_ps[oc] = INTEGER(nzoffs);
+	}
+	UNPROTECT(1);
+	return leaves;
+}
+
+static void INPLACE_lacunarize_result_leaves(SEXP leaves)
+{
+	R_xlen_t n = XLENGTH(leaves);
+	for (R_xlen_t oc = 0; oc < n; oc++) {
+		SEXP leaf = VECTOR_ELT(leaves, oc);
+		if (leaf != R_NilValue)
+			_INPLACE_turn_into_lacunar_leaf_if_all_ones(leaf);
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * C_cumulate_SVT()
+ */
+
+/* --- .Call ENTRY POINT ---
+   'op' must be "cumsum", "cumprod", or "diff". 'along' is 1-based. 'lag'
+   is ignored when 'op' is not "diff". 'output' must be "array",
+   "SparseArray", or "Rle". Returns respectively the data of an ordinary
+   array (no dim attribute), an SVT, or a list of 3 vectors (the run values
+   and run lengths of all the columns of the result, one column after the
+   other, and the number of runs in each column). */
+SEXP C_cumulate_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+		    SEXP op, SEXP along, SEXP lag, SEXP output)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	if (x_Rtype != INTSXP && x_Rtype != LGLSXP && x_Rtype != REALSXP)
+		error("cumulative sums, cumulative products, and lagged "
+		      "differences are only supported on SparseArray "
+		      "objects of type() \"logical\", \"integer\", "
+		      "or \"double\"");
+
+	CumulateSpec spec;
+	spec.op = get_cumulate_op(op);
+	int format = get_output_format(output);
+	int x_ndim = LENGTH(x_dim);
+	const int *dim = INTEGER(x_dim);
+	if (!IS_INTEGER(along) || LENGTH(along) != 1 ||
+	    INTEGER(along)[0] < 1 || INTEGER(along)[0] > x_ndim)
+		error("SparseArray internal error in C_cumulate_SVT():\n"
+		      "    'along' must be a single integer >= 1 and <= the "
+		      "number of dimensions of 'x'");
+	spec.along = INTEGER(along)[0] - 1;
+	spec.along_len = dim[spec.along];
+	spec.lag = 0;
+	spec.out_along_len = spec.along_len;
+	if (spec.op == DIFF_OP) {
+		if (!IS_INTEGER(lag) || LENGTH(lag) != 1 ||
+		    INTEGER(lag)[0] == NA_INTEGER || INTEGER(lag)[0] < 1)
+			error("SparseArray internal error in "
+			      "C_cumulate_SVT():\n"
+			      "    'lag' must be a single positive integer");
+		spec.lag = INTEGER(lag)[0];
+		spec.out_along_len = spec.along_len > spec.lag ?
+				     spec.along_len - spec.lag : 0;
+	}
+	spec.x_Rtype = x_Rtype;
+	spec.int_mode = x_Rtype != REALSXP;
+	spec.x_nrow = dim[0];
+	spec.out_nrow = spec.along == 0 ? spec.out_along_len : spec.x_nrow;
+
+	Emitter em;
+	em.format = format;
+	em.Rtype = spec.op == CUMPROD_OP || !spec.int_mode ? REALSXP : INTSXP;
+	em.out_nrow = spec.out_nrow;
+
+	/* Collect the leaves of 'x'. */
+	R_xlen_t nleaf = 1;
+	for (int d = 1; d < x_ndim; d++)
+		nleaf *= dim[d];
+	SEXP *leaves = (SEXP *) R_alloc(nleaf, sizeof(SEXP));
+	_collect_subSVTs(x_SVT, dim, x_ndim, 1, leaves);
+	spec.leaves = leaves;
+	spec.n_mid = 1;
+	for (int d = 1; d < spec.along; d++)
+		spec.n_mid *= dim[d];
+
+	/* Number of output columns. */
+	R_xlen_t n_oc = nleaf;
+	if (spec.along != 0)
+		n_oc = spec.along_len == 0 ? 0 :
+		       nleaf / spec.along_len * spec.out_along_len;
+	R_xlen_t nunit = get_nunit(&spec, n_oc);
+
+	int overflow;
+	SEXP ans;
+	if (format == ARRAY_OUTPUT) {
+		ans = PROTECT(allocVector(em.Rtype,
+					  (R_xlen_t) spec.out_nrow * n_oc));
+		em.array = DATAPTR(ans);
+		em.pass = FILL_PASS;
+		overflow = run_pass(&spec, nunit, &em);
+	} else {
+		em.counts = (int *) R_alloc(n_oc, sizeof(int));
+		em.pass = COUNT_PASS;
+		overflow = run_pass(&spec, nunit, &em);
+		em.pass = FILL_PASS;
+		if (format == SVT_OUTPUT) {
+			em.nzvals_ps = (void **) R_alloc(n_oc, sizeof(void *));
+			em.nzoffs_ps = (int **) R_alloc(n_oc, sizeof(int *));
+			SEXP ans_leaves = PROTECT(
+				alloc_result_leaves(em.Rtype, em.counts, n_oc,
+						em.nzvals_ps, em.nzoffs_ps));
+			run_pass(&spec, nunit, &em);
+			INPLACE_lacunarize_result_leaves(ans_leaves);
+			if (n_oc == 0 || spec.out_nrow == 0) {
+				ans = R_NilValue;
+			} else if (x_ndim == 1) {
+				ans = VECTOR_ELT(ans_leaves, 0);
+			} else {
+				int *ans_dim = (int *)
+					R_alloc(x_ndim, sizeof(int));
+				memcpy(ans_dim, dim, sizeof(int) * x_ndim);
+				ans_dim[spec.along] = spec.out_along_len;
+				ans = REC_build_SVT_from_leaves(ans_leaves, 0,
+						ans_dim, x_ndim, n_oc);
+			}
+			UNPROTECT(1);
+			PROTECT(ans);
+		} else {
+			R_xlen_t nrun = 0;
+			em.starts = (R_xlen_t *)
+				R_alloc(n_oc, sizeof(R_xlen_t));
+			for (R_xlen_t oc = 0; oc < n_oc; oc++) {
+				em.starts[oc] = nrun;
+				nrun += em.counts[oc];
+			}
+			ans = PROTECT(NEW_LIST(3));
+			SEXP ans_vals = PROTECT(allocVector(em.Rtype, nrun));
+			SET_VECTOR_ELT(ans, 0, ans_vals);
+			SEXP ans_lens = PROTECT(NEW_INTEGER(nrun));
+			SET_VECTOR_ELT(ans, 1, ans_lens);
+			SEXP ans_nruns = PROTECT(NEW_INTEGER(n_oc));
+			SET_VECTOR_ELT(ans, 2, ans_nruns);
+			UNPROTECT(3);
+			if (n_oc != 0)
+				memcpy(INTEGER(ans_nruns), em.counts,
+				       sizeof(int) * n_oc);
+			em.run_vals = DATAPTR(ans_vals);
+			em.run_lens = INTEGER(ans_lens);
+			run_pass(&spec, nunit, &em);
+		}
+	}
+	if (overflow) {
+		if (spec.op == CUMSUM_OP) {
+			warning("integer overflow in 'cumsum'; "
+				"use 'cumsum(as.numeric(.))'");
+		} else {
+			warning("NAs produced by integer overflow");
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
@@ -0,0 +1,16 @@
+#ifndef _SPARSEARRAY_CUMULATE_H_
+#define _SPARSEARRAY_CUMULATE_H_
+
+#include <Rdefines.h>
+
+SEXP C_cumulate_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP op,
+	SEXP along,
+	SEXP lag,
+	SEXP output
+);
+
+#endif  /* _SPARSEARRAY_CUMULATE_H_ */
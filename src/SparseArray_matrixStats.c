@@ -9,14 +9,17 @@
  ****************************************************************************/
 #include "SparseArray_matrixStats.h"
 
-#include "thread_control.h"  /* for which_max() */
+#include "thread_control.h"  /* for which_max(), _get_max_threads(),
+				_get_thread_num() */
 #include "Rvector_utils.h"
 #include "Rvector_summarization.h"
 #include "SparseVec.h"
 #include "leaf_utils.h"
 #include "SparseArray_summarization.h"
+#include "order_stats.h"
 
-#include <string.h>  /* for memcpy() */
+#include <string.h>  /* for memcpy(), memset() */
+#include <math.h>    /* for sqrt(), fabs() */
 
 
 static SEXPTYPE compute_ans_Rtype(const SummarizeOp *summarize_op)
@@ -473,9 +476,83 @@ static void rowCenteredX2Sum_SV(const SparseVec *sv,
 	return;
 }
 
+/* Single-pass (Welford) update of the running mean and centered X2 sum of
+   each row. For each row, 'moments' stores a (nonzero count, mean, NA count)
+   triplet and 'out' the centered X2 sum. Only the nonzero values are seen
+   here. The zeros are accounted for analytically by finalize_rowVars(). */
+static void rowMoments_SV(const SparseVec *sv,
+		int narm, double *out, double *moments)
+{
+	int nzcount = get_SV_nzcount(sv);
+	SEXPTYPE sv_Rtype = get_SV_Rtype(sv);
+	for (int k = 0; k < nzcount; k++) {
+		int i = sv->nzoffs[k];
+		double x;
+		if (sv->nzvals == NULL) {  /* lacunar leaf */
+			x = double1;
+		} else {  /* regular leaf */
+			switch (sv_Rtype) {
+			    case INTSXP: case LGLSXP: {
+				const int *nzvals_p = sv->nzvals;
+				int v = nzvals_p[k];
+				x = v == NA_INTEGER ? NA_REAL : (double) v;
+				break;
+			    }
+			    case REALSXP: {
+				const double *nzvals_p = sv->nzvals;
+				x = nzvals_p[k];
+				break;
+			    }
+			    default:
+				error("SparseArray internal error in "
+				      "rowMoments_SV():\n"
+				      "    type \"%s\" is not supported",
+				      type2char(sv_Rtype));
+			}
+		}
+		double *m = moments + 3 * (R_xlen_t) i;
+		/* ISNAN(): True for *both* NA and NaN.
+		   See <R_ext/Arith.h> */
+		if (ISNAN(x)) {
+			if (narm) {
+				m[2] += 1.0;
+			} else {
+				out[i] += x;
+			}
+			continue;
+		}
+		m[0] += 1.0;
+		double delta = x - m[1];
+		m[1] += delta / m[0];
+		out[i] += delta * (x - m[1]);
+	}
+	return;
+}
+
+/* 'n' is the number of values per row (including zeros and NAs). */
+static void finalize_rowVars(int opcode, double *out, R_xlen_t out_len,
+		const double *moments, R_xlen_t n)
+{
+	for (R_xlen_t i = 0; i < out_len; i++) {
+		const double *m = moments + 3 * i;
+		double nvals = (double) n - m[2];
+		if (nvals <= 1.0) {
+			out[i] = NA_REAL;
+			continue;
+		}
+		double M2 = out[i];
+		double nzeros = nvals - m[0];
+		if (!ISNAN(M2) && nzeros != 0.0 && m[0] != 0.0)
+			M2 += m[1] * m[1] * (m[0] * nzeros / nvals);
+		M2 /= nvals - 1.0;
+		out[i] = opcode == SD1_OPCODE ? sqrt(M2) : M2;
+	}
+	return;
+}
+
 static void rowStats_leaf(SEXP leaf, int dim0,
 		const SummarizeOp *summarize_op, const double *center,
-		void *out, SEXPTYPE out_Rtype, int *warn)
+		double *moments, void *out, SEXPTYPE out_Rtype, int *warn)
 {
 	SparseVec sv = leaf2SV(leaf, summarize_op->in_Rtype, dim0);
 	switch (summarize_op->opcode) {
@@ -491,6 +568,9 @@ static void rowStats_leaf(SEXP leaf, int dim0,
 	    case CENTERED_X2_SUM_OPCODE:
 		rowCenteredX2Sum_SV(&sv, summarize_op->na_rm, center, out);
 		return;
+	    case VAR1_OPCODE: case SD1_OPCODE:
+		rowMoments_SV(&sv, summarize_op->na_rm, out, moments);
+		return;
 	}
 	error("SparseArray internal error in rowStats_leaf():\n"
 	      "    operation not supported");
@@ -500,7 +580,7 @@ static void rowStats_leaf(SEXP leaf, int dim0,
 /* Recursive. */
 static void REC_rowStats_SVT(SEXP SVT, const int *dims, int ndim,
 		const SummarizeOp *summarize_op, const double *center,
-		void *out, SEXPTYPE out_Rtype,
+		double *moments, void *out, SEXPTYPE out_Rtype,
 		const R_xlen_t *out_incs, int out_ndim,
 		int *warn)
 {
@@ -510,7 +590,7 @@ static void REC_rowStats_SVT(SEXP SVT, const int *dims, int ndim,
 	if (ndim == 1) { /* 'out_ndim' also guaranteed to be 1 */
 		/* 'SVT' is a leaf (i.e. a 1D SVT). */
 		rowStats_leaf(SVT, dims[0], summarize_op, center,
-			      out, out_Rtype, warn);
+			      moments, out, out_Rtype, warn);
 		return;
 	}
 
@@ -523,10 +603,11 @@ static void REC_rowStats_SVT(SEXP SVT, const int *dims, int ndim,
 	for (int i = 0; i < SVT_len; i++) {
 		SEXP subSVT = VECTOR_ELT(SVT, i);
 		const double *subcenter = center + out_inc * i;
+		double *submoments = moments + 3 * out_inc * i;
 		void *subout = shift_dataptr(out_Rtype, out, out_inc * i);
 		REC_rowStats_SVT(subSVT, dims, ndim - 1,
 				 summarize_op, subcenter,
-				 subout, out_Rtype,
+				 submoments, subout, out_Rtype,
 				 out_incs, out_ndim,
 				 warn);
 	}
@@ -551,6 +632,11 @@ SEXP C_rowStats_SVT(SEXP x_dim, SEXP x_dimnames, SEXP x_type, SEXP x_SVT,
 
 	int d = check_dims(dims, 1, LENGTH(x_dim) - 1);
 	const double *center_p = check_rowStats_center(center, x_dim, d);
+	int is_var = opcode == VAR1_OPCODE || opcode == SD1_OPCODE;
+	if (is_var && center_p != NULL)
+		error("SparseArray internal error in C_rowStats_SVT():\n"
+		      "    'center' must be NULL when 'op' is \"var1\" "
+		      "or \"sd1\"");
 
 	SummarizeOp summarize_op = _make_SummarizeOp(opcode, x_Rtype, narm,
 						     NA_REAL);
@@ -566,12 +652,208 @@ SEXP C_rowStats_SVT(SEXP x_dim, SEXP x_dimnames, SEXP x_type, SEXP x_SVT,
 	propagate_rowStats_dimnames(ans, x_dimnames, ans_ndim);
 	init_rowStats_ans(ans, &summarize_op, center_p, x_dim, d);
 
+	double *moments = NULL;
+	if (is_var) {
+		R_xlen_t moments_len = 3 * XLENGTH(ans);
+		moments = (double *) R_alloc(moments_len, sizeof(double));
+		memset(moments, 0, sizeof(double) * moments_len);
+	}
+
 	int warn = 0;
 	REC_rowStats_SVT(x_SVT, INTEGER(x_dim), LENGTH(x_dim),
 			 &summarize_op, center_p,
-			 DATAPTR(ans), ans_Rtype,
+			 moments, DATAPTR(ans), ans_Rtype,
 			 out_incs, ans_ndim,
 			 &warn);
+	if (is_var) {
+		R_xlen_t n = 1;
+		for (int along = d; along < LENGTH(x_dim); along++)
+			n *= INTEGER(x_dim)[along];
+		finalize_rowVars(opcode, REAL(ans), XLENGTH(ans), moments, n);
+	}
+	if (warn)
+		warning("NAs introduced by coercion of "
+			"infinite values to integers");
+
+	UNPROTECT(2);
+	return ans;
+}
+
+
+
+/****************************************************************************
+ * C_colSummaries_SVT() and C_rowSummaries_SVT()
+ *
+ * Compute several statistics at once in a single pass on the SVT (instead
+ * of one pass per statistic). The result is an ordinary numeric matrix with
+ * one row per col/row of 'x' and one column per statistic.
+ */
+
+#define	MAX_SUMMARIES		16
+
+/* Pseudo opcodes for the number of nonzero values (including NAs), and
+   for the median (only supported by C_groupSummaries_SVT()). */
+#define	NZCOUNT_STATCODE	0
+#define	MEDIAN_STATCODE		-1
+
+typedef struct summaries_spec_t {
+	int nstat;
+	int statcodes[MAX_SUMMARIES];  /* summarize opcode or NZCOUNT_STATCODE */
+	/* The SummarizeOp's of the statistics that are not "nzcount", and
+	   their position in 'statcodes'. */
+	int nop;
+	SummarizeOp ops[MAX_SUMMARIES];
+	int op_cols[MAX_SUMMARIES];
+	int nzcount_col;  /* -1 if "nzcount" was not requested */
+	int median_col;   /* -1 if "median" was not requested */
+} SummariesSpec;
+
+static void make_SummariesSpec(SEXP stats, SEXPTYPE x_Rtype, int narm,
+			       int allow_median, SummariesSpec *spec)
+{
+	if (!IS_CHARACTER(stats))
+		error("SparseArray internal error in make_SummariesSpec():\n"
+		      "    'stats' must be a character vector");
+	int nstat = LENGTH(stats);
+	if (nstat > MAX_SUMMARIES)
+		error("cannot compute more than %d statistics at once",
+		      MAX_SUMMARIES);
+	spec->nstat = nstat;
+	spec->nop = 0;
+	spec->nzcount_col = -1;
+	spec->median_col = -1;
+	for (int j = 0; j < nstat; j++) {
+		SEXP stat = STRING_ELT(stats, j);
+		if (stat != NA_STRING && strcmp(CHAR(stat), "nzcount") == 0) {
+			spec->statcodes[j] = NZCOUNT_STATCODE;
+			spec->nzcount_col = j;
+			continue;
+		}
+		if (allow_median && stat != NA_STRING &&
+		    strcmp(CHAR(stat), "median") == 0)
+		{
+			spec->statcodes[j] = MEDIAN_STATCODE;
+			spec->median_col = j;
+			continue;
+		}
+		SEXP op = PROTECT(ScalarString(stat));
+		int opcode = _get_summarize_opcode(op, x_Rtype);
+		UNPROTECT(1);
+		switch (opcode) {
+		    case ANYNA_OPCODE: case COUNTNAS_OPCODE:
+		    case MIN_OPCODE: case MAX_OPCODE:
+		    case SUM_OPCODE: case MEAN_OPCODE:
+		    case VAR1_OPCODE: case SD1_OPCODE:
+			break;
+		    default:
+			error("statistic \"%s\" is not supported",
+			      CHAR(stat));
+		}
+		spec->statcodes[j] = opcode;
+		spec->ops[spec->nop] = _make_SummarizeOp(opcode, x_Rtype,
+							 narm, NA_REAL);
+		spec->op_cols[spec->nop] = j;
+		spec->nop++;
+	}
+	return;
+}
+
+static inline double result_as_double(const SummarizeResult *res)
+{
+	if (res->out_Rtype == REALSXP)
+		return res->outbuf.one_double[0];
+	int v = res->outbuf.one_int[0];
+	return v == NA_INTEGER ? NA_REAL : (double) v;
+}
+
+/* Returns 'prod(tail(dim(x), n=-dims))'. */
+static R_xlen_t prod_tail_dims(SEXP x_dim, int dims)
+{
+	R_xlen_t p = 1;
+	for (int along = dims; along < LENGTH(x_dim); along++)
+		p *= INTEGER(x_dim)[along];
+	return p;
+}
+
+/* Recursive. 'out' points to the row of the output matrix that corresponds
+   to 'SVT'. */
+static void REC_colSummaries_SVT(SEXP SVT, const int *dims, int ndim,
+		const SummariesSpec *spec, double *out, R_xlen_t out_nrow,
+		const R_xlen_t *out_incs, int out_ndim, int pardim,
+		int *warn)
+{
+	if (out_ndim == 0) {
+		SummarizeResult results[MAX_SUMMARIES];
+		R_xlen_t nzcount = _summarize_SVT_multi(SVT, dims, ndim,
+						spec->ops, spec->nop, results);
+		for (int k = 0; k < spec->nop; k++) {
+			if (results[k].warn)
+				*warn = 1;
+			out[out_nrow * spec->op_cols[k]] =
+				result_as_double(results + k);
+		}
+		if (spec->nzcount_col >= 0)
+			out[out_nrow * spec->nzcount_col] = (double) nzcount;
+		return;
+	}
+	int SVT_len = dims[ndim - 1];
+	R_xlen_t out_inc = out_incs[out_ndim - 1];
+	/* Parallel execution along the biggest dimension only. Each thread
+	   gets its own copy of 'local_warn'. */
+	int local_warn = 0;
+	#pragma omp parallel for schedule(static) if(out_ndim == pardim) \
+		reduction(|:local_warn)
+	for (int i = 0; i < SVT_len; i++) {
+		SEXP subSVT = SVT == R_NilValue ? R_NilValue
+						: VECTOR_ELT(SVT, i);
+		REC_colSummaries_SVT(subSVT, dims, ndim - 1,
+				     spec, out + out_inc * i, out_nrow,
+				     out_incs, out_ndim - 1, pardim,
+				     &local_warn);
+	}
+	if (local_warn)
+		*warn = 1;
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_colSummaries_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			SEXP stats, SEXP na_rm, SEXP dims)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	if (x_Rtype == 0)
+		error("SparseArray internal error in "
+		      "C_colSummaries_SVT():\n"
+		      "    SVT_SparseArray object has invalid type");
+
+	if (!(IS_LOGICAL(na_rm) && LENGTH(na_rm) == 1))
+		error("'na.rm' must be TRUE or FALSE");
+	int narm = LOGICAL(na_rm)[0];
+
+	SummariesSpec spec;
+	make_SummariesSpec(stats, x_Rtype, narm, 0, &spec);
+
+	int d = check_dims(dims, 1, LENGTH(x_dim));
+	SEXP ans_dim = PROTECT(compute_colStats_ans_dim(x_dim, d));
+	int ans_ndim = LENGTH(ans_dim);  /* = x_ndim - d */
+	int pardim = which_max(INTEGER(ans_dim), ans_ndim) + 1;
+
+	R_xlen_t *out_incs = NULL;
+	if (ans_ndim != 0)
+		out_incs = (R_xlen_t *) R_alloc(ans_ndim, sizeof(R_xlen_t));
+	R_xlen_t out_inc = 1;
+	for (int along = 0; along < ans_ndim; along++) {
+		out_incs[along] = out_inc;
+		out_inc *= INTEGER(ans_dim)[along];
+	}
+	R_xlen_t ans_nrow = out_inc;
+
+	SEXP ans = PROTECT(allocMatrix(REALSXP, ans_nrow, spec.nstat));
+	int warn = 0;
+	REC_colSummaries_SVT(x_SVT, INTEGER(x_dim), LENGTH(x_dim),
+			     &spec, REAL(ans), ans_nrow,
+			     out_incs, ans_ndim, pardim,
+			     &warn);
 	if (warn)
 		warning("NAs introduced by coercion of "
 			"infinite values to integers");
@@ -580,3 +862,1024 @@ SEXP C_rowStats_SVT(SEXP x_dim, SEXP x_dimnames, SEXP x_type, SEXP x_SVT,
 	return ans;
 }
 
+/* One set of accumulators per row. NA and NaN values are counted in
+   'nacount' and recorded in 'NAflags' but don't contribute to 'sum',
+   'mean', 'M2', 'min', or 'max'. The zeros are accounted for at the end
+   by finalize_row_summaries(). */
+typedef struct row_accumulators_t {
+	double *nzcount;  /* nb of nonzero values (including NA and NaN) */
+	double *nacount;  /* nb of NA and NaN values */
+	double *sum;
+	double *mean;     /* Welford's running mean and centered X2 sum */
+	double *M2;
+	double *min;
+	double *max;
+	int *NAflags;     /* bit 0: NA found, bit 1: NaN found */
+} RowAccumulators;
+
+#define	NA_FOUND	1
+#define	NaN_FOUND	2
+
+static RowAccumulators alloc_RowAccumulators(R_xlen_t n)
+{
+	RowAccumulators acc;
+	double *buf = (double *) R_alloc(7 * n, sizeof(double));
+	memset(buf, 0, sizeof(double) * 5 * n);
+	acc.nzcount = buf;
+	acc.nacount = buf + n;
+	acc.sum = buf + 2 * n;
+	acc.mean = buf + 3 * n;
+	acc.M2 = buf + 4 * n;
+	acc.min = buf + 5 * n;
+	acc.max = buf + 6 * n;
+	for (R_xlen_t i = 0; i < n; i++) {
+		acc.min[i] = R_PosInf;
+		acc.max[i] = R_NegInf;
+	}
+	acc.NAflags = (int *) R_alloc(n, sizeof(int));
+	memset(acc.NAflags, 0, sizeof(int) * n);
+	return acc;
+}
+
+/* The k-th nonzero value of 'sv' goes to the accumulators at index
+   'offset + sv->nzoffs[k]', or at index 'offset + row_map[sv->nzoffs[k]]'
+   if 'row_map' is not NULL. */
+static void update_RowAccumulators(const SparseVec *sv, const int *row_map,
+				   R_xlen_t offset, RowAccumulators *acc)
+{
+	int nzcount = get_SV_nzcount(sv);
+	SEXPTYPE sv_Rtype = get_SV_Rtype(sv);
+	for (int k = 0; k < nzcount; k++) {
+		int row = sv->nzoffs[k];
+		R_xlen_t i = offset + (row_map == NULL ? row : row_map[row]);
+		double x = double1;
+		int flag = 0;
+		if (sv->nzvals != NULL) {  /* regular leaf */
+			if (sv_Rtype == REALSXP) {
+				x = ((const double *) sv->nzvals)[k];
+				/* ISNAN(): True for *both* NA and NaN.
+				   See <R_ext/Arith.h> */
+				if (ISNAN(x))
+					flag = R_IsNA(x) ? NA_FOUND : NaN_FOUND;
+			} else {
+				int v = ((const int *) sv->nzvals)[k];
+				if (v == NA_INTEGER) {
+					flag = NA_FOUND;
+				} else {
+					x = (double) v;
+				}
+			}
+		}
+		acc->nzcount[i] += 1.0;
+		if (flag != 0) {
+			acc->nacount[i] += 1.0;
+			acc->NAflags[i] |= flag;
+			continue;
+		}
+		acc->sum[i] += x;
+		double delta = x - acc->mean[i];
+		acc->mean[i] += delta / (acc->nzcount[i] - acc->nacount[i]);
+		acc->M2[i] += delta * (x - acc->mean[i]);
+		if (x < acc->min[i])
+			acc->min[i] = x;
+		if (x > acc->max[i])
+			acc->max[i] = x;
+	}
+	return;
+}
+
+/* Merges the accumulators in 'acc2' into 'acc1'. */
+static void merge_RowAccumulators(RowAccumulators *acc1,
+		const RowAccumulators *acc2, R_xlen_t n)
+{
+	for (R_xlen_t i = 0; i < n; i++) {
+		double n2 = acc2->nzcount[i] - acc2->nacount[i];
+		if (n2 != 0.0) {
+			double n1 = acc1->nzcount[i] - acc1->nacount[i];
+			double delta = acc2->mean[i] - acc1->mean[i];
+			double n12 = n1 + n2;
+			acc1->M2[i] += acc2->M2[i] +
+				       delta * delta * (n1 * n2 / n12);
+			acc1->mean[i] += delta * (n2 / n12);
+			acc1->sum[i] += acc2->sum[i];
+			if (acc2->min[i] < acc1->min[i])
+				acc1->min[i] = acc2->min[i];
+			if (acc2->max[i] > acc1->max[i])
+				acc1->max[i] = acc2->max[i];
+		}
+		acc1->nzcount[i] += acc2->nzcount[i];
+		acc1->nacount[i] += acc2->nacount[i];
+		acc1->NAflags[i] |= acc2->NAflags[i];
+	}
+	return;
+}
+
+/* Recursive. */
+static void REC_rowSummaries_SVT(SEXP SVT, const int *dims, int ndim,
+		SEXPTYPE Rtype, const R_xlen_t *out_incs, int out_ndim,
+		R_xlen_t offset, RowAccumulators *acc)
+{
+	if (SVT == R_NilValue)
+		return;
+	if (ndim == 1) {
+		/* 'SVT' is a leaf (i.e. a 1D SVT). */
+		SparseVec sv = leaf2SV(SVT, Rtype, dims[0]);
+		update_RowAccumulators(&sv, NULL, offset, acc);
+		return;
+	}
+	int SVT_len = dims[ndim - 1];
+	R_xlen_t out_inc = ndim <= out_ndim ? out_incs[ndim - 1] : 0;
+	for (int i = 0; i < SVT_len; i++)
+		REC_rowSummaries_SVT(VECTOR_ELT(SVT, i), dims, ndim - 1,
+				     Rtype, out_incs, out_ndim,
+				     offset + out_inc * i, acc);
+	return;
+}
+
+/* 'nvals' is the number of values in the row (including zeros and NAs if
+   'narm' is False). */
+static double finalize_row_summary(int statcode, const RowAccumulators *acc,
+		R_xlen_t i, double nvals, int narm, SEXPTYPE x_Rtype,
+		int *warn)
+{
+	switch (statcode) {
+	    case NZCOUNT_STATCODE:
+		return acc->nzcount[i];
+	    case ANYNA_OPCODE:
+		return acc->nacount[i] != 0.0;
+	    case COUNTNAS_OPCODE:
+		return acc->nacount[i];
+	}
+	if (!narm) {
+		if (acc->NAflags[i] & NA_FOUND)
+			return NA_REAL;
+		if (acc->NAflags[i] & NaN_FOUND)
+			return R_NaN;
+	}
+	/* Nb of zeros. */
+	double nzeros = nvals - (acc->nzcount[i] - acc->nacount[i]);
+	switch (statcode) {
+	    case SUM_OPCODE:
+		return acc->sum[i];
+	    case MEAN_OPCODE:
+		return acc->sum[i] / nvals;
+	    case MIN_OPCODE: case MAX_OPCODE: {
+		if (nvals == 0.0 && x_Rtype != REALSXP) {
+			/* Same as what C_colStats_SVT() does. */
+			*warn = 1;
+			return NA_REAL;
+		}
+		double v = statcode == MIN_OPCODE ? acc->min[i] : acc->max[i];
+		if (nzeros != 0.0 &&
+		    (statcode == MIN_OPCODE ? v > 0.0 : v < 0.0))
+			v = 0.0;
+		return v;
+	    }
+	    case VAR1_OPCODE: case SD1_OPCODE: {
+		if (nvals <= 1.0)
+			return NA_REAL;
+		double M2 = acc->M2[i];
+		double nnz = nvals - nzeros;
+		if (nzeros != 0.0 && nnz != 0.0)
+			M2 += acc->mean[i] * acc->mean[i] *
+			      (nnz * nzeros / nvals);
+		double var = M2 / (nvals - 1.0);
+		return statcode == SD1_OPCODE ? sqrt(var) : var;
+	    }
+	}
+	error("SparseArray internal error in finalize_row_summary():\n"
+	      "    unsupported 'statcode'");
+	return 0.0;  /* will never reach this */
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_rowSummaries_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			SEXP stats, SEXP na_rm, SEXP dims)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	if (x_Rtype != INTSXP && x_Rtype != LGLSXP && x_Rtype != REALSXP)
+		error("rowSummaries() only supports SparseArray objects "
+		      "of type() \"logical\", \"integer\", or \"double\"");
+
+	if (!(IS_LOGICAL(na_rm) && LENGTH(na_rm) == 1))
+		error("'na.rm' must be TRUE or FALSE");
+	int narm = LOGICAL(na_rm)[0];
+
+	SummariesSpec spec;
+	make_SummariesSpec(stats, x_Rtype, narm, 0, &spec);
+
+	int x_ndim = LENGTH(x_dim);
+	int d = check_dims(dims, 1, x_ndim - 1);
+	R_xlen_t *out_incs = (R_xlen_t *) R_alloc(d, sizeof(R_xlen_t));
+	R_xlen_t out_inc = 1;
+	for (int along = 0; along < d; along++) {
+		out_incs[along] = out_inc;
+		out_inc *= INTEGER(x_dim)[along];
+	}
+	R_xlen_t ans_nrow = out_inc;
+
+	/* Each thread walks a range of the outermost dimension (which is
+	   never a row dimension) and fills its own set of accumulators.
+	   The sets are merged at the end. */
+	int top_len = INTEGER(x_dim)[x_ndim - 1];
+	int nthread = _get_max_threads();
+	if (nthread > top_len)
+		nthread = top_len;
+	if (nthread < 1 || x_SVT == R_NilValue)
+		nthread = 1;
+	RowAccumulators *accs = (RowAccumulators *)
+		R_alloc(nthread, sizeof(RowAccumulators));
+	for (int t = 0; t < nthread; t++)
+		accs[t] = alloc_RowAccumulators(ans_nrow);
+	if (x_SVT != R_NilValue) {
+		#pragma omp parallel for schedule(static) num_threads(nthread)
+		for (int t = 0; t < nthread; t++) {
+			int i1 = (int) ((R_xlen_t) top_len * t / nthread);
+			int i2 = (int) ((R_xlen_t) top_len * (t + 1) / nthread);
+			for (int i = i1; i < i2; i++)
+				REC_rowSummaries_SVT(VECTOR_ELT(x_SVT, i),
+						     INTEGER(x_dim), x_ndim - 1,
+						     x_Rtype, out_incs, d,
+						     0, accs + t);
+		}
+		for (int t = 1; t < nthread; t++)
+			merge_RowAccumulators(accs, accs + t, ans_nrow);
+	}
+
+	R_xlen_t n = prod_tail_dims(x_dim, d);
+	SEXP ans = PROTECT(allocMatrix(REALSXP, ans_nrow, spec.nstat));
+	double *out = REAL(ans);
+	int warn = 0;
+	for (int j = 0; j < spec.nstat; j++) {
+		for (R_xlen_t i = 0; i < ans_nrow; i++) {
+			double nvals = (double) n;
+			if (narm)
+				nvals -= accs[0].nacount[i];
+			*(out++) = finalize_row_summary(spec.statcodes[j],
+						accs, i, nvals, narm,
+						x_Rtype, &warn);
+		}
+	}
+	if (warn)
+		warning("NAs introduced by coercion of "
+			"infinite values to integers");
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * C_colOrderStats_SVT() and C_rowOrderStats_SVT()
+ *
+ * Medians, quantiles, MADs, and IQRs. The nonzero values of each col/row are
+ * gathered in a buffer and the order statistics are found with a selection
+ * algorithm that accounts for the zeros without realizing them (see
+ * order_stats.c).
+ */
+
+#define	MEDIAN_ORDER_STAT	1
+#define	QUANTILE_ORDER_STAT	2
+#define	MAD_ORDER_STAT		3
+#define	IQR_ORDER_STAT		4
+
+typedef struct order_stats_op_t {
+	int opcode;
+	const double *probs;   /* for QUANTILE_ORDER_STAT */
+	int nprob;             /* nb of values to compute per col/row */
+	int type;              /* for QUANTILE_ORDER_STAT */
+	const double *center;  /* for MAD_ORDER_STAT (can be NULL) */
+} OrderStatsOp;
+
+static OrderStatsOp make_OrderStatsOp(SEXP op, SEXPTYPE x_Rtype,
+		SEXP probs, SEXP type, SEXP center, R_xlen_t ans_len)
+{
+	if (x_Rtype != INTSXP && x_Rtype != LGLSXP && x_Rtype != REALSXP)
+		error("medians, quantiles, MADs, and IQRs can only be "
+		      "computed on a SparseArray object of type() \"logical\", "
+		      "\"integer\", or \"double\"");
+	if (!IS_CHARACTER(op) || LENGTH(op) != 1)
+		error("SparseArray internal error in make_OrderStatsOp():\n"
+		      "    'op' must be a single string");
+	const char *s = CHAR(STRING_ELT(op, 0));
+	OrderStatsOp order_stats_op;
+	order_stats_op.probs = NULL;
+	order_stats_op.nprob = 1;
+	order_stats_op.type = 7;
+	order_stats_op.center = NULL;
+	if (strcmp(s, "median") == 0) {
+		order_stats_op.opcode = MEDIAN_ORDER_STAT;
+	} else if (strcmp(s, "quantile") == 0) {
+		order_stats_op.opcode = QUANTILE_ORDER_STAT;
+		if (!IS_NUMERIC(probs))
+			error("SparseArray internal error in "
+			      "make_OrderStatsOp():\n"
+			      "    'probs' must be a numeric vector");
+		order_stats_op.probs = REAL(probs);
+		order_stats_op.nprob = LENGTH(probs);
+		if (!IS_INTEGER(type) || LENGTH(type) != 1 ||
+		    INTEGER(type)[0] < 1 || INTEGER(type)[0] > 9)
+			error("SparseArray internal error in "
+			      "make_OrderStatsOp():\n"
+			      "    'type' must be a single integer in [1, 9]");
+		order_stats_op.type = INTEGER(type)[0];
+	} else if (strcmp(s, "mad") == 0) {
+		order_stats_op.opcode = MAD_ORDER_STAT;
+		if (center != R_NilValue) {
+			if (!IS_NUMERIC(center) || XLENGTH(center) != ans_len)
+				error("SparseArray internal error in "
+				      "make_OrderStatsOp():\n"
+				      "    'center' must be NULL or a numeric "
+				      "vector with one value per col/row");
+			order_stats_op.center = REAL(center);
+		}
+	} else if (strcmp(s, "iqr") == 0) {
+		order_stats_op.opcode = IQR_ORDER_STAT;
+	} else {
+		error("SparseArray internal error in make_OrderStatsOp():\n"
+		      "    unsupported 'op': \"%s\"", s);
+	}
+	return order_stats_op;
+}
+
+/* Computes the order statistic(s) of the 'n' values in 'buf' padded with
+   'nzeros' zeros, and stores them at 'out[0]', 'out[out_stride]', etc...
+   'j' is the index of the col/row. Reorders or overwrites 'buf'. */
+static void compute_order_stats(const OrderStatsOp *op, R_xlen_t j,
+		double *buf, R_xlen_t n, R_xlen_t nzeros, R_xlen_t *counts,
+		double *out, R_xlen_t out_stride)
+{
+	switch (op->opcode) {
+	    case MEDIAN_ORDER_STAT:
+		*out = _padded_median(buf, n, 0.0, nzeros, counts);
+		return;
+	    case QUANTILE_ORDER_STAT:
+		for (int p = 0; p < op->nprob; p++)
+			out[out_stride * p] = _padded_quantile(buf, n,
+						0.0, nzeros,
+						op->probs[p], op->type,
+						counts);
+		return;
+	    case MAD_ORDER_STAT: {
+		double center = op->center != NULL ?
+				op->center[j] :
+				_padded_median(buf, n, 0.0, nzeros, counts);
+		if (ISNAN(center) || n + nzeros == 0) {
+			*out = NA_REAL;
+			return;
+		}
+		/* The absolute deviation of the zeros is '|center|'. */
+		for (R_xlen_t k = 0; k < n; k++)
+			buf[k] = fabs(buf[k] - center);
+		*out = _padded_median(buf, n, fabs(center), nzeros, counts);
+		return;
+	    }
+	    case IQR_ORDER_STAT: {
+		/* Same as 'diff(quantile(x, c(0.25, 0.75)))'. */
+		double q1 = _padded_quantile(buf, n, 0.0, nzeros, 0.25, 7,
+					     counts);
+		double q3 = _padded_quantile(buf, n, 0.0, nzeros, 0.75, 7,
+					     counts);
+		*out = q3 - q1;
+		return;
+	    }
+	}
+	return;
+}
+
+static void set_order_stats_to_NA(const OrderStatsOp *op,
+				  double *out, R_xlen_t out_stride)
+{
+	for (int p = 0; p < op->nprob; p++)
+		out[out_stride * p] = NA_REAL;
+	return;
+}
+
+/* Returns an array shaped like the result of C_colStats_SVT() or
+   C_rowStats_SVT() if 'op' computes one value per col/row, or an
+   'ans_len' x 'nprob' matrix otherwise. */
+static SEXP alloc_order_stats_ans(const OrderStatsOp *op, SEXP ans_dim,
+				  R_xlen_t *out_incs, R_xlen_t ans_len)
+{
+	if (op->opcode != QUANTILE_ORDER_STAT)
+		return alloc_ans(REALSXP, ans_dim, out_incs);
+	R_xlen_t out_inc = 1;
+	for (int along = 0; along < LENGTH(ans_dim); along++) {
+		out_incs[along] = out_inc;
+		out_inc *= INTEGER(ans_dim)[along];
+	}
+	return allocMatrix(REALSXP, ans_len, op->nprob);
+}
+
+/* Returns a buffer to be used by the counting path of _padded_median(), or
+   NULL if 'x_Rtype' is "double". */
+static R_xlen_t *alloc_counts_bufs(SEXPTYPE x_Rtype, R_xlen_t max_nzcount,
+				   int nthread, R_xlen_t *counts_len)
+{
+	if (x_Rtype == REALSXP)
+		return NULL;
+	*counts_len = max_nzcount + 1;
+	if (*counts_len > COUNTING_SELECT_MAX_RANGE)
+		*counts_len = COUNTING_SELECT_MAX_RANGE;
+	return (R_xlen_t *) R_alloc(*counts_len * nthread, sizeof(R_xlen_t));
+}
+
+/* Recursive. */
+static R_xlen_t REC_count_nzvals(SEXP SVT, int ndim)
+{
+	if (SVT == R_NilValue)
+		return 0;
+	if (ndim == 1)
+		return get_leaf_nzcount(SVT);
+	R_xlen_t nzcount = 0;
+	int SVT_len = LENGTH(SVT);
+	for (int i = 0; i < SVT_len; i++)
+		nzcount += REC_count_nzvals(VECTOR_ELT(SVT, i), ndim - 1);
+	return nzcount;
+}
+
+/* Copies the nonzero values of 'leaf' that are not NA or NaN to 'out' (as
+   doubles) and returns their number. Also returns the number of NAs and
+   NaNs in '*nacount'. */
+static int copy_leaf_nzvals(SEXP leaf, SEXPTYPE Rtype, double *out,
+			    R_xlen_t *nacount)
+{
+	SEXP nzvals, nzoffs;
+	int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
+	if (nzvals == R_NilValue) {  /* lacunar leaf */
+		for (int k = 0; k < nzcount; k++)
+			out[k] = double1;
+		return nzcount;
+	}
+	/* regular leaf */
+	int n = 0;
+	if (Rtype == REALSXP) {
+		const double *nzvals_p = REAL(nzvals);
+		for (int k = 0; k < nzcount; k++) {
+			double v = nzvals_p[k];
+			/* ISNAN(): True for *both* NA and NaN.
+			   See <R_ext/Arith.h> */
+			if (ISNAN(v))
+				continue;
+			out[n++] = v;
+		}
+	} else {
+		const int *nzvals_p = INTEGER(nzvals);
+		for (int k = 0; k < nzcount; k++) {
+			int v = nzvals_p[k];
+			if (v == NA_INTEGER)
+				continue;
+			out[n++] = (double) v;
+		}
+	}
+	*nacount += nzcount - n;
+	return n;
+}
+
+/* Recursive. Appends the nonzero values of 'SVT' that are not NA or NaN to
+   'buf' and returns the new number of values in 'buf'. */
+static R_xlen_t REC_gather_nzvals(SEXP SVT, int ndim, SEXPTYPE Rtype,
+				  double *buf, R_xlen_t buf_len,
+				  R_xlen_t *nacount)
+{
+	if (SVT == R_NilValue)
+		return buf_len;
+	if (ndim == 1)
+		return buf_len + copy_leaf_nzvals(SVT, Rtype, buf + buf_len,
+						  nacount);
+	int SVT_len = LENGTH(SVT);
+	for (int i = 0; i < SVT_len; i++)
+		buf_len = REC_gather_nzvals(VECTOR_ELT(SVT, i), ndim - 1, Rtype,
+					    buf, buf_len, nacount);
+	return buf_len;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_colOrderStats_SVT(SEXP x_dim, SEXP x_dimnames, SEXP x_type, SEXP x_SVT,
+			 SEXP op, SEXP na_rm, SEXP probs, SEXP type,
+			 SEXP center, SEXP dims)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+
+	if (!(IS_LOGICAL(na_rm) && LENGTH(na_rm) == 1))
+		error("'na.rm' must be TRUE or FALSE");
+	int narm = LOGICAL(na_rm)[0];
+
+	int d = check_dims(dims, 1, LENGTH(x_dim));
+	SEXP ans_dim = PROTECT(compute_colStats_ans_dim(x_dim, d));
+	int ans_ndim = LENGTH(ans_dim);  /* = x_ndim - d */
+	R_xlen_t ans_len = prod_tail_dims(x_dim, d);
+	OrderStatsOp order_stats_op = make_OrderStatsOp(op, x_Rtype,
+					probs, type, center, ans_len);
+	R_xlen_t *out_incs = NULL;
+	if (ans_ndim != 0)
+		out_incs = (R_xlen_t *) R_alloc(ans_ndim, sizeof(R_xlen_t));
+	SEXP ans = PROTECT(alloc_order_stats_ans(&order_stats_op, ans_dim,
+						 out_incs, ans_len));
+	if (order_stats_op.opcode != QUANTILE_ORDER_STAT)
+		propagate_colStats_dimnames(ans, x_dimnames, d);
+
+	R_xlen_t col_len = 1;
+	for (int along = 0; along < d; along++)
+		col_len *= INTEGER(x_dim)[along];
+
+	SEXP *subSVTs = (SEXP *) R_alloc(ans_len, sizeof(SEXP));
+	_collect_subSVTs(x_SVT, INTEGER(x_dim), LENGTH(x_dim), d, subSVTs);
+	R_xlen_t max_nzcount = 0;
+	for (R_xlen_t j = 0; j < ans_len; j++) {
+		R_xlen_t nzcount = REC_count_nzvals(subSVTs[j], d);
+		if (nzcount > max_nzcount)
+			max_nzcount = nzcount;
+	}
+
+	/* One buffer per thread. */
+	int nthread = _get_max_threads();
+	double *bufs = (double *) R_alloc(max_nzcount * nthread,
+					  sizeof(double));
+	R_xlen_t counts_len = 0;
+	R_xlen_t *counts_bufs = alloc_counts_bufs(x_Rtype, max_nzcount,
+						  nthread, &counts_len);
+	double *out = REAL(ans);
+	#pragma omp parallel num_threads(nthread)
+	{
+		int t = _get_thread_num();
+		double *buf = bufs + max_nzcount * t;
+		R_xlen_t *counts = counts_bufs == NULL ? NULL
+					: counts_bufs + counts_len * t;
+		#pragma omp for schedule(dynamic, 16)
+		for (R_xlen_t j = 0; j < ans_len; j++) {
+			R_xlen_t nacount = 0;
+			R_xlen_t n = REC_gather_nzvals(subSVTs[j], d, x_Rtype,
+						       buf, 0, &nacount);
+			if (nacount != 0 && !narm) {
+				set_order_stats_to_NA(&order_stats_op,
+						      out + j, ans_len);
+				continue;
+			}
+			compute_order_stats(&order_stats_op, j,
+					    buf, n, col_len - n - nacount,
+					    counts, out + j, ans_len);
+		}
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+/* Recursive. Counts the nonzero values of each row. NAs and NaNs are
+   counted separately. */
+static void REC_count_row_nzvals(SEXP SVT, const int *dims, int ndim,
+		SEXPTYPE Rtype, const R_xlen_t *out_incs, int out_ndim,
+		R_xlen_t offset, R_xlen_t *counts, R_xlen_t *nacounts)
+{
+	if (SVT == R_NilValue)
+		return;
+	if (ndim == 1) {
+		/* 'SVT' is a leaf (i.e. a 1D SVT). */
+		SEXP nzvals, nzoffs;
+		int nzcount = unzip_leaf(SVT, &nzvals, &nzoffs);
+		const int *nzoffs_p = INTEGER(nzoffs);
+		for (int k = 0; k < nzcount; k++) {
+			R_xlen_t i = offset + nzoffs_p[k];
+			int is_na = 0;
+			if (nzvals != R_NilValue) {
+				is_na = Rtype == REALSXP ?
+					ISNAN(REAL(nzvals)[k]) :
+					INTEGER(nzvals)[k] == NA_INTEGER;
+			}
+			if (is_na) {
+				nacounts[i]++;
+			} else {
+				counts[i]++;
+			}
+		}
+		return;
+	}
+	int SVT_len = dims[ndim - 1];
+	R_xlen_t out_inc = ndim <= out_ndim ? out_incs[ndim - 1] : 0;
+	for (int i = 0; i < SVT_len; i++)
+		REC_count_row_nzvals(VECTOR_ELT(SVT, i), dims, ndim - 1,
+				     Rtype, out_incs, out_ndim,
+				     offset + out_inc * i, counts, nacounts);
+	return;
+}
+
+/* Recursive. Scatters the nonzero values that are not NA or NaN to the
+   row slices of 'buf'. 'cursors[i]' is the position in 'buf' where to
+   store the next value of row 'i'. */
+static void REC_scatter_row_nzvals(SEXP SVT, const int *dims, int ndim,
+		SEXPTYPE Rtype, const R_xlen_t *out_incs, int out_ndim,
+		R_xlen_t offset, R_xlen_t *cursors, double *buf)
+{
+	if (SVT == R_NilValue)
+		return;
+	if (ndim == 1) {
+		/* 'SVT' is a leaf (i.e. a 1D SVT). */
+		SEXP nzvals, nzoffs;
+		int nzcount = unzip_leaf(SVT, &nzvals, &nzoffs);
+		const int *nzoffs_p = INTEGER(nzoffs);
+		for (int k = 0; k < nzcount; k++) {
+			double v = double1;
+			if (nzvals != R_NilValue) {
+				if (Rtype == REALSXP) {
+					v = REAL(nzvals)[k];
+					if (ISNAN(v))
+						continue;
+				} else {
+					int iv = INTEGER(nzvals)[k];
+					if (iv == NA_INTEGER)
+						continue;
+					v = (double) iv;
+				}
+			}
+			buf[cursors[offset + nzoffs_p[k]]++] = v;
+		}
+		return;
+	}
+	int SVT_len = dims[ndim - 1];
+	R_xlen_t out_inc = ndim <= out_ndim ? out_incs[ndim - 1] : 0;
+	for (int i = 0; i < SVT_len; i++)
+		REC_scatter_row_nzvals(VECTOR_ELT(SVT, i), dims, ndim - 1,
+				       Rtype, out_incs, out_ndim,
+				       offset + out_inc * i, cursors, buf);
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_rowOrderStats_SVT(SEXP x_dim, SEXP x_dimnames, SEXP x_type, SEXP x_SVT,
+			 SEXP op, SEXP na_rm, SEXP probs, SEXP type,
+			 SEXP center, SEXP dims)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+
+	if (!(IS_LOGICAL(na_rm) && LENGTH(na_rm) == 1))
+		error("'na.rm' must be TRUE or FALSE");
+	int narm = LOGICAL(na_rm)[0];
+
+	int d = check_dims(dims, 1, LENGTH(x_dim) - 1);
+	SEXP ans_dim = PROTECT(compute_rowStats_ans_dim(x_dim, d));
+	R_xlen_t ans_len = 1;
+	for (int along = 0; along < d; along++)
+		ans_len *= INTEGER(x_dim)[along];
+	OrderStatsOp order_stats_op = make_OrderStatsOp(op, x_Rtype,
+					probs, type, center, ans_len);
+	/* 'd' is guaranteed to be >= 1. */
+	R_xlen_t *out_incs = (R_xlen_t *) R_alloc(d, sizeof(R_xlen_t));
+	SEXP ans = PROTECT(alloc_order_stats_ans(&order_stats_op, ans_dim,
+						 out_incs, ans_len));
+	if (order_stats_op.opcode != QUANTILE_ORDER_STAT)
+		propagate_rowStats_dimnames(ans, x_dimnames, d);
+	R_xlen_t row_len = prod_tail_dims(x_dim, d);
+
+	/* 1st pass: count the values of each row. */
+	R_xlen_t *counts = (R_xlen_t *) R_alloc(ans_len, sizeof(R_xlen_t));
+	R_xlen_t *nacounts = (R_xlen_t *) R_alloc(ans_len, sizeof(R_xlen_t));
+	memset(counts, 0, sizeof(R_xlen_t) * ans_len);
+	memset(nacounts, 0, sizeof(R_xlen_t) * ans_len);
+	REC_count_row_nzvals(x_SVT, INTEGER(x_dim), LENGTH(x_dim),
+			     x_Rtype, out_incs, d,
+			     0, counts, nacounts);
+
+	/* 2nd pass: gather the values of each row in a contiguous slice
+	   of 'buf'. */
+	R_xlen_t *starts = (R_xlen_t *) R_alloc(ans_len + 1, sizeof(R_xlen_t));
+	R_xlen_t max_nzcount = 0;
+	starts[0] = 0;
+	for (R_xlen_t i = 0; i < ans_len; i++) {
+		starts[i + 1] = starts[i] + counts[i];
+		if (counts[i] > max_nzcount)
+			max_nzcount = counts[i];
+	}
+	double *buf = (double *) R_alloc(starts[ans_len], sizeof(double));
+	R_xlen_t *cursors = (R_xlen_t *) R_alloc(ans_len, sizeof(R_xlen_t));
+	memcpy(cursors, starts, sizeof(R_xlen_t) * ans_len);
+	REC_scatter_row_nzvals(x_SVT, INTEGER(x_dim), LENGTH(x_dim),
+			       x_Rtype, out_incs, d,
+			       0, cursors, buf);
+
+	/* 3rd pass: compute the order statistics in parallel. */
+	int nthread = _get_max_threads();
+	R_xlen_t counts_len = 0;
+	R_xlen_t *counts_bufs = alloc_counts_bufs(x_Rtype, max_nzcount,
+						  nthread, &counts_len);
+	double *out = REAL(ans);
+	#pragma omp parallel num_threads(nthread)
+	{
+		int t = _get_thread_num();
+		R_xlen_t *cbuf = counts_bufs == NULL ? NULL
+					: counts_bufs + counts_len * t;
+		#pragma omp for schedule(dynamic, 64)
+		for (R_xlen_t i = 0; i < ans_len; i++) {
+			if (nacounts[i] != 0 && !narm) {
+				set_order_stats_to_NA(&order_stats_op,
+						      out + i, ans_len);
+				continue;
+			}
+			compute_order_stats(&order_stats_op, i,
+					buf + starts[i], counts[i],
+					row_len - counts[i] - nacounts[i],
+					cbuf, out + i, ans_len);
+		}
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+
+/****************************************************************************
+ * C_groupSummaries_SVT()
+ *
+ * Group-wise statistics along any dimension of 'x'. This generalizes
+ * rowsum()/colsum() to the statistics supported by colSummaries(), plus the
+ * median. The result has the dimensions of 'x', except along the grouping
+ * dimension where it has one element per group. All the statistics are
+ * computed in a single parallel pass with the accumulators used by
+ * C_rowSummaries_SVT(), and the zeros are accounted for at the end from the
+ * group sizes.
+ *
+ * We call "output column" a 1D slice of the result along its 1st dimension.
+ * When grouping along the 1st dimension, each output column is computed from
+ * a single leaf of 'x'. Otherwise it's computed from the leaves that belong
+ * to the same group. The output columns are computed in parallel.
+ */
+
+typedef struct grouping_t {
+	int along;          /* 0-based grouping dimension */
+	int ngroup;
+	int *groups;        /* 0-based group of each element along 'along' */
+	R_xlen_t *sizes;    /* nb of elements along 'along' in each group */
+	int *starts;        /* members of group g are 'members[starts[g]]' */
+	int *members;       /* to 'members[starts[g + 1] - 1]' */
+	R_xlen_t n_mid;     /* nb of leaves between 2 consecutive elements
+			       along 'along' */
+	int along_len;
+} Grouping;
+
+static Grouping make_Grouping(SEXP x_dim, SEXP group, SEXP ngroup, SEXP along)
+{
+	Grouping grp;
+	int x_ndim = LENGTH(x_dim);
+	if (!IS_INTEGER(along) || LENGTH(along) != 1 ||
+	    INTEGER(along)[0] < 1 || INTEGER(along)[0] > x_ndim)
+		error("SparseArray internal error in make_Grouping():\n"
+		      "    'along' must be a single integer >= 1 and <= the "
+		      "number of dimensions of 'x'");
+	grp.along = INTEGER(along)[0] - 1;
+	grp.along_len = INTEGER(x_dim)[grp.along];
+	grp.ngroup = INTEGER(ngroup)[0];
+	if (!IS_INTEGER(group) || LENGTH(group) != grp.along_len)
+		error("SparseArray internal error in make_Grouping():\n"
+		      "    'group' must be an integer vector with one element "
+		      "per element of 'x' along the grouping dimension");
+	grp.groups = (int *) R_alloc(grp.along_len, sizeof(int));
+	grp.sizes = (R_xlen_t *) R_alloc(grp.ngroup, sizeof(R_xlen_t));
+	memset(grp.sizes, 0, sizeof(R_xlen_t) * grp.ngroup);
+	for (int i = 0; i < grp.along_len; i++) {
+		int g = INTEGER(group)[i];
+		if (g == NA_INTEGER)
+			g = grp.ngroup;
+		if (g < 1 || g > grp.ngroup)
+			error("SparseArray internal error in make_Grouping():\n"
+			      "    all values in 'group' must be NA or "
+			      ">= 1 and <= 'ngroup'");
+		grp.groups[i] = g - 1;
+		grp.sizes[g - 1]++;
+	}
+	grp.starts = (int *) R_alloc(grp.ngroup + 1, sizeof(int));
+	grp.starts[0] = 0;
+	for (int g = 0; g < grp.ngroup; g++)
+		grp.starts[g + 1] = grp.starts[g] + (int) grp.sizes[g];
+	grp.members = (int *) R_alloc(grp.along_len, sizeof(int));
+	int *cursors = (int *) R_alloc(grp.ngroup, sizeof(int));
+	memcpy(cursors, grp.starts, sizeof(int) * grp.ngroup);
+	for (int i = 0; i < grp.along_len; i++)
+		grp.members[cursors[grp.groups[i]]++] = i;
+	grp.n_mid = 1;
+	for (int along = 1; along < grp.along; along++)
+		grp.n_mid *= INTEGER(x_dim)[along];
+	return grp;
+}
+
+/* Returns the number of leaves that contribute to output column 'oc'. */
+static inline int count_contributing_leaves(const Grouping *grp, R_xlen_t oc)
+{
+	if (grp->along == 0)
+		return 1;
+	int g = (int) ((oc / grp->n_mid) % grp->ngroup);
+	return (int) grp->sizes[g];
+}
+
+/* Returns the m-th leaf that contributes to output column 'oc'. */
+static inline SEXP get_contributing_leaf(const Grouping *grp,
+		const SEXP *leaves, R_xlen_t oc, int m)
+{
+	if (grp->along == 0)
+		return leaves[oc];
+	R_xlen_t c_inner = oc % grp->n_mid;
+	R_xlen_t q = oc / grp->n_mid;
+	int g = (int) (q % grp->ngroup);
+	R_xlen_t c_outer = q / grp->ngroup;
+	int a = grp->members[grp->starts[g] + m];
+	return leaves[c_inner + grp->n_mid * (a + grp->along_len * c_outer)];
+}
+
+/* Returns the nb of values in the cell of the result that is at row 'i'
+   of output column 'oc' (zeros and NAs included). */
+static inline R_xlen_t get_cell_size(const Grouping *grp, R_xlen_t oc,
+				     int i)
+{
+	if (grp->along == 0)
+		return grp->sizes[i];
+	return grp->sizes[(oc / grp->n_mid) % grp->ngroup];
+}
+
+/* Gathers the nonzero values (that are not NA or NaN) of the leaves that
+   contribute to output column 'oc' in 'buf', bucketed by row of the output
+   column. On return, the values of row i are at 'buf[bstarts[i]]' to
+   'buf[bstarts[i + 1] - 1]'. 'bstarts' and 'bcursors' must have room for
+   'out_nrow + 1' values. */
+static void gather_output_col_nzvals(const Grouping *grp, const SEXP *leaves,
+		R_xlen_t oc, SEXPTYPE Rtype, int out_nrow,
+		double *buf, R_xlen_t *bstarts, R_xlen_t *bcursors)
+{
+	const int *row_map = grp->along == 0 ? grp->groups : NULL;
+	int nleaf = count_contributing_leaves(grp, oc);
+	memset(bstarts, 0, sizeof(R_xlen_t) * (out_nrow + 1));
+	for (int pass = 0; pass < 2; pass++) {
+		for (int m = 0; m < nleaf; m++) {
+			SEXP leaf = get_contributing_leaf(grp, leaves, oc, m);
+			if (leaf == R_NilValue)
+				continue;
+			SEXP nzvals, nzoffs;
+			int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
+			const int *nzoffs_p = INTEGER(nzoffs);
+			for (int k = 0; k < nzcount; k++) {
+				double v = double1;
+				if (nzvals != R_NilValue) {
+					if (Rtype == REALSXP) {
+						v = REAL(nzvals)[k];
+					} else {
+						int iv = INTEGER(nzvals)[k];
+						v = iv == NA_INTEGER ?
+						    NA_REAL : (double) iv;
+					}
+					if (ISNAN(v))
+						continue;
+				}
+				int row = nzoffs_p[k];
+				if (row_map != NULL)
+					row = row_map[row];
+				if (pass == 0) {
+					bstarts[row + 1]++;
+				} else {
+					buf[bcursors[row]++] = v;
+				}
+			}
+		}
+		if (pass == 0) {
+			for (int i = 0; i < out_nrow; i++)
+				bstarts[i + 1] += bstarts[i];
+			memcpy(bcursors, bstarts, sizeof(R_xlen_t) * out_nrow);
+		}
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_groupSummaries_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			  SEXP group, SEXP ngroup, SEXP along,
+			  SEXP stats, SEXP na_rm)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	if (x_Rtype != INTSXP && x_Rtype != LGLSXP && x_Rtype != REALSXP)
+		error("groupSummaries() only supports SparseArray objects "
+		      "of type() \"logical\", \"integer\", or \"double\"");
+
+	if (!(IS_LOGICAL(na_rm) && LENGTH(na_rm) == 1))
+		error("'na.rm' must be TRUE or FALSE");
+	int narm = LOGICAL(na_rm)[0];
+
+	SummariesSpec spec;
+	make_SummariesSpec(stats, x_Rtype, narm, 1, &spec);
+	Grouping grp = make_Grouping(x_dim, group, ngroup, along);
+
+	/* Collect the leaves of 'x'. */
+	int x_ndim = LENGTH(x_dim);
+	int nrow = INTEGER(x_dim)[0];
+	R_xlen_t nleaf = 1;
+	for (int along = 1; along < x_ndim; along++)
+		nleaf *= INTEGER(x_dim)[along];
+	SEXP *leaves = (SEXP *) R_alloc(nleaf, sizeof(SEXP));
+	_collect_subSVTs(x_SVT, INTEGER(x_dim), x_ndim, 1, leaves);
+
+	int out_nrow = grp.along == 0 ? grp.ngroup : nrow;
+	R_xlen_t n_outer = 1;
+	for (int along = grp.along + 1; along < x_ndim; along++)
+		n_outer *= INTEGER(x_dim)[along];
+	R_xlen_t n_oc = grp.along == 0 ? nleaf
+				       : grp.n_mid * grp.ngroup * n_outer;
+	R_xlen_t ans_len = (R_xlen_t) out_nrow * n_oc;
+
+	/* The medians need a buffer big enough for the values of any output
+	   column. */
+	int nthread = _get_max_threads();
+	R_xlen_t max_nzcount = 0;
+	double *bufs = NULL, *medians = NULL;
+	R_xlen_t *bstarts_bufs = NULL, *counts_bufs = NULL, counts_len = 0;
+	if (spec.median_col >= 0) {
+		for (R_xlen_t oc = 0; oc < n_oc; oc++) {
+			R_xlen_t nzcount = 0;
+			int n = count_contributing_leaves(&grp, oc);
+			for (int m = 0; m < n; m++) {
+				SEXP leaf = get_contributing_leaf(&grp, leaves,
+								  oc, m);
+				if (leaf != R_NilValue)
+					nzcount += get_leaf_nzcount(leaf);
+			}
+			if (nzcount > max_nzcount)
+				max_nzcount = nzcount;
+		}
+		bufs = (double *) R_alloc(max_nzcount * nthread,
+					  sizeof(double));
+		bstarts_bufs = (R_xlen_t *) R_alloc(
+				(R_xlen_t) 2 * (out_nrow + 1) * nthread,
+				sizeof(R_xlen_t));
+		counts_bufs = alloc_counts_bufs(x_Rtype, max_nzcount,
+						nthread, &counts_len);
+		medians = (double *) R_alloc(ans_len, sizeof(double));
+	}
+
+	RowAccumulators acc = alloc_RowAccumulators(ans_len);
+	const int *row_map = grp.along == 0 ? grp.groups : NULL;
+	#pragma omp parallel num_threads(nthread)
+	{
+		int t = _get_thread_num();
+		#pragma omp for schedule(dynamic, 16)
+		for (R_xlen_t oc = 0; oc < n_oc; oc++) {
+			R_xlen_t offset = oc * out_nrow;
+			int n = count_contributing_leaves(&grp, oc);
+			for (int m = 0; m < n; m++) {
+				SEXP leaf = get_contributing_leaf(&grp, leaves,
+								  oc, m);
+				if (leaf == R_NilValue)
+					continue;
+				SparseVec sv = leaf2SV(leaf, x_Rtype, nrow);
+				update_RowAccumulators(&sv, row_map, offset,
+						       &acc);
+			}
+			if (medians == NULL)
+				continue;
+			double *buf = bufs + max_nzcount * t;
+			R_xlen_t *bstarts = bstarts_bufs +
+					    (R_xlen_t) 2 * (out_nrow + 1) * t;
+			R_xlen_t *bcursors = bstarts + out_nrow + 1;
+			R_xlen_t *counts = counts_bufs == NULL ? NULL
+					: counts_bufs + counts_len * t;
+			gather_output_col_nzvals(&grp, leaves, oc, x_Rtype,
+					out_nrow, buf, bstarts, bcursors);
+			for (int i = 0; i < out_nrow; i++) {
+				R_xlen_t cell = offset + i;
+				if (acc.nacount[cell] != 0.0 && !narm) {
+					medians[cell] = NA_REAL;
+					continue;
+				}
+				R_xlen_t nzeros = get_cell_size(&grp, oc, i) -
+						  (R_xlen_t) acc.nzcount[cell];
+				medians[cell] = _padded_median(
+						buf + bstarts[i],
+						bstarts[i + 1] - bstarts[i],
+						0.0, nzeros, counts);
+			}
+		}
+	}
+
+	SEXP ans = PROTECT(NEW_LIST(spec.nstat));
+	int warn = 0;
+	for (int j = 0; j < spec.nstat; j++) {
+		SEXP ans_elt = PROTECT(NEW_NUMERIC(ans_len));
+		double *out = REAL(ans_elt);
+		int statcode = spec.statcodes[j];
+		if (statcode == MEDIAN_STATCODE) {
+			memcpy(out, medians, sizeof(double) * ans_len);
+		} else {
+			for (R_xlen_t cell = 0; cell < ans_len; cell++) {
+				R_xlen_t oc = cell / out_nrow;
+				int i = (int) (cell % out_nrow);
+				double nvals = (double)
+					get_cell_size(&grp, oc, i);
+				if (narm)
+					nvals -= acc.nacount[cell];
+				out[cell] = finalize_row_summary(statcode,
+						&acc, cell, nvals, narm,
+						x_Rtype, &warn);
+			}
+		}
+		SET_VECTOR_ELT(ans, j, ans_elt);
+		UNPROTECT(1);
+	}
+	if (warn)
+		warning("NAs introduced by coercion of "
+			"infinite values to integers");
+
+	UNPROTECT(1);
+	return ans;
+}
@@ -25,5 +25,60 @@ SEXP C_rowStats_SVT(
 	SEXP dims
 );
 
+SEXP C_colSummaries_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP stats,
+	SEXP na_rm,
+	SEXP dims
+);
+
+SEXP C_rowSummaries_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP stats,
+	SEXP na_rm,
+	SEXP dims
+);
+
+SEXP C_colOrderStats_SVT(
+	SEXP x_dim,
+	SEXP x_dimnames,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP op,
+	SEXP na_rm,
+	SEXP probs,
+	SEXP type,
+	SEXP center,
+	SEXP dims
+);
+
+SEXP C_rowOrderStats_SVT(
+	SEXP x_dim,
+	SEXP x_dimnames,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP op,
+	SEXP na_rm,
+	SEXP probs,
+	SEXP type,
+	SEXP center,
+	SEXP dims
+);
+
+SEXP C_groupSummaries_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP group,
+	SEXP ngroup,
+	SEXP along,
+	SEXP stats,
+	SEXP na_rm
+);
+
 #endif  /* _SPARSEARRAY_MATRIXSTATS_H_ */
 
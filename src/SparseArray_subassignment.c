@@ -8,10 +8,12 @@
 #include "SparseArray_subassignment.h"
 
 #include "OPBufTree.h"
-#include "thread_control.h"  /* for which_max() */
+#include "thread_control.h"  /* for _get_max_threads() */
 #include "Rvector_utils.h"
 #include "leaf_utils.h"
 
+#include <stdlib.h>  /* for qsort() */
+#include <string.h>  /* for memcpy() */
 #include <limits.h>  /* for INT_MAX */
 //#include <time.h>
 
@@ -43,58 +45,35 @@ static inline R_xlen_t get_Lidx(SEXP Lindex, long long atid_lloff)
 
 
 /****************************************************************************
- * Basic manipulation of "extended leaves"
+ * Long incoming data
  *
- * An "extended leaf" is used to temporarily attach a subset of the incoming
- * data (represented by 'Mindex' and 'vals', or by 'Lindex' and 'vals') to
- * an SVT leaf.
+ * C_subassign_SVT_by_Lindex() accepts a _long_ linear index (Lindex), that
+ * is, an Lindex of length > INT_MAX. This is needed to bulk-assign into an
+ * array with more than 2^31 elements e.g.
  *
- * There are 3 types of extended leaves:
+ *     svt[sample(length(svt), 3e9, replace=TRUE)] <- 2.5
  *
- * - type 1: A standalone Incoming Data Subset (IDS). An IDS is simply a
- *           set of offsets w.r.t. 'Mindex' (or 'Lindex') and 'vals'.
- *           These offsets get stored in an IntAE or LLongAE buffer placed
- *           behind an external pointer, and are referred to as "atid" offsets
- *           (offsets along the incoming data).
- *           Note that using an IntAE buffer would be ok for now because we're
- *           not dealing with _long_ incoming data yet. However, this will
- *           change when we start supporting _long_ incoming data e.g. when
- *           C_subassign_SVT_by_Lindex() will get passed a _long_ linear index.
+ * In the multidimensional case, the (idx0,Loff) pairs get stored in the
+ * OPBuf's of an OPBufTree. The 'Loff' component of a pair is stored in an
+ * 'int' or 'R_xlen_t' array depending on whether it's <= INT_MAX or not
+ * (see OPBufTree.h). Sorting of the pairs is performed on a per-OPBuf basis
+ * with qsort() (see sort_and_dedup_opbuf() below), which is not limited to
+ * INT_MAX elements. However an OPBuf can hold at most INT_MAX pairs, so more
+ * than INT_MAX incoming values landing on the same SVT leaf will trigger an
+ * error. This can only happen if the supplied Lindex is _long_ and contains
+ * a lot of duplicates. A very atypical situation.
  *
- * - type 2: Just a regular leaf (possibly lacunar) so not really "extended"
- *           in that case.
- *
- * - type 3: A regular leaf with an IDS on it. This is represented by a
- *           list of length 3: the 2 list elements of a regular leaf (nzvals
- *           and nzoffs) + the IDS.
- *
- * IMPORTANT NOTE: We don't allow the length of an IDS to be more than INT_MAX
- * at the moment. This is because we use sort_ints() in compute_offs_order()
- * below to sort a vector of 'IDS_len' integers and sort_ints() only handles
- * a vector of length <= INT_MAX!
- * Note however that 'IDS_len' > INT_MAX can't happen at the moment anyway
- * because 'IDS_len' is necessarily <= 'nrow(Mindex)' which is guaranteed
- * to be <= INT_MAX. However, this will change when we start supporting
- * _long_ incoming data e.g. when C_subassign_SVT_by_Lindex() is called
- * with a _long_ linear index (Lindex). Then it will be possible that more
- * than INT_MAX incoming values land on the same SVT leaf but only in some
- * crazy and rather unlikely situations. More precisely this will be possible
- * only if the supplied Lindex is _long_ and contains duplicates. Like here:
- *
- *     svt[sample(nrow(svt), 3e9, replace=TRUE)] <- 2.5
- *
- * where 3e9 incoming values are landing on the SVT leaf associated with
- * the first column of the sparse matrix! A very atypical situation.
+ * In the 1D case, the incoming values all land on the same leaf. A long
+ * Lindex is handled by subassign_leaf_by_long_Lindex() which doesn't need
+ * to sort anything.
  */
 #include "S4Vectors_interface.h"
 
-typedef SEXP (*NewIDS_FUNType)(void);
-
 
 /****************************************************************************
- * REC_postprocess_SVT_using_[M|L]index()
+ * SortBufs
  *
- * This implements the 2nd pass of C_subassign_SVT_by_[M|L]index().
+ * Used by subassign_leaf_by_Lindex() below (1D case).
  */
 
 typedef struct sort_bufs_t {
@@ -210,6 +189,46 @@ static SEXP make_offval_pairs_from_Lindex_vals(SEXP Lindex, SEXP vals,
 	return ans;
 }
 
+/* To use when 'length(Lindex)' > INT_MAX. Because 'dim0' is <= INT_MAX
+   (and therefore < 'length(Lindex)'), we can afford to use a buffer of
+   length 'dim0' that maps each offset in the leaf to the last incoming
+   value that lands on it. This avoids sorting the incoming offsets.
+   The returned leaf can be NULL or lacunar. */
+static SEXP subassign_leaf_by_long_Lindex(SEXP leaf, int dim0,
+		SEXP Lindex, SEXP vals)
+{
+	R_xlen_t nvals = XLENGTH(vals);
+	R_xlen_t *last_Loffs = (R_xlen_t *) R_alloc(dim0, sizeof(R_xlen_t));
+	for (int i = 0; i < dim0; i++)
+		last_Loffs[i] = -1;
+	/* Walk along the incoming data. */
+	for (R_xlen_t Loff = 0; Loff < nvals; Loff++) {
+		R_xlen_t idx0;
+		int ret = extract_long_idx0(Lindex, Loff, (R_xlen_t) dim0,
+					    &idx0);
+		if (ret < 0) {
+			_bad_Lindex_error(ret);
+			return R_NilValue;  /* will never reach this */
+		}
+		last_Loffs[idx0] = Loff;
+	}
+	SEXPTYPE Rtype = TYPEOF(vals);
+	CopyRVectorElt_FUNType copy_Rvector_elt_FUN =
+		_select_copy_Rvector_elt_FUN(Rtype);
+	SEXP buf = PROTECT(_new_Rvector0(Rtype, (R_xlen_t) dim0));
+	if (leaf != R_NilValue)
+		_expand_leaf(leaf, buf, 0);
+	for (int i = 0; i < dim0; i++) {
+		R_xlen_t Loff = last_Loffs[i];
+		if (Loff != -1)
+			copy_Rvector_elt_FUN(vals, Loff, buf, (R_xlen_t) i);
+	}
+	int *offs_buf = (int *) R_alloc(dim0, sizeof(int));
+	SEXP ans = _make_leaf_from_Rsubvec(buf, 0, dim0, offs_buf, 0);
+	UNPROTECT(1);
+	return ans;
+}
+
 /* 'Lindex' and 'vals' are assumed to have the same nonzero length.
    The returned leaf can be NULL or lacunar. */
 static SEXP subassign_leaf_by_Lindex(SEXP leaf, int dim0,
@@ -220,9 +239,7 @@ static SEXP subassign_leaf_by_Lindex(SEXP leaf, int dim0,
 		      "is not supported yet");
 	R_xlen_t nvals = XLENGTH(vals);
 	if (nvals > INT_MAX)
-		error("assigning more than INT_MAX values to "
-		      "a monodimensional SVT_SparseArray object "
-		      "is not supported");
+		return subassign_leaf_by_long_Lindex(leaf, dim0, Lindex, vals);
 	size_t worst_nzcount;
 	if (leaf == R_NilValue) {
 		worst_nzcount = nvals;
@@ -258,88 +275,95 @@ static SEXP subassign_leaf_by_Lindex(SEXP leaf, int dim0,
 
 
 /****************************************************************************
- * subassign_leaf_by_OPBuf()
+ * Merging an OPBuf with an SVT leaf
+ *
+ * The 2nd pass of C_subassign_SVT_by_[L|M]index() merges each OPBuf in the
+ * OPBufTree with the SVT leaf it lands on. This is done in 2 steps:
+ *
+ *   (a) For each (OPBuf,leaf) pair, compute a "merge plan" i.e. the offsets
+ *       of the nonzero values in the resulting leaf and where these values
+ *       come from ('vals' or 'nzvals(leaf)'). This step does not use the
+ *       R API for memory allocation so it is performed in parallel over
+ *       the (OPBuf,leaf) pairs.
+ *
+ *   (b) Walk on the OPBufTree again to build the new SVT from the merge
+ *       plans. This step allocates R objects so is performed sequentially.
+ *       Note that the values get copied only once, directly from 'vals'
+ *       or from the original leaves to the new leaves.
  */
 
-static void init_idx0_to_k_map(int *idx0_to_k_map, const int *idx0s, int nelt)
-{
-	for (int k = 0; k < nelt; k++)
-		idx0_to_k_map[idx0s[k]] = k;
-	return;
-}
-
-static void reset_idx0_to_k_map(int *idx0_to_k_map, const int *idx0s, int nelt)
-{
-	for (int k = 0; k < nelt; k++)
-		idx0_to_k_map[idx0s[k]] = -1;
-	return;
-}
-
-/*
-static void print_idx0_to_k_map(const int *idx0_to_k_map, int dim0)
-{
-	printf("idx0_to_k_map:");
-	for (int i = 0; i < dim0; i++)
-		printf(" %4d", idx0_to_k_map[i]);
-	printf("\n");
-	return;
-}
-*/
-
 /* TODO: Maybe add this to OPBufTree.h as inline functions. */
 #define	GET_LOFF(Loffs, xLoffs, k) \
 	((Loffs) != NULL ? (R_xlen_t) ((Loffs)[(k)]) : (xLoffs)[(k)])
 #define	GET_OPBUF_LOFF(opbuf, k) GET_LOFF(opbuf->Loffs, opbuf->xLoffs, k)
 
-/* TODO: Move all this to Rvector_utils.h. */
-static inline int Rvector_elt_is_int0(SEXP Rvector, R_xlen_t i)
+/* The functions below are called from within a parallel region (see
+   subassign_SVT_by_OPBufTree() below) so must not touch the R API when the
+   vector is atomic. This is why they take the data pointer 'Rvector_p'
+   obtained on the main thread, in addition to the vector itself. Only the
+   functions for STRSXP and VECSXP access 'Rvector' (via STRING_ELT() or
+   VECTOR_ELT()) and subassign_SVT_by_OPBufTree() makes sure that they are
+   called from the main thread only.
+   TODO: Move all this to Rvector_utils.h. */
+static inline int Rvector_elt_is_int0(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
-	return INTEGER(Rvector)[i] == int0;
+	return ((const int *) Rvector_p)[i] == int0;
 }
-static inline int Rvector_elt_is_intNA(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_intNA(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
-	return INTEGER(Rvector)[i] == NA_INTEGER;
+	return ((const int *) Rvector_p)[i] == NA_INTEGER;
 }
 
-static inline int Rvector_elt_is_double0(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_double0(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
-	return REAL(Rvector)[i] == double0;
+	return ((const double *) Rvector_p)[i] == double0;
 }
-static inline int Rvector_elt_is_doubleNA(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_doubleNA(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
-	return ISNAN(REAL(Rvector)[i]);
+	return ISNAN(((const double *) Rvector_p)[i]);
 }
 
-static inline int Rvector_elt_is_Rcomplex0(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_Rcomplex0(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
-	const Rcomplex *z = COMPLEX(Rvector) + i;
+	const Rcomplex *z = (const Rcomplex *) Rvector_p + i;
 	return z->r == Rcomplex0.r && z->i == Rcomplex0.i;
 }
-static inline int Rvector_elt_is_RcomplexNA(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_RcomplexNA(SEXP Rvector,
+		const void *Rvector_p, R_xlen_t i)
 {
-	return RCOMPLEX_IS_NA(COMPLEX(Rvector) + i);
+	return RCOMPLEX_IS_NA((const Rcomplex *) Rvector_p + i);
 }
 
-static inline int Rvector_elt_is_Rbyte0(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_Rbyte0(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
-	return RAW(Rvector)[i] == Rbyte0;
+	return ((const Rbyte *) Rvector_p)[i] == Rbyte0;
 }
 
-static inline int Rvector_elt_is_Rstring0(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_Rstring0(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
 	return IS_EMPTY_CHARSXP(STRING_ELT(Rvector, i));
 }
-static inline int Rvector_elt_is_RstringNA(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_RstringNA(SEXP Rvector, const void *Rvector_p,
+		R_xlen_t i)
 {
 	return STRING_ELT(Rvector, i) == NA_STRING;
 }
 
-static inline int Rvector_elt_is_R_NilValue(SEXP Rvector, R_xlen_t i)
+static inline int Rvector_elt_is_R_NilValue(SEXP Rvector,
+		const void *Rvector_p, R_xlen_t i)
 {
 	return VECTOR_ELT(Rvector, i) == R_NilValue;
 }
 
-typedef int (*RVectorEltIsZero_FUNType)(SEXP Rvector, R_xlen_t i);
+typedef int (*RVectorEltIsZero_FUNType)(SEXP Rvector, const void *Rvector_p,
+					R_xlen_t i);
 
 static RVectorEltIsZero_FUNType select_Rvector_elt_is_zero_FUN(SEXPTYPE Rtype)
 {
@@ -369,72 +393,76 @@ static RVectorEltIsZero_FUNType select_Rvector_elt_is_NA_FUN(SEXPTYPE Rtype)
 	      "    type \"%s\" is not supported", type2char(Rtype));
 }
 
+/* A NULL 'Rvector1_p' (atomic types) or an 'Rvector1' set to R_NilValue
+   (STRSXP and VECSXP) means that 'Rvector1' is the 'nzvals' of a lacunar
+   leaf. The same_*_vals() functions are called from within a parallel
+   region so must never call error(). */
 static inline int same_INTEGER_vals(
-		SEXP Rvector1, R_xlen_t i1,
-		SEXP Rvector2, R_xlen_t i2)
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2)
 {
-	int val1 = Rvector1 == R_NilValue ? int1 : INTEGER(Rvector1)[i1];
-	return val1 == INTEGER(Rvector2)[i2];
+	int val1 = Rvector1_p == NULL ? int1
+				      : ((const int *) Rvector1_p)[i1];
+	return val1 == ((const int *) Rvector2_p)[i2];
 }
 
 static inline int same_NUMERIC_vals(
-		SEXP Rvector1, R_xlen_t i1,
-		SEXP Rvector2, R_xlen_t i2)
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2)
 {
-	double val1 = Rvector1 == R_NilValue ? double1 : REAL(Rvector1)[i1];
-	return val1 == REAL(Rvector2)[i2];
+	double val1 = Rvector1_p == NULL ? double1
+					 : ((const double *) Rvector1_p)[i1];
+	return val1 == ((const double *) Rvector2_p)[i2];
 }
 
 static inline int same_COMPLEX_vals(
-		SEXP Rvector1, R_xlen_t i1,
-		SEXP Rvector2, R_xlen_t i2)
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2)
 {
-	const Rcomplex *z1 = Rvector1 == R_NilValue ? &Rcomplex1
-						    : COMPLEX(Rvector1) + i1;
-	const Rcomplex *z2 = COMPLEX(Rvector2) + i2;
+	const Rcomplex *z1 = Rvector1_p == NULL ? &Rcomplex1
+				: (const Rcomplex *) Rvector1_p + i1;
+	const Rcomplex *z2 = (const Rcomplex *) Rvector2_p + i2;
 	return z1->r == z2->r && z1->i == z2->i;
 }
 
 static inline int same_RAW_vals(
-		SEXP Rvector1, R_xlen_t i1,
-		SEXP Rvector2, R_xlen_t i2)
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2)
 {
-	Rbyte val1 = Rvector1 == R_NilValue ? Rbyte1 : RAW(Rvector1)[i1];
-	return val1 == RAW(Rvector2)[i2];
+	Rbyte val1 = Rvector1_p == NULL ? Rbyte1
+					: ((const Rbyte *) Rvector1_p)[i1];
+	return val1 == ((const Rbyte *) Rvector2_p)[i2];
 }
 
+/* A lacunar leaf is not expected in an SVT_SparseArray object of type
+   "character" or "list". If we get one, we just report the values as
+   different, which is always safe (the subassignment won't be treated as
+   a no-op). Note that we compare the addresses, not the actual values.
+   Doesn't matter as long as our primary use case is covered. Primary use
+   case is that
+       svt[Lindex] <- svt[Lindex]
+   is a no-op that triggers no copy. */
 static inline int same_CHARACTER_vals(
-		SEXP Rvector1, R_xlen_t i1,
-		SEXP Rvector2, R_xlen_t i2)
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2)
 {
 	if (Rvector1 == R_NilValue)
-		error("SparseArray internal error in same_CHARACTER_vals():\n"
-		      "    lacunar leaf found in an SVT_SparseArray object "
-		      "of type \"character\"");
-	/* Compares the addresses, not the actual values. Doesn't matter as
-	   long as our primary use case is covered. Primary use case is that
-	       svt[Lindex] <- svt[Lindex]
-	   is a no-op that triggers no copy. */
+		return 0;
 	return STRING_ELT(Rvector1, i1) == STRING_ELT(Rvector2, i2);
 }
 
 static inline int same_LIST_vals(
-		SEXP Rvector1, R_xlen_t i1,
-		SEXP Rvector2, R_xlen_t i2)
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2)
 {
 	if (Rvector1 == R_NilValue)
-		error("SparseArray internal error in same_LIST_vals():\n"
-		      "    lacunar leaf found in an SVT_SparseArray object "
-		      "of type \"list\"");
-	/* Compares the addresses, not the actual values. Doesn't matter as
-	   long as our primary use case is covered. Primary use case is that
-	       svt[Lindex] <- svt[Lindex]
-	   is a no-op that triggers no copy. */
+		return 0;
 	return VECTOR_ELT(Rvector1, i1) == VECTOR_ELT(Rvector2, i2);
 }
 
-typedef int (*SameRVectorVals_FUNType)(SEXP Rvector1, R_xlen_t i1,
-				       SEXP Rvector2, R_xlen_t i2);
+typedef int (*SameRVectorVals_FUNType)(
+		SEXP Rvector1, const void *Rvector1_p, R_xlen_t i1,
+		SEXP Rvector2, const void *Rvector2_p, R_xlen_t i2);
 
 static SameRVectorVals_FUNType select_same_Rvector_vals_FUN(SEXPTYPE Rtype)
 {
@@ -449,234 +477,346 @@ static SameRVectorVals_FUNType select_same_Rvector_vals_FUN(SEXPTYPE Rtype)
 	return NULL;
 }
 
-static SEXP subassign_NULL_by_OPBuf(int dim0,
-		const OPBuf *opbuf, SEXP vals,
-		RVectorEltIsZero_FUNType Rvector_elt_is_zero_FUN,
-		CopyRVectorElt_FUNType copy_Rvector_elt_FUN,
-		int *idx0_order_buf, unsigned short int *rxbuf1, int *rxbuf2,
-		int *idx0_to_k_map)
+/* Returns a pointer to the data of atomic vector 'Rvector', or NULL if
+   'Rvector' is R_NilValue, a character vector, or a list. Must be called
+   on the main thread: if 'Rvector' is an ALTREP object (e.g. 1:20000),
+   DATAPTR_RO() will materialize it. */
+static const void *get_atomic_dataptr(SEXP Rvector)
 {
-	int ans_nzcount = 0;
-	for (int k = 0; k < opbuf->nelt; k++) {
-		int idx0 = opbuf->idx0s[k];
-		R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k);
-		int val_is_zero = Rvector_elt_is_zero_FUN(vals, Loff);
-		if (val_is_zero) {
-			if (idx0_to_k_map[idx0] == -1)
-				continue;
-			idx0_to_k_map[idx0] = -1;
-			ans_nzcount--;
-		} else {
-			if (idx0_to_k_map[idx0] == -1)
-				ans_nzcount++;
-			idx0_to_k_map[idx0] = k;
-		}
-	}
-	if (ans_nzcount == 0)
-		return R_NilValue;
+	SEXPTYPE Rtype = TYPEOF(Rvector);
+	if (Rtype == NILSXP || Rtype == STRSXP || Rtype == VECSXP)
+		return NULL;
+	return DATAPTR_RO(Rvector);
+}
 
-	for (int k = 0; k < opbuf->nelt; k++)
-		idx0_order_buf[k] = k;
-	int ret = sort_ints(idx0_order_buf, opbuf->nelt, opbuf->idx0s, 0, 1,
-			    rxbuf1, rxbuf2);
-	/* Note that ckecking the value returned by sort_ints() is not really
-	   necessary here because sort_ints() should never fail when 'rxbuf1'
-	   and 'rxbuf2' are supplied (see implementation of _sort_ints() in
-	   S4Vectors/src/sort_utils.c for the details). We perform this check
-	   nonetheless just to be on the safe side in case the implementation
-	   of sort_ints() changes in the future. */
-	if (ret < 0)
-		error("SparseArray internal error in "
-		      "subassign_NULL_by_OPBuf():\n"
-		      "    sort_ints() returned an error");
+typedef struct leaf_merge_plan_t {
+	const OPBuf *opbuf;
+	SEXP leaf;        /* original SVT leaf, can be R_NilValue or lacunar */
+	SEXP leaf_nzvals; /* 'nzvals(leaf)', or R_NilValue */
+	const void *leaf_nzvals_p;  /* see get_atomic_dataptr() */
+	const int *leaf_nzoffs_p;
+	int leaf_nzcount;
+	int *offs;        /* offsets of the nonzero values in the new leaf */
+	R_xlen_t *srcs;   /* where the nonzero values in the new leaf come from:
+			     a value >= 0 is an offset in 'vals', a negative
+			     value is -(k + 1) where k is an offset in
+			     'nzvals(leaf)' */
+	int maxlen;       /* length of 'offs' and 'srcs' */
+	int nzcount;      /* nzcount of the new leaf, or -1 if the merge is
+			     a no-op (the new leaf is 'leaf'), or -2 if
+			     something went wrong */
+} LeafMergePlan;
+
+/* Returns the number of (idx0,Loff) pairs in 'opbuf' after removal of the
+   duplicated 'idx0's. The surviving pairs are stored in 'keys' in ascending
+   'idx0' order, each of them as a single 64-bit key made of 'idx0' (upper
+   32 bits) and 'k' (lower 32 bits), where 'k' is the position of the pair
+   in 'opbuf'. When 'idx0' is duplicated, we keep the pair with the greatest
+   'k' i.e. the pair that was appended last to 'opbuf'. This is because
+   the incoming values must be assigned in order e.g. x[c(5, 5)] <- 1:2
+   must set x[5] to 2.
+   Note that qsort() is thread-safe, unlike sort_ints() from S4Vectors which
+   relies on static variables. */
+static int compar_keys(const void *p1, const void *p2)
+{
+	unsigned long long key1 = *((const unsigned long long *) p1);
+	unsigned long long key2 = *((const unsigned long long *) p2);
+	return key1 > key2 ? 1 : (key1 < key2 ? -1 : 0);
+}
 
-	SEXP ans_nzvals = PROTECT(allocVector(TYPEOF(vals), ans_nzcount));
-	SEXP ans_nzoffs = PROTECT(NEW_INTEGER(ans_nzcount));
-	int *ans_nzoffs_p = INTEGER(ans_nzoffs);
-	ans_nzcount = 0;
-/*
-	for (int i = 0; i < dim0; i++) {
-		int k1 = idx0_to_k_map[i];
-		if (k1 == -1)
-			continue;
-		R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k1);
-		copy_Rvector_elt_FUN(vals, Loff,
-				     ans_nzvals, (R_xlen_t) ans_nzcount);
-		ans_nzoffs_p[ans_nzcount] = i;
-		ans_nzcount++;
+static int sort_and_dedup_opbuf(const OPBuf *opbuf, unsigned long long *keys)
+{
+	int nelt = opbuf->nelt;
+	int is_sorted = 1;
+	for (int k = 0; k < nelt; k++) {
+		unsigned long long key =
+			((unsigned long long) opbuf->idx0s[k] << 32) |
+			(unsigned long long) k;
+		if (k > 0 && key < keys[k - 1])
+			is_sorted = 0;
+		keys[k] = key;
 	}
-*/
-	/* Walk on the (idx0,Loff) pairs in ascending 'idx0' order. */
-	for (int k0 = 0; k0 < opbuf->nelt; k0++) {
-		int k = idx0_order_buf[k0];
-		int idx0 = opbuf->idx0s[k];
-		if (idx0_to_k_map[idx0] != k)
-			continue;
-		R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k);
-		copy_Rvector_elt_FUN(vals, Loff,
-				     ans_nzvals, (R_xlen_t) ans_nzcount);
-		ans_nzoffs_p[ans_nzcount] = idx0;
-		ans_nzcount++;
+	/* The incoming values often arrive in ascending 'idx0' order (e.g.
+	   when 'Mindex' or 'Lindex' is sorted) in which case we can skip
+	   the sorting. */
+	if (!is_sorted)
+		qsort(keys, nelt, sizeof(unsigned long long), compar_keys);
+	int n = 0;
+	for (int k = 0; k < nelt; k++) {
+		if (n > 0 && (keys[k] >> 32) == (keys[n - 1] >> 32))
+			n--;
+		keys[n++] = keys[k];
 	}
-	SEXP ans = zip_leaf(ans_nzvals, ans_nzoffs, 1);
-	UNPROTECT(2);
-	return ans;
+	return n;
 }
 
-/* Returns -1 if subassignment is a no-op. */
-static int compute_subassignment_nzcount(SEXP leaf, int dim0,
-		const OPBuf *opbuf, SEXP vals,
+/* Must be thread-safe: no use of the R API when 'vals' is atomic, and no
+   calls to error(). 'vals_p' must be get_atomic_dataptr(vals). */
+static void compute_leaf_merge_plan(LeafMergePlan *plan,
+		SEXP vals, const void *vals_p,
 		RVectorEltIsZero_FUNType Rvector_elt_is_zero_FUN,
 		SameRVectorVals_FUNType same_Rvector_vals_FUN,
-		int *idx0_to_k_map)
-{
-	SEXP nzvals, nzoffs;
-	int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
-	//print_idx0_to_k_map(idx0_to_k_map, dim0);
-	int out_nzcount = 0;
-	int k2 = 0, nzoff = INTEGER(nzoffs)[0];
-	int is_noop = 1;
-	for (int i = 0; i < dim0; i++) {
-		int k1 = idx0_to_k_map[i];
-		if (i != nzoff) {
-			if (k1 == -1)
-				continue;
-			R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k1);
-			int is_zero = Rvector_elt_is_zero_FUN(vals, Loff);
-			if (is_zero) {
-				idx0_to_k_map[i] = -1;
-				continue;
-			}
+		unsigned long long *keys)
+{
+	const OPBuf *opbuf = plan->opbuf;
+	int n = sort_and_dedup_opbuf(opbuf, keys);
+	const int *nzoffs_p = plan->leaf_nzoffs_p;
+	int nzcount = plan->leaf_nzcount;
+	int is_noop = 1, out_nzcount = 0, k1 = 0, k2 = 0;
+	/* Walk on the (idx0,Loff) pairs and on the leaf offsets in
+	   parallel, in ascending offset order. */
+	while (k1 < n || k2 < nzcount) {
+		int idx0 = k1 < n ? (int) (keys[k1] >> 32) : INT_MAX;
+		int nzoff = k2 < nzcount ? nzoffs_p[k2] : INT_MAX;
+		if (nzoff < idx0) {
+			/* Keep the original nonzero value. */
+			if (out_nzcount >= plan->maxlen)
+				goto on_error;
+			plan->offs[out_nzcount] = nzoff;
+			plan->srcs[out_nzcount] = -((R_xlen_t) k2 + 1);
 			out_nzcount++;
-			is_noop = 0;
+			k2++;
 			continue;
 		}
-		if (k1 == -1) {
-			out_nzcount++;
-		} else {
-			R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k1);
-			int is_zero = Rvector_elt_is_zero_FUN(vals, Loff);
-			if (is_zero) {
+		int k = (int) (keys[k1] & 0xffffffffULL);
+		R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k);
+		int is_zero = Rvector_elt_is_zero_FUN(vals, vals_p, Loff);
+		if (nzoff == idx0) {
+			/* Incoming value replaces original nonzero value. */
+			if (is_zero ||
+			    !same_Rvector_vals_FUN(plan->leaf_nzvals,
+						   plan->leaf_nzvals_p, k2,
+						   vals, vals_p, Loff))
 				is_noop = 0;
-			} else {
-				out_nzcount++;
-				R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k1);
-				if (!same_Rvector_vals_FUN(nzvals, k2,
-							   vals, Loff))
-				{
-					is_noop = 0;
-				}
-			}
+			k2++;
+		} else if (!is_zero) {
+			is_noop = 0;
+		}
+		if (!is_zero) {
+			if (out_nzcount >= plan->maxlen)
+				goto on_error;
+			plan->offs[out_nzcount] = idx0;
+			plan->srcs[out_nzcount] = Loff;
+			out_nzcount++;
 		}
-		/* Move to next nzoffs[]. */
-		k2++;
-		nzoff = k2 < nzcount ? INTEGER(nzoffs)[k2] : -1;
+		k1++;
 	}
-	if (is_noop && out_nzcount != nzcount)  /* sanity check */
-		error("SparseArray internal error in "
-		      "compute_subassignment_nzcount():\n"
-		      "    leaf subassignment is a no-op "
-		      "but nzcount(out_leaf) != nzcount(in_leaf)");
-	return is_noop ? -1 : out_nzcount;
+	plan->nzcount = is_noop ? -1 : out_nzcount;
+	return;
+
+    on_error:
+	plan->nzcount = -2;
+	return;
 }
 
-static void do_subassign_nonNULL_leaf_by_OPBuf(SEXP leaf, int dim0,
-		const OPBuf *opbuf, SEXP vals,
-		SEXP ans_nzvals, SEXP ans_nzoffs,
-		RVectorEltIsZero_FUNType Rvector_elt_is_zero_FUN,
-		CopyRVectorElt_FUNType copy_Rvector_elt_FUN,
-		const int *idx0_to_k_map)
+static SEXP make_leaf_from_merge_plan(const LeafMergePlan *plan, SEXP vals,
+		CopyRVectorElt_FUNType copy_Rvector_elt_FUN)
 {
-	SEXP nzvals, nzoffs;
-	int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
-	int *ans_nzoffs_p = INTEGER(ans_nzoffs);
-	int ans_nzcount = 0;
-	int k2 = 0, nzoff = INTEGER(nzoffs)[0];
-	for (int i = 0; i < dim0; i++) {
-		int k1 = idx0_to_k_map[i];
-		if (i != nzoff) {
-			if (k1 == -1)
-				continue;
-			R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k1);
-			copy_Rvector_elt_FUN(vals, Loff,
-					ans_nzvals, (R_xlen_t) ans_nzcount);
-			ans_nzoffs_p[ans_nzcount] = i;
-			ans_nzcount++;
-			continue;
-		}
-		if (k1 == -1) {
-			copy_Rvector_elt_FUN(nzvals, k2,
-					ans_nzvals, (R_xlen_t) ans_nzcount);
-			ans_nzoffs_p[ans_nzcount] = i;
-			ans_nzcount++;
+	if (plan->nzcount == -1)  /* no-op */
+		return plan->leaf;
+	if (plan->nzcount == 0)
+		return R_NilValue;
+	SEXP nzvals = plan->leaf == R_NilValue ? R_NilValue
+					       : get_leaf_nzvals(plan->leaf);
+	SEXP ans_nzvals = PROTECT(allocVector(TYPEOF(vals), plan->nzcount));
+	SEXP ans_nzoffs = PROTECT(NEW_INTEGER(plan->nzcount));
+	memcpy(INTEGER(ans_nzoffs), plan->offs, sizeof(int) * plan->nzcount);
+	for (int k = 0; k < plan->nzcount; k++) {
+		R_xlen_t src = plan->srcs[k];
+		if (src >= 0) {
+			copy_Rvector_elt_FUN(vals, src, ans_nzvals, k);
 		} else {
-			R_xlen_t Loff = GET_OPBUF_LOFF(opbuf, k1);
-			int is_zero = Rvector_elt_is_zero_FUN(vals, Loff);
-			if (!is_zero) {
-				copy_Rvector_elt_FUN(vals, Loff,
-					ans_nzvals, (R_xlen_t) ans_nzcount);
-				ans_nzoffs_p[ans_nzcount] = i;
-				ans_nzcount++;
-			}
+			/* Note that copy_Rvector_elt_FUN() knows how to
+			   handle a lacunar leaf (i.e. 'nzvals' set to
+			   R_NilValue). */
+			copy_Rvector_elt_FUN(nzvals, -src - 1, ans_nzvals, k);
 		}
-		/* Move to next nzoffs[]. */
-		k2++;
-		nzoff = k2 < nzcount ? INTEGER(nzoffs)[k2] : -1;
 	}
-	if (ans_nzcount != LENGTH(ans_nzoffs))  /* sanity check */
-		error("SparseArray internal error in "
-		      "do_subassign_nonNULL_leaf_by_OPBuf():\n"
-		      "    ans_nzcount != LENGTH(ans_nzoffs)");
-	return;
-}
-
-/* 'leaf' cannot be R_NilValue. */
-static SEXP subassign_nonNULL_leaf_by_OPBuf(SEXP leaf, int dim0,
-		const OPBuf *opbuf, SEXP vals,
-		RVectorEltIsZero_FUNType fun1,
-		SameRVectorVals_FUNType fun2,
-		CopyRVectorElt_FUNType fun3,
-		int *idx0_to_k_map)
-{
-	int ans_nzcount = compute_subassignment_nzcount(leaf, dim0,
-				opbuf, vals, fun1, fun2, idx0_to_k_map);
-	if (ans_nzcount == -1)  /* no-op */
-		return leaf;
-	if (ans_nzcount == 0)
-		return R_NilValue;
-	SEXP ans_nzvals = PROTECT(allocVector(TYPEOF(vals), ans_nzcount));
-	SEXP ans_nzoffs = PROTECT(NEW_INTEGER(ans_nzcount));
-	do_subassign_nonNULL_leaf_by_OPBuf(leaf, dim0,
-				opbuf, vals, ans_nzvals, ans_nzoffs,
-				fun1, fun3, idx0_to_k_map);
 	SEXP ans = zip_leaf(ans_nzvals, ans_nzoffs, 1);
 	UNPROTECT(2);
 	return ans;
 }
 
-static SEXP subassign_leaf_by_OPBuf(SEXP leaf, int dim0,
-		const OPBuf *opbuf, SEXP vals,
+
+/****************************************************************************
+ * subassign_SVT_by_OPBufTree()
+ *
+ * This implements the 2nd pass of C_subassign_SVT_by_[L|M]index().
+ */
+
+static R_xlen_t REC_count_OPBufTree_leaves(const OPBufTree *opbuf_tree)
+{
+	if (opbuf_tree->node_type == NULL_NODE)
+		return 0;
+	if (opbuf_tree->node_type == LEAF_NODE)
+		return 1;
+	R_xlen_t nleaf = 0;
+	int n = get_OPBufTree_nchildren(opbuf_tree);
+	for (int i = 0; i < n; i++)
+		nleaf += REC_count_OPBufTree_leaves(
+				get_OPBufTree_child(opbuf_tree, i));
+	return nleaf;
+}
+
+/* Recursive tree traversal of 'opbuf_tree'. Initializes one merge plan per
+   leaf in 'opbuf_tree', in the order the leaves are visited. Also adds the
+   lengths of the buffers needed by the merge plans to '*buflen'. */
+static LeafMergePlan *REC_init_leaf_merge_plans(const OPBufTree *opbuf_tree,
+		SEXP SVT, int dim0, int ndim,
+		LeafMergePlan *plan, size_t *buflen)
+{
+	if (opbuf_tree->node_type == NULL_NODE)
+		return plan;
+
+	if (ndim == 1) {
+		/* Both 'opbuf_tree' and 'SVT' are leaves. */
+		const OPBuf *opbuf = get_OPBufTree_leaf(opbuf_tree);
+		R_xlen_t maxlen = opbuf->nelt;
+		if (SVT != R_NilValue)
+			maxlen += get_leaf_nzcount(SVT);
+		if (maxlen > dim0)
+			maxlen = dim0;
+		plan->opbuf = opbuf;
+		plan->leaf = SVT;
+		plan->leaf_nzvals = R_NilValue;
+		plan->leaf_nzvals_p = NULL;
+		plan->leaf_nzoffs_p = NULL;
+		plan->leaf_nzcount = 0;
+		if (SVT != R_NilValue) {
+			/* We unzip the leaf here (i.e. on the main thread)
+			   so compute_leaf_merge_plan() doesn't need to. */
+			SEXP nzvals, nzoffs;
+			plan->leaf_nzcount = unzip_leaf(SVT, &nzvals, &nzoffs);
+			plan->leaf_nzvals = nzvals;
+			plan->leaf_nzvals_p = get_atomic_dataptr(nzvals);
+			plan->leaf_nzoffs_p = INTEGER(nzoffs);
+		}
+		plan->offs = NULL;
+		plan->srcs = NULL;
+		plan->maxlen = (int) maxlen;
+		plan->nzcount = -2;
+		*buflen += maxlen;
+		return plan + 1;
+	}
+
+	/* Both 'opbuf_tree' and 'SVT' are inner nodes. */
+	int n = get_OPBufTree_nchildren(opbuf_tree);  /* = dim[ndim - 1] */
+	for (int i = 0; i < n; i++) {
+		const OPBufTree *child = get_OPBufTree_child(opbuf_tree, i);
+		SEXP subSVT = SVT == R_NilValue ? R_NilValue
+						: VECTOR_ELT(SVT, i);
+		plan = REC_init_leaf_merge_plans(child, subSVT, dim0, ndim - 1,
+						 plan, buflen);
+	}
+	return plan;
+}
+
+/* Recursive tree traversal of 'opbuf_tree'. Must visit the leaves in the
+   same order as REC_init_leaf_merge_plans() above. Untouched subtrees of
+   'SVT' are not copied but shared with the returned SVT. */
+static SEXP REC_subassign_SVT_by_OPBufTree(OPBufTree *opbuf_tree,
+		SEXP SVT, int ndim, SEXP vals,
+		CopyRVectorElt_FUNType copy_Rvector_elt_FUN,
+		const LeafMergePlan **plan_p)
+{
+	if (opbuf_tree->node_type == NULL_NODE)
+		return SVT;
+
+	if (ndim == 1) {
+		/* Both 'opbuf_tree' and 'SVT' are leaves. */
+		SEXP ans = make_leaf_from_merge_plan(*plan_p, vals,
+						     copy_Rvector_elt_FUN);
+		(*plan_p)++;
+		/* PROTECT not really necessary since _free_OPBufTree()
+		   won't trigger R's garbage collector but this could change
+		   someday so we'd better not take any risk. */
+		PROTECT(ans);
+		_free_OPBufTree(opbuf_tree);
+		UNPROTECT(1);
+		return ans;
+	}
+
+	/* Both 'opbuf_tree' and 'SVT' are inner nodes. */
+	int n = get_OPBufTree_nchildren(opbuf_tree);  /* = dim[ndim - 1] */
+	SEXP ans = PROTECT(NEW_LIST(n));
+	int is_empty = 1, is_unchanged = SVT != R_NilValue;
+	for (int i = 0; i < n; i++) {
+		OPBufTree *child = get_OPBufTree_child(opbuf_tree, i);
+		SEXP subSVT = SVT == R_NilValue ? R_NilValue
+						: VECTOR_ELT(SVT, i);
+		SEXP ans_elt = REC_subassign_SVT_by_OPBufTree(child,
+					subSVT, ndim - 1, vals,
+					copy_Rvector_elt_FUN, plan_p);
+		if (ans_elt != subSVT)
+			is_unchanged = 0;
+		if (ans_elt != R_NilValue) {
+			PROTECT(ans_elt);
+			SET_VECTOR_ELT(ans, i, ans_elt);
+			UNPROTECT(1);
+			is_empty = 0;
+		}
+	}
+	UNPROTECT(1);
+	if (is_unchanged)
+		return SVT;
+	return is_empty ? R_NilValue : ans;
+}
+
+static SEXP subassign_SVT_by_OPBufTree(OPBufTree *opbuf_tree,
+		SEXP x_SVT, const int *x_dim, int x_ndim,
+		SEXP vals, int max_outleaf_len,
 		RVectorEltIsZero_FUNType fun1,
 		SameRVectorVals_FUNType fun2,
-		CopyRVectorElt_FUNType fun3,
-		int *idx0_order_buf, unsigned short int *rxbuf1, int *rxbuf2,
-		int *idx0_to_k_map)
+		CopyRVectorElt_FUNType fun3)
 {
-	SEXP ans;
-	/* PROTECT(ans) not necessary because reset_idx0_to_k_map() won't
-	   trigger R's garbage collector. */
-	if (leaf == R_NilValue) {
-		ans = subassign_NULL_by_OPBuf(dim0, opbuf, vals,
-					fun1, fun3,
-					idx0_order_buf, rxbuf1, rxbuf2,
-					idx0_to_k_map);
-	} else {
-		init_idx0_to_k_map(idx0_to_k_map, opbuf->idx0s, opbuf->nelt);
-		ans = subassign_nonNULL_leaf_by_OPBuf(leaf, dim0, opbuf, vals,
-					fun1, fun2, fun3, idx0_to_k_map);
+	R_xlen_t nplan = REC_count_OPBufTree_leaves(opbuf_tree);
+	if (nplan == 0)
+		return x_SVT;
+
+	/* Step (a): compute the merge plans. */
+	LeafMergePlan *plans = (LeafMergePlan *)
+			R_alloc(nplan, sizeof(LeafMergePlan));
+	size_t buflen = 0;
+	REC_init_leaf_merge_plans(opbuf_tree, x_SVT, x_dim[0], x_ndim,
+				  plans, &buflen);
+	int *offs_buf = (int *) R_alloc(buflen, sizeof(int));
+	R_xlen_t *srcs_buf = (R_xlen_t *) R_alloc(buflen, sizeof(R_xlen_t));
+	for (R_xlen_t p = 0; p < nplan; p++) {
+		plans[p].offs = offs_buf;
+		plans[p].srcs = srcs_buf;
+		offs_buf += plans[p].maxlen;
+		srcs_buf += plans[p].maxlen;
 	}
-	reset_idx0_to_k_map(idx0_to_k_map, opbuf->idx0s, opbuf->nelt);
-	return ans;
+	/* Take the data pointer of 'vals' here, on the main thread, so that
+	   an ALTREP 'vals' gets materialized before we enter the parallel
+	   region. The elements of a character vector or list can only be
+	   accessed via the R API (STRING_ELT() or VECTOR_ELT()) so we don't
+	   parallelize in that case. */
+	const void *vals_p = get_atomic_dataptr(vals);
+	int parallel = vals_p != NULL;
+	/* One 'keys' buffer per thread. */
+	int nthread = parallel ? _get_max_threads() : 1;
+	unsigned long long *keys_bufs = (unsigned long long *)
+		R_alloc((size_t) nthread * max_outleaf_len,
+			sizeof(unsigned long long));
+	#pragma omp parallel for schedule(static) if(parallel)
+	for (R_xlen_t p = 0; p < nplan; p++) {
+		unsigned long long *keys = keys_bufs +
+			(size_t) _get_thread_num() * max_outleaf_len;
+		compute_leaf_merge_plan(plans + p, vals, vals_p,
+					fun1, fun2, keys);
+	}
+	for (R_xlen_t p = 0; p < nplan; p++) {
+		if (plans[p].nzcount == -2)
+			error("SparseArray internal error in "
+			      "subassign_SVT_by_OPBufTree():\n"
+			      "    compute_leaf_merge_plan() failed");
+	}
+
+	/* Step (b): build the new SVT. */
+	const LeafMergePlan *plan = plans;
+	return REC_subassign_SVT_by_OPBufTree(opbuf_tree,
+				x_SVT, x_ndim, vals, fun3, &plan);
 }
 
 
@@ -736,12 +876,38 @@ static int build_OPBufTree_from_Lindex1(OPBufTree *opbuf_tree, SEXP Lindex,
 	return max_outleaf_len;
 }
 
+/* To use on a long 'Lindex'. Based on _append_idx0xLoff_to_host_node()
+   which switches the host OPBuf from 'int' to 'R_xlen_t' storage of the
+   Loffs as soon as a Loff > INT_MAX gets appended to it. Can return
+   MAX_OPBUF_LEN_REACHED if more than INT_MAX incoming values land on the
+   same SVT leaf. */
 static int build_OPBufTree_from_Lindex2(OPBufTree *opbuf_tree, SEXP Lindex,
 		const int *x_dim, int x_ndim,
 		const R_xlen_t *dimcumprod)
 {
-	error("build_OPBufTree_from_Lindex2() not ready yet");
-	return 0;
+	int max_outleaf_len = 0;
+	R_xlen_t in_len = XLENGTH(Lindex);
+	R_xlen_t x_len = dimcumprod[x_ndim - 1];
+	/* Walk along 'Lindex'. Direction of the walk matters: it must be
+	   from left to right so that, in case of duplicates in 'Lindex',
+	   the last incoming value wins. */
+	for (R_xlen_t Loff = 0; Loff < in_len; Loff++) {
+		R_xlen_t Lidx0;
+		int ret = extract_long_idx0(Lindex, Loff, x_len, &Lidx0);
+		if (ret < 0)
+			return ret;
+		int idx0;
+		OPBufTree *host_node = find_host_node_for_Lidx0(
+						opbuf_tree, Lidx0,
+						x_dim, x_ndim,
+						dimcumprod, &idx0);
+		ret = _append_idx0xLoff_to_host_node(host_node, idx0, Loff);
+		if (ret < 0)
+			return ret;
+		if (ret > max_outleaf_len)
+			max_outleaf_len = ret;
+	}
+	return max_outleaf_len;
 }
 
 static int build_OPBufTree_from_Lindex(OPBufTree *opbuf_tree, SEXP Lindex,
@@ -758,58 +924,6 @@ static int build_OPBufTree_from_Lindex(OPBufTree *opbuf_tree, SEXP Lindex,
 				x_dim, x_ndim, dimcumprod);
 }
 
-/* Recursive tree traversal of 'opbuf_tree'. */
-static SEXP REC_subassign_SVT_by_OPBufTree(OPBufTree *opbuf_tree,
-		SEXP SVT, const int *dim, int ndim, SEXP vals,
-		RVectorEltIsZero_FUNType fun1,
-		SameRVectorVals_FUNType fun2,
-		CopyRVectorElt_FUNType fun3,
-		int *idx0_order_buf, unsigned short int *rxbuf1, int *rxbuf2,
-		int *idx0_to_k_map, int pardim)
-{
-	if (opbuf_tree->node_type == NULL_NODE)
-		return SVT;
-
-	if (ndim == 1) {
-		/* Both 'opbuf_tree' and 'SVT' are leaves. */
-		OPBuf *opbuf = get_OPBufTree_leaf(opbuf_tree);
-		SEXP ans = subassign_leaf_by_OPBuf(SVT, dim[0], opbuf, vals,
-					fun1, fun2, fun3,
-					idx0_order_buf, rxbuf1, rxbuf2,
-					idx0_to_k_map);
-		/* PROTECT not really necessary since neither _free_OPBufTree()
-		   won't trigger R's garbage collector but this could change
-		   someday so we'd better not take any risk. */
-		PROTECT(ans);
-		_free_OPBufTree(opbuf_tree);
-		UNPROTECT(1);
-		return ans;
-	}
-
-	/* Both 'opbuf_tree' and 'SVT' are inner nodes. */
-	int n = get_OPBufTree_nchildren(opbuf_tree);  /* = dim[ndim - 1] */
-	SEXP ans = PROTECT(NEW_LIST(n));
-	int is_empty = 1;
-	for (int i = 0; i < n; i++) {
-		OPBufTree *child = get_OPBufTree_child(opbuf_tree, i);
-		SEXP subSVT = SVT == R_NilValue ? R_NilValue
-						: VECTOR_ELT(SVT, i);
-		SEXP ans_elt = REC_subassign_SVT_by_OPBufTree(child,
-					subSVT, dim, ndim - 1, vals,
-					fun1, fun2, fun3,
-					idx0_order_buf, rxbuf1, rxbuf2,
-					idx0_to_k_map, pardim);
-		if (ans_elt != R_NilValue) {
-			PROTECT(ans_elt);
-			SET_VECTOR_ELT(ans, i, ans_elt);
-			UNPROTECT(1);
-			is_empty = 0;
-		}
-	}
-	UNPROTECT(1);
-	return is_empty ? R_NilValue : ans;
-}
-
 /* --- .Call ENTRY POINT ---
    'Lindex' must be a numeric vector (integer or double), possibly a long one.
    NAs are not allowed (they'll trigger an error).
@@ -870,10 +984,8 @@ SEXP C_subassign_SVT_by_Lindex(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 	int max_outleaf_len =
 		build_OPBufTree_from_Lindex(opbuf_tree, Lindex,
 				INTEGER(x_dim), x_ndim, dimcumprod);
-	if (max_outleaf_len < 0) {
-		UNPROTECT(1);
+	if (max_outleaf_len < 0)
 		_bad_Lindex_error(max_outleaf_len);
-	}
 
 	//double dt = (1.0 * clock() - t0) * 1000.0 / CLOCKS_PER_SEC;
 	//printf("1st pass: %2.3f ms\n", dt);
@@ -881,24 +993,11 @@ SEXP C_subassign_SVT_by_Lindex(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 	//printf("max_outleaf_len = %d\n", max_outleaf_len);
 	//_print_OPBufTree(opbuf_tree, 1);
 
-	/* 2nd pass: Subset SVT by OPBufTree. */
+	/* 2nd pass: Subassign SVT by OPBufTree. */
 	//t0 = clock();
-	int *idx0_to_k_map = (int *) R_alloc(x_dim0, sizeof(int));
-	for (int i = 0; i < x_dim0; i++)
-		idx0_to_k_map[i] = -1;
-	/* Three buffers needed by sort_ints(). */
-	int *idx0_order_buf = (int *) R_alloc(max_outleaf_len, sizeof(int));
-	unsigned short int *rxbuf1 = (unsigned short int *)
-			R_alloc(max_outleaf_len, sizeof(unsigned short int));
-	int *rxbuf2 = (int *) R_alloc(max_outleaf_len, sizeof(int));
-	/* Get 1-based rank of biggest dimension (ignoring the 1st dim).
-	   Parallel execution will be along that dimension. */
-	int pardim = which_max(INTEGER(x_dim) + 1, x_ndim - 1) + 2;
-	SEXP ans = REC_subassign_SVT_by_OPBufTree(opbuf_tree,
-				x_SVT, INTEGER(x_dim), x_ndim, vals,
-				fun1, fun2, fun3,
-				idx0_order_buf, rxbuf1, rxbuf2,
-				idx0_to_k_map, pardim);
+	SEXP ans = subassign_SVT_by_OPBufTree(opbuf_tree,
+				x_SVT, INTEGER(x_dim), x_ndim,
+				vals, max_outleaf_len, fun1, fun2, fun3);
 	//dt = (1.0 * clock() - t0) * 1000.0 / CLOCKS_PER_SEC;
 	//printf("2nd pass: %2.3f ms\n", dt);
 	return ans;
@@ -924,7 +1023,64 @@ static void check_Mindex_dim(SEXP Mindex, R_xlen_t nvals, int ndim,
 	return;
 }
 
-/* --- .Call ENTRY POINT --- */
+/* Unlike find_host_node_for_Mindex_row() in SparseArray_subsetting.c, we
+   don't walk on the SVT in parallel with 'opbuf_tree' here: an Mindex row
+   always lands somewhere, even if it lands on a NULL node of the SVT. */
+static OPBufTree *find_host_node_for_Mindex_row(OPBufTree *opbuf_tree,
+		SEXP Mindex, R_xlen_t Moff, int nvals,
+		const int *dim, int ndim,
+		int *idx0, int *ret_code)
+{
+	for (int along = ndim - 1; along >= 1; along--, Moff -= nvals) {
+		int i, d = dim[along];
+		*ret_code = extract_idx0(Mindex, Moff, d, &i);
+		if (*ret_code < 0)
+			return NULL;
+		if (opbuf_tree->node_type == NULL_NODE)
+			_alloc_OPBufTree_children(opbuf_tree, d);
+		opbuf_tree = get_OPBufTree_child(opbuf_tree, i);
+	}
+	/* At this point 'opbuf_tree' is guaranteed to be a node of type
+	   NULL_NODE or LEAF_NODE. */
+	*ret_code = extract_idx0(Mindex, Moff, dim[0], idx0);
+	return opbuf_tree;
+}
+
+/* Returns a negative value in case of error. */
+static int build_OPBufTree_from_Mindex(OPBufTree *opbuf_tree, SEXP Mindex,
+		const int *x_dim, int x_ndim)
+{
+	/* _free_OPBufTree(opbuf_tree) resets 'opbuf_tree->node_type'
+	   to NULL_NODE. */
+	_free_OPBufTree(opbuf_tree);
+	int max_outleaf_len = 0;
+	int nvals = INTEGER(GET_DIM(Mindex))[0];  /* = nrow(Mindex) */
+	R_xlen_t Moff = (R_xlen_t) nvals * (x_ndim - 1);
+	/* Walk along 'vals'. Direction of the walk matters: it must be
+	   from left to right so that, in case of duplicates in 'Mindex',
+	   the last incoming value wins. */
+	for (int Loff = 0; Loff < nvals; Loff++, Moff++) {
+		int idx0, ret;
+		OPBufTree *host_node = find_host_node_for_Mindex_row(
+						opbuf_tree,
+						Mindex, Moff, nvals,
+						x_dim, x_ndim,
+						&idx0, &ret);
+		if (ret < 0)
+			return ret;
+		ret = _append_idx0Loff_to_host_node(host_node, idx0, Loff);
+		if (ret < 0)
+			return ret;
+		if (ret > max_outleaf_len)
+			max_outleaf_len = ret;
+	}
+	return max_outleaf_len;
+}
+
+/* --- .Call ENTRY POINT ---
+   'Mindex' must be an integer matrix with one column per dimension in the
+   array to subassign. NAs are not allowed (they'll trigger an error).
+   'vals' must be a vector (atomic or list) of type 'x_type'. */
 SEXP C_subassign_SVT_by_Mindex(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 		SEXP Mindex, SEXP vals)
 {
@@ -947,20 +1103,142 @@ SEXP C_subassign_SVT_by_Mindex(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 	if (nvals == 0)
 		return x_SVT;  /* no-op */
 
-	//RVectorEltIsZero_FUNType fun1 = select_Rvector_elt_is_zero_FUN(Rtype);
-	//SameRVectorVals_FUNType fun2 = select_same_Rvector_vals_FUN(Rtype);
-	//CopyRVectorElt_FUNType fun3 = _select_copy_Rvector_elt_FUN(Rtype);
+	RVectorEltIsZero_FUNType fun1 = select_Rvector_elt_is_zero_FUN(Rtype);
+	SameRVectorVals_FUNType fun2 = select_same_Rvector_vals_FUN(Rtype);
+	CopyRVectorElt_FUNType fun3 = _select_copy_Rvector_elt_FUN(Rtype);
 
 	int x_dim0 = INTEGER(x_dim)[0];
 	if (x_ndim == 1)
 		return subassign_leaf_by_Lindex(x_SVT, x_dim0, Mindex, vals, 0);
 
 	/* 1st pass: Build the OPBufTree. */
-	error("C_subassign_SVT_by_Mindex() not ready yet");
+	OPBufTree *opbuf_tree = _get_global_opbuf_tree();
+	int max_outleaf_len =
+		build_OPBufTree_from_Mindex(opbuf_tree, Mindex,
+					    INTEGER(x_dim), x_ndim);
+	if (max_outleaf_len < 0)
+		_bad_Mindex_error(max_outleaf_len);
+
+	/* 2nd pass: Subassign SVT by OPBufTree. */
+	return subassign_SVT_by_OPBufTree(opbuf_tree,
+				x_SVT, INTEGER(x_dim), x_ndim,
+				vals, max_outleaf_len, fun1, fun2, fun3);
+}
+
 
-	/* 2nd pass: Subset SVT by OPBufTree. */
+/****************************************************************************
+ * C_subassign_index_shape()
+ *
+ * Used at the R level to choose between the buffer tree engine above and
+ * the extended leaf engine in SparseArray_subassignment_OLD.c. Note that
+ * the latter sorts the incoming offsets of each leaf with a radix sort so
+ * is faster than the former when many incoming values land on the same
+ * leaf in no particular order.
+ */
 
-	return R_NilValue;
+/* Set of leaf ids (i.e. offsets along prod(dim[-1])) implemented as an
+   open-addressing hash table. 'capacity' must be a power of 2. */
+typedef struct leaf_id_set_t {
+	R_xlen_t *ids;
+	R_xlen_t capacity;
+	R_xlen_t count;
+} LeafIdSet;
+
+static void add_leaf_id_to_set(LeafIdSet *set, R_xlen_t id)
+{
+	R_xlen_t mask = set->capacity - 1;
+	R_xlen_t h = (R_xlen_t)
+		(((unsigned long long) id * 0x9E3779B97F4A7C15ULL) >> 17) & mask;
+	while (set->ids[h] != -1) {
+		if (set->ids[h] == id)
+			return;
+		h = (h + 1) & mask;
+	}
+	set->ids[h] = id;
+	set->count++;
+	return;
+}
+
+/* Returns the offset of the Mindex row along the array (i.e. its Lidx0),
+   or -1 if the row contains an invalid index. */
+static R_xlen_t get_Mindex_row_Lidx0(SEXP Mindex, R_xlen_t i,
+		R_xlen_t nrow, const int *dim, int ndim)
+{
+	R_xlen_t Lidx0 = 0;
+	for (int along = ndim - 1; along >= 0; along--) {
+		R_xlen_t idx0;
+		if (extract_long_idx0(Mindex, i + along * nrow,
+				      (R_xlen_t) dim[along], &idx0) < 0)
+			return -1;
+		Lidx0 = Lidx0 * dim[along] + idx0;
+	}
+	return Lidx0;
+}
+
+/* --- .Call ENTRY POINT ---
+   'index' must be an L-index (numeric vector) or M-index (integer matrix).
+   Returns an integer vector of length 2:
+     1. 1 if the array offsets in 'index' are sorted (ascending order,
+        duplicates allowed), 0 otherwise;
+     2. the number of distinct SVT leaves hit by 'index', or
+        'max_nleaf + 1' if that number is greater than 'max_nleaf'.
+   The walk on 'index' stops as soon as the result is known. Any invalid
+   index stops it too and produces c(1, max_nleaf + 1), which tells the
+   caller to use the buffer tree engine (the error is reported by the
+   engine). */
+SEXP C_subassign_index_shape(SEXP x_dim, SEXP index, SEXP max_nleaf)
+{
+	int x_ndim = LENGTH(x_dim);
+	const int *dim = INTEGER(x_dim);
+	R_xlen_t x_len = 1;
+	for (int along = 0; along < x_ndim; along++)
+		x_len *= dim[along];
+	int dim0 = dim[0];
+	int max = INTEGER(max_nleaf)[0];
+
+	SEXP index_dim = GET_DIM(index);
+	int is_Mindex = index_dim != R_NilValue;
+	R_xlen_t n = is_Mindex ? INTEGER(index_dim)[0] : XLENGTH(index);
+
+	LeafIdSet set;
+	set.capacity = 16;
+	while (set.capacity < 2 * ((R_xlen_t) max + 1))
+		set.capacity *= 2;
+	set.ids = (R_xlen_t *) R_alloc(set.capacity, sizeof(R_xlen_t));
+	for (R_xlen_t h = 0; h < set.capacity; h++)
+		set.ids[h] = -1;
+	set.count = 0;
+
+	int is_sorted = 1, is_valid = 1;
+	R_xlen_t prev_Lidx0 = -1, prev_leaf_id = -1;
+	for (R_xlen_t i = 0; i < n; i++) {
+		R_xlen_t Lidx0;
+		if (is_Mindex) {
+			Lidx0 = get_Mindex_row_Lidx0(index, i, n, dim, x_ndim);
+		} else if (extract_long_idx0(index, i, x_len, &Lidx0) < 0) {
+			Lidx0 = -1;
+		}
+		if (Lidx0 < 0) {
+			is_valid = 0;
+			break;
+		}
+		if (Lidx0 < prev_Lidx0)
+			is_sorted = 0;
+		prev_Lidx0 = Lidx0;
+		/* Consecutive indices often hit the same leaf. */
+		R_xlen_t leaf_id = Lidx0 / dim0;
+		if (leaf_id != prev_leaf_id && set.count <= max)
+			add_leaf_id_to_set(&set, leaf_id);
+		prev_leaf_id = leaf_id;
+		if (!is_sorted && set.count > max)
+			break;
+	}
+
+	SEXP ans = PROTECT(NEW_INTEGER(2));
+	INTEGER(ans)[0] = is_valid ? is_sorted : 1;
+	INTEGER(ans)[1] = is_valid ? (int) set.count : max + 1;
+	UNPROTECT(1);
+	return ans;
 }
 
 
@@ -1244,6 +1522,254 @@ SEXP C_subassign_SVT_with_short_Rvector(SEXP x_dim, SEXP x_type, SEXP x_SVT,
  * C_subassign_SVT_with_Rarray() and C_subassign_SVT_with_SVT()
  */
 
+/* The 'left_Rvector' and 'right_Rvector' buffers must contain only zeros
+   between leaf subassignments. */
+typedef struct right_bufs_t {
+	CopyRVectorElt_FUNType copy_Rvector_elt_FUN;
+	SEXP left_Rvector;   /* of length 'dim0' */
+	SEXP right_Rvector;  /* of length 'length(index0)' (SVT case only) */
+	int *offs;           /* of length 'dim0' */
+	int nfull;           /* nb of leading NULLs in 'Nindex' */
+} RightBufs;
+
+static RightBufs init_right_bufs(int dim0, SEXP Nindex, SEXPTYPE Rtype,
+		int with_SVT)
+{
+	RightBufs right_bufs;
+	right_bufs.copy_Rvector_elt_FUN = _select_copy_Rvector_elt_FUN(Rtype);
+	if (right_bufs.copy_Rvector_elt_FUN == NULL)
+		error("SparseArray internal error in init_right_bufs():\n"
+		      "    type \"%s\" is not supported", type2char(Rtype));
+	right_bufs.offs = (int *) R_alloc(dim0, sizeof(int));
+	right_bufs.left_Rvector = _new_Rvector0(Rtype, dim0);
+	SEXP index0 = VECTOR_ELT(Nindex, 0);
+	if (with_SVT && index0 != R_NilValue) {
+		PROTECT(right_bufs.left_Rvector);
+		right_bufs.right_Rvector =
+			_new_Rvector0(Rtype, XLENGTH(index0));
+		UNPROTECT(1);
+	} else {
+		right_bufs.right_Rvector = R_NilValue;
+	}
+	int ndim = LENGTH(Nindex), nfull = 0;
+	while (nfull < ndim && VECTOR_ELT(Nindex, nfull) == R_NilValue)
+		nfull++;
+	right_bufs.nfull = nfull;
+	return right_bufs;
+}
+
+/* Subassigns 'leaf' with the 'd2' values in 'Rvector' that start at offset
+   'Roffset', where 'd2' is 'length(index0)', or 'dim0' if 'index0' is NULL.
+   The returned leaf can be NULL or lacunar. */
+static SEXP subassign_leaf_with_Rsubvec(SEXP leaf, int dim0, SEXP index0,
+		SEXP Rvector, R_xlen_t Roffset, RightBufs *right_bufs)
+{
+	if (index0 == R_NilValue) {
+		/* Full replacement: we compress the dense subvector
+		   directly. */
+		return _make_leaf_from_Rsubvec(Rvector, Roffset, dim0,
+					       right_bufs->offs, 0);
+	}
+	SEXP left_Rvector = right_bufs->left_Rvector;
+	if (leaf != R_NilValue)
+		_expand_leaf(leaf, left_Rvector, 0);
+	int d2 = LENGTH(index0);
+	for (int i2 = 0; i2 < d2; i2++) {
+		int coord = INTEGER(index0)[i2];
+		if (INVALID_COORD(coord, dim0))
+			error("subscript contains "
+			      "out-of-bound indices or NAs");
+		right_bufs->copy_Rvector_elt_FUN(Rvector, Roffset + i2,
+						 left_Rvector, coord - 1);
+	}
+	SEXP ans = PROTECT(_make_leaf_from_Rsubvec(left_Rvector, 0, dim0,
+						   right_bufs->offs, 0));
+	if (ans != R_NilValue) {
+		/* Remove nonzeros introduced in 'left_Rvector'. */
+		SEXP ans_nzoffs = get_leaf_nzoffs(ans);
+		_set_selected_Rsubvec_elts_to_zero(left_Rvector, 0,
+					     INTEGER(ans_nzoffs),
+					     LENGTH(ans_nzoffs));
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Subassigns 'leaf' with 'v_leaf'. 'v_leaf' is a leaf of length 'd2' where
+   'd2' is 'length(index0)', or 'dim0' if 'index0' is NULL.
+   The returned leaf can be NULL or lacunar. */
+static SEXP subassign_leaf_with_leaf(SEXP leaf, int dim0, SEXP index0,
+		SEXP v_leaf, RightBufs *right_bufs)
+{
+	if (index0 == R_NilValue)
+		return v_leaf;  /* full replacement */
+	if (leaf == R_NilValue && v_leaf == R_NilValue)
+		return R_NilValue;
+	SEXP right_Rvector = right_bufs->right_Rvector;
+	if (v_leaf != R_NilValue)
+		_expand_leaf(v_leaf, right_Rvector, 0);
+	SEXP ans = PROTECT(
+		subassign_leaf_with_Rsubvec(leaf, dim0, index0,
+					    right_Rvector, 0, right_bufs)
+	);
+	if (v_leaf != R_NilValue) {
+		/* Remove nonzeros introduced in 'right_Rvector'. */
+		SEXP v_nzoffs = get_leaf_nzoffs(v_leaf);
+		_set_selected_Rsubvec_elts_to_zero(right_Rvector, 0,
+					     INTEGER(v_nzoffs),
+					     LENGTH(v_nzoffs));
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Recursive. 'ndim' must be >= 2. 'SVT' must be a list of length
+   'dim[ndim - 1]'.
+   When 'Rarray' is not R_NilValue, the values to assign are taken from
+   'Rarray' and 'Rarray_off' is the offset of the current subarray of
+   'Rarray' (in units of 'Rarray' leaves, i.e. of 'length(index0)'). Otherwise
+   they're taken from 'v_SVT' (which can be NULL). */
+static SEXP REC_subassign_SVT_with_Rarray_or_SVT(SEXP SVT, SEXP SVT0,
+		const int *dim, int ndim, SEXP Nindex,
+		SEXP Rarray, R_xlen_t Rarray_off, SEXP v_SVT,
+		RightBufs *right_bufs)
+{
+	SEXP subSVT0 = R_NilValue;
+	int d1 = dim[ndim - 1];
+	SEXP Nindex_elt = VECTOR_ELT(Nindex, ndim - 1);
+	int d2 = Nindex_elt == R_NilValue ? d1 : LENGTH(Nindex_elt);
+	SEXP index0 = VECTOR_ELT(Nindex, 0);
+	R_xlen_t leaf_len = index0 == R_NilValue ? dim[0] : XLENGTH(index0);
+	for (int i2 = 0; i2 < d2; i2++) {
+		int i1;
+		if (Nindex_elt == R_NilValue) {
+			i1 = i2;
+		} else {
+			int coord = INTEGER(Nindex_elt)[i2];
+			if (INVALID_COORD(coord, d1))
+				error("subscript contains "
+				      "out-of-bound indices or NAs");
+			i1 = coord - 1;
+		}
+		R_xlen_t sub_off = Rarray_off * d2 + i2;
+		SEXP v_subSVT = R_NilValue;
+		if (Rarray == R_NilValue && v_SVT != R_NilValue)
+			v_subSVT = VECTOR_ELT(v_SVT, i2);
+		SEXP subSVT = VECTOR_ELT(SVT, i1);
+		if (Rarray == R_NilValue &&
+		    (ndim - 1 <= right_bufs->nfull ||
+		     (subSVT == R_NilValue && v_subSVT == R_NilValue)))
+		{
+			/* The subtree is either fully replaced by the
+			   corresponding subtree in 'v', in which case we
+			   share the latter, or both subtrees are empty. */
+			SET_VECTOR_ELT(SVT, i1, v_subSVT);
+			continue;
+		}
+		if (ndim == 2) {
+			if (Rarray != R_NilValue) {
+				subSVT = subassign_leaf_with_Rsubvec(
+						subSVT, dim[0], index0,
+						Rarray, sub_off * leaf_len,
+						right_bufs);
+			} else {
+				subSVT = subassign_leaf_with_leaf(
+						subSVT, dim[0], index0,
+						v_subSVT, right_bufs);
+			}
+			PROTECT(subSVT);
+		} else {
+			if (SVT0 != R_NilValue)
+				subSVT0 = VECTOR_ELT(SVT0, i1);
+			subSVT = PROTECT(
+				make_SVT_node(subSVT, dim[ndim - 2], subSVT0)
+			);
+			subSVT = PROTECT(
+				REC_subassign_SVT_with_Rarray_or_SVT(
+					subSVT, subSVT0,
+					dim, ndim - 1, Nindex,
+					Rarray, sub_off, v_subSVT,
+					right_bufs)
+			);
+		}
+		SET_VECTOR_ELT(SVT, i1, subSVT);
+		UNPROTECT(ndim == 2 ? 1 : 2);
+	}
+	int is_empty = 1;
+	for (int i1 = 0; i1 < d1; i1++) {
+		if (VECTOR_ELT(SVT, i1) != R_NilValue) {
+			is_empty = 0;
+			break;
+		}
+	}
+	return is_empty ? R_NilValue : SVT;
+}
+
+/* Returns the length of the selection described by 'Nindex' and checks
+   that its dimensions are 'v_dim' (if not R_NilValue). */
+static R_xlen_t check_selection_dim(SEXP Nindex, const int *dim, int ndim,
+		SEXP v_dim)
+{
+	if (!isVectorList(Nindex) || LENGTH(Nindex) != ndim)
+		error("'Nindex' must be a list with one list "
+		      "element along each dimension in 'x'");
+	if (v_dim != R_NilValue && LENGTH(v_dim) != ndim)
+		error("the selection and supplied value must have "
+		      "the same number of dimensions");
+	R_xlen_t selection_len = 1;
+	for (int along = 0; along < ndim; along++) {
+		SEXP Nindex_elt = VECTOR_ELT(Nindex, along);
+		int d2;
+		if (Nindex_elt == R_NilValue) {
+			d2 = dim[along];
+		} else {
+			if (!IS_INTEGER(Nindex_elt))
+				error("'Nindex' must contain integer vectors "
+				      "(or NULLs)");
+			d2 = LENGTH(Nindex_elt);
+		}
+		if (v_dim != R_NilValue && INTEGER(v_dim)[along] != d2)
+			error("the selection and supplied value must have "
+			      "the same dimensions");
+		selection_len *= d2;
+	}
+	return selection_len;
+}
+
+static SEXP subassign_SVT_with_Rarray_or_SVT(SEXP x_dim, SEXP x_SVT,
+		SEXP Nindex, SEXPTYPE Rtype, SEXP Rarray, SEXP v_SVT)
+{
+	const int *dim = INTEGER(x_dim);
+	int ndim = LENGTH(x_dim);
+	int dim0 = dim[0];
+	SEXP index0 = VECTOR_ELT(Nindex, 0);
+
+	RightBufs right_bufs = init_right_bufs(dim0, Nindex, Rtype,
+					       Rarray == R_NilValue);
+	PROTECT(right_bufs.left_Rvector);
+	PROTECT(right_bufs.right_Rvector);
+
+	SEXP ans;
+	if (ndim == 1) {
+		if (Rarray != R_NilValue) {
+			ans = subassign_leaf_with_Rsubvec(x_SVT, dim0, index0,
+						Rarray, 0, &right_bufs);
+		} else {
+			ans = subassign_leaf_with_leaf(x_SVT, dim0, index0,
+						v_SVT, &right_bufs);
+		}
+		UNPROTECT(2);
+		return ans;
+	}
+
+	ans = PROTECT(make_SVT_node(x_SVT, dim[ndim - 1], x_SVT));
+	ans = REC_subassign_SVT_with_Rarray_or_SVT(ans, x_SVT,
+					dim, ndim, Nindex,
+					Rarray, 0, v_SVT, &right_bufs);
+	UNPROTECT(3);
+	return ans;
+}
+
 /* --- .Call ENTRY POINT ---
    The left and right arrays ('x' and 'Rarray') must have the same number
    of dimensions.
@@ -1252,8 +1778,29 @@ SEXP C_subassign_SVT_with_short_Rvector(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 SEXP C_subassign_SVT_with_Rarray(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 		SEXP Nindex, SEXP Rarray)
 {
-	error("not ready yet");
-	return R_NilValue;
+	SEXPTYPE Rtype = _get_Rtype_from_Rstring(x_type);
+	if (Rtype == 0)
+		error("SparseArray internal error in "
+		      "C_subassign_SVT_with_Rarray():\n"
+		      "    SVT_SparseArray object has invalid type");
+	if (TYPEOF(Rarray) != Rtype)
+		error("SparseArray internal error in "
+		      "C_subassign_SVT_with_Rarray():\n"
+		      "    SVT_SparseArray object and 'Rarray' "
+		      "must have the same type");
+
+	const int *dim = INTEGER(x_dim);
+	int ndim = LENGTH(x_dim);
+	R_xlen_t selection_len = check_selection_dim(Nindex, dim, ndim,
+						     GET_DIM(Rarray));
+	if (XLENGTH(Rarray) != selection_len)
+		error("SparseArray internal error in "
+		      "C_subassign_SVT_with_Rarray():\n"
+		      "    length(Rarray) != length of the selection");
+	if (selection_len == 0)
+		return x_SVT;  /* no-op */
+	return subassign_SVT_with_Rarray_or_SVT(x_dim, x_SVT,
+				Nindex, Rtype, Rarray, R_NilValue);
 }
 
 /* --- .Call ENTRY POINT ---
@@ -1264,8 +1811,25 @@ SEXP C_subassign_SVT_with_Rarray(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 SEXP C_subassign_SVT_with_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 		SEXP Nindex, SEXP v_dim, SEXP v_type, SEXP v_SVT)
 {
-	error("not ready yet");
-	return R_NilValue;
+	SEXPTYPE Rtype = _get_Rtype_from_Rstring(x_type);
+	if (Rtype == 0)
+		error("SparseArray internal error in "
+		      "C_subassign_SVT_with_SVT():\n"
+		      "    SVT_SparseArray object has invalid type");
+	if (_get_Rtype_from_Rstring(v_type) != Rtype)
+		error("SparseArray internal error in "
+		      "C_subassign_SVT_with_SVT():\n"
+		      "    the two SVT_SparseArray objects "
+		      "must have the same type");
+
+	const int *dim = INTEGER(x_dim);
+	int ndim = LENGTH(x_dim);
+	R_xlen_t selection_len = check_selection_dim(Nindex, dim, ndim,
+						     v_dim);
+	if (selection_len == 0)
+		return x_SVT;  /* no-op */
+	return subassign_SVT_with_Rarray_or_SVT(x_dim, x_SVT,
+				Nindex, Rtype, R_NilValue, v_SVT);
 }
 
 
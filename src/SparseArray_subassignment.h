@@ -20,6 +20,12 @@ SEXP C_subassign_SVT_by_Mindex(
 	SEXP vals
 );
 
+SEXP C_subassign_index_shape(
+	SEXP x_dim,
+	SEXP index,
+	SEXP max_nleaf
+);
+
 SEXP C_subassign_SVT_with_short_Rvector(
 	SEXP x_dim,
 	SEXP x_type,
@@ -10,6 +10,7 @@
 #include "Rvector_utils.h"
 #include "Rvector_summarization.h"
 #include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads() */
 
 
 static void summarize_leaf(SEXP leaf, int dim0,
@@ -31,7 +32,7 @@ static void summarize_leaf(SEXP leaf, int dim0,
 
 
 /****************************************************************************
- * C_summarize_SVT()
+ * REC_summarize_SVT()
  */
 
 /* Recursive. */
@@ -67,56 +68,244 @@ static void REC_summarize_SVT(SEXP SVT, const int *dim, int ndim,
 	return;
 }
 
-static SummarizeOp replace_SummarizeOp_center_with_mean(
+/****************************************************************************
+ * Parallel summarization
+ *
+ * The SVT is split into "blocks" i.e. into the subtrees found at a given
+ * depth, and the blocks are split into "chunks" of consecutive blocks. Each
+ * chunk is summarized by a single thread into its own SummarizeResult, and
+ * the per-chunk results are merged at the end. A thread that finds a
+ * breaking value tells the other threads to stop.
+ * In reproducible mode, the number of chunks depends only on the dimensions
+ * of the SVT, and the per-chunk results are merged with a fixed-shape
+ * pairwise reduction. This means that the floating-point operations are
+ * performed in the same order, whatever the number of threads is, so the
+ * result is bit-identical for any number of threads (including 1).
+ * Otherwise we use a few chunks per thread (so the result can depend on
+ * the number of threads) and merge them sequentially. Note that with 1
+ * thread and no reproducible mode we just walk the SVT serially.
+ */
+
+#define	MAX_NBLOCK		1048576  /* 2^20 */
+#define	CHUNKS_PER_THREAD	8
+#define	REPRODUCIBLE_NCHUNK	1024
+
+typedef struct svt_blocks_t {
+	SEXP SVT;
+	const int *dim;
+	int ndim;
+	int depth;        /* nb of outermost dimensions spanned by the blocks */
+	R_xlen_t nblock;  /* product of the 'depth' outermost dimensions */
+} SVTBlocks;
+
+/* Uses the outermost dimensions until the number of blocks exceeds
+   MAX_NBLOCK. Leaves are never split. */
+static SVTBlocks make_SVTBlocks(SEXP SVT, const int *dim, int ndim)
+{
+	SVTBlocks blocks;
+	blocks.SVT = SVT;
+	blocks.dim = dim;
+	blocks.ndim = ndim;
+	blocks.depth = 1;
+	blocks.nblock = dim[ndim - 1];
+	while (blocks.depth < ndim - 1 &&
+	       blocks.nblock * dim[ndim - 1 - blocks.depth] <= MAX_NBLOCK)
+	{
+		blocks.nblock *= dim[ndim - 1 - blocks.depth];
+		blocks.depth++;
+	}
+	return blocks;
+}
+
+/* Blocks are numbered in the order in which REC_summarize_SVT() walks
+   them. */
+static SEXP get_block(const SVTBlocks *blocks, R_xlen_t b)
+{
+	SEXP subSVT = blocks->SVT;
+	R_xlen_t stride = blocks->nblock;
+	for (int along = blocks->ndim - 1;
+	     along >= blocks->ndim - blocks->depth;
+	     along--)
+	{
+		if (subSVT == R_NilValue)
+			break;
+		stride /= blocks->dim[along];
+		subSVT = VECTOR_ELT(subSVT, (int) (b / stride));
+		b %= stride;
+	}
+	return subSVT;
+}
+
+static void summarize_blocks(const SVTBlocks *blocks,
+		R_xlen_t b1, R_xlen_t b2,
+		const SummarizeOp *summarize_op, SummarizeResult *res,
+		int *stop)
+{
+	for (R_xlen_t b = b1; b < b2; b++) {
+		int stop_now;
+		#pragma omp atomic read
+		stop_now = *stop;
+		if (stop_now)
+			return;
+		REC_summarize_SVT(get_block(blocks, b),
+				  blocks->dim, blocks->ndim - blocks->depth,
+				  summarize_op, res);
+		if (res->outbuf_status == OUTBUF_IS_SET_WITH_BREAKING_VALUE) {
+			#pragma omp atomic write
+			*stop = 1;
+			return;
+		}
+	}
+	return;
+}
+
+/* Merges 'results[1..n-1]' into 'results[0]'. The shape of the reduction
+   tree depends only on 'n'. */
+static void merge_results_pairwise(const SummarizeOp *summarize_op,
+		SummarizeResult *results, int n)
+{
+	if (n <= 1)
+		return;
+	int half = n / 2;
+	merge_results_pairwise(summarize_op, results, half);
+	merge_results_pairwise(summarize_op, results + half, n - half);
+	_merge_SummarizeResults(summarize_op, results, results + half);
+	return;
+}
+
+/* Does NOT postprocess 'res'. */
+static void summarize_SVT(SEXP SVT, const int *dim, int ndim,
+		const SummarizeOp *summarize_op, SummarizeResult *res,
+		int nthread, int reproducible)
+{
+	_init_SummarizeResult(summarize_op, res);
+	if (ndim == 1 || (nthread <= 1 && !reproducible)) {
+		REC_summarize_SVT(SVT, dim, ndim, summarize_op, res);
+		return;
+	}
+	SVTBlocks blocks = make_SVTBlocks(SVT, dim, ndim);
+	R_xlen_t nchunk = reproducible ? REPRODUCIBLE_NCHUNK
+				       : (R_xlen_t) nthread * CHUNKS_PER_THREAD;
+	if (nchunk > blocks.nblock)
+		nchunk = blocks.nblock;
+	if (nchunk <= 1) {
+		REC_summarize_SVT(SVT, dim, ndim, summarize_op, res);
+		return;
+	}
+	SummarizeResult *results = (SummarizeResult *)
+		R_alloc(nchunk, sizeof(SummarizeResult));
+	for (int c = 0; c < nchunk; c++)
+		_init_SummarizeResult(summarize_op, results + c);
+	int stop = 0;
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthread)
+	for (int c = 0; c < nchunk; c++) {
+		R_xlen_t b1 = blocks.nblock * c / nchunk;
+		R_xlen_t b2 = blocks.nblock * (c + 1) / nchunk;
+		summarize_blocks(&blocks, b1, b2, summarize_op, results + c,
+				 &stop);
+	}
+	if (reproducible) {
+		merge_results_pairwise(summarize_op, results, nchunk);
+	} else {
+		for (int c = 1; c < nchunk; c++)
+			_merge_SummarizeResults(summarize_op, results,
+						results + c);
+	}
+	*res = results[0];
+	return;
+}
+
+static SummarizeResult summarize_SVT_with_nthread(
 		SEXP SVT, const int *dim, int ndim,
-		const SummarizeOp *summarize_op)
+		const SummarizeOp *summarize_op,
+		int nthread, int reproducible)
 {
-	SummarizeOp tmp_op;
 	SummarizeResult res;
-	double SVT_mean;
-
-	/* Compute 'mean(SVT)'. */
-	tmp_op = *summarize_op;
-	tmp_op.opcode = MEAN_OPCODE;
-	_init_SummarizeResult(&tmp_op, &res);
-	REC_summarize_SVT(SVT, dim, ndim, &tmp_op, &res);
-	_postprocess_SummarizeResult(&tmp_op, &res);
-	SVT_mean = res.outbuf.one_double[0];
-
-	/* Set 'center' with 'mean(SVT)'. */
-	tmp_op = *summarize_op;
-	tmp_op.center = SVT_mean;
-	return tmp_op;
+
+	/* Note that ops CENTERED_X2_SUM, VAR1, and SD1 with 'center' set
+	   to NA (i.e. centered around the mean) don't need a separate pass
+	   to compute the mean. */
+	summarize_SVT(SVT, dim, ndim, summarize_op, &res,
+		      nthread, reproducible);
+	_postprocess_SummarizeResult(summarize_op, &res);
+	return res;
 }
 
+/* Serial. Safe to call from a parallel region. */
 SummarizeResult _summarize_SVT(SEXP SVT, const int *dim, int ndim,
 			       const SummarizeOp *summarize_op)
 {
-	SummarizeOp tmp_op;
-	SummarizeResult res;
+	return summarize_SVT_with_nthread(SVT, dim, ndim, summarize_op, 1, 0);
+}
 
-	if (ISNAN(summarize_op->center) &&
-		(summarize_op->opcode == CENTERED_X2_SUM_OPCODE ||
-		 summarize_op->opcode == VAR1_OPCODE ||
-		 summarize_op->opcode == SD1_OPCODE))
-	{
-		tmp_op = replace_SummarizeOp_center_with_mean(SVT, dim, ndim,
-							      summarize_op);
-		summarize_op = &tmp_op;
+/****************************************************************************
+ * _summarize_SVT_multi()
+ */
+
+/* Recursive. Like REC_summarize_SVT() but updates 'nop' results (one per
+   operation in 'ops') while walking the SVT only once. Also counts the
+   nonzero values. Note that we don't bail out early when all the results
+   are set with a breaking value because we still need to count the
+   nonzero values. */
+static void REC_summarize_SVT_multi(SEXP SVT, const int *dim, int ndim,
+		const SummarizeOp *ops, int nop, SummarizeResult *results,
+		R_xlen_t *nzcount)
+{
+	if (SVT == R_NilValue) {
+		R_xlen_t in_len = 1;
+		for (int along = 0; along < ndim; along++)
+			in_len *= dim[along];
+		for (int k = 0; k < nop; k++)
+			results[k].in_length += in_len;
+		return;
 	}
 
-	_init_SummarizeResult(summarize_op, &res);
-	REC_summarize_SVT(SVT, dim, ndim, summarize_op, &res);
-	_postprocess_SummarizeResult(summarize_op, &res);
-	return res;
+	if (ndim == 1) {
+		/* 'SVT' is a leaf (i.e. a 1D SVT). */
+		*nzcount += get_leaf_nzcount(SVT);
+		for (int k = 0; k < nop; k++) {
+			SummarizeResult *res = results + k;
+			if (res->outbuf_status !=
+			    OUTBUF_IS_SET_WITH_BREAKING_VALUE)
+				summarize_leaf(SVT, dim[0], ops + k, res);
+		}
+		return;
+	}
+
+	/* 'SVT' is a regular node (list). */
+	int SVT_len = LENGTH(SVT);
+	for (int i = 0; i < SVT_len; i++)
+		REC_summarize_SVT_multi(VECTOR_ELT(SVT, i), dim, ndim - 1,
+					ops, nop, results, nzcount);
+	return;
+}
+
+/* Serial. Safe to call from a parallel region.
+   Fills 'results' (which must have room for 'nop' results) and returns
+   the number of nonzero values in 'SVT'. */
+R_xlen_t _summarize_SVT_multi(SEXP SVT, const int *dim, int ndim,
+		const SummarizeOp *ops, int nop, SummarizeResult *results)
+{
+	for (int k = 0; k < nop; k++)
+		_init_SummarizeResult(ops + k, results + k);
+	R_xlen_t nzcount = 0;
+	REC_summarize_SVT_multi(SVT, dim, ndim, ops, nop, results, &nzcount);
+	for (int k = 0; k < nop; k++)
+		_postprocess_SummarizeResult(ops + k, results + k);
+	return nzcount;
 }
 
+
+/****************************************************************************
+ * C_summarize_SVT()
+ */
+
 /* --- .Call ENTRY POINT --- */
 SEXP C_summarize_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
-		SEXP op, SEXP na_rm, SEXP center)
+		SEXP op, SEXP na_rm, SEXP center, SEXP reproducible)
 {
 	SEXPTYPE x_Rtype;
-	int opcode, narm;
+	int opcode, narm, repro;
 	SummarizeOp summarize_op;
 	SummarizeResult res;
 
@@ -137,10 +326,17 @@ SEXP C_summarize_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 		      "C_summarize_SVT():\n"
 		      "    'center' must be a single number");
 
+	if (!(IS_LOGICAL(reproducible) && LENGTH(reproducible) == 1))
+		error("SparseArray internal error in "
+		      "C_summarize_SVT():\n"
+		      "    'reproducible' must be TRUE or FALSE");
+	repro = LOGICAL(reproducible)[0];
+
 	summarize_op = _make_SummarizeOp(opcode, x_Rtype, narm,
 					 REAL(center)[0]);
-	res = _summarize_SVT(x_SVT, INTEGER(x_dim), LENGTH(x_dim),
-			     &summarize_op);
+	res = summarize_SVT_with_nthread(x_SVT, INTEGER(x_dim), LENGTH(x_dim),
+					 &summarize_op,
+					 _get_max_threads(), repro);
 	if (res.warn)
 		warning("NAs introduced by coercion of "
 			"infinite values to integers");
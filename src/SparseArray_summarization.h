@@ -11,13 +11,23 @@ SummarizeResult _summarize_SVT(
 	const SummarizeOp *summarize_op
 );
 
+R_xlen_t _summarize_SVT_multi(
+	SEXP SVT,
+	const int *dim,
+	int ndim,
+	const SummarizeOp *ops,
+	int nop,
+	SummarizeResult *results
+);
+
 SEXP C_summarize_SVT(
 	SEXP x_dim,
 	SEXP x_type,
 	SEXP x_SVT,
 	SEXP op,
 	SEXP na_rm,
-	SEXP center
+	SEXP center,
+	SEXP reproducible
 );
 
 #endif  /* _SPARSEARRAY_SUMMARIZATION_H_ */
@@ -0,0 +1,434 @@
+/****************************************************************************
+ *       Top-k values (and their indices) along any dimension of an         *
+ *                          SVT_SparseArray object                          *
+ ****************************************************************************/
+#include "SparseArray_topK.h"
+
+#include "Rvector_utils.h"
+#include "SparseVec.h"
+#include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads(), _get_thread_num() */
+
+
+/****************************************************************************
+ * Bounded heaps
+ *
+ * A bounded heap keeps the k "best" (value, index) pairs seen so far,
+ * where "best" means largest value if 'decreasing' is TRUE and smallest
+ * value otherwise. Ties are broken by index (smallest index first), like
+ * base::which.max() and base::order() do. The root of the heap is the
+ * worst pair kept, so a new pair only needs to be compared with the root.
+ * NAs and NaNs never enter the heap.
+ */
+
+typedef struct topk_heap_t {
+	double *vals;
+	int *idxs;
+	int n;
+} TopKHeap;
+
+static inline int is_better(double v1, int i1, double v2, int i2,
+			    int decreasing)
+{
+	if (v1 != v2)
+		return decreasing ? v1 > v2 : v1 < v2;
+	return i1 < i2;
+}
+
+static inline void swap_heap_elts(TopKHeap *heap, int i, int j)
+{
+	double v = heap->vals[i];
+	heap->vals[i] = heap->vals[j];
+	heap->vals[j] = v;
+	int idx = heap->idxs[i];
+	heap->idxs[i] = heap->idxs[j];
+	heap->idxs[j] = idx;
+}
+
+static void sift_down(TopKHeap *heap, int i, int n, int decreasing)
+{
+	while (1) {
+		int worst = i, left = 2 * i + 1, right = left + 1;
+		if (left < n && is_better(heap->vals[worst], heap->idxs[worst],
+					  heap->vals[left], heap->idxs[left],
+					  decreasing))
+			worst = left;
+		if (right < n && is_better(heap->vals[worst], heap->idxs[worst],
+					   heap->vals[right], heap->idxs[right],
+					   decreasing))
+			worst = right;
+		if (worst == i)
+			return;
+		swap_heap_elts(heap, i, worst);
+		i = worst;
+	}
+}
+
+static void push_to_heap(TopKHeap *heap, int k, double v, int idx,
+			 int decreasing)
+{
+	if (heap->n < k) {
+		int i = heap->n++;
+		heap->vals[i] = v;
+		heap->idxs[i] = idx;
+		while (i > 0) {
+			int parent = (i - 1) / 2;
+			if (!is_better(heap->vals[parent], heap->idxs[parent],
+				       v, idx, decreasing))
+				break;
+			swap_heap_elts(heap, i, parent);
+			i = parent;
+		}
+		return;
+	}
+	if (!is_better(v, idx, heap->vals[0], heap->idxs[0], decreasing))
+		return;
+	heap->vals[0] = v;
+	heap->idxs[0] = idx;
+	sift_down(heap, 0, heap->n, decreasing);
+}
+
+/* Sorts the heap in place, best pair first. */
+static void sort_heap(TopKHeap *heap, int decreasing)
+{
+	for (int n = heap->n - 1; n > 0; n--) {
+		swap_heap_elts(heap, 0, n);
+		sift_down(heap, 0, n, decreasing);
+	}
+}
+
+
+/****************************************************************************
+ * Writing the top-k values and indices of a 1D slice
+ *
+ * The zeros are never pushed to the heap. Instead, we keep track of the
+ * indices of the first k zeros of the slice, and merge them with the
+ * sorted heap at the end. This is what allows negative data (where the
+ * implicit zeros can be among the top values) to be handled correctly.
+ */
+
+typedef struct topk_out_t {
+	SEXPTYPE Rtype;  /* INTSXP, LGLSXP, or REALSXP */
+	void *vals;
+	int *idxs;
+	int k;
+	int decreasing;
+} TopKOut;
+
+static void write_topk(const TopKOut *out, R_xlen_t offset, R_xlen_t stride,
+		TopKHeap *heap, const int *zero_idxs, int nzero)
+{
+	sort_heap(heap, out->decreasing);
+	int p = 0, q = 0;
+	for (int j = 0; j < out->k; j++) {
+		R_xlen_t i = offset + stride * j;
+		double v;
+		int idx;
+		if (p < heap->n &&
+		    (q >= nzero || is_better(heap->vals[p], heap->idxs[p],
+					     0.0, zero_idxs[q],
+					     out->decreasing))) {
+			v = heap->vals[p];
+			idx = heap->idxs[p++] + 1;
+		} else if (q < nzero) {
+			v = 0.0;
+			idx = zero_idxs[q++] + 1;
+		} else {
+			v = NA_REAL;
+			idx = NA_INTEGER;
+		}
+		if (out->Rtype == REALSXP) {
+			((double *) out->vals)[i] = v;
+		} else {
+			((int *) out->vals)[i] = ISNAN(v) ? NA_INTEGER
+							  : (int) v;
+		}
+		out->idxs[i] = idx;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * Along the 1st dimension
+ *
+ * Each 1D slice is a leaf. The first k zeros are the first k offsets that
+ * are not in 'nzoffs'.
+ */
+
+static void topK_leaf(SEXP leaf, SEXPTYPE Rtype, int len, const TopKOut *out,
+		R_xlen_t oc, TopKHeap *heap, int *zero_idxs)
+{
+	heap->n = 0;
+	int nzero = 0;
+	if (leaf == R_NilValue) {
+		for (; nzero < out->k && nzero < len; nzero++)
+			zero_idxs[nzero] = nzero;
+		write_topk(out, oc * out->k, 1, heap, zero_idxs, nzero);
+		return;
+	}
+	SparseVec sv = leaf2SV(leaf, Rtype, len);
+	int z = 0;
+	for (int k = 0; k < sv.nzcount; k++) {
+		int off = sv.nzoffs[k];
+		for (; z < off && nzero < out->k; z++)
+			zero_idxs[nzero++] = z;
+		z = off + 1;
+		double v = get_SV_nzval_as_double(&sv, k);
+		if (!ISNAN(v))
+			push_to_heap(heap, out->k, v, off, out->decreasing);
+	}
+	for (; z < len && nzero < out->k; z++)
+		zero_idxs[nzero++] = z;
+	write_topk(out, oc * out->k, 1, heap, zero_idxs, nzero);
+	return;
+}
+
+
+/****************************************************************************
+ * Along another dimension
+ *
+ * The 1D slices go across the leaves. We call "chain" the sequence of leaves
+ * that share the same indices along all the dimensions but the 1st one and
+ * the 'along' dimension. A chain is walked leaf by leaf and each row of the
+ * chain has its own heap. To get some parallelism even when there are only
+ * a few chains (e.g. for a 2D object, there's only one chain), the rows of
+ * a chain are split into blocks that are processed independently.
+ * The zeros of row i are the gaps between the consecutive leaves where
+ * row i is present.
+ */
+
+typedef struct chain_bufs_t {
+	double *heap_vals;   /* block_len * k */
+	int *heap_idxs;      /* block_len * k */
+	int *heap_ns;        /* block_len */
+	int *zero_idxs;      /* block_len * k */
+	int *nzeros;         /* block_len */
+	int *prev_idxs;      /* block_len */
+} ChainBufs;
+
+static ChainBufs alloc_ChainBufs(int block_len, int k, int nthread)
+{
+	ChainBufs bufs;
+	R_xlen_t n = (R_xlen_t) block_len * nthread;
+	bufs.heap_vals = (double *) R_alloc(n * k, sizeof(double));
+	bufs.heap_idxs = (int *) R_alloc(n * k, sizeof(int));
+	bufs.heap_ns = (int *) R_alloc(n, sizeof(int));
+	bufs.zero_idxs = (int *) R_alloc(n * k, sizeof(int));
+	bufs.nzeros = (int *) R_alloc(n, sizeof(int));
+	bufs.prev_idxs = (int *) R_alloc(n, sizeof(int));
+	return bufs;
+}
+
+/* Returns the position of the first offset >= 'off' in 'nzoffs'. */
+static inline int lower_bound(const int *nzoffs, int nzcount, int off)
+{
+	int lo = 0, hi = nzcount;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (nzoffs[mid] < off) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static inline void record_zeros(int *zero_idxs, int *nzero, int k,
+				int from, int to)
+{
+	for (int a = from; a < to && *nzero < k; a++)
+		zero_idxs[(*nzero)++] = a;
+}
+
+/* Processes rows 'row0' to 'row0 + block_len - 1' of the chain that starts
+   at 'leaves[chain_offset]'. Consecutive leaves of the chain are 'n_mid'
+   leaves apart. */
+static void topK_chain_block(const SEXP *leaves, SEXPTYPE Rtype, int nrow,
+		R_xlen_t chain_offset, R_xlen_t n_mid, int along_len,
+		int row0, int block_len, const TopKOut *out,
+		R_xlen_t out_offset, R_xlen_t out_stride, const ChainBufs *bufs)
+{
+	int k = out->k;
+	for (int r = 0; r < block_len; r++) {
+		bufs->heap_ns[r] = 0;
+		bufs->nzeros[r] = 0;
+		bufs->prev_idxs[r] = -1;
+	}
+	for (int a = 0; a < along_len; a++) {
+		SEXP leaf = leaves[chain_offset + n_mid * a];
+		if (leaf == R_NilValue)
+			continue;
+		SparseVec sv = leaf2SV(leaf, Rtype, nrow);
+		for (int j = lower_bound(sv.nzoffs, sv.nzcount, row0);
+		     j < sv.nzcount; j++)
+		{
+			int r = sv.nzoffs[j] - row0;
+			if (r >= block_len)
+				break;
+			record_zeros(bufs->zero_idxs + (R_xlen_t) r * k,
+				     bufs->nzeros + r, k,
+				     bufs->prev_idxs[r] + 1, a);
+			bufs->prev_idxs[r] = a;
+			double v = get_SV_nzval_as_double(&sv, j);
+			if (ISNAN(v))
+				continue;
+			TopKHeap heap;
+			heap.vals = bufs->heap_vals + (R_xlen_t) r * k;
+			heap.idxs = bufs->heap_idxs + (R_xlen_t) r * k;
+			heap.n = bufs->heap_ns[r];
+			push_to_heap(&heap, k, v, a, out->decreasing);
+			bufs->heap_ns[r] = heap.n;
+		}
+	}
+	for (int r = 0; r < block_len; r++) {
+		int *zero_idxs = bufs->zero_idxs + (R_xlen_t) r * k;
+		record_zeros(zero_idxs, bufs->nzeros + r, k,
+			     bufs->prev_idxs[r] + 1, along_len);
+		TopKHeap heap;
+		heap.vals = bufs->heap_vals + (R_xlen_t) r * k;
+		heap.idxs = bufs->heap_idxs + (R_xlen_t) r * k;
+		heap.n = bufs->heap_ns[r];
+		write_topk(out, out_offset + row0 + r, out_stride,
+			   &heap, zero_idxs, bufs->nzeros[r]);
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * C_topK_SVT()
+ */
+
+/* --- .Call ENTRY POINT ---
+   'along' is 1-based. 'k' must be <= the length of 'x' along 'along'.
+   Returns a list of 2 vectors, the values and their 1-based indices
+   along 'along', to be turned into arrays with the dimensions of 'x',
+   except along 'along' where they have 'k' elements. */
+SEXP C_topK_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+		SEXP k, SEXP along, SEXP decreasing)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	if (x_Rtype != INTSXP && x_Rtype != LGLSXP && x_Rtype != REALSXP)
+		error("top-k values are only supported on SparseArray "
+		      "objects of type() \"logical\", \"integer\", "
+		      "or \"double\"");
+
+	int x_ndim = LENGTH(x_dim);
+	const int *dim = INTEGER(x_dim);
+	if (!IS_INTEGER(along) || LENGTH(along) != 1 ||
+	    INTEGER(along)[0] < 1 || INTEGER(along)[0] > x_ndim)
+		error("SparseArray internal error in C_topK_SVT():\n"
+		      "    'along' must be a single integer >= 1 and <= the "
+		      "number of dimensions of 'x'");
+	int along0 = INTEGER(along)[0] - 1;
+	int along_len = dim[along0];
+	if (!IS_INTEGER(k) || LENGTH(k) != 1 || INTEGER(k)[0] == NA_INTEGER ||
+	    INTEGER(k)[0] < 0 || INTEGER(k)[0] > along_len)
+		error("SparseArray internal error in C_topK_SVT():\n"
+		      "    'k' must be a single integer >= 0 and <= the "
+		      "length of 'x' along 'along'");
+	if (!(IS_LOGICAL(decreasing) && LENGTH(decreasing) == 1 &&
+	      LOGICAL(decreasing)[0] != NA_LOGICAL))
+		error("'decreasing' must be TRUE or FALSE");
+
+	TopKOut out;
+	out.Rtype = x_Rtype;
+	out.k = INTEGER(k)[0];
+	out.decreasing = LOGICAL(decreasing)[0];
+
+	/* Collect the leaves of 'x'. */
+	R_xlen_t nleaf = 1;
+	for (int d = 1; d < x_ndim; d++)
+		nleaf *= dim[d];
+	SEXP *leaves = (SEXP *) R_alloc(nleaf, sizeof(SEXP));
+	_collect_subSVTs(x_SVT, dim, x_ndim, 1, leaves);
+
+	int nrow = dim[0];
+	R_xlen_t ans_len = along_len == 0 ? 0 :
+		(R_xlen_t) nrow * (nleaf / along_len) * out.k;
+	if (along0 == 0)
+		ans_len = nleaf * out.k;
+	SEXP ans = PROTECT(NEW_LIST(2));
+	SEXP ans_vals = PROTECT(allocVector(x_Rtype, ans_len));
+	SET_VECTOR_ELT(ans, 0, ans_vals);
+	SEXP ans_idxs = PROTECT(NEW_INTEGER(ans_len));
+	SET_VECTOR_ELT(ans, 1, ans_idxs);
+	UNPROTECT(2);
+	if (ans_len == 0) {
+		UNPROTECT(1);
+		return ans;
+	}
+	out.vals = DATAPTR(ans_vals);
+	out.idxs = INTEGER(ans_idxs);
+
+	int nthread = _get_max_threads();
+	if (along0 == 0) {
+		double *heap_vals_bufs = (double *)
+			R_alloc((R_xlen_t) out.k * nthread, sizeof(double));
+		int *heap_idxs_bufs = (int *)
+			R_alloc((R_xlen_t) out.k * nthread, sizeof(int));
+		int *zero_idxs_bufs = (int *)
+			R_alloc((R_xlen_t) out.k * nthread, sizeof(int));
+		#pragma omp parallel num_threads(nthread)
+		{
+			int t = _get_thread_num();
+			TopKHeap heap;
+			heap.vals = heap_vals_bufs + (R_xlen_t) out.k * t;
+			heap.idxs = heap_idxs_bufs + (R_xlen_t) out.k * t;
+			int *zero_idxs = zero_idxs_bufs + (R_xlen_t) out.k * t;
+			#pragma omp for schedule(dynamic, 16)
+			for (R_xlen_t oc = 0; oc < nleaf; oc++)
+				topK_leaf(leaves[oc], x_Rtype, nrow, &out, oc,
+					  &heap, zero_idxs);
+		}
+		UNPROTECT(1);
+		return ans;
+	}
+
+	R_xlen_t n_mid = 1;
+	for (int d = 1; d < along0; d++)
+		n_mid *= dim[d];
+	R_xlen_t nchain = nleaf / along_len;
+	/* Split the rows of each chain into blocks when there are not
+	   enough chains to keep all the threads busy. */
+	int nblock = nchain >= nthread ? 1 : nthread;
+	if (nblock > nrow)
+		nblock = nrow;
+	int block_len = (nrow + nblock - 1) / nblock;
+	ChainBufs bufs0 = alloc_ChainBufs(block_len, out.k, nthread);
+	R_xlen_t out_stride = (R_xlen_t) nrow * n_mid;
+	#pragma omp parallel num_threads(nthread)
+	{
+		int t = _get_thread_num();
+		R_xlen_t n = (R_xlen_t) block_len * t;
+		ChainBufs bufs;
+		bufs.heap_vals = bufs0.heap_vals + n * out.k;
+		bufs.heap_idxs = bufs0.heap_idxs + n * out.k;
+		bufs.heap_ns = bufs0.heap_ns + n;
+		bufs.zero_idxs = bufs0.zero_idxs + n * out.k;
+		bufs.nzeros = bufs0.nzeros + n;
+		bufs.prev_idxs = bufs0.prev_idxs + n;
+		#pragma omp for schedule(dynamic, 1)
+		for (R_xlen_t u = 0; u < nchain * nblock; u++) {
+			R_xlen_t chain = u / nblock;
+			int row0 = (int) (u % nblock) * block_len;
+			if (row0 >= nrow)
+				continue;
+			int len = nrow - row0 < block_len ? nrow - row0
+							  : block_len;
+			R_xlen_t c_inner = chain % n_mid;
+			R_xlen_t c_outer = chain / n_mid;
+			R_xlen_t chain_offset = c_inner +
+					n_mid * along_len * c_outer;
+			R_xlen_t out_offset = (R_xlen_t) nrow *
+					(c_inner + n_mid * out.k * c_outer);
+			topK_chain_block(leaves, x_Rtype, nrow, chain_offset,
+					 n_mid, along_len, row0, len, &out,
+					 out_offset, out_stride, &bufs);
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
@@ -0,0 +1,15 @@
+#ifndef _SPARSEARRAY_TOPK_H_
+#define _SPARSEARRAY_TOPK_H_
+
+#include <Rdefines.h>
+
+SEXP C_topK_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP k,
+	SEXP along,
+	SEXP decreasing
+);
+
+#endif  /* _SPARSEARRAY_TOPK_H_ */
@@ -0,0 +1,553 @@
+/****************************************************************************
+ ****************************************************************************
+ **									   **
+ **    Preconditioned conjugate gradient solver for SparseMatrix objects   **
+ **									   **
+ **       This is the workhorse behind sparse_cg() and solve(a, b,         **
+ **                            method="cg")                                **
+ **									   **
+ ****************************************************************************
+ ****************************************************************************/
+#include "SparseMatrix_cg.h"
+
+#include "Rvector_utils.h"
+#include "SparseVec.h"
+#include "SparseMatrix_mult.h"  /* for _SVT2SVs() and _SpMM_SVT_double() */
+#include "thread_control.h"     /* for _get_max_threads() */
+
+#include <string.h>  /* for memcpy(), memset(), strcmp() */
+#include <limits.h>  /* for INT_MAX */
+#include <math.h>    /* for sqrt() */
+
+
+/* Vector operations on vectors shorter than this are not worth
+   parallelizing. */
+#define PAR_MIN_LEN 8192
+
+/* Maximum number of diagonal shifts tried by the incomplete Cholesky
+   factorization before giving up. */
+#define IC0_MAX_SHIFTS 12
+
+enum precond_type_t { PRECOND_NONE, PRECOND_JACOBI, PRECOND_IC0 };
+
+
+/****************************************************************************
+ * Parallel vector operations
+ */
+
+static double dot(const double *x, const double *y, int n)
+{
+	double s = 0.0;
+	#pragma omp parallel for schedule(static) reduction(+:s) \
+		if(n >= PAR_MIN_LEN)
+	for (int i = 0; i < n; i++)
+		s += x[i] * y[i];
+	return s;
+}
+
+/* Performs 'x <- x + alpha * p' and 'r <- r - alpha * Ap', and returns
+   the squared norm of the updated 'r'. */
+static double update_x_and_r(double *x, double *r,
+		const double *p, const double *Ap, double alpha, int n)
+{
+	double s = 0.0;
+	#pragma omp parallel for schedule(static) reduction(+:s) \
+		if(n >= PAR_MIN_LEN)
+	for (int i = 0; i < n; i++) {
+		x[i] += alpha * p[i];
+		double ri = r[i] - alpha * Ap[i];
+		r[i] = ri;
+		s += ri * ri;
+	}
+	return s;
+}
+
+/* Performs 'p <- z + beta * p'. */
+static void update_p(double *p, const double *z, double beta, int n)
+{
+	#pragma omp parallel for schedule(static) if(n >= PAR_MIN_LEN)
+	for (int i = 0; i < n; i++)
+		p[i] = z[i] + beta * p[i];
+	return;
+}
+
+
+/****************************************************************************
+ * Preconditioners
+ *
+ * Jacobi: 'M' is 'diag(diag(a))'.
+ * IC(0): 'M' is 't(U) %*% U' where 'U' is the zero fill-in incomplete
+ *        Cholesky factor of 'a', that is, 'U' is upper triangular with the
+ *        sparsity pattern of the upper triangle of 'a'. If the factorization
+ *        breaks down (this can happen for positive-definite matrices that
+ *        are not M-matrices), it's restarted on 'a + shift * diag(diag(a))'
+ *        with increasing values of 'shift'.
+ */
+
+typedef struct precond_t {
+	enum precond_type_t type;
+	int n;
+	double *invdiag;  /* Jacobi */
+	int *p;           /* IC(0): column pointers of 'U' */
+	int *i;           /* IC(0): row indices of 'U' (diagonal last) */
+	double *x;        /* IC(0): values of 'U' */
+	double *a;        /* IC(0): values of 'a' (aligned with 'i') */
+} Precond;
+
+static void not_positive_definite(int j)
+{
+	error("the matrix is not positive definite (diagonal element %d "
+	      "is not positive)", j + 1);
+}
+
+/* Returns the position of the diagonal element in 'sv', or -1. */
+static int find_diag(const SparseVec *sv, int j)
+{
+	int lo = 0, hi = get_SV_nzcount(sv);
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (sv->nzoffs[mid] < j)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < get_SV_nzcount(sv) && sv->nzoffs[lo] == j)
+		return lo;
+	return -1;
+}
+
+static void init_jacobi(Precond *M, const SparseVec *svs)
+{
+	int n = M->n;
+	M->invdiag = (double *) R_alloc(n, sizeof(double));
+	for (int j = 0; j < n; j++) {
+		int k = find_diag(svs + j, j);
+		double d = k < 0 ? 0.0 : get_doubleSV_nzval(svs + j, k);
+		if (!(d > 0.0))
+			not_positive_definite(j);
+		M->invdiag[j] = 1.0 / d;
+	}
+	return;
+}
+
+/* Sets up the pattern of 'U' (the upper triangle of 'a'). */
+static void init_ic0_pattern(Precond *M, const SparseVec *svs)
+{
+	int n = M->n;
+	M->p = (int *) R_alloc((size_t) n + 1, sizeof(int));
+	M->p[0] = 0;
+	for (int j = 0; j < n; j++) {
+		int k = find_diag(svs + j, j);
+		if (k < 0)
+			not_positive_definite(j);
+		if (M->p[j] > INT_MAX - (k + 1))
+			error("too many nonzero values in the upper "
+			      "triangle of the matrix");
+		M->p[j + 1] = M->p[j] + k + 1;
+	}
+	int nnz = M->p[n];
+	M->i = (int *) R_alloc(nnz, sizeof(int));
+	M->x = (double *) R_alloc(nnz, sizeof(double));
+	M->a = (double *) R_alloc(nnz, sizeof(double));
+	for (int j = 0; j < n; j++) {
+		const SparseVec *sv = svs + j;
+		int start = M->p[j];
+		for (int k = 0; k < M->p[j + 1] - start; k++) {
+			M->i[start + k] = sv->nzoffs[k];
+			M->a[start + k] = get_doubleSV_nzval(sv, k);
+		}
+	}
+	return;
+}
+
+/* Returns 1 on success, or 0 if the factorization broke down. */
+static int ic0_factor(Precond *M, double shift)
+{
+	const int *p = M->p, *I = M->i;
+	const double *a = M->a;
+	double *u = M->x;
+	for (int j = 0; j < M->n; j++) {
+		int jdiag = p[j + 1] - 1;
+		for (int q = p[j]; q < jdiag; q++) {
+			/* U[i,j] = (a[i,j] - sum_{k<i} U[k,i] U[k,j]) / U[i,i] */
+			int i = I[q];
+			double s = a[q];
+			int qi = p[i], idiag = p[i + 1] - 1, qj = p[j];
+			while (qi < idiag && qj < q) {
+				if (I[qi] < I[qj]) {
+					qi++;
+				} else if (I[qi] > I[qj]) {
+					qj++;
+				} else {
+					s -= u[qi++] * u[qj++];
+				}
+			}
+			u[q] = s / u[idiag];
+		}
+		double d = a[jdiag] * (1.0 + shift);
+		for (int q = p[j]; q < jdiag; q++)
+			d -= u[q] * u[q];
+		if (!(d > 0.0))
+			return 0;
+		u[jdiag] = sqrt(d);
+	}
+	return 1;
+}
+
+static void init_ic0(Precond *M, const SparseVec *svs)
+{
+	init_ic0_pattern(M, svs);
+	double shift = 0.0;
+	for (int attempt = 0; attempt < IC0_MAX_SHIFTS; attempt++) {
+		if (ic0_factor(M, shift))
+			return;
+		shift = shift == 0.0 ? 1e-3 : 2.0 * shift;
+	}
+	error("the incomplete Cholesky factorization of the matrix failed "
+	      "(is the matrix positive definite?)\n  Try the Jacobi "
+	      "preconditioner instead.");
+}
+
+static Precond init_precond(enum precond_type_t type,
+		const SparseVec *svs, int n)
+{
+	Precond M;
+	memset(&M, 0, sizeof(Precond));
+	M.type = type;
+	M.n = n;
+	if (type == PRECOND_JACOBI) {
+		init_jacobi(&M, svs);
+	} else if (type == PRECOND_IC0) {
+		init_ic0(&M, svs);
+	}
+	return M;
+}
+
+/* Solves 't(U) %*% U %*% z = r'. */
+static void ic0_solve(const Precond *M, double *z)
+{
+	const int *p = M->p, *I = M->i;
+	const double *u = M->x;
+	int n = M->n;
+	/* Solve 't(U) %*% y = r' in place. */
+	for (int j = 0; j < n; j++) {
+		int jdiag = p[j + 1] - 1;
+		double s = z[j];
+		for (int q = p[j]; q < jdiag; q++)
+			s -= u[q] * z[I[q]];
+		z[j] = s / u[jdiag];
+	}
+	/* Solve 'U %*% z = y' in place. */
+	for (int j = n - 1; j >= 0; j--) {
+		int jdiag = p[j + 1] - 1;
+		double zj = z[j] / u[jdiag];
+		z[j] = zj;
+		for (int q = p[j]; q < jdiag; q++)
+			z[I[q]] -= u[q] * zj;
+	}
+	return;
+}
+
+/* Computes 'Z <- M^-1 R' for the first 'ncol' columns of 'R' and 'Z'. */
+static void apply_precond(const Precond *M, const double *R, double *Z,
+		int ncol)
+{
+	int n = M->n;
+	size_t len = (size_t) n * ncol;
+	if (M->type == PRECOND_NONE) {
+		memcpy(Z, R, sizeof(double) * len);
+		return;
+	}
+	if (M->type == PRECOND_JACOBI) {
+		const double *invdiag = M->invdiag;
+		#pragma omp parallel for schedule(static) \
+			if(len >= PAR_MIN_LEN)
+		for (size_t k = 0; k < len; k++)
+			Z[k] = R[k] * invdiag[k % n];
+		return;
+	}
+	/* The triangular solves are sequential so we parallelize across
+	   the right-hand sides. */
+	memcpy(Z, R, sizeof(double) * len);
+	int nthread = _get_max_threads();
+	if (nthread > ncol)
+		nthread = ncol;
+	if (nthread < 1)
+		nthread = 1;
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthread)
+	for (int s = 0; s < ncol; s++)
+		ic0_solve(M, Z + (size_t) s * n);
+	return;
+}
+
+
+/****************************************************************************
+ * Block PCG
+ *
+ * The right-hand sides are solved simultaneously with independent CG
+ * recurrences, but all the active search directions are multiplied by 'a'
+ * at once so the matrix is traversed only once per iteration. Each
+ * right-hand side occupies a "slot" (a column in the work matrices). When
+ * a right-hand side converges, its solution is written to the output and
+ * the last active slot is moved into its place, so the active search
+ * directions always form a contiguous block.
+ */
+
+enum cg_status_t { CG_CONVERGED, CG_MAXIT, CG_BREAKDOWN };
+
+typedef struct cg_work_t {
+	int n;
+	double *X, *R, *Z, *P, *AP;
+	double *rz, *target;
+	int *rhs;  /* slot -> right-hand side */
+} CGWork;
+
+static void move_slot(CGWork *w, int from, int to)
+{
+	size_t n = w->n;
+	memcpy(w->X + to * n, w->X + from * n, sizeof(double) * n);
+	memcpy(w->R + to * n, w->R + from * n, sizeof(double) * n);
+	memcpy(w->P + to * n, w->P + from * n, sizeof(double) * n);
+	w->rz[to] = w->rz[from];
+	w->target[to] = w->target[from];
+	w->rhs[to] = w->rhs[from];
+	return;
+}
+
+/* Writes the solution in slot 's' to the output and releases the slot.
+   Returns the new number of active slots. */
+static int retire_slot(CGWork *w, int s, int nact, double rnorm2,
+		double bnorm, int iter, int status,
+		double *out_x, int *out_iter, int *out_status, double *out_relres)
+{
+	int j = w->rhs[s];
+	memcpy(out_x + (size_t) j * w->n, w->X + (size_t) s * w->n,
+	       sizeof(double) * w->n);
+	out_iter[j] = iter;
+	out_status[j] = status;
+	out_relres[j] = bnorm == 0.0 ? 0.0 : sqrt(rnorm2) / bnorm;
+	nact--;
+	if (s != nact)
+		move_slot(w, nact, s);
+	return nact;
+}
+
+static void block_pcg(const SparseVec *svs, int n,
+		const double *B, const double *X0, int m,
+		double tol, int maxit, const Precond *M,
+		double *out_x, int *out_iter, int *out_status, double *out_relres)
+{
+	CGWork w;
+	size_t len = (size_t) n * m;
+	w.n = n;
+	w.X = (double *) R_alloc(len, sizeof(double));
+	w.R = (double *) R_alloc(len, sizeof(double));
+	w.Z = (double *) R_alloc(len, sizeof(double));
+	w.P = (double *) R_alloc(len, sizeof(double));
+	w.AP = (double *) R_alloc(len, sizeof(double));
+	w.rz = (double *) R_alloc(m, sizeof(double));
+	w.target = (double *) R_alloc(m, sizeof(double));
+	w.rhs = (int *) R_alloc(m, sizeof(int));
+	double *bnorm = (double *) R_alloc(m, sizeof(double));
+
+	/* R <- B - A X0 */
+	memcpy(w.R, B, sizeof(double) * len);
+	if (X0 != NULL) {
+		memcpy(w.X, X0, sizeof(double) * len);
+		_SpMM_SVT_double(svs, n, n, NULL, 0, NULL, w.X, m, w.AP);
+		#pragma omp parallel for schedule(static) if(len >= PAR_MIN_LEN)
+		for (size_t k = 0; k < len; k++)
+			w.R[k] -= w.AP[k];
+	} else {
+		memset(w.X, 0, sizeof(double) * len);
+	}
+
+	/* Retire the right-hand sides that are already solved. The solution
+	   for a zero right-hand side is zero, whatever 'X0' is. */
+	int nact = m;
+	for (int j = 0; j < m; j++) {
+		bnorm[j] = sqrt(dot(B + (size_t) j * n, B + (size_t) j * n, n));
+		w.target[j] = tol * bnorm[j];
+		w.rhs[j] = j;
+	}
+	for (int s = 0; s < nact; ) {
+		double *r = w.R + (size_t) s * n;
+		if (bnorm[w.rhs[s]] == 0.0) {
+			memset(w.X + (size_t) s * n, 0, sizeof(double) * n);
+			memset(r, 0, sizeof(double) * n);
+		}
+		double rnorm2 = dot(r, r, n);
+		if (sqrt(rnorm2) <= w.target[s]) {
+			nact = retire_slot(&w, s, nact, rnorm2,
+					   bnorm[w.rhs[s]], 0, CG_CONVERGED,
+					   out_x, out_iter, out_status,
+					   out_relres);
+			continue;
+		}
+		s++;
+	}
+
+	/* Z <- M^-1 R, P <- Z */
+	apply_precond(M, w.R, w.Z, nact);
+	memcpy(w.P, w.Z, sizeof(double) * n * nact);
+	for (int s = 0; s < nact; s++) {
+		size_t off = (size_t) s * n;
+		w.rz[s] = dot(w.R + off, w.Z + off, n);
+	}
+
+	/* 'done[s]' is set to the status of the slots that finish at the
+	   current iteration, or -1. */
+	int *done = (int *) R_alloc(m, sizeof(int));
+	double *rnorm2 = (double *) R_alloc(m, sizeof(double));
+	for (int iter = 1; nact != 0; iter++) {
+		/* AP <- A P. We compute 't(A) %*% P' because the gather kernel
+		   parallelizes without needing per-thread accumulators, and
+		   'A' is symmetric. */
+		_SpMM_SVT_double(svs, n, n, NULL, 0, NULL, w.P, nact, w.AP);
+		int nact0 = nact;
+		for (int s = 0; s < nact0; s++) {
+			size_t off = (size_t) s * n;
+			double pAp = dot(w.P + off, w.AP + off, n);
+			done[s] = -1;
+			if (!(pAp > 0.0) || !R_FINITE(pAp)) {
+				rnorm2[s] = dot(w.R + off, w.R + off, n);
+				done[s] = CG_BREAKDOWN;
+				continue;
+			}
+			double alpha = w.rz[s] / pAp;
+			rnorm2[s] = update_x_and_r(w.X + off, w.R + off,
+						   w.P + off, w.AP + off,
+						   alpha, n);
+			if (sqrt(rnorm2[s]) <= w.target[s])
+				done[s] = CG_CONVERGED;
+			else if (iter >= maxit)
+				done[s] = CG_MAXIT;
+		}
+		/* Retire the finished slots, starting from the end so that the
+		   slots that get moved have already been examined. */
+		for (int s = nact0 - 1; s >= 0; s--) {
+			if (done[s] < 0)
+				continue;
+			int last = nact - 1;
+			nact = retire_slot(&w, s, nact, rnorm2[s],
+					   bnorm[w.rhs[s]], iter, done[s],
+					   out_x, out_iter, out_status,
+					   out_relres);
+			if (s != last)
+				rnorm2[s] = rnorm2[last];
+		}
+		if (nact == 0)
+			break;
+		apply_precond(M, w.R, w.Z, nact);
+		for (int s = 0; s < nact; s++) {
+			size_t off = (size_t) s * n;
+			double rz = dot(w.R + off, w.Z + off, n);
+			double beta = rz / w.rz[s];
+			w.rz[s] = rz;
+			update_p(w.P + off, w.Z + off, beta, n);
+		}
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * .Call entry point
+ */
+
+static enum precond_type_t get_precond_type(SEXP precond)
+{
+	if (!IS_CHARACTER(precond) || LENGTH(precond) != 1)
+		error("SparseArray internal error in get_precond_type():\n"
+		      "    'precond' must be a single string");
+	const char *s = CHAR(STRING_ELT(precond, 0));
+	if (strcmp(s, "none") == 0)
+		return PRECOND_NONE;
+	if (strcmp(s, "jacobi") == 0)
+		return PRECOND_JACOBI;
+	if (strcmp(s, "ic") == 0)
+		return PRECOND_IC0;
+	error("SparseArray internal error in get_precond_type():\n"
+	      "    invalid 'precond' value: \"%s\"", s);
+	return PRECOND_NONE;  /* will never reach this */
+}
+
+static void check_finite_SVs(const SparseVec *svs, int ncol)
+{
+	for (int j = 0; j < ncol; j++) {
+		const double *nzvals = get_doubleSV_nzvals_p(svs + j);
+		if (nzvals == NULL)  /* lacunar leaf */
+			continue;
+		int nzcount = get_SV_nzcount(svs + j);
+		for (int k = 0; k < nzcount; k++)
+			if (!R_FINITE(nzvals[k]))
+				error("the matrix contains NA, NaN, Inf, "
+				      "or -Inf values");
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+   Solves 'a %*% x = b' with the preconditioned conjugate gradient method.
+   'a' must be a symmetric positive-definite square SVT_SparseMatrix of
+   type "double", 'b' a double matrix, and 'x0' NULL or a double matrix with
+   the same dimensions as 'b'. Returns an unnamed list of length 4 with the
+   solution matrix, the nb of iterations, the exit status (0: converged,
+   1: maximum nb of iterations reached, 2: breakdown), and the relative
+   residual norm, for each column of 'b'. */
+SEXP C_cg_SVT(SEXP a_dim, SEXP a_type, SEXP a_SVT, SEXP b, SEXP x0,
+	      SEXP tol, SEXP maxit, SEXP precond)
+{
+	if (LENGTH(a_dim) != 2 || INTEGER(a_dim)[0] != INTEGER(a_dim)[1])
+		error("'a' must be a square matrix");
+	int n = INTEGER(a_dim)[0];
+	if (_get_Rtype_from_Rstring(a_type) != REALSXP)
+		error("SparseArray internal error in C_cg_SVT():\n"
+		      "    'a_type' must be \"double\"");
+	SEXP b_dim = GET_DIM(b);
+	if (!IS_NUMERIC(b) || b_dim == R_NilValue || LENGTH(b_dim) != 2 ||
+	    INTEGER(b_dim)[0] != n)
+		error("SparseArray internal error in C_cg_SVT():\n"
+		      "    'b' must be a double matrix with nrow(a) rows");
+	int m = INTEGER(b_dim)[1];
+	if (x0 != R_NilValue && (!IS_NUMERIC(x0) || XLENGTH(x0) != XLENGTH(b)))
+		error("SparseArray internal error in C_cg_SVT():\n"
+		      "    'x0' must be NULL or a double matrix with the "
+		      "same dimensions as 'b'");
+	double tol0 = REAL(tol)[0];
+	int maxit0 = INTEGER(maxit)[0];
+	enum precond_type_t precond_type = get_precond_type(precond);
+
+	const SparseVec *svs = _SVT2SVs(a_SVT, REALSXP, n, n);
+	check_finite_SVs(svs, n);
+	Precond M = init_precond(precond_type, svs, n);
+
+	SEXP ans = PROTECT(NEW_LIST(4));
+	SEXP ans_x = PROTECT(allocMatrix(REALSXP, n, m));
+	SET_VECTOR_ELT(ans, 0, ans_x);
+	UNPROTECT(1);
+	SEXP ans_iter = PROTECT(NEW_INTEGER(m));
+	SET_VECTOR_ELT(ans, 1, ans_iter);
+	UNPROTECT(1);
+	SEXP ans_status = PROTECT(NEW_INTEGER(m));
+	SET_VECTOR_ELT(ans, 2, ans_status);
+	UNPROTECT(1);
+	SEXP ans_relres = PROTECT(NEW_NUMERIC(m));
+	SET_VECTOR_ELT(ans, 3, ans_relres);
+	UNPROTECT(1);
+	if (n != 0 && m != 0)
+		block_pcg(svs, n, REAL(b),
+			  x0 == R_NilValue ? NULL : REAL(x0), m,
+			  tol0, maxit0, &M,
+			  REAL(ans_x), INTEGER(ans_iter),
+			  INTEGER(ans_status), REAL(ans_relres));
+	else {
+		for (int j = 0; j < m; j++) {
+			INTEGER(ans_iter)[j] = 0;
+			INTEGER(ans_status)[j] = CG_CONVERGED;
+			REAL(ans_relres)[j] = 0.0;
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
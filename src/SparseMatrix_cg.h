@@ -0,0 +1,17 @@
+#ifndef _SPARSEMATRIX_CG_H_
+#define _SPARSEMATRIX_CG_H_
+
+#include <Rdefines.h>
+
+SEXP C_cg_SVT(
+	SEXP a_dim,
+	SEXP a_type,
+	SEXP a_SVT,
+	SEXP b,
+	SEXP x0,
+	SEXP tol,
+	SEXP maxit,
+	SEXP precond
+);
+
+#endif  /* _SPARSEMATRIX_CG_H_ */
@@ -0,0 +1,759 @@
+/****************************************************************************
+ ****************************************************************************
+ **									   **
+ **         Sparse Cholesky factorization of SparseMatrix objects          **
+ **									   **
+ **           This is the workhorse behind chol() and solve() for          **
+ **        symmetric positive-definite SVT_SparseMatrix objects            **
+ **									   **
+ ****************************************************************************
+ ****************************************************************************/
+#include "SparseMatrix_chol.h"
+
+#include "Rvector_utils.h"
+#include "SparseVec.h"
+#include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads() */
+
+#include <stdlib.h>  /* for malloc(), realloc(), free(), qsort() */
+#include <string.h>  /* for memcpy() */
+#include <limits.h>  /* for INT_MAX */
+#include <math.h>    /* for sqrt() */
+
+
+/* Compressed sparse column (CSC) matrix. All the arrays are allocated with
+   R_alloc(). */
+typedef struct csc_t {
+	int n;      /* nb of columns */
+	int *p;     /* column pointers (length 'n + 1') */
+	int *i;     /* row indices (length 'p[n]') */
+	double *x;  /* values (length 'p[n]') */
+} CSC;
+
+static void check_square_dim(SEXP x_dim)
+{
+	if (LENGTH(x_dim) != 2)
+		error("'x' must have 2 dimensions");
+	if (INTEGER(x_dim)[0] != INTEGER(x_dim)[1])
+		error("'x' must be a square matrix");
+	return;
+}
+
+static SEXPTYPE get_and_check_chol_Rtype(SEXP x_type)
+{
+	SEXPTYPE Rtype = _get_Rtype_from_Rstring(x_type);
+	if (Rtype != REALSXP && Rtype != INTSXP)
+		error("SparseArray internal error in "
+		      "get_and_check_chol_Rtype():\n"
+		      "    'x_type' must be \"double\" or \"integer\"");
+	return Rtype;
+}
+
+static inline double get_checked_nzval(const SparseVec *sv, int k)
+{
+	double v;
+	if (sv->Rtype == REALSXP) {
+		v = get_doubleSV_nzval(sv, k);
+		if (!R_FINITE(v))
+			error("the matrix contains NA, NaN, Inf, or -Inf values");
+	} else {
+		int iv = get_intSV_nzval(sv, k);
+		if (iv == NA_INTEGER)
+			error("the matrix contains NA values");
+		v = (double) iv;
+	}
+	return v;
+}
+
+static void cumsum_counts(const int *counts, int n, int *p)
+{
+	size_t nz = 0;
+	for (int j = 0; j < n; j++) {
+		p[j] = (int) nz;
+		nz += counts[j];
+		if (nz > INT_MAX)
+			error("the Cholesky factor is too big "
+			      "(more than INT_MAX nonzero values)");
+	}
+	p[n] = (int) nz;
+	return;
+}
+
+
+/****************************************************************************
+ * Minimum degree ordering
+ *
+ * Fill-reducing ordering of the rows and columns of a symmetric matrix.
+ * The nodes of the graph of 'x + t(x)' are eliminated one at a time, always
+ * picking a node of minimum degree in the current elimination graph (ties
+ * are broken in favor of the node with the smallest index). Eliminating a
+ * node turns its neighbors into a clique. The elimination graph is stored
+ * explicitly so the amount of work is of the order of the number of
+ * floating point operations needed by the factorization itself.
+ */
+
+typedef struct node_set_t {
+	int *nodes;  /* sorted */
+	int n;
+	int cap;
+} NodeSet;
+
+typedef struct heap_item_t {
+	int deg;
+	int node;
+} HeapItem;
+
+typedef struct min_heap_t {
+	HeapItem *items;
+	size_t n;
+	size_t cap;
+} MinHeap;
+
+static inline int heap_item_less(const HeapItem *a, const HeapItem *b)
+{
+	return a->deg < b->deg || (a->deg == b->deg && a->node < b->node);
+}
+
+/* Returns 0 if memory allocation failed. */
+static int heap_push(MinHeap *heap, int deg, int node)
+{
+	if (heap->n == heap->cap) {
+		size_t new_cap = heap->cap == 0 ? 1024 : 2 * heap->cap;
+		HeapItem *new_items = (HeapItem *)
+			realloc(heap->items, sizeof(HeapItem) * new_cap);
+		if (new_items == NULL)
+			return 0;
+		heap->items = new_items;
+		heap->cap = new_cap;
+	}
+	HeapItem item = { deg, node };
+	size_t k = heap->n++;
+	while (k > 0) {
+		size_t parent = (k - 1) / 2;
+		if (!heap_item_less(&item, heap->items + parent))
+			break;
+		heap->items[k] = heap->items[parent];
+		k = parent;
+	}
+	heap->items[k] = item;
+	return 1;
+}
+
+static HeapItem heap_pop(MinHeap *heap)
+{
+	HeapItem top = heap->items[0];
+	HeapItem last = heap->items[--heap->n];
+	size_t k = 0;
+	for (;;) {
+		size_t child = 2 * k + 1;
+		if (child >= heap->n)
+			break;
+		if (child + 1 < heap->n &&
+		    heap_item_less(heap->items + child + 1,
+				   heap->items + child))
+			child++;
+		if (!heap_item_less(heap->items + child, &last))
+			break;
+		heap->items[k] = heap->items[child];
+		k = child;
+	}
+	if (heap->n != 0)
+		heap->items[k] = last;
+	return top;
+}
+
+/* Replaces the neighbors of 'u' with their union with 'clique', minus
+   nodes 'u' and 'v'. 'buf' must have room for all the nodes in the graph.
+   Returns 0 if memory allocation failed. */
+static int merge_clique(NodeSet *set, const int *clique, int clique_len,
+		int u, int v, int *buf)
+{
+	int n = 0, k1 = 0, k2 = 0;
+	while (k1 < set->n || k2 < clique_len) {
+		int node;
+		if (k2 >= clique_len ||
+		    (k1 < set->n && set->nodes[k1] < clique[k2])) {
+			node = set->nodes[k1++];
+		} else if (k1 >= set->n || clique[k2] < set->nodes[k1]) {
+			node = clique[k2++];
+		} else {
+			node = set->nodes[k1++];
+			k2++;
+		}
+		if (node != u && node != v)
+			buf[n++] = node;
+	}
+	if (n > set->cap) {
+		int new_cap = n > 2 * set->cap ? n : 2 * set->cap;
+		int *new_nodes = (int *)
+			realloc(set->nodes, sizeof(int) * new_cap);
+		if (new_nodes == NULL)
+			return 0;
+		set->nodes = new_nodes;
+		set->cap = new_cap;
+	}
+	memcpy(set->nodes, buf, sizeof(int) * n);
+	set->n = n;
+	return 1;
+}
+
+static int compar_ints(const void *p1, const void *p2)
+{
+	int i1 = *((const int *) p1), i2 = *((const int *) p2);
+	return (i1 > i2) - (i1 < i2);
+}
+
+/* Builds the adjacency lists of the graph of 'x + t(x)' (diagonal
+   excluded). The neighbors of node j are 'adj_i[adj_p[j]]' to
+   'adj_i[adj_p[j + 1] - 1]', sorted and with no duplicates. */
+static void build_sym_graph(SEXP SVT, int n, int **adj_p, int **adj_i)
+{
+	int *counts = (int *) R_alloc(n, sizeof(int));
+	memset(counts, 0, sizeof(int) * n);
+	for (int j = 0; j < n && SVT != R_NilValue; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SEXP nzvals, nzoffs;
+		int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
+		const int *offs = INTEGER(nzoffs);
+		for (int k = 0; k < nzcount; k++) {
+			int i = offs[k];
+			if (i == j)
+				continue;
+			counts[i]++;
+			counts[j]++;
+		}
+	}
+	int *p = (int *) R_alloc((size_t) n + 1, sizeof(int));
+	cumsum_counts(counts, n, p);
+	int *adj = (int *) R_alloc(p[n], sizeof(int));
+	memcpy(counts, p, sizeof(int) * n);  /* next free slot in each list */
+	for (int j = 0; j < n && SVT != R_NilValue; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SEXP nzvals, nzoffs;
+		int nzcount = unzip_leaf(leaf, &nzvals, &nzoffs);
+		const int *offs = INTEGER(nzoffs);
+		for (int k = 0; k < nzcount; k++) {
+			int i = offs[k];
+			if (i == j)
+				continue;
+			adj[counts[i]++] = j;
+			adj[counts[j]++] = i;
+		}
+	}
+	/* Sort each list and remove duplicates (in place). */
+	int nz = 0;
+	for (int j = 0; j < n; j++) {
+		int start = p[j], end = p[j + 1];
+		qsort(adj + start, end - start, sizeof(int), compar_ints);
+		p[j] = nz;
+		for (int q = start; q < end; q++) {
+			if (q > start && adj[q] == adj[q - 1])
+				continue;
+			adj[nz++] = adj[q];
+		}
+	}
+	p[n] = nz;
+	*adj_p = p;
+	*adj_i = adj;
+	return;
+}
+
+static void free_NodeSets(NodeSet *sets, int n)
+{
+	for (int j = 0; j < n; j++)
+		free(sets[j].nodes);
+	free(sets);
+	return;
+}
+
+/* Returns a 0-based permutation in 'perm'. */
+static void mindeg_order(SEXP SVT, int n, int *perm)
+{
+	int *adj_p, *adj_i;
+	build_sym_graph(SVT, n, &adj_p, &adj_i);
+	int *buf = (int *) R_alloc(n, sizeof(int));
+	char *eliminated = S_alloc(n, sizeof(char));  /* zero-initialized */
+
+	NodeSet *sets = (NodeSet *) calloc(n, sizeof(NodeSet));
+	MinHeap heap = { NULL, 0, 0 };
+	int ok = sets != NULL;
+	for (int j = 0; ok && j < n; j++) {
+		int deg = adj_p[j + 1] - adj_p[j];
+		sets[j].nodes = (int *) malloc(sizeof(int) * (deg + 1));
+		if (sets[j].nodes == NULL) {
+			ok = 0;
+			break;
+		}
+		memcpy(sets[j].nodes, adj_i + adj_p[j], sizeof(int) * deg);
+		sets[j].n = deg;
+		sets[j].cap = deg + 1;
+		ok = heap_push(&heap, deg, j);
+	}
+	for (int step = 0; ok && step < n; step++) {
+		/* Skip stale heap items. */
+		HeapItem item;
+		do {
+			item = heap_pop(&heap);
+		} while (eliminated[item.node] ||
+			 item.deg != sets[item.node].n);
+		int v = item.node;
+		perm[step] = v;
+		eliminated[v] = 1;
+		const NodeSet *clique = sets + v;
+		for (int k = 0; ok && k < clique->n; k++) {
+			int u = clique->nodes[k];
+			ok = merge_clique(sets + u, clique->nodes, clique->n,
+					  u, v, buf) &&
+			     heap_push(&heap, sets[u].n, u);
+		}
+		free(sets[v].nodes);
+		sets[v].nodes = NULL;
+		sets[v].n = 0;
+	}
+	free(heap.items);
+	if (sets != NULL)
+		free_NodeSets(sets, n);
+	if (!ok)
+		error("SparseArray internal error in mindeg_order():\n"
+		      "    memory allocation failed");
+	return;
+}
+
+
+/****************************************************************************
+ * Up-looking sparse Cholesky factorization
+ *
+ * Row k of the lower triangular factor 'L' is obtained by solving the
+ * sparse triangular system 'L[0:k, 0:k] %*% t(L[k, 0:k]) = A[0:k, k]'.
+ * The nonzero pattern of 'L[k, ]' is the set of nodes reachable from the
+ * nonzero rows of 'A[0:k, k]' in the elimination tree (see ereach() below).
+ * A symbolic pass computes the column counts of 'L' so the factor can be
+ * allocated upfront, then a numeric pass fills it. Only the upper triangle
+ * of the input matrix is used (like base::chol() does).
+ * See Davis (2006), "Direct Methods for Sparse Linear Systems", SIAM.
+ */
+
+/* Returns the upper triangle of 'A[perm, perm]' as a CSC matrix. 'pinv'
+   must be the inverse of 'perm', or NULL for the identity permutation. */
+static CSC permuted_upper_CSC(SEXP SVT, SEXPTYPE Rtype, int n,
+		const int *pinv)
+{
+	CSC C;
+	C.n = n;
+	int *counts = (int *) R_alloc(n, sizeof(int));
+	memset(counts, 0, sizeof(int) * n);
+	for (int j = 0; j < n && SVT != R_NilValue; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SparseVec sv = leaf2SV(leaf, Rtype, n);
+		int pj = pinv == NULL ? j : pinv[j];
+		for (int k = 0; k < sv.nzcount; k++) {
+			int i = sv.nzoffs[k];
+			if (i > j)
+				break;
+			int pi = pinv == NULL ? i : pinv[i];
+			counts[pi > pj ? pi : pj]++;
+		}
+	}
+	C.p = (int *) R_alloc((size_t) n + 1, sizeof(int));
+	cumsum_counts(counts, n, C.p);
+	C.i = (int *) R_alloc(C.p[n], sizeof(int));
+	C.x = (double *) R_alloc(C.p[n], sizeof(double));
+	memcpy(counts, C.p, sizeof(int) * n);
+	for (int j = 0; j < n && SVT != R_NilValue; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SparseVec sv = leaf2SV(leaf, Rtype, n);
+		int pj = pinv == NULL ? j : pinv[j];
+		for (int k = 0; k < sv.nzcount; k++) {
+			int i = sv.nzoffs[k];
+			if (i > j)
+				break;
+			int pi = pinv == NULL ? i : pinv[i];
+			int q = counts[pi > pj ? pi : pj]++;
+			C.i[q] = pi < pj ? pi : pj;
+			C.x[q] = get_checked_nzval(&sv, k);
+		}
+	}
+	return C;
+}
+
+/* Elimination tree of the symmetric matrix whose upper triangle is 'C'.
+   Root nodes have a parent of -1. */
+static int *etree(const CSC *C)
+{
+	int n = C->n;
+	int *parent = (int *) R_alloc(n, sizeof(int));
+	int *ancestor = (int *) R_alloc(n, sizeof(int));
+	for (int k = 0; k < n; k++) {
+		parent[k] = ancestor[k] = -1;
+		for (int q = C->p[k]; q < C->p[k + 1]; q++) {
+			int i = C->i[q];
+			while (i != -1 && i < k) {
+				int inext = ancestor[i];
+				ancestor[i] = k;
+				if (inext == -1)
+					parent[i] = k;
+				i = inext;
+			}
+		}
+	}
+	return parent;
+}
+
+/* Stores the nonzero pattern of 'L[k, 0:(k-1)]' in 's[top:(n-1)]' in
+   topological order and returns 'top'. 'marks' must be all zeros on entry
+   and is left all zeros on exit. */
+static int ereach(const CSC *C, int k, const int *parent, int *s,
+		char *marks)
+{
+	int n = C->n, top = n;
+	marks[k] = 1;
+	for (int q = C->p[k]; q < C->p[k + 1]; q++) {
+		int i = C->i[q], len = 0;
+		for ( ; !marks[i]; i = parent[i]) {
+			s[len++] = i;
+			marks[i] = 1;
+		}
+		while (len > 0)
+			s[--top] = s[--len];
+	}
+	for (int q = top; q < n; q++)
+		marks[s[q]] = 0;
+	marks[k] = 0;
+	return top;
+}
+
+/* Returns the lower triangular factor 'L' as a CSC matrix where the first
+   element in each column is the diagonal element. */
+static CSC up_looking_chol(const CSC *C)
+{
+	int n = C->n;
+	const int *parent = etree(C);
+	int *s = (int *) R_alloc(n, sizeof(int));
+	char *marks = S_alloc(n, sizeof(char));  /* zero-initialized */
+
+	/* Symbolic pass: column counts of 'L'. */
+	int *next = (int *) R_alloc(n, sizeof(int));
+	for (int k = 0; k < n; k++)
+		next[k] = 1;  /* diagonal */
+	for (int k = 0; k < n; k++) {
+		int top = ereach(C, k, parent, s, marks);
+		for (int q = top; q < n; q++)
+			next[s[q]]++;
+	}
+	CSC L;
+	L.n = n;
+	L.p = (int *) R_alloc((size_t) n + 1, sizeof(int));
+	cumsum_counts(next, n, L.p);
+	L.i = (int *) R_alloc(L.p[n], sizeof(int));
+	L.x = (double *) R_alloc(L.p[n], sizeof(double));
+	memcpy(next, L.p, sizeof(int) * n);
+
+	/* Numeric pass. */
+	double *x = (double *) R_alloc(n, sizeof(double));
+	memset(x, 0, sizeof(double) * n);
+	for (int k = 0; k < n; k++) {
+		int top = ereach(C, k, parent, s, marks);
+		for (int q = C->p[k]; q < C->p[k + 1]; q++)
+			x[C->i[q]] += C->x[q];
+		double d = x[k];
+		x[k] = 0.0;
+		for ( ; top < n; top++) {
+			int i = s[top];
+			double lki = x[i] / L.x[L.p[i]];
+			x[i] = 0.0;
+			for (int q = L.p[i] + 1; q < next[i]; q++)
+				x[L.i[q]] -= L.x[q] * lki;
+			d -= lki * lki;
+			int q = next[i]++;
+			L.i[q] = k;
+			L.x[q] = lki;
+		}
+		if (d <= 0.0)
+			error("the leading minor of order %d is not "
+			      "positive", k + 1);
+		int q = next[k]++;
+		L.i[q] = k;
+		L.x[q] = sqrt(d);
+	}
+	return L;
+}
+
+/* Returns the SVT of 't(L)', i.e. column k of the returned SVT is row k
+   of 'L'. Elements of 'L' that are zero (because of numerical
+   cancellation) are dropped. */
+static SEXP tL2SVT(const CSC *L)
+{
+	int n = L->n;
+	if (n == 0)
+		return R_NilValue;
+	int *counts = (int *) R_alloc(n, sizeof(int));
+	memset(counts, 0, sizeof(int) * n);
+	for (int q = 0; q < L->p[n]; q++)
+		if (L->x[q] != 0.0)
+			counts[L->i[q]]++;
+	int *p = (int *) R_alloc((size_t) n + 1, sizeof(int));
+	cumsum_counts(counts, n, p);
+	int *offs = (int *) R_alloc(p[n], sizeof(int));
+	double *vals = (double *) R_alloc(p[n], sizeof(double));
+	memcpy(counts, p, sizeof(int) * n);
+	/* Walking on the columns of 'L' in order guarantees that the
+	   offsets in each row are sorted. */
+	for (int j = 0; j < n; j++) {
+		for (int q = L->p[j]; q < L->p[j + 1]; q++) {
+			if (L->x[q] == 0.0)
+				continue;
+			int r = counts[L->i[q]]++;
+			offs[r] = j;
+			vals[r] = L->x[q];
+		}
+	}
+	SEXP ans = PROTECT(NEW_LIST(n));
+	for (int k = 0; k < n; k++) {
+		SEXP leaf = _make_leaf_from_two_arrays(REALSXP,
+					vals + p[k], offs + p[k],
+					p[k + 1] - p[k]);
+		SET_VECTOR_ELT(ans, k, leaf);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Sparse triangular solves
+ *
+ * The triangular matrix is an upper triangular SVT_SparseMatrix 'R' (e.g.
+ * the result of chol()) so its columns are the rows of 't(R)'. Both
+ * 'R %*% x = b' (backward substitution) and 't(R) %*% x = b' (forward
+ * substitution) are solved column-wise, so no transposition is needed.
+ * The right-hand sides are solved in parallel.
+ */
+
+/* Returns the columns of 'R_SVT' as an array of SparseVec structs after
+   checking that 'R' is upper triangular with a nonzero diagonal. */
+static SparseVec *get_triangular_SVs(SEXP R_SVT, SEXPTYPE Rtype, int n)
+{
+	SparseVec *svs = (SparseVec *) R_alloc(n, sizeof(SparseVec));
+	for (int j = 0; j < n; j++) {
+		SEXP leaf = R_SVT == R_NilValue ? R_NilValue
+						: VECTOR_ELT(R_SVT, j);
+		if (leaf == R_NilValue)
+			error("'r' is singular");
+		svs[j] = leaf2SV(leaf, Rtype, n);
+		int last = svs[j].nzcount - 1;
+		if (svs[j].nzoffs[last] > j)
+			error("'r' must be upper triangular");
+		if (svs[j].nzoffs[last] < j ||
+		    get_checked_nzval(svs + j, last) == 0.0)
+			error("'r' is singular");
+		for (int k = 0; k < last; k++)
+			(void) get_checked_nzval(svs + j, k);
+	}
+	return svs;
+}
+
+static inline double get_nzval(const SparseVec *sv, int k)
+{
+	if (sv->Rtype == REALSXP)
+		return get_doubleSV_nzval(sv, k);
+	return (double) get_intSV_nzval(sv, k);
+}
+
+/* Solves 't(R) %*% x = b' in place ('x' contains 'b' on entry). */
+static void forwardsolve_tR(const SparseVec *svs, int n, double *x)
+{
+	for (int j = 0; j < n; j++) {
+		const SparseVec *sv = svs + j;
+		int last = sv->nzcount - 1;
+		double s = x[j];
+		for (int k = 0; k < last; k++)
+			s -= get_nzval(sv, k) * x[sv->nzoffs[k]];
+		x[j] = s / get_nzval(sv, last);
+	}
+	return;
+}
+
+/* Solves 'R %*% x = b' in place ('x' contains 'b' on entry). */
+static void backsolve_R(const SparseVec *svs, int n, double *x)
+{
+	for (int j = n - 1; j >= 0; j--) {
+		const SparseVec *sv = svs + j;
+		int last = sv->nzcount - 1;
+		double xj = x[j] / get_nzval(sv, last);
+		x[j] = xj;
+		for (int k = 0; k < last; k++)
+			x[sv->nzoffs[k]] -= get_nzval(sv, k) * xj;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * Symmetry check
+ */
+
+/* Returns 1 if 'x' is symmetric, and 0 otherwise. The elements of 'x'
+   are compared with '=='. */
+static int SVT_is_symmetric(SEXP SVT, SEXPTYPE Rtype, int n)
+{
+	if (SVT == R_NilValue)
+		return 1;
+	/* Count the nonzero elements in each row. */
+	int *counts = (int *) R_alloc(n, sizeof(int));
+	int *colcounts = (int *) R_alloc(n, sizeof(int));
+	memset(counts, 0, sizeof(int) * n);
+	for (int j = 0; j < n; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		colcounts[j] = 0;
+		if (leaf == R_NilValue)
+			continue;
+		SparseVec sv = leaf2SV(leaf, Rtype, n);
+		colcounts[j] = sv.nzcount;
+		for (int k = 0; k < sv.nzcount; k++)
+			counts[sv.nzoffs[k]]++;
+	}
+	for (int j = 0; j < n; j++)
+		if (counts[j] != colcounts[j])
+			return 0;
+	/* Build the rows of 'x' (i.e. the columns of 't(x)') and compare
+	   them with the columns. */
+	int *p = (int *) R_alloc((size_t) n + 1, sizeof(int));
+	cumsum_counts(counts, n, p);
+	int *offs = (int *) R_alloc(p[n], sizeof(int));
+	double *vals = (double *) R_alloc(p[n], sizeof(double));
+	memcpy(counts, p, sizeof(int) * n);
+	for (int j = 0; j < n; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SparseVec sv = leaf2SV(leaf, Rtype, n);
+		for (int k = 0; k < sv.nzcount; k++) {
+			int r = counts[sv.nzoffs[k]]++;
+			offs[r] = j;
+			vals[r] = get_nzval(&sv, k);
+		}
+	}
+	for (int j = 0; j < n; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SparseVec sv = leaf2SV(leaf, Rtype, n);
+		for (int k = 0; k < sv.nzcount; k++) {
+			int r = p[j] + k;
+			if (offs[r] != sv.nzoffs[k] ||
+			    vals[r] != get_nzval(&sv, k))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+/****************************************************************************
+ * .Call entry points
+ */
+
+/* --- .Call ENTRY POINT ---
+   Returns a 1-based fill-reducing permutation of the rows and columns of
+   square matrix 'x'. */
+SEXP C_mindeg_order_SVT(SEXP x_dim, SEXP x_SVT)
+{
+	check_square_dim(x_dim);
+	int n = INTEGER(x_dim)[0];
+	SEXP ans = PROTECT(NEW_INTEGER(n));
+	int *perm = INTEGER(ans);
+	mindeg_order(x_SVT, n, perm);
+	for (int k = 0; k < n; k++)
+		perm[k]++;
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT ---
+   Returns the SVT of the upper triangular Cholesky factor 'R' of
+   'x[perm, perm]', i.e. 't(R) %*% R' is 'x[perm, perm]'. 'perm' must be
+   NULL or a 1-based permutation. Only the upper triangle of 'x' is used. */
+SEXP C_chol_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT, SEXP perm)
+{
+	check_square_dim(x_dim);
+	int n = INTEGER(x_dim)[0];
+	SEXPTYPE x_Rtype = get_and_check_chol_Rtype(x_type);
+	int *pinv = NULL;
+	if (perm != R_NilValue) {
+		if (!IS_INTEGER(perm) || LENGTH(perm) != n)
+			error("SparseArray internal error in C_chol_SVT():\n"
+			      "    invalid 'perm'");
+		pinv = (int *) R_alloc(n, sizeof(int));
+		for (int k = 0; k < n; k++)
+			pinv[k] = -1;
+		for (int k = 0; k < n; k++) {
+			int i = INTEGER(perm)[k];
+			if (i == NA_INTEGER || i < 1 || i > n ||
+			    pinv[i - 1] != -1)
+				error("SparseArray internal error in "
+				      "C_chol_SVT():\n"
+				      "    'perm' is not a permutation");
+			pinv[i - 1] = k;
+		}
+	}
+	CSC C = permuted_upper_CSC(x_SVT, x_Rtype, n, pinv);
+	CSC L = up_looking_chol(&C);
+	return tL2SVT(&L);
+}
+
+/* --- .Call ENTRY POINT ---
+   Solves 'r %*% x = b' or 't(r) %*% x = b' where 'r' is an upper triangular
+   square SVT_SparseMatrix and 'b' a double matrix. */
+SEXP C_backsolve_SVT(SEXP r_dim, SEXP r_type, SEXP r_SVT, SEXP b,
+		     SEXP transpose)
+{
+	check_square_dim(r_dim);
+	int n = INTEGER(r_dim)[0];
+	SEXPTYPE r_Rtype = get_and_check_chol_Rtype(r_type);
+	SEXP b_dim = GET_DIM(b);
+	if (!IS_NUMERIC(b) || b_dim == R_NilValue || LENGTH(b_dim) != 2 ||
+	    INTEGER(b_dim)[0] != n)
+		error("SparseArray internal error in C_backsolve_SVT():\n"
+		      "    'b' must be a double matrix with nrow(r) rows");
+	int b_ncol = INTEGER(b_dim)[1];
+	int tr = LOGICAL(transpose)[0];
+	const SparseVec *svs = get_triangular_SVs(r_SVT, r_Rtype, n);
+
+	SEXP ans = PROTECT(allocMatrix(REALSXP, n, b_ncol));
+	double *out = REAL(ans);
+	memcpy(out, REAL(b), sizeof(double) * XLENGTH(b));
+	int nthread = _get_max_threads();
+	if (nthread > b_ncol)
+		nthread = b_ncol;
+	if (nthread < 1)
+		nthread = 1;
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthread)
+	for (int j = 0; j < b_ncol; j++) {
+		double *x = out + (size_t) j * n;
+		if (tr) {
+			forwardsolve_tR(svs, n, x);
+		} else {
+			backsolve_R(svs, n, x);
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_is_symmetric_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT)
+{
+	if (LENGTH(x_dim) != 2 || INTEGER(x_dim)[0] != INTEGER(x_dim)[1])
+		return ScalarLogical(0);
+	int n = INTEGER(x_dim)[0];
+	SEXPTYPE x_Rtype = get_and_check_chol_Rtype(x_type);
+	return ScalarLogical(SVT_is_symmetric(x_SVT, x_Rtype, n));
+}
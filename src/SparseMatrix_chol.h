@@ -0,0 +1,32 @@
+#ifndef _SPARSEMATRIX_CHOL_H_
+#define _SPARSEMATRIX_CHOL_H_
+
+#include <Rdefines.h>
+
+SEXP C_mindeg_order_SVT(
+	SEXP x_dim,
+	SEXP x_SVT
+);
+
+SEXP C_chol_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP perm
+);
+
+SEXP C_backsolve_SVT(
+	SEXP r_dim,
+	SEXP r_type,
+	SEXP r_SVT,
+	SEXP b,
+	SEXP transpose
+);
+
+SEXP C_is_symmetric_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT
+);
+
+#endif  /* _SPARSEMATRIX_CHOL_H_ */
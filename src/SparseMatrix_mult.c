@@ -15,8 +15,11 @@
 #include "SparseVec_dotprod.h"
 #include "leaf_utils.h"             /* for leaf2SV() */
 #include "SVT_SparseArray_class.h"  /* for _REC_nzcount_SVT() */
+#include "thread_control.h"         /* for _get_max_threads() */
 
+#include <stdlib.h>  /* for qsort() */
 #include <string.h>  /* for memset() */
+#include <math.h>    /* for log1p(), exp(), log2() */
 
 
 /* TODO: Maybe move this to Rvector_summarization.c */
@@ -35,15 +38,6 @@ static int has_no_NA(const int *x, int x_len)
 	return 1;
 }
 
-static int doubleSV_has_no_NaN_or_Inf(const SparseVec *sv)
-{
-	const double *nzvals_p = get_doubleSV_nzvals_p(sv);
-	if (nzvals_p == NULL)  /* lacunar SparseVec */
-		return 1;
-	/* regular SparseVec */
-	return has_no_NaN_or_Inf(nzvals_p, get_SV_nzcount(sv));
-}
-
 static int intSV_has_no_NA(const SparseVec *sv)
 {
 	const int *nzvals_p = get_intSV_nzvals_p(sv);
@@ -147,6 +141,38 @@ static double dotprod_leaf_doubleSV(SEXP leaf1, const SparseVec *sv2)
 	return _dotprod_doubleSV_doubleSV(&sv1, sv2);
 }
 
+/* Returns the columns of 'SVT' as an array of SparseVec structs.
+   NULL leaves are represented by SparseVec structs with a zero 'nzcount'.
+   This is done upfront so that parallel loops don't need to touch the SVT. */
+SparseVec *_SVT2SVs(SEXP SVT, SEXPTYPE Rtype, int nrow, int ncol)
+{
+	SparseVec *svs = (SparseVec *) R_alloc(ncol, sizeof(SparseVec));
+	for (int j = 0; j < ncol; j++) {
+		SEXP leaf = SVT == R_NilValue ? R_NilValue
+					      : VECTOR_ELT(SVT, j);
+		if (leaf == R_NilValue) {
+			svs[j].Rtype = Rtype;
+			svs[j].nzvals = NULL;
+			svs[j].nzoffs = NULL;
+			svs[j].nzcount = 0;
+			svs[j].len = nrow;
+		} else {
+			svs[j] = leaf2SV(leaf, Rtype, nrow);
+		}
+	}
+	return svs;
+}
+
+/* 'svs' must contain doubles. Returns an array of 'nsv' flags telling
+   whether each SparseVec is finite or not. */
+static int *SVs_finiteness(const SparseVec *svs, int nsv)
+{
+	int *is_finite = (int *) R_alloc(nsv, sizeof(int));
+	for (int j = 0; j < nsv; j++)
+		is_finite[j] = _doubleSV_is_finite(svs + j);
+	return is_finite;
+}
+
 
 /****************************************************************************
  * Core multithreaded routines
@@ -266,64 +292,83 @@ static void compute_dotprods2_with_int_Rcol(SEXP SVT,
 	return;
 }
 
-static void compute_dotprods2_with_Lsv(const SparseVec *sv1, SEXP SVT,
+/* 'sv1' must be finite and 'Lcol' must be its dense form. When 'sv1' is
+   much sparser than a column of 'SVT' that is finite too, galloping over
+   the offsets of the column is cheaper than gathering its nonzero values
+   from 'Lcol'. 'svs' and 'is_finite' are the columns of 'SVT' and their
+   finiteness, computed once by the caller. */
+static void compute_dotprods2_with_finite_Lsv(const SparseVec *sv1,
+		const double *Lcol, const SparseVec *svs, const int *is_finite,
 		double *out, int out_nrow, int out_ncol)
 {
+	double n1 = (double) get_SV_nzcount(sv1);
 	#pragma omp parallel for schedule(static)
 	for (int j = 0; j < out_ncol; j++) {
-		SEXP leaf = VECTOR_ELT(SVT, j);
-		out[j * out_nrow] = dotprod_leaf_doubleSV(leaf, sv1);
+		const SparseVec *sv2 = svs + j;
+		double dp;
+		if (is_finite[j] &&
+		    n1 * GALLOP_MIN_RATIO <= (double) get_SV_nzcount(sv2))
+			dp = _dotprod_finite_doubleSV_doubleSV(sv1, sv2);
+		else
+			dp = _dotprod_doubleSV_finite_doubles(sv2, Lcol);
+		out[j * out_nrow] = dp;
 	}
 	return;
 }
 
-static void compute_dotprods2_with_Rsv(SEXP SVT, const SparseVec *sv2,
+/* Same as compute_dotprods2_with_finite_Lsv() above but with the columns
+   of 'SVT' on the left. */
+static void compute_dotprods2_with_finite_Rsv(const SparseVec *svs,
+		const int *is_finite, const SparseVec *sv2, const double *Rcol,
 		double *out, int out_nrow)
 {
+	double n2 = (double) get_SV_nzcount(sv2);
 	#pragma omp parallel for schedule(static)
 	for (int i = 0; i < out_nrow; i++) {
-		SEXP leaf = VECTOR_ELT(SVT, i);
-		out[i] = dotprod_leaf_doubleSV(leaf, sv2);
+		const SparseVec *sv1 = svs + i;
+		if (is_finite[i] &&
+		    n2 * GALLOP_MIN_RATIO <= (double) get_SV_nzcount(sv1))
+			out[i] = _dotprod_finite_doubleSV_doubleSV(sv1, sv2);
+		else
+			out[i] = _dotprod_doubleSV_finite_doubles(sv1, Rcol);
 	}
 	return;
 }
 
-static void compute_sym_dotprods_with_finite_col(SEXP SVT, int j,
-		const double *col, int col_len, double *out, int out_nrow)
+static void compute_dotprods2_with_Lsv(const SparseVec *sv1, SEXP SVT,
+		double *out, int out_nrow, int out_ncol)
 {
 	#pragma omp parallel for schedule(static)
-	for (int k = out_nrow - 1 - j; k >= 1; k--) {
-		SEXP leaf = VECTOR_ELT(SVT, j + k);
-		out[k] = out[k * out_nrow] =
-			dotprod_leaf_finite_doubles(leaf, col, col_len);
+	for (int j = 0; j < out_ncol; j++) {
+		SEXP leaf = VECTOR_ELT(SVT, j);
+		out[j * out_nrow] = dotprod_leaf_doubleSV(leaf, sv1);
 	}
 	return;
 }
 
-static void compute_sym_dotprods_with_noNA_int_col(SEXP SVT, int j,
-		const int *col, int col_len, double *out, int out_nrow)
+static void compute_dotprods2_with_Rsv(SEXP SVT, const SparseVec *sv2,
+		double *out, int out_nrow)
 {
 	#pragma omp parallel for schedule(static)
-	for (int k = out_nrow - 1 - j; k >= 1; k--) {
-		SEXP leaf = VECTOR_ELT(SVT, j + k);
-		out[k] = out[k * out_nrow] =
-			dotprod_leaf_noNA_ints(leaf, col, col_len);
+	for (int i = 0; i < out_nrow; i++) {
+		SEXP leaf = VECTOR_ELT(SVT, i);
+		out[i] = dotprod_leaf_doubleSV(leaf, sv2);
 	}
 	return;
 }
 
-static void compute_sym_dotprods_with_doubleSV(SEXP SVT, int j,
-		const SparseVec *sv2, double *out, int out_nrow)
+static void compute_sym_dotprods_with_noNA_int_col(SEXP SVT, int j,
+		const int *col, int col_len, double *out, int out_nrow)
 {
 	#pragma omp parallel for schedule(static)
 	for (int k = out_nrow - 1 - j; k >= 1; k--) {
 		SEXP leaf = VECTOR_ELT(SVT, j + k);
-		out[k] = out[k * out_nrow] = dotprod_leaf_doubleSV(leaf, sv2);
+		out[k] = out[k * out_nrow] =
+			dotprod_leaf_noNA_ints(leaf, col, col_len);
 	}
 	return;
 }
 
-
 /****************************************************************************
  * Workhorses behind C_crossprod2_SVT_mat() and C_crossprod2_mat_SVT()
  */
@@ -408,6 +453,82 @@ static void crossprod2_doublemat_doubleSV(
 	return;
 }
 
+/* crossprod2_SVT_mat_double() and crossprod2_mat_SVT_double() below don't
+   compute the dot products one dense column at a time, because that means
+   re-reading the offsets and values of each leaf once per dense column.
+   Instead, they process the dense columns by blocks of TILE_NCOL. Each block
+   is first packed into a "panel" where the TILE_NCOL values of a given row
+   are contiguous in memory. Then each nonzero value in a leaf triggers a
+   single contiguous load of TILE_NCOL doubles (instead of TILE_NCOL gathers)
+   that gets multiplied and accumulated into TILE_NCOL accumulators. With a
+   fixed TILE_NCOL, the compiler keeps the accumulators in SIMD registers and
+   vectorizes the inner loop. */
+#define TILE_NCOL 8
+
+/* Packs 'ncol' (<= TILE_NCOL) columns of a dense matrix into 'panel'.
+   Element (i, b) of the block is at 'mat[i * rstride + b * cstride]'.
+   The unused columns of the panel are set to zeros.
+   Returns 0 if the block contains NA, NaN, Inf, or -Inf, and 1 otherwise. */
+static int pack_panel(const double *mat, size_t rstride, size_t cstride,
+		int nrow, int ncol, double *panel)
+{
+	int is_finite = 1;
+	for (int i = 0; i < nrow; i++, mat += rstride, panel += TILE_NCOL) {
+		const double *m = mat;
+		int b;
+		for (b = 0; b < ncol; b++, m += cstride) {
+			double v = *m;
+			if (!R_FINITE(v))
+				is_finite = 0;
+			panel[b] = v;
+		}
+		for ( ; b < TILE_NCOL; b++)
+			panel[b] = 0.0;
+	}
+	return is_finite;
+}
+
+static void unpack_panel_col(const double *panel, int nrow, int b,
+		double *out)
+{
+	panel += b;
+	for (int i = 0; i < nrow; i++, panel += TILE_NCOL)
+		out[i] = *panel;
+	return;
+}
+
+/* Computes the dot products of 'sv' with the TILE_NCOL columns in 'panel'.
+   'panel' is assumed to contain only finite values. */
+static inline void tiled_dotprods_doubleSV_panel(const SparseVec *sv,
+		const double *panel, double *out)
+{
+	double acc[TILE_NCOL];
+	for (int b = 0; b < TILE_NCOL; b++)
+		acc[b] = 0.0;
+	const double *nzvals_p = get_doubleSV_nzvals_p(sv);
+	const int *nzoffs_p = sv->nzoffs;
+	int nzcount = get_SV_nzcount(sv);
+	if (nzvals_p == NULL) {
+		/* lacunar SparseVec */
+		for (int k = 0; k < nzcount; k++) {
+			const double *p = panel + (size_t) nzoffs_p[k] * TILE_NCOL;
+			for (int b = 0; b < TILE_NCOL; b++)
+				acc[b] += p[b];
+		}
+	} else {
+		/* regular SparseVec */
+		for (int k = 0; k < nzcount; k++) {
+			double v = nzvals_p[k];
+			const double *p = panel + (size_t) nzoffs_p[k] * TILE_NCOL;
+			for (int b = 0; b < TILE_NCOL; b++)
+				acc[b] += v * p[b];
+		}
+	}
+	for (int b = 0; b < TILE_NCOL; b++)
+		out[b] = acc[b];
+	return;
+}
+
 /* Cross-product between 'SVT1' (on the left) and a dense matrix of doubles
    (on the right). 'SVT1' must contain leaves of type "double". */
 static void crossprod2_SVT_mat_double(SEXP SVT1, const double *mat2,
@@ -416,43 +537,42 @@ static void crossprod2_SVT_mat_double(SEXP SVT1, const double *mat2,
 {
 	if (SVT1 == R_NilValue)
 		return;
-	/* Outer loop: walk on SVT1.
-	   Inner loop: walk on the columns of 'mat2'.
-	   Does NOT support 'tr_mat2' != 0. */
-/*
-	for (int i = 0; i < out_nrow; i++, out++) {
-		SEXP leaf = VECTOR_ELT(SVT1, i);
-		if (leaf == R_NilValue)
+	const SparseVec *svs = _SVT2SVs(SVT1, REALSXP, in_nrow, out_nrow);
+	double *panel = (double *)
+		R_alloc((size_t) in_nrow * TILE_NCOL, sizeof(double));
+	double *colbuf = NULL;
+	/* Element (i, j) of 'mat2' (or of 't(mat2)' if 'tr_mat2' is true). */
+	size_t rstride = tr_mat2 ? (size_t) out_ncol : 1;
+	size_t cstride = tr_mat2 ? 1 : (size_t) in_nrow;
+	for (int j0 = 0; j0 < out_ncol; j0 += TILE_NCOL) {
+		int ncol = out_ncol - j0;
+		if (ncol > TILE_NCOL)
+			ncol = TILE_NCOL;
+		double *out_p = out + (size_t) j0 * out_nrow;
+		int is_finite = pack_panel(mat2 + j0 * cstride,
+					   rstride, cstride,
+					   in_nrow, ncol, panel);
+		if (!is_finite) {
+			/* Use the slower column-at-a-time approach
+			   (handles NA, NaN, Inf, and -Inf). */
+			if (colbuf == NULL)
+				colbuf = (double *)
+					R_alloc(in_nrow, sizeof(double));
+			for (int b = 0; b < ncol; b++, out_p += out_nrow) {
+				unpack_panel_col(panel, in_nrow, b, colbuf);
+				compute_dotprods2_with_double_Rcol(SVT1, colbuf,
+							in_nrow,
+							out_p, out_nrow);
+			}
 			continue;
-		const SparseVec sv1 = leaf2SV(leaf, REALSXP, in_nrow);
-		crossprod2_doubleSV_doublemat(&sv1, REAL(mat2), in_nrow,
-					      out, out_nrow, out_ncol);
-	}
-*/
-	/* Outer loop: walk on the columns of 'mat2' (or on its rows
-	   if 'tr_mat2' is true).
-	   Inner loop: walk on SVT1.
-	   For some mysterious reason, this is faster than the above. */
-	double *colbuf;
-	int i, j;
-
-	if (tr_mat2) {
-		colbuf = (double *) R_alloc(in_nrow, sizeof(double));
-		for (j = 0; j < out_ncol; j++, out += out_nrow) {
-			/* Copy 'mat2[j, ]' to 'colbuf'. */
-			for (i = 0; i < in_nrow; i++)
-				colbuf[i] = mat2[i * out_ncol];
-			compute_dotprods2_with_double_Rcol(SVT1, colbuf,
-						in_nrow,
-						out, out_nrow);
-			mat2++;
 		}
-	} else {
-		for (j = 0; j < out_ncol; j++, out += out_nrow) {
-			compute_dotprods2_with_double_Rcol(SVT1, mat2,
-						in_nrow,
-						out, out_nrow);
-			mat2 += in_nrow;
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < out_nrow; i++) {
+			double dp[TILE_NCOL];
+			tiled_dotprods_doubleSV_panel(svs + i, panel, dp);
+			double *o = out_p + i;
+			for (int b = 0; b < ncol; b++, o += out_nrow)
+				*o = dp[b];
 		}
 	}
 	return;
@@ -466,41 +586,43 @@ static void crossprod2_mat_SVT_double(const double *mat1, SEXP SVT2,
 {
 	if (SVT2 == R_NilValue)
 		return;
-	/* Outer loop: walk on SVT2.
-	   Inner loop: walk on the columns of 'mat1'.
-	   Does NOT support 'tr_mat1' != 0. */
-/*
-	for (int j = 0; j < out_ncol; j++, out += out_nrow) {
-		SEXP leaf = VECTOR_ELT(SVT2, j);
-		if (leaf == R_NilValue)
+	const SparseVec *svs = _SVT2SVs(SVT2, REALSXP, in_nrow, out_ncol);
+	double *panel = (double *)
+		R_alloc((size_t) in_nrow * TILE_NCOL, sizeof(double));
+	double *colbuf = NULL;
+	/* Element (j, i) of 'mat1' (or of 't(mat1)' if 'tr_mat1' is true). */
+	size_t rstride = tr_mat1 ? (size_t) out_nrow : 1;
+	size_t cstride = tr_mat1 ? 1 : (size_t) in_nrow;
+	for (int i0 = 0; i0 < out_nrow; i0 += TILE_NCOL) {
+		int nrow = out_nrow - i0;
+		if (nrow > TILE_NCOL)
+			nrow = TILE_NCOL;
+		double *out_p = out + i0;
+		int is_finite = pack_panel(mat1 + i0 * cstride,
+					   rstride, cstride,
+					   in_nrow, nrow, panel);
+		if (!is_finite) {
+			/* Use the slower column-at-a-time approach
+			   (handles NA, NaN, Inf, and -Inf). */
+			if (colbuf == NULL)
+				colbuf = (double *)
+					R_alloc(in_nrow, sizeof(double));
+			for (int b = 0; b < nrow; b++, out_p++) {
+				unpack_panel_col(panel, in_nrow, b, colbuf);
+				compute_dotprods2_with_double_Lcol(colbuf,
+							in_nrow, SVT2,
+							out_p, out_nrow,
+							out_ncol);
+			}
 			continue;
-		const SparseVec sv2 = leaf2SV(leaf, REALSXP, in_nrow);
-		crossprod2_doublemat_doubleSV(mat1, &sv2, in_nrow,
-					      out, out_nrow);
-	}
-*/
-	/* Outer loop: walk on the columns of 'mat1' (or on its rows
-	   if 'tr_mat1' is true).
-	   Inner loop: walk on SVT2.
-	   For some mysterious reason, this is faster than the above. */
-	double *colbuf;
-	int i, j;
-
-	if (tr_mat1) {
-		colbuf = (double *) R_alloc(in_nrow, sizeof(double));
-		for (i = 0; i < out_nrow; i++, out++) {
-			/* Copy 'mat1[i, ]' to 'colbuf'. */
-			for (j = 0; j < in_nrow; j++)
-				colbuf[j] = mat1[j * out_nrow];
-			compute_dotprods2_with_double_Lcol(colbuf, in_nrow,
-						SVT2, out, out_nrow, out_ncol);
-			mat1++;
 		}
-	} else {
-		for (i = 0; i < out_nrow; i++, out++) {
-			compute_dotprods2_with_double_Lcol(mat1, in_nrow,
-						SVT2, out, out_nrow, out_ncol);
-			mat1 += in_nrow;
+		#pragma omp parallel for schedule(static)
+		for (int j = 0; j < out_ncol; j++) {
+			double dp[TILE_NCOL];
+			tiled_dotprods_doubleSV_panel(svs + j, panel, dp);
+			double *o = out_p + (size_t) j * out_nrow;
+			for (int b = 0; b < nrow; b++)
+				o[b] = dp[b];
 		}
 	}
 	return;
@@ -656,8 +778,10 @@ static void crossprod2_SVT_mat0_int(SEXP SVT1, int in_nrow,
 }
 
 /* Preprocesses 'leaf1' by turning it into a dense vector, but only if it
-   contains no infinite values (i.e. no NA, NaN, Inf, or -Inf). */
+   contains no infinite values (i.e. no NA, NaN, Inf, or -Inf).
+   'svs2' and 'is_finite2' are the columns of 'SVT2' and their finiteness. */
 static void compute_dotprods2_with_left_double_leaf(SEXP leaf1, SEXP SVT2,
+		const SparseVec *svs2, const int *is_finite2,
 		double *densebuf, int dense_len,
 		double *out, int out_nrow, int out_ncol)
 {
@@ -668,11 +792,12 @@ static void compute_dotprods2_with_left_double_leaf(SEXP leaf1, SEXP SVT2,
 		return;
 	}
 	const SparseVec sv1 = leaf2SV(leaf1, REALSXP, dense_len);
-	if (doubleSV_has_no_NaN_or_Inf(&sv1)) {
+	if (_doubleSV_is_finite(&sv1)) {
 		/* Turn 'sv1' into dense vector. */
 		expand_doubleSV(&sv1, densebuf);
-		compute_dotprods2_with_finite_Lcol(densebuf, dense_len, SVT2,
-						   out, out_nrow, out_ncol);
+		compute_dotprods2_with_finite_Lsv(&sv1, densebuf,
+						  svs2, is_finite2,
+						  out, out_nrow, out_ncol);
 		return;
 	}
 	compute_dotprods2_with_Lsv(&sv1, SVT2, out, out_nrow, out_ncol);
@@ -680,8 +805,10 @@ static void compute_dotprods2_with_left_double_leaf(SEXP leaf1, SEXP SVT2,
 }
 
 /* Preprocesses 'leaf2' by turning it into a dense vector, but only if it
-   contains no infinite values (i.e. no NA, NaN, Inf, or -Inf). */
-static void compute_dotprods2_with_right_double_leaf(SEXP SVT1, SEXP leaf2,
+   contains no infinite values (i.e. no NA, NaN, Inf, or -Inf).
+   'svs1' and 'is_finite1' are the columns of 'SVT1' and their finiteness. */
+static void compute_dotprods2_with_right_double_leaf(SEXP SVT1,
+		const SparseVec *svs1, const int *is_finite1, SEXP leaf2,
 		double *densebuf, int dense_len,
 		double *out, int out_nrow)
 {
@@ -692,11 +819,12 @@ static void compute_dotprods2_with_right_double_leaf(SEXP SVT1, SEXP leaf2,
 		return;
 	}
 	const SparseVec sv2 = leaf2SV(leaf2, REALSXP, dense_len);
-	if (doubleSV_has_no_NaN_or_Inf(&sv2)) {
+	if (_doubleSV_is_finite(&sv2)) {
 		/* Turn 'sv2' into dense vector. */
 		expand_doubleSV(&sv2, densebuf);
-		compute_dotprods2_with_finite_Rcol(SVT1, densebuf, dense_len,
-						   out, out_nrow);
+		compute_dotprods2_with_finite_Rsv(svs1, is_finite1,
+						  &sv2, densebuf,
+						  out, out_nrow);
 		return;
 	}
 	compute_dotprods2_with_Rsv(SVT1, &sv2, out, out_nrow);
@@ -762,10 +890,14 @@ static void crossprod2_Lpp_double(SEXP SVT1, SEXP SVT2, int in_nrow,
 		return;
 	}
 	double *densebuf = (double *) R_alloc(in_nrow, sizeof(double));
+	/* The finiteness of each leaf in 'SVT2' is checked once here. */
+	const SparseVec *svs2 = _SVT2SVs(SVT2, REALSXP, in_nrow, out_ncol);
+	const int *is_finite2 = SVs_finiteness(svs2, out_ncol);
 	for (int i = 0; i < out_nrow; i++) {
 		SEXP leaf = SVT1 != R_NilValue ? VECTOR_ELT(SVT1, i) :
 						 R_NilValue;
 		compute_dotprods2_with_left_double_leaf(leaf, SVT2,
+						svs2, is_finite2,
 						densebuf, in_nrow,
 						out, out_nrow, out_ncol);
 		out++;
@@ -784,11 +916,14 @@ static void crossprod2_Rpp_double(SEXP SVT1, SEXP SVT2, int in_nrow,
 		return;
 	}
 	double *densebuf = (double *) R_alloc(in_nrow, sizeof(double));
+	/* The finiteness of each leaf in 'SVT1' is checked once here. */
+	const SparseVec *svs1 = _SVT2SVs(SVT1, REALSXP, in_nrow, out_nrow);
+	const int *is_finite1 = SVs_finiteness(svs1, out_nrow);
 	for (int j = 0; j < out_ncol; j++) {
 		SEXP leaf = SVT2 != R_NilValue ? VECTOR_ELT(SVT2, j) :
 						 R_NilValue;
-		compute_dotprods2_with_right_double_leaf(SVT1, leaf,
-						densebuf, in_nrow,
+		compute_dotprods2_with_right_double_leaf(SVT1, svs1, is_finite1,
+						leaf, densebuf, in_nrow,
 						out, out_nrow);
 		out += out_nrow;
 	}
@@ -852,32 +987,6 @@ static void crossprod2_Rpp_int(SEXP SVT1, SEXP SVT2, int in_nrow,
  * Workhorses behind C_crossprod1_SVT()
  */
 
-static void compute_sym_dotprods_double(SEXP SVT, int j,
-		double *densebuf, int dense_len, double *out, int out_ncol)
-{
-	SEXP leaf = VECTOR_ELT(SVT, j);
-	if (leaf == R_NilValue) {
-		memset(densebuf, 0, sizeof(double) * dense_len);
-		compute_sym_dotprods_with_finite_col(SVT, j,
-						densebuf, dense_len,
-						out, out_ncol);
-		return;
-	}
-	const SparseVec sv = leaf2SV(leaf, REALSXP, dense_len);
-	if (doubleSV_has_no_NaN_or_Inf(&sv)) {
-		/* Turn 'sv' into dense vector. */
-		expand_doubleSV(&sv, densebuf);
-		*out = _dotprod_doubleSV_finite_doubles(&sv, densebuf);
-		compute_sym_dotprods_with_finite_col(SVT, j,
-						densebuf, dense_len,
-						out, out_ncol);
-	} else {
-		*out = _dotprod_doubleSV_doubleSV(&sv, &sv);
-		compute_sym_dotprods_with_doubleSV(SVT, j, &sv, out, out_ncol);
-	}
-	return;
-}
-
 static void compute_sym_dotprods_int(SEXP SVT, int j,
 		int *densebuf, int dense_len, double *out, int out_ncol)
 {
@@ -903,14 +1012,107 @@ static void compute_sym_dotprods_int(SEXP SVT, int j,
 	return;
 }
 
+/* crossprod1_double() computes the upper triangle of the Gram matrix by
+   tiles of TILE_NCOL rows. For each tile, the corresponding TILE_NCOL
+   columns of 'SVT' are expanded into a panel (see pack_panel() above) that
+   is reused for all the dot products in the tile, i.e. with all the leaves
+   to the right of the tile. The tiles are processed in parallel, each
+   thread using its own panel, then the lower triangle is filled by
+   mirroring the upper triangle.
+   Columns that contain NA, NaN, Inf, or -Inf are not expanded. Their dot
+   products with the other columns are computed with
+   _dotprod_doubleSV_doubleSV() instead. */
+
+/* Max amount of memory to use for the per-thread panels. */
+#define MAX_PANELS_BYTES ((size_t) 1 << 30)
+
+static void pack_SVs_panel(const SparseVec *svs, const int *is_finite,
+		int ncol, int nrow, double *panel)
+{
+	memset(panel, 0, sizeof(double) * (size_t) nrow * TILE_NCOL);
+	for (int b = 0; b < ncol; b++) {
+		const SparseVec *sv = svs + b;
+		if (!is_finite[b])
+			continue;
+		const double *nzvals_p = get_doubleSV_nzvals_p(sv);
+		int nzcount = get_SV_nzcount(sv);
+		for (int k = 0; k < nzcount; k++) {
+			size_t i = (size_t) sv->nzoffs[k] * TILE_NCOL + b;
+			panel[i] = nzvals_p == NULL ? 1.0 : nzvals_p[k];
+		}
+	}
+	return;
+}
+
+static void compute_Gram_tile(const SparseVec *svs, const int *is_finite,
+		int i0, int in_nrow, double *panel, double *out, int out_ncol)
+{
+	int nrow = out_ncol - i0;
+	if (nrow > TILE_NCOL)
+		nrow = TILE_NCOL;
+	pack_SVs_panel(svs + i0, is_finite + i0, nrow, in_nrow, panel);
+	for (int j = i0; j < out_ncol; j++) {
+		double dp[TILE_NCOL];
+		tiled_dotprods_doubleSV_panel(svs + j, panel, dp);
+		/* Only fill the upper triangle (i.e. 'i <= j'). */
+		int bmax = j - i0 + 1;
+		if (bmax > nrow)
+			bmax = nrow;
+		double *o = out + (size_t) j * out_ncol + i0;
+		for (int b = 0; b < bmax; b++) {
+			int i = i0 + b;
+			o[b] = is_finite[i] ? dp[b] :
+				_dotprod_doubleSV_doubleSV(svs + i, svs + j);
+		}
+	}
+	return;
+}
+
+static void mirror_upper_triangle(double *out, int n)
+{
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (int j0 = 0; j0 < n; j0 += 64) {
+		int j1 = j0 + 64 < n ? j0 + 64 : n;
+		for (int i0 = 0; i0 <= j0; i0 += 64) {
+			int i1 = i0 + 64 < n ? i0 + 64 : n;
+			for (int j = j0; j < j1; j++) {
+				for (int i = i0; i < i1 && i < j; i++)
+					out[j + (size_t) i * n] =
+						out[i + (size_t) j * n];
+			}
+		}
+	}
+	return;
+}
+
 static void crossprod1_double(SEXP SVT, int in_nrow, double *out, int out_ncol)
 {
 	if (SVT == R_NilValue)
 		return;
-	double *densebuf = (double *) R_alloc(in_nrow, sizeof(double));
-	for (int j = 0; j < out_ncol; j++, out += out_ncol + 1)
-		compute_sym_dotprods_double(SVT, j,
-					    densebuf, in_nrow, out, out_ncol);
+	const SparseVec *svs = _SVT2SVs(SVT, REALSXP, in_nrow, out_ncol);
+	const int *is_finite = SVs_finiteness(svs, out_ncol);
+
+	int ntile = (out_ncol + TILE_NCOL - 1) / TILE_NCOL;
+	size_t panel_len = (size_t) in_nrow * TILE_NCOL;
+	int nthread = _get_max_threads();
+	if (nthread > ntile)
+		nthread = ntile;
+	size_t max_nthread = MAX_PANELS_BYTES / (panel_len * sizeof(double));
+	if (max_nthread < 1)
+		max_nthread = 1;
+	if ((size_t) nthread > max_nthread)
+		nthread = (int) max_nthread;
+	double *panels = (double *)
+		R_alloc((size_t) nthread * panel_len, sizeof(double));
+
+	/* Tiles at the top are the biggest so process them first. */
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(nthread)
+	for (int t = 0; t < ntile; t++) {
+		double *panel = panels + (size_t) _get_thread_num() * panel_len;
+		compute_Gram_tile(svs, is_finite, t * TILE_NCOL, in_nrow,
+				  panel, out, out_ncol);
+	}
+	mirror_upper_triangle(out, out_ncol);
 	return;
 }
 
@@ -1182,3 +1384,771 @@ SEXP C_crossprod1_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 	return ans;
 }
 
+
+
+/****************************************************************************
+ * Sparse-output matrix multiplication (SpGEMM)
+ *
+ * Gustavson's algorithm: column j of 'x %*% y' is the linear combination
+ * of the columns of 'x' selected by the nonzero elements of 'y[ , j]', with
+ * these elements as coefficients. Since the columns of 'x' and 'y' are the
+ * leaves of 'x_SVT' and 'y_SVT', no transposition is needed.
+ *
+ * The output columns are computed in parallel. Each thread has its own
+ * sparse accumulator (SPA): a dense array of values and a dense array of
+ * markers, both of length 'nrow(x)', plus the list of rows touched by the
+ * current column (stored directly in the output buffer). The product is
+ * computed in two passes over the columns of 'y': a symbolic pass that
+ * counts the nonzero elements in each output column, then a numeric pass
+ * that fills preallocated buffers. The leaves are made serially at the end.
+ *
+ * Note that the code in this section does not handle NA, NaN, Inf, or -Inf
+ * in the input (0 * Inf is NaN, which would make the result dense).
+ * C_estimate_SpGEMM_density() returns NA when it finds such values, in
+ * which case the R code falls back to the dense product.
+ */
+
+static int SVs_are_finite(const SparseVec *svs, int nsv)
+{
+	for (int j = 0; j < nsv; j++) {
+		const SparseVec *sv = svs + j;
+		if (sv->nzcount == 0)
+			continue;
+		if (sv->Rtype == REALSXP) {
+			if (!_doubleSV_is_finite(sv))
+				return 0;
+		} else {
+			if (!intSV_has_no_NA(sv))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static int compar_ints(const void *p1, const void *p2)
+{
+	return *((const int *) p1) - *((const int *) p2);
+}
+
+/* Symbolic pass for output column 'j'. Returns the nb of rows touched. */
+static int count_SpGEMM_col_nzs(const SparseVec *x_svs,
+		const SparseVec *y_sv, int j, int *marks)
+{
+	int count = 0;
+	for (int k2 = 0; k2 < y_sv->nzcount; k2++) {
+		const SparseVec *x_sv = x_svs + y_sv->nzoffs[k2];
+		for (int k1 = 0; k1 < x_sv->nzcount; k1++) {
+			int i = x_sv->nzoffs[k1];
+			if (marks[i] != j) {
+				marks[i] = j;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+/* Accumulates output column 'j' in the SPA ('marks' and 'vals'). The rows
+   touched by the column are stored in 'touched' in no particular order.
+   Returns their nb. */
+static int accumulate_SpGEMM_col(const SparseVec *x_svs,
+		const SparseVec *y_sv, int j, int *marks, double *vals,
+		int *touched)
+{
+	int n = 0;
+	for (int k2 = 0; k2 < y_sv->nzcount; k2++) {
+		const SparseVec *x_sv = x_svs + y_sv->nzoffs[k2];
+		double y_val = get_SV_nzval_as_double(y_sv, k2);
+		for (int k1 = 0; k1 < x_sv->nzcount; k1++) {
+			int i = x_sv->nzoffs[k1];
+			double v = get_SV_nzval_as_double(x_sv, k1) * y_val;
+			if (marks[i] != j) {
+				marks[i] = j;
+				vals[i] = v;
+				touched[n++] = i;
+			} else {
+				vals[i] += v;
+			}
+		}
+	}
+	return n;
+}
+
+/* Numeric pass for output column 'j'. 'out_offs' and 'out_vals' must have
+   room for the nb of rows found by count_SpGEMM_col_nzs(). Returns the nb
+   of nonzero values written to them, which can be less than that because
+   of numerical cancellation. */
+static int compute_SpGEMM_col(const SparseVec *x_svs, int x_nrow,
+		const SparseVec *y_sv, int j, int *marks, double *vals,
+		int *out_offs, double *out_vals)
+{
+	int n = accumulate_SpGEMM_col(x_svs, y_sv, j, marks, vals, out_offs);
+	/* Put the touched rows in order. Sorting them costs n*log2(n)
+	   comparisons vs 'x_nrow' for scanning the markers. */
+	if ((double) n * log2((double) n + 1.0) < (double) x_nrow) {
+		qsort(out_offs, n, sizeof(int), compar_ints);
+	} else {
+		int n2 = 0;
+		for (int i = 0; i < x_nrow; i++)
+			if (marks[i] == j)
+				out_offs[n2++] = i;
+	}
+	int nzcount = 0;
+	for (int t = 0; t < n; t++) {
+		int i = out_offs[t];
+		double v = vals[i];
+		if (v == 0.0)
+			continue;
+		out_offs[nzcount] = i;
+		out_vals[nzcount] = v;
+		nzcount++;
+	}
+	return nzcount;
+}
+
+static SEXP SpGEMM_SVT_SVT(SEXP x_SVT, SEXPTYPE x_Rtype, int x_nrow, int x_ncol,
+			   SEXP y_SVT, SEXPTYPE y_Rtype, int y_ncol)
+{
+	if (x_SVT == R_NilValue || y_SVT == R_NilValue)
+		return R_NilValue;
+
+	const SparseVec *x_svs = _SVT2SVs(x_SVT, x_Rtype, x_nrow, x_ncol);
+	const SparseVec *y_svs = _SVT2SVs(y_SVT, y_Rtype, x_ncol, y_ncol);
+
+	/* Allocate one SPA per thread. */
+	int nthread = _get_max_threads();
+	size_t spa_len = (size_t) nthread * x_nrow;
+	int *marks = (int *) R_alloc(spa_len, sizeof(int));
+	double *vals = (double *) R_alloc(spa_len, sizeof(double));
+	int *counts = (int *) R_alloc(y_ncol, sizeof(int));
+
+	/* Symbolic pass. */
+	for (size_t t = 0; t < spa_len; t++)
+		marks[t] = -1;
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int j = 0; j < y_ncol; j++) {
+		int *marks_p = marks + (size_t) _get_thread_num() * x_nrow;
+		counts[j] = count_SpGEMM_col_nzs(x_svs, y_svs + j, j, marks_p);
+	}
+
+	R_xlen_t *colptrs = (R_xlen_t *) R_alloc(y_ncol + 1, sizeof(R_xlen_t));
+	colptrs[0] = 0;
+	for (int j = 0; j < y_ncol; j++)
+		colptrs[j + 1] = colptrs[j] + counts[j];
+	R_xlen_t total = colptrs[y_ncol];
+	if (total == 0)
+		return R_NilValue;
+	int *out_offs = (int *) R_alloc(total, sizeof(int));
+	double *out_vals = (double *) R_alloc(total, sizeof(double));
+
+	/* Numeric pass. */
+	for (size_t t = 0; t < spa_len; t++)
+		marks[t] = -1;
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (int j = 0; j < y_ncol; j++) {
+		size_t spa_offset = (size_t) _get_thread_num() * x_nrow;
+		counts[j] = compute_SpGEMM_col(x_svs, x_nrow, y_svs + j, j,
+					       marks + spa_offset,
+					       vals + spa_offset,
+					       out_offs + colptrs[j],
+					       out_vals + colptrs[j]);
+	}
+
+	/* Make the leaves. */
+	SEXP ans = PROTECT(NEW_LIST(y_ncol));
+	int is_empty = 1;
+	for (int j = 0; j < y_ncol; j++) {
+		SEXP ans_elt = _make_leaf_from_two_arrays(REALSXP,
+					out_vals + colptrs[j],
+					out_offs + colptrs[j],
+					counts[j]);
+		if (ans_elt != R_NilValue) {
+			PROTECT(ans_elt);
+			SET_VECTOR_ELT(ans, j, ans_elt);
+			UNPROTECT(1);
+			is_empty = 0;
+		}
+	}
+	UNPROTECT(1);
+	return is_empty ? R_NilValue : ans;
+}
+
+/* Estimates the density of 'x %*% y' assuming that the nonzero elements
+   in each column of 'x' are randomly distributed. This tends to slightly
+   overestimate the density of structured inputs, which is on the safe side
+   when choosing between sparse and dense output. */
+static double estimate_SpGEMM_density(const SparseVec *x_svs, int x_nrow,
+		const SparseVec *y_svs, int y_ncol)
+{
+	if (x_nrow == 0 || y_ncol == 0)
+		return 0.0;
+	double est_nzcount = 0.0;
+	for (int j = 0; j < y_ncol; j++) {
+		const SparseVec *y_sv = y_svs + j;
+		double log_p0 = 0.0, nflops = 0.0;
+		for (int k2 = 0; k2 < y_sv->nzcount; k2++) {
+			int x_nzcount = x_svs[y_sv->nzoffs[k2]].nzcount;
+			log_p0 += log1p(- (double) x_nzcount / x_nrow);
+			nflops += x_nzcount;
+		}
+		double est = x_nrow * (1.0 - exp(log_p0));
+		est_nzcount += est < nflops ? est : nflops;
+	}
+	return est_nzcount / ((double) x_nrow * y_ncol);
+}
+
+static void check_SpGEMM_input(SEXP x_dim, SEXP x_type,
+			       SEXP y_dim, SEXP y_type,
+			       SEXPTYPE *x_Rtype, SEXPTYPE *y_Rtype)
+{
+	if (LENGTH(x_dim) != 2 || LENGTH(y_dim) != 2)
+		error("input objects must have 2 dimensions");
+	if (INTEGER(x_dim)[1] != INTEGER(y_dim)[0])
+		error("input SVT_SparseMatrix objects "
+		      "are non-conformable");
+	*x_Rtype = get_and_check_input_Rtype(x_type, "x_type");
+	*y_Rtype = get_and_check_input_Rtype(y_type, "y_type");
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+   Returns NA_real_ if 'x_SVT' or 'y_SVT' contains NA, NaN, Inf, or -Inf. */
+SEXP C_estimate_SpGEMM_density(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			       SEXP y_dim, SEXP y_type, SEXP y_SVT)
+{
+	SEXPTYPE x_Rtype, y_Rtype;
+
+	check_SpGEMM_input(x_dim, x_type, y_dim, y_type, &x_Rtype, &y_Rtype);
+	int x_nrow = INTEGER(x_dim)[0];
+	int x_ncol = INTEGER(x_dim)[1];
+	int y_ncol = INTEGER(y_dim)[1];
+	const SparseVec *x_svs = _SVT2SVs(x_SVT, x_Rtype, x_nrow, x_ncol);
+	const SparseVec *y_svs = _SVT2SVs(y_SVT, y_Rtype, x_ncol, y_ncol);
+	if (!SVs_are_finite(x_svs, x_ncol) || !SVs_are_finite(y_svs, y_ncol))
+		return ScalarReal(NA_REAL);
+	return ScalarReal(estimate_SpGEMM_density(x_svs, x_nrow,
+						  y_svs, y_ncol));
+}
+
+/* --- .Call ENTRY POINT ---
+   Computes 'x %*% y' and returns it as an SVT of type "double".
+   'x_SVT' and 'y_SVT' are trusted to contain no NA, NaN, Inf, or -Inf
+   (see C_estimate_SpGEMM_density() above). */
+SEXP C_SpGEMM_SVT_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+		      SEXP y_dim, SEXP y_type, SEXP y_SVT)
+{
+	SEXPTYPE x_Rtype, y_Rtype;
+
+	check_SpGEMM_input(x_dim, x_type, y_dim, y_type, &x_Rtype, &y_Rtype);
+	return SpGEMM_SVT_SVT(x_SVT, x_Rtype,
+			      INTEGER(x_dim)[0], INTEGER(x_dim)[1],
+			      y_SVT, y_Rtype, INTEGER(y_dim)[1]);
+}
+
+
+/****************************************************************************
+ * Sparse-output thresholded or top-k crossprod(x)
+ *
+ * Column j of 'crossprod(x)' is computed as 't(x) %*% x[ , j]' with the
+ * SpGEMM machinery above, i.e. by accumulating the rows of 'x' (the leaves
+ * of 'tx_SVT') selected by the nonzero elements of 'x[ , j]'. Only the
+ * pairs of columns that share at least one nonzero row get visited. Then
+ * the column is filtered (cutoff and/or top-k) before being stored.
+ * The output columns are processed by blocks of GRAM_BLOCK_NCOL columns.
+ * Within a block, the columns are computed in parallel and the kept entries
+ * are appended to a per-thread buffer. The leaves are made serially at the
+ * end of each block and the buffers are reused for the next block. So memory
+ * usage is bounded by the SPAs plus the kept entries of one block.
+ */
+
+#define GRAM_BLOCK_NCOL 4096
+
+typedef struct kept_buf_t {
+	int *offs;
+	double *vals;
+	size_t len;
+	size_t maxlen;
+} KeptBuf;
+
+typedef struct gram_filter_t {
+	int topk;         /* -1 for no top-k selection */
+	double cutoff;    /* -Inf for no cutoff */
+	int keep_diag;
+} GramFilter;
+
+/* Returns 0 if memory allocation failed. Safe to call in a parallel
+   region (doesn't use the R API). */
+static int grow_KeptBuf(KeptBuf *buf, size_t min_maxlen)
+{
+	if (min_maxlen <= buf->maxlen)
+		return 1;
+	size_t new_maxlen = buf->maxlen == 0 ? 1024 : 2 * buf->maxlen;
+	if (new_maxlen < min_maxlen)
+		new_maxlen = min_maxlen;
+	int *new_offs = (int *) realloc(buf->offs, sizeof(int) * new_maxlen);
+	if (new_offs == NULL)
+		return 0;
+	buf->offs = new_offs;
+	double *new_vals = (double *)
+		realloc(buf->vals, sizeof(double) * new_maxlen);
+	if (new_vals == NULL)
+		return 0;
+	buf->vals = new_vals;
+	buf->maxlen = new_maxlen;
+	return 1;
+}
+
+/* Top-k selection is done with a min-heap of size k where the root is the
+   "worst" kept entry, i.e. the one with the smallest value (or the biggest
+   offset in case of ties, so the selection is deterministic). */
+static inline int is_worse(double val1, int off1, double val2, int off2)
+{
+	return val1 < val2 || (val1 == val2 && off1 > off2);
+}
+
+static void heap_sift_down(int *offs, const double *vals, int n, int i)
+{
+	while (1) {
+		int l = 2 * i + 1, r = l + 1, worst = i;
+		if (l < n && is_worse(vals[offs[l]], offs[l],
+				      vals[offs[worst]], offs[worst]))
+			worst = l;
+		if (r < n && is_worse(vals[offs[r]], offs[r],
+				      vals[offs[worst]], offs[worst]))
+			worst = r;
+		if (worst == i)
+			return;
+		int tmp = offs[i];
+		offs[i] = offs[worst];
+		offs[worst] = tmp;
+		i = worst;
+	}
+}
+
+/* Filters the 'n' touched rows in place. 'vals' is the SPA i.e. the value
+   for row i is 'vals[i]'. Returns the nb of rows kept. They're put at the
+   beginning of 'touched' and sorted. */
+static int filter_Gram_col(int *touched, int n, const double *vals, int j,
+		const GramFilter *filter)
+{
+	int nkept = 0;
+	for (int t = 0; t < n; t++) {
+		int i = touched[t];
+		double v = vals[i];
+		if (v == 0.0 || v < filter->cutoff ||
+		    (i == j && !filter->keep_diag))
+			continue;
+		touched[nkept++] = i;
+	}
+	int k = filter->topk;
+	if (k >= 0 && nkept > k) {
+		/* Heapify the first k rows then push the others thru. */
+		for (int i = k / 2 - 1; i >= 0; i--)
+			heap_sift_down(touched, vals, k, i);
+		for (int t = k; t < nkept; t++) {
+			int i = touched[t];
+			if (k == 0 || !is_worse(vals[touched[0]], touched[0],
+						vals[i], i))
+				continue;
+			touched[0] = i;
+			heap_sift_down(touched, vals, k, 0);
+		}
+		nkept = k;
+	}
+	qsort(touched, nkept, sizeof(int), compar_ints);
+	return nkept;
+}
+
+static SEXP sparse_crossprod1(const SparseVec *x_svs, const SparseVec *tx_svs,
+		int x_ncol, const GramFilter *filter)
+{
+	/* Allocate one SPA per thread. */
+	int nthread = _get_max_threads();
+	size_t spa_len = (size_t) nthread * x_ncol;
+	int *marks = (int *) R_alloc(spa_len, sizeof(int));
+	double *vals = (double *) R_alloc(spa_len, sizeof(double));
+	int *touched = (int *) R_alloc(spa_len, sizeof(int));
+	for (size_t t = 0; t < spa_len; t++)
+		marks[t] = -1;
+	KeptBuf *bufs = (KeptBuf *) R_alloc(nthread, sizeof(KeptBuf));
+	memset(bufs, 0, sizeof(KeptBuf) * nthread);
+	int *col_thread = (int *) R_alloc(GRAM_BLOCK_NCOL, sizeof(int));
+	size_t *col_start = (size_t *) R_alloc(GRAM_BLOCK_NCOL, sizeof(size_t));
+	int *col_nkept = (int *) R_alloc(GRAM_BLOCK_NCOL, sizeof(int));
+
+	SEXP ans = PROTECT(NEW_LIST(x_ncol));
+	int is_empty = 1, alloc_failed = 0;
+	for (int j0 = 0; j0 < x_ncol && !alloc_failed; j0 += GRAM_BLOCK_NCOL) {
+		int block_ncol = x_ncol - j0;
+		if (block_ncol > GRAM_BLOCK_NCOL)
+			block_ncol = GRAM_BLOCK_NCOL;
+		for (int t = 0; t < nthread; t++)
+			bufs[t].len = 0;
+		#pragma omp parallel for schedule(dynamic, 16) \
+			reduction(|:alloc_failed)
+		for (int b = 0; b < block_ncol; b++) {
+			int j = j0 + b, thread_num = _get_thread_num();
+			size_t spa_offset = (size_t) thread_num * x_ncol;
+			int *touched_p = touched + spa_offset;
+			const double *vals_p = vals + spa_offset;
+			int n = accumulate_SpGEMM_col(tx_svs, x_svs + j, j,
+						      marks + spa_offset,
+						      vals + spa_offset,
+						      touched_p);
+			int nkept = filter_Gram_col(touched_p, n, vals_p, j,
+						    filter);
+			KeptBuf *buf = bufs + thread_num;
+			col_thread[b] = thread_num;
+			col_start[b] = buf->len;
+			col_nkept[b] = 0;
+			if (!grow_KeptBuf(buf, buf->len + nkept)) {
+				alloc_failed = 1;
+				continue;
+			}
+			for (int t = 0; t < nkept; t++) {
+				int i = touched_p[t];
+				buf->offs[buf->len + t] = i;
+				buf->vals[buf->len + t] = vals_p[i];
+			}
+			buf->len += nkept;
+			col_nkept[b] = nkept;
+		}
+		if (alloc_failed)
+			break;
+		/* Make the leaves. */
+		for (int b = 0; b < block_ncol; b++) {
+			const KeptBuf *buf = bufs + col_thread[b];
+			SEXP ans_elt = _make_leaf_from_two_arrays(REALSXP,
+						buf->vals + col_start[b],
+						buf->offs + col_start[b],
+						col_nkept[b]);
+			if (ans_elt != R_NilValue) {
+				PROTECT(ans_elt);
+				SET_VECTOR_ELT(ans, j0 + b, ans_elt);
+				UNPROTECT(1);
+				is_empty = 0;
+			}
+		}
+	}
+	for (int t = 0; t < nthread; t++) {
+		free(bufs[t].offs);
+		free(bufs[t].vals);
+	}
+	if (alloc_failed)
+		error("SparseArray internal error in sparse_crossprod1():\n"
+		      "    memory allocation failed");
+	UNPROTECT(1);
+	return is_empty ? R_NilValue : ans;
+}
+
+/* --- .Call ENTRY POINT ---
+   'tx_SVT' must be the SVT of 't(x)'. 'topk' must be NULL or a single
+   non-negative integer, and 'cutoff' NULL or a single number. */
+SEXP C_sparse_crossprod1_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			     SEXP tx_SVT, SEXP topk, SEXP cutoff,
+			     SEXP keep_diag)
+{
+	GramFilter filter;
+
+	/* Check 'x_dim'. */
+	if (LENGTH(x_dim) != 2)
+		error("'x' must have 2 dimensions");
+	int x_nrow = INTEGER(x_dim)[0];
+	int x_ncol = INTEGER(x_dim)[1];
+
+	/* Check 'x_type'. */
+	SEXPTYPE x_Rtype = get_and_check_input_Rtype(x_type, "x_type");
+
+	filter.topk = topk == R_NilValue ? -1 : INTEGER(topk)[0];
+	if (filter.topk == NA_INTEGER)
+		error("'topk' must be NULL or a single non-negative integer");
+	filter.cutoff = cutoff == R_NilValue ? R_NegInf : REAL(cutoff)[0];
+	filter.keep_diag = LOGICAL(keep_diag)[0];
+
+	if (x_SVT == R_NilValue)
+		return R_NilValue;
+	const SparseVec *x_svs = _SVT2SVs(x_SVT, x_Rtype, x_nrow, x_ncol);
+	const SparseVec *tx_svs = _SVT2SVs(tx_SVT, x_Rtype, x_ncol, x_nrow);
+	if (!SVs_are_finite(x_svs, x_ncol))
+		error("sparse_crossprod() does not support input "
+		      "containing NA, NaN, Inf, or -Inf values");
+	return sparse_crossprod1(x_svs, tx_svs, x_ncol, &filter);
+}
+
+
+
+/****************************************************************************
+ * Fused multi-vector products for iterative algorithms
+ *
+ * _SpMM_SVT_double() computes 'x %*% V' and 't(x) %*% W' in a single pass
+ * over the nonzero elements of 'x', and writes the results to buffers
+ * provided by the caller. Both products are computed directly from the
+ * columns of 'x' so no transposition is needed:
+ *   - row j of 't(x) %*% W' is made of the dot products of column j of 'x'
+ *     with the columns of 'W' (gather);
+ *   - column j of 'x' contributes 'x[ , j] %o% V[j, ]' to 'x %*% V'
+ *     (scatter).
+ * The columns of 'V' and 'W' are processed by blocks of TILE_NCOL columns
+ * packed into panels (see pack_panel() above). The columns of 'x' are
+ * distributed across threads. Each thread scatters into its own accumulator
+ * and the accumulators are summed at the end of each block. The number of
+ * threads is capped so that the accumulators don't use more than
+ * MAX_PANELS_BYTES.
+ */
+
+/* Adds 'sv %o% prow' to 'acc'. 'prow' is a row of a panel and 'acc' is
+   laid out like a panel. */
+static inline void scatter_doubleSV_panel_row(const SparseVec *sv,
+		const double *prow, double *acc)
+{
+	const double *nzvals_p = get_doubleSV_nzvals_p(sv);
+	const int *nzoffs_p = sv->nzoffs;
+	int nzcount = get_SV_nzcount(sv);
+	if (nzvals_p == NULL) {
+		/* lacunar SparseVec */
+		for (int k = 0; k < nzcount; k++) {
+			double *p = acc + (size_t) nzoffs_p[k] * TILE_NCOL;
+			for (int b = 0; b < TILE_NCOL; b++)
+				p[b] += prow[b];
+		}
+	} else {
+		/* regular SparseVec */
+		for (int k = 0; k < nzcount; k++) {
+			double v = nzvals_p[k];
+			double *p = acc + (size_t) nzoffs_p[k] * TILE_NCOL;
+			for (int b = 0; b < TILE_NCOL; b++)
+				p[b] += v * prow[b];
+		}
+	}
+	return;
+}
+
+/* The scatter step only sees the nonzero elements of 'x'. When 'V[j, b]'
+   is NA, NaN, Inf, or -Inf, the implicit zeros in 'x[ , j]' also contribute
+   to 'xV[ , b]' (0 * Inf is NaN). */
+static void add_implicit_zero_products(const SparseVec *sv, double v,
+		double *out, int out_len)
+{
+	int nzcount = get_SV_nzcount(sv);
+	if (nzcount == out_len)
+		return;
+	double z = 0.0 * v;
+	int k = 0;
+	for (int i = 0; i < out_len; i++) {
+		if (k < nzcount && sv->nzoffs[k] == i) {
+			k++;
+			continue;
+		}
+		out[i] += z;
+	}
+	return;
+}
+
+void _SpMM_SVT_double(const SparseVec *svs, int x_nrow, int x_ncol,
+		const double *V, int V_ncol, double *xV,
+		const double *W, int W_ncol, double *txW)
+{
+	int ntile_V = (V_ncol + TILE_NCOL - 1) / TILE_NCOL;
+	int ntile_W = (W_ncol + TILE_NCOL - 1) / TILE_NCOL;
+	int ntile = ntile_V > ntile_W ? ntile_V : ntile_W;
+	size_t acc_len = (size_t) x_nrow * TILE_NCOL;
+	int nthread = _get_max_threads();
+	if (nthread > x_ncol)
+		nthread = x_ncol;
+	if (ntile_V != 0 && acc_len != 0) {
+		size_t max_nthread = MAX_PANELS_BYTES /
+				     (acc_len * sizeof(double));
+		if ((size_t) nthread > max_nthread)
+			nthread = (int) max_nthread;
+	}
+	if (nthread < 1)
+		nthread = 1;
+	double *panel_V = NULL, *accs = NULL, *panel_W = NULL, *colbuf = NULL;
+	if (ntile_V != 0) {
+		panel_V = (double *)
+			R_alloc((size_t) x_ncol * TILE_NCOL, sizeof(double));
+		accs = (double *)
+			R_alloc((size_t) nthread * acc_len, sizeof(double));
+	}
+	if (ntile_W != 0)
+		panel_W = (double *) R_alloc(acc_len, sizeof(double));
+
+	for (int t = 0; t < ntile; t++) {
+		int b0 = t * TILE_NCOL;
+		int nV = V_ncol - b0, nW = W_ncol - b0;
+		if (nV < 0)
+			nV = 0;
+		else if (nV > TILE_NCOL)
+			nV = TILE_NCOL;
+		if (nW < 0)
+			nW = 0;
+		else if (nW > TILE_NCOL)
+			nW = TILE_NCOL;
+		int V_is_finite = 1, W_is_finite = 1;
+		if (nV != 0)
+			V_is_finite = pack_panel(V + (size_t) b0 * x_ncol,
+						 1, x_ncol, x_ncol, nV,
+						 panel_V);
+		if (nW != 0)
+			W_is_finite = pack_panel(W + (size_t) b0 * x_nrow,
+						 1, x_nrow, x_nrow, nW,
+						 panel_W);
+		int do_gather = nW != 0 && W_is_finite;
+		int do_scatter = nV != 0;
+		double *txW_p = txW + (size_t) b0 * x_ncol;
+		double *xV_p = xV + (size_t) b0 * x_nrow;
+
+		#pragma omp parallel num_threads(nthread)
+		{
+			if (do_scatter) {
+				#pragma omp for schedule(static)
+				for (int th = 0; th < nthread; th++)
+					memset(accs + (size_t) th * acc_len, 0,
+					       sizeof(double) * acc_len);
+			}
+			double *acc = accs == NULL ? NULL :
+				accs + (size_t) _get_thread_num() * acc_len;
+			#pragma omp for schedule(static)
+			for (int j = 0; j < x_ncol; j++) {
+				const SparseVec *sv = svs + j;
+				if (do_gather) {
+					double dp[TILE_NCOL];
+					tiled_dotprods_doubleSV_panel(sv,
+							panel_W, dp);
+					double *o = txW_p + j;
+					for (int b = 0; b < nW;
+					     b++, o += x_ncol)
+						*o = dp[b];
+				}
+				if (do_scatter)
+					scatter_doubleSV_panel_row(sv,
+						panel_V + (size_t) j * TILE_NCOL,
+						acc);
+			}
+			if (do_scatter) {
+				#pragma omp for schedule(static)
+				for (int i = 0; i < x_nrow; i++) {
+					double sum[TILE_NCOL];
+					const double *a = accs +
+						(size_t) i * TILE_NCOL;
+					for (int b = 0; b < TILE_NCOL; b++)
+						sum[b] = a[b];
+					for (int th = 1; th < nthread; th++) {
+						a += acc_len;
+						for (int b = 0; b < TILE_NCOL;
+						     b++)
+							sum[b] += a[b];
+					}
+					double *o = xV_p + i;
+					for (int b = 0; b < nV;
+					     b++, o += x_nrow)
+						*o = sum[b];
+				}
+			}
+		}
+
+		if (nW != 0 && !W_is_finite) {
+			/* Use the slower column-at-a-time approach
+			   (handles NA, NaN, Inf, and -Inf). */
+			if (colbuf == NULL)
+				colbuf = (double *)
+					R_alloc(x_nrow, sizeof(double));
+			for (int b = 0; b < nW; b++, txW_p += x_ncol) {
+				unpack_panel_col(panel_W, x_nrow, b, colbuf);
+				#pragma omp parallel for schedule(static) \
+					num_threads(nthread)
+				for (int j = 0; j < x_ncol; j++)
+					txW_p[j] = _dotprod_doubleSV_doubles(
+							svs + j, colbuf);
+			}
+		}
+		if (nV != 0 && !V_is_finite) {
+			for (int b = 0; b < nV; b++, xV_p += x_nrow) {
+				const double *Vcol = V +
+					(size_t) (b0 + b) * x_ncol;
+				for (int j = 0; j < x_ncol; j++) {
+					if (R_FINITE(Vcol[j]))
+						continue;
+					add_implicit_zero_products(svs + j,
+						Vcol[j], xV_p, x_nrow);
+				}
+			}
+		}
+	}
+	return;
+}
+
+/* Returns the number of columns in 'M', or 0 if 'M' is NULL. */
+static int check_SpMM_operand(SEXP M, SEXP buf, int M_nrow, int buf_nrow,
+		const char *what)
+{
+	if (M == R_NilValue)
+		return 0;
+	SEXP M_dim = GET_DIM(M);
+	if (!IS_NUMERIC(M) || M_dim == R_NilValue || LENGTH(M_dim) != 2 ||
+	    INTEGER(M_dim)[0] != M_nrow)
+		error("SparseArray internal error in "
+		      "check_SpMM_operand():\n"
+		      "    invalid '%s'", what);
+	int M_ncol = INTEGER(M_dim)[1];
+	if (!IS_NUMERIC(buf) ||
+	    XLENGTH(buf) != (R_xlen_t) buf_nrow * M_ncol)
+		error("SparseArray internal error in "
+		      "check_SpMM_operand():\n"
+		      "    invalid output buffer for '%s'", what);
+	return M_ncol;
+}
+
+/* --- .Call ENTRY POINT ---
+   Computes 'x %*% V' and 't(x) %*% W', and writes them to 'xV' and 'txW',
+   respectively. 'V' and 'xV' must be both NULL or both non-NULL, same for
+   'W' and 'txW'. 'x_type' must be "double", and 'V', 'W', 'xV', and 'txW'
+   must be double matrices or vectors of the appropriate lengths.
+   'xV' and 'txW' are modified in place only if they are not shared.
+   Returns the list of the 2 (possibly new) buffers. */
+SEXP C_SpMM_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+		SEXP V, SEXP xV, SEXP W, SEXP txW)
+{
+	/* Check 'x_dim'. */
+	if (LENGTH(x_dim) != 2)
+		error("'x' must have 2 dimensions");
+	int x_nrow = INTEGER(x_dim)[0];
+	int x_ncol = INTEGER(x_dim)[1];
+
+	/* Check 'x_type'. */
+	SEXPTYPE x_Rtype = get_and_check_input_Rtype(x_type, "x_type");
+	if (x_Rtype != REALSXP)
+		error("SparseArray internal error in C_SpMM_SVT():\n"
+		      "    'x_type' must be \"double\"");
+
+	int V_ncol = check_SpMM_operand(V, xV, x_ncol, x_nrow, "V");
+	int W_ncol = check_SpMM_operand(W, txW, x_nrow, x_ncol, "W");
+	/* A buffer that is shared with other R objects cannot be modified
+	   in place without breaking R's copy-on-modify semantics so we
+	   write to a copy of it instead. */
+	if (V_ncol != 0 && MAYBE_SHARED(xV))
+		xV = duplicate(xV);
+	PROTECT(xV);
+	if (W_ncol != 0 && MAYBE_SHARED(txW))
+		txW = duplicate(txW);
+	PROTECT(txW);
+	const double *V_p = V_ncol == 0 ? NULL : REAL(V);
+	const double *W_p = W_ncol == 0 ? NULL : REAL(W);
+	double *xV_p = V_ncol == 0 ? NULL : REAL(xV);
+	double *txW_p = W_ncol == 0 ? NULL : REAL(txW);
+	if (xV_p != NULL &&
+	    (xV_p == V_p || xV_p == W_p || xV_p == txW_p))
+		error("'xV' must not share its data with "
+		      "'V', 'W', or 'txW'");
+	if (txW_p != NULL && (txW_p == V_p || txW_p == W_p))
+		error("'txW' must not share its data with 'V' or 'W'");
+
+	const SparseVec *svs = _SVT2SVs(x_SVT, REALSXP, x_nrow, x_ncol);
+	_SpMM_SVT_double(svs, x_nrow, x_ncol, V_p, V_ncol, xV_p,
+			W_p, W_ncol, txW_p);
+	SEXP ans = PROTECT(NEW_LIST(2));
+	SET_VECTOR_ELT(ans, 0, xV);
+	SET_VECTOR_ELT(ans, 1, txW);
+	UNPROTECT(3);
+	return ans;
+}
@@ -2,6 +2,26 @@
 #define _SPARSEMATRIX_MULT_H_
 
 #include <Rdefines.h>
+#include "SparseVec.h"
+
+SparseVec *_SVT2SVs(
+	SEXP SVT,
+	SEXPTYPE Rtype,
+	int nrow,
+	int ncol
+);
+
+void _SpMM_SVT_double(
+	const SparseVec *svs,
+	int x_nrow,
+	int x_ncol,
+	const double *V,
+	int V_ncol,
+	double *xV,
+	const double *W,
+	int W_ncol,
+	double *txW
+);
 
 SEXP C_crossprod2_SVT_mat(
 	SEXP x_dim,
@@ -42,5 +62,43 @@ SEXP C_crossprod1_SVT(
 	SEXP ans_dimnames
 );
 
+SEXP C_estimate_SpGEMM_density(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP y_dim,
+	SEXP y_type,
+	SEXP y_SVT
+);
+
+SEXP C_SpGEMM_SVT_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP y_dim,
+	SEXP y_type,
+	SEXP y_SVT
+);
+
+SEXP C_sparse_crossprod1_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP tx_SVT,
+	SEXP topk,
+	SEXP cutoff,
+	SEXP keep_diag
+);
+
+SEXP C_SpMM_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP V,
+	SEXP xV,
+	SEXP W,
+	SEXP txW
+);
+
 #endif  /* _SPARSEMATRIX_MULT_H_ */
 
@@ -0,0 +1,425 @@
+/****************************************************************************
+ *               Ranking the columns of a SparseMatrix object               *
+ ****************************************************************************/
+#include "SparseMatrix_ranks.h"
+
+#include "Rvector_utils.h"
+#include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads(), _get_thread_num() */
+
+#include <R_ext/Random.h>  /* for GetRNGstate(), PutRNGstate(), unif_rand() */
+
+#include <stdlib.h>  /* for qsort() */
+#include <string.h>  /* for strcmp(), memset() */
+
+
+/****************************************************************************
+ * Ties methods
+ *
+ * Same as the ties methods supported by matrixStats::colRanks().
+ */
+
+#define	AVERAGE_TIES	1
+#define	FIRST_TIES	2
+#define	LAST_TIES	3
+#define	RANDOM_TIES	4
+#define	MAX_TIES	5
+#define	MIN_TIES	6
+#define	DENSE_TIES	7
+
+static int get_ties_method(SEXP ties_method)
+{
+	if (!IS_CHARACTER(ties_method) || LENGTH(ties_method) != 1 ||
+	    STRING_ELT(ties_method, 0) == NA_STRING)
+		error("SparseArray internal error in get_ties_method():\n"
+		      "    'ties_method' must be a single string");
+	const char *s = CHAR(STRING_ELT(ties_method, 0));
+	if (strcmp(s, "average") == 0)
+		return AVERAGE_TIES;
+	if (strcmp(s, "first") == 0)
+		return FIRST_TIES;
+	if (strcmp(s, "last") == 0)
+		return LAST_TIES;
+	if (strcmp(s, "random") == 0)
+		return RANDOM_TIES;
+	if (strcmp(s, "max") == 0)
+		return MAX_TIES;
+	if (strcmp(s, "min") == 0)
+		return MIN_TIES;
+	if (strcmp(s, "dense") == 0)
+		return DENSE_TIES;
+	error("SparseArray internal error in get_ties_method():\n"
+	      "    unsupported ties method: \"%s\"", s);
+	return 0;  /* will never reach this */
+}
+
+
+/****************************************************************************
+ * Sorting the nonzero values of a column
+ */
+
+typedef struct ranked_val_t {
+	double val;
+	int k;  /* position of the value in the leaf */
+} RankedVal;
+
+static int compare_RankedVals(const void *p1, const void *p2)
+{
+	const RankedVal *rv1 = (const RankedVal *) p1;
+	const RankedVal *rv2 = (const RankedVal *) p2;
+	if (rv1->val < rv2->val)
+		return -1;
+	if (rv1->val > rv2->val)
+		return 1;
+	return rv1->k - rv2->k;
+}
+
+static inline unsigned int radix_digit(const RankedVal *rv, int shift)
+{
+	unsigned int u = (unsigned int) (int) rv->val ^ 0x80000000U;
+	return (u >> shift) & 0xFFU;
+}
+
+/* Stable LSD radix sort on the (integral) 'val' fields, 8 bits per pass.
+   The passes where all the values have the same digit are skipped.
+   Returns a pointer to the sorted array ('rvals' or 'tmp'). */
+static RankedVal *radix_sort_int_RankedVals(RankedVal *rvals, int n,
+					    RankedVal *tmp)
+{
+	int counts[256];
+	for (int shift = 0; shift < 32; shift += 8) {
+		memset(counts, 0, sizeof(counts));
+		for (int i = 0; i < n; i++)
+			counts[radix_digit(rvals + i, shift)]++;
+		if (counts[radix_digit(rvals, shift)] == n)
+			continue;
+		int pos = 0;
+		for (int d = 0; d < 256; d++) {
+			int c = counts[d];
+			counts[d] = pos;
+			pos += c;
+		}
+		for (int i = 0; i < n; i++)
+			tmp[counts[radix_digit(rvals + i, shift)]++] = rvals[i];
+		RankedVal *swap = rvals;
+		rvals = tmp;
+		tmp = swap;
+	}
+	return rvals;
+}
+
+/* Sorts by value, then by position in the leaf. */
+static RankedVal *sort_RankedVals(RankedVal *rvals, int n, int is_int,
+				  RankedVal *tmp)
+{
+	if (n <= 1)
+		return rvals;
+	if (is_int)
+		return radix_sort_int_RankedVals(rvals, n, tmp);
+	qsort(rvals, n, sizeof(RankedVal), compare_RankedVals);
+	return rvals;
+}
+
+
+/****************************************************************************
+ * Ranking a column
+ *
+ * The ranks of the nonzero values are computed from their sorted order.
+ * The zeros form a single block of tied values that sits between the
+ * negative and positive values so its rank is computed analytically.
+ * NAs and NaNs get an NA rank (like with 'na.last="keep"').
+ *
+ * In sparse mode, the rank of the zeros is subtracted from all the ranks,
+ * so zeros map to zero. A column with no zeros is ranked as if it contained
+ * one zero, so no nonzero value can map to zero.
+ */
+
+typedef struct rank_col_out_t {
+	void *out;
+	int is_double;
+	const int *nzoffs;  /* NULL in sparse mode */
+	R_xlen_t stride;
+} RankColOut;
+
+/* 'k' is the position of the value in the leaf. */
+static inline void set_rank(const RankColOut *col_out, int k, double rank)
+{
+	R_xlen_t i = col_out->nzoffs == NULL ? k :
+		     col_out->stride * col_out->nzoffs[k];
+	if (col_out->is_double) {
+		((double *) col_out->out)[i] = rank;
+	} else {
+		((int *) col_out->out)[i] = (int) rank;
+	}
+	return;
+}
+
+static inline void set_NA_rank(const RankColOut *col_out, int k)
+{
+	R_xlen_t i = col_out->nzoffs == NULL ? k :
+		     col_out->stride * col_out->nzoffs[k];
+	if (col_out->is_double) {
+		((double *) col_out->out)[i] = NA_REAL;
+	} else {
+		((int *) col_out->out)[i] = NA_INTEGER;
+	}
+	return;
+}
+
+static inline void set_zero_rank(const RankColOut *col_out, int row,
+				 double rank)
+{
+	R_xlen_t i = col_out->stride * row;
+	if (col_out->is_double) {
+		((double *) col_out->out)[i] = rank;
+	} else {
+		((int *) col_out->out)[i] = (int) rank;
+	}
+	return;
+}
+
+/* Stores a random permutation of '0, 1, ..., n - 1' in 'perm'. Uses R's
+   random number generator so is NOT thread-safe. */
+static void random_perm(int *perm, R_xlen_t n)
+{
+	for (R_xlen_t i = 0; i < n; i++)
+		perm[i] = (int) i;
+	for (R_xlen_t i = n - 1; i > 0; i--) {
+		R_xlen_t j = (R_xlen_t) (unif_rand() * (double) (i + 1));
+		int tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+	return;
+}
+
+/* Rank of the 't'-th value (in leaf order) of a group of 'L' tied values
+   that starts at 0-based position 'p' in the sorted column. */
+static inline double tied_rank(int ties, R_xlen_t p, R_xlen_t L, R_xlen_t t,
+			       double dense_rank, const int *perm)
+{
+	switch (ties) {
+	    case AVERAGE_TIES: return (double) p + (double) (L + 1) / 2.0;
+	    case FIRST_TIES:   return (double) (p + 1 + t);
+	    case LAST_TIES:    return (double) (p + L - t);
+	    case RANDOM_TIES:  return (double) (p + 1 + perm[t]);
+	    case MAX_TIES:     return (double) (p + L);
+	    case MIN_TIES:     return (double) (p + 1);
+	}
+	return dense_rank;  /* DENSE_TIES */
+}
+
+/* 'sv' is the column to rank. 'rvals' and 'tmp' must have room for
+   'sv->nzcount' values. 'perm' is only used with RANDOM_TIES and must have
+   room for 'sv->len' values. */
+static void rank_column(const SparseVec *sv, int ties, int sparse,
+		RankedVal *rvals, RankedVal *tmp, int *perm,
+		const RankColOut *col_out)
+{
+	const int *nzoffs = sv->nzoffs;
+	int nzcount = sv->nzcount;
+	int nrow = sv->len;
+
+	/* Collect the nonzero values that are not NA or NaN. */
+	int n = 0;
+	for (int k = 0; k < nzcount; k++) {
+		double v = get_SV_nzval_as_double(sv, k);
+		if (ISNAN(v)) {
+			set_NA_rank(col_out, k);
+			continue;
+		}
+		rvals[n].val = v;
+		rvals[n].k = k;
+		n++;
+	}
+	rvals = sort_RankedVals(rvals, n, sv->Rtype != REALSXP, tmp);
+
+	int nneg = 0, ndneg = 0;  /* nb of negative values (distinct) */
+	for ( ; nneg < n && rvals[nneg].val < 0.0; nneg++)
+		if (nneg == 0 || rvals[nneg].val != rvals[nneg - 1].val)
+			ndneg++;
+	R_xlen_t nzeros = (R_xlen_t) nrow - nzcount;
+	R_xlen_t npad = sparse && nzeros == 0 ? 1 : nzeros;
+	/* In sparse mode, 'ties' is never FIRST_TIES, LAST_TIES, or
+	   RANDOM_TIES so the zeros have a single rank. */
+	double shift = sparse ? tied_rank(ties, nneg, npad, 0, ndneg + 1, NULL)
+			      : 0.0;
+
+	/* Rank the nonzero values, one group of tied values at a time. */
+	double dense_rank = 0.0;
+	for (int g = 0; g < n; ) {
+		double val = rvals[g].val;
+		int L = 1;
+		while (g + L < n && rvals[g + L].val == val)
+			L++;
+		R_xlen_t p = g;
+		dense_rank += 1.0;
+		if (val > 0.0) {
+			p += npad;
+			if (g == nneg && npad != 0)
+				dense_rank += 1.0;  /* the zeros */
+		}
+		if (ties == RANDOM_TIES)
+			random_perm(perm, L);
+		for (int t = 0; t < L; t++) {
+			double rank = tied_rank(ties, p, L, t, dense_rank, perm);
+			set_rank(col_out, rvals[g + t].k, rank - shift);
+		}
+		g += L;
+	}
+	if (sparse || nzeros == 0)
+		return;
+
+	/* Rank the zeros (in row order). */
+	if (ties == RANDOM_TIES)
+		random_perm(perm, nzeros);
+	R_xlen_t t = 0;
+	int k = 0;
+	for (int row = 0; row < nrow; row++) {
+		if (k < nzcount && nzoffs[k] == row) {
+			k++;
+			continue;
+		}
+		double rank = tied_rank(ties, nneg, nzeros, t, ndneg + 1, perm);
+		set_zero_rank(col_out, row, rank);
+		t++;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * C_colRanks_SVT()
+ */
+
+/* Per-thread buffers. */
+typedef struct rank_bufs_t {
+	RankedVal *rvals;
+	RankedVal *tmp;
+	int *perm;
+} RankBufs;
+
+static RankBufs *alloc_RankBufs(int nthread, int nrow, int ties)
+{
+	RankBufs *bufs = (RankBufs *) R_alloc(nthread, sizeof(RankBufs));
+	for (int t = 0; t < nthread; t++) {
+		bufs[t].rvals = (RankedVal *) R_alloc(nrow, sizeof(RankedVal));
+		bufs[t].tmp = (RankedVal *) R_alloc(nrow, sizeof(RankedVal));
+		bufs[t].perm = ties == RANDOM_TIES ?
+			       (int *) R_alloc(nrow, sizeof(int)) : NULL;
+	}
+	return bufs;
+}
+
+/* Returns the SVT of the sparse result. */
+static SEXP sparse_colRanks(SEXPTYPE x_Rtype, SEXP x_SVT, int nrow, int ncol,
+			    int ties, SEXPTYPE ans_Rtype)
+{
+	if (x_SVT == R_NilValue)
+		return R_NilValue;
+	/* Allocate the output leaves. They share their 'nzoffs' with the
+	   input leaves. */
+	SEXP ans = PROTECT(NEW_LIST(ncol));
+	void **outs = (void **) R_alloc(ncol, sizeof(void *));
+	for (int j = 0; j < ncol; j++) {
+		outs[j] = NULL;
+		SEXP leaf = VECTOR_ELT(x_SVT, j);
+		if (leaf == R_NilValue)
+			continue;
+		SEXP nzoffs = get_leaf_nzoffs(leaf);
+		SEXP ans_nzvals = PROTECT(allocVector(ans_Rtype,
+						      XLENGTH(nzoffs)));
+		SET_VECTOR_ELT(ans, j, zip_leaf(ans_nzvals, nzoffs, 0));
+		outs[j] = DATAPTR(ans_nzvals);
+		UNPROTECT(1);
+	}
+
+	int nthread = _get_max_threads();
+	RankBufs *bufs = alloc_RankBufs(nthread, nrow, ties);
+	#pragma omp parallel num_threads(nthread)
+	{
+		const RankBufs *b = bufs + _get_thread_num();
+		#pragma omp for schedule(dynamic, 16)
+		for (int j = 0; j < ncol; j++) {
+			if (outs[j] == NULL)
+				continue;
+			SparseVec sv = get_SVT_col_as_SV(x_SVT, j,
+							 x_Rtype, nrow);
+			RankColOut col_out = { outs[j], ans_Rtype == REALSXP,
+					       NULL, 1 };
+			rank_column(&sv, ties, 1, b->rvals, b->tmp, b->perm,
+				    &col_out);
+		}
+	}
+	for (int j = 0; j < ncol; j++) {
+		SEXP leaf = VECTOR_ELT(ans, j);
+		if (leaf != R_NilValue)
+			_INPLACE_turn_into_lacunar_leaf_if_all_ones(leaf);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_colRanks_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT, SEXP ties_method,
+		    SEXP preserve_shape, SEXP sparse)
+{
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	if (x_Rtype != INTSXP && x_Rtype != LGLSXP && x_Rtype != REALSXP)
+		error("colRanks() and rowRanks() only support SparseMatrix "
+		      "objects of type() \"logical\", \"integer\", "
+		      "or \"double\"");
+	if (LENGTH(x_dim) != 2)
+		error("SparseArray internal error in C_colRanks_SVT():\n"
+		      "    'x' must have exactly 2 dimensions");
+	int nrow = INTEGER(x_dim)[0];
+	int ncol = INTEGER(x_dim)[1];
+	int ties = get_ties_method(ties_method);
+	int sparse0 = LOGICAL(sparse)[0];
+	if (sparse0 && (ties == FIRST_TIES || ties == LAST_TIES ||
+			ties == RANDOM_TIES))
+		error("sparse ranks are not supported when 'ties.method' "
+		      "is \"first\", \"last\", or \"random\"");
+	SEXPTYPE ans_Rtype = ties == AVERAGE_TIES ? REALSXP : INTSXP;
+	if (sparse0)
+		return sparse_colRanks(x_Rtype, x_SVT, nrow, ncol,
+				       ties, ans_Rtype);
+
+	/* matrixStats::colRanks() returns the ranks of each column of 'x'
+	   as a row of the result, unless 'preserveShape' is TRUE. */
+	int preserve = LOGICAL(preserve_shape)[0];
+	SEXP ans = PROTECT(preserve ? allocMatrix(ans_Rtype, nrow, ncol)
+				    : allocMatrix(ans_Rtype, ncol, nrow));
+	R_xlen_t col_inc = preserve ? nrow : 1;
+	R_xlen_t row_stride = preserve ? 1 : ncol;
+	int is_double = ans_Rtype == REALSXP;
+
+	/* Ties method "random" uses R's random number generator which is not
+	   thread-safe. */
+	int nthread = ties == RANDOM_TIES ? 1 : _get_max_threads();
+	RankBufs *bufs = alloc_RankBufs(nthread, nrow, ties);
+	if (ties == RANDOM_TIES)
+		GetRNGstate();
+	void *out = DATAPTR(ans);
+	#pragma omp parallel num_threads(nthread)
+	{
+		const RankBufs *b = bufs + _get_thread_num();
+		#pragma omp for schedule(dynamic, 16)
+		for (int j = 0; j < ncol; j++) {
+			SparseVec sv = get_SVT_col_as_SV(x_SVT, j,
+							 x_Rtype, nrow);
+			void *col_out_p = is_double ?
+				(void *) ((double *) out + col_inc * j) :
+				(void *) ((int *) out + col_inc * j);
+			RankColOut col_out = { col_out_p, is_double,
+					       sv.nzoffs, row_stride };
+			rank_column(&sv, ties, 0, b->rvals, b->tmp, b->perm,
+				    &col_out);
+		}
+	}
+	if (ties == RANDOM_TIES)
+		PutRNGstate();
+	UNPROTECT(1);
+	return ans;
+}
+
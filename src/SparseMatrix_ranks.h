@@ -0,0 +1,16 @@
+#ifndef _SPARSEMATRIX_RANKS_H_
+#define _SPARSEMATRIX_RANKS_H_
+
+#include <Rdefines.h>
+
+SEXP C_colRanks_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP ties_method,
+	SEXP preserve_shape,
+	SEXP sparse
+);
+
+#endif  /* _SPARSEMATRIX_RANKS_H_ */
+
@@ -115,6 +115,15 @@ static inline Rcomplex get_RcomplexSV_nzval(const SparseVec *sv, int k)
 	return nzvals_p == NULL ? Rcomplex1 : nzvals_p[k];
 }
 
+/* For an int or double SparseVec. Integer NAs are turned into NA_REAL. */
+static inline double get_SV_nzval_as_double(const SparseVec *sv, int k)
+{
+	if (sv->Rtype == REALSXP)
+		return get_doubleSV_nzval(sv, k);
+	int v = get_intSV_nzval(sv, k);
+	return v == NA_INTEGER ? NA_REAL : (double) v;
+}
+
 static inline int smallest_offset(
 		const int *offs1, int n1,
 		const int *offs2, int n2,
@@ -7,111 +7,148 @@
 
 #include <math.h>   /* for fabs(), sqrt(), floor(), ceil(), trunc(),
 		       log1p(), expm1(), sin(), asin(), tan(), atan(),
-		       sinh(), asinh(), tanh(), atanh() */
+		       sinh(), asinh(), tanh(), atanh(), nearbyint() */
 #include <Rmath.h>  /* for sign(), sinpi(), tanpi(), fround(), fprec() */
 
-#include <string.h> /* for strcmp() */
+#include <string.h> /* for strcmp(), memcpy() */
 
 
-static int NaNs_produced_flag;
+/****************************************************************************
+ * _get_Math_opcode()
+ */
 
-static inline void set_NaNs_produced_flag(int flag)
+int _get_Math_opcode(SEXP op)
 {
-	NaNs_produced_flag = flag;
-	return;
-}
+	if (!IS_CHARACTER(op) || LENGTH(op) != 1)
+		error("SparseArray internal error in _get_Math_opcode():\n"
+		      "    'op' must be a single string");
+	op = STRING_ELT(op, 0);
+	if (op == NA_STRING)
+		error("SparseArray internal error in _get_Math_opcode():\n"
+		      "    'op' cannot be NA");
+	const char *s = CHAR(op);
 
-static inline int get_NaNs_produced_flag(void)
-{
-	return NaNs_produced_flag;
+	/* 'Math' group */
+	if (strcmp(s, "abs") == 0)
+		return ABS_OPCODE;
+	if (strcmp(s, "sign") == 0)
+		return SIGN_OPCODE;
+	if (strcmp(s, "sqrt") == 0)
+		return SQRT_OPCODE;
+	if (strcmp(s, "floor") == 0)
+		return FLOOR_OPCODE;
+	if (strcmp(s, "ceiling") == 0)
+		return CEILING_OPCODE;
+	if (strcmp(s, "trunc") == 0)
+		return TRUNC_OPCODE;
+	if (strcmp(s, "log1p") == 0)
+		return LOG1P_OPCODE;
+	if (strcmp(s, "expm1") == 0)
+		return EXPM1_OPCODE;
+	if (strcmp(s, "sin") == 0)
+		return SIN_OPCODE;
+	if (strcmp(s, "sinpi") == 0)
+		return SINPI_OPCODE;
+	if (strcmp(s, "asin") == 0)
+		return ASIN_OPCODE;
+	if (strcmp(s, "tan") == 0)
+		return TAN_OPCODE;
+	if (strcmp(s, "tanpi") == 0)
+		return TANPI_OPCODE;
+	if (strcmp(s, "atan") == 0)
+		return ATAN_OPCODE;
+	if (strcmp(s, "sinh") == 0)
+		return SINH_OPCODE;
+	if (strcmp(s, "asinh") == 0)
+		return ASINH_OPCODE;
+	if (strcmp(s, "tanh") == 0)
+		return TANH_OPCODE;
+	if (strcmp(s, "atanh") == 0)
+		return ATANH_OPCODE;
+
+	/* 'Math2' group */
+	if (strcmp(s, "round") == 0)
+		return ROUND_OPCODE;
+	if (strcmp(s, "signif") == 0)
+		return SIGNIF_OPCODE;
+
+	error("SparseArray internal error in _get_Math_opcode():\n"
+	      "    unsupported 'Math' or 'Math2' function: \"%s\"", s);
+	return 0;  /* will never reach this */
 }
 
 
 /****************************************************************************
- * _get_MathFUN()
+ * _Math_doubles()
+ *
+ * One tight loop per operation: no function pointer is called on each
+ * element, and no global state is touched, so _Math_doubles() can be called
+ * concurrently from several threads. The loops for abs(), sqrt(), and
+ * round() (with 'digits' set to 0) can be auto-vectorized by the compiler.
  */
 
-#define	FUNDEF_Rmath_double(funname)		\
-	(double x)				\
+#define	MATH_LOOP(expr)				\
 {						\
-	double v = funname(x);			\
-	if (ISNAN(v) && !ISNAN(x))		\
-		set_NaNs_produced_flag(1);	\
-	return v;				\
+	for (int k = 0; k < n; k++) {		\
+		double v = x[k];		\
+		out[k] = (expr);		\
+	}					\
+	break;					\
 }
 
-static inline double Rabs_double	FUNDEF_Rmath_double(fabs)
-static inline double Rsign_double	FUNDEF_Rmath_double(sign)
-static inline double Rsqrt_double	FUNDEF_Rmath_double(sqrt)
-static inline double Rfloor_double	FUNDEF_Rmath_double(floor)
-static inline double Rceiling_double	FUNDEF_Rmath_double(ceil)
-static inline double Rtrunc_double	FUNDEF_Rmath_double(trunc)
-static inline double Rlog1p_double	FUNDEF_Rmath_double(log1p)
-static inline double Rexpm1_double	FUNDEF_Rmath_double(expm1)
-static inline double Rsin_double	FUNDEF_Rmath_double(sin)
-static inline double Rsinpi_double	FUNDEF_Rmath_double(sinpi)
-static inline double Rasin_double	FUNDEF_Rmath_double(asin)
-static inline double Rtan_double	FUNDEF_Rmath_double(tan)
-static inline double Rtanpi_double	FUNDEF_Rmath_double(tanpi)
-static inline double Ratan_double	FUNDEF_Rmath_double(atan)
-static inline double Rsinh_double	FUNDEF_Rmath_double(sinh)
-static inline double Rasinh_double	FUNDEF_Rmath_double(asinh)
-static inline double Rtanh_double	FUNDEF_Rmath_double(tanh)
-static inline double Ratanh_double	FUNDEF_Rmath_double(atanh)
-
-static double digits0;  /* yes, double! don't ask me why */
-static inline double Rround_double(double x) { return fround(x, digits0); }
-static inline double Rsignif_double(double x) { return fprec(x, digits0); }
-
-MathFUN _get_MathFUN(const char *op)
+static void map_Math_op(int opcode, const double *x, int n, double digits,
+		double *out)
 {
-	/* 'Math' group */
-	if (strcmp(op, "abs") == 0)
-		return Rabs_double;
-	if (strcmp(op, "sign") == 0)
-		return Rsign_double;
-	if (strcmp(op, "sqrt") == 0)
-		return Rsqrt_double;
-	if (strcmp(op, "floor") == 0)
-		return Rfloor_double;
-	if (strcmp(op, "ceiling") == 0)
-		return Rceiling_double;
-	if (strcmp(op, "trunc") == 0)
-		return Rtrunc_double;
-	if (strcmp(op, "log1p") == 0)
-		return Rlog1p_double;
-	if (strcmp(op, "expm1") == 0)
-		return Rexpm1_double;
-	if (strcmp(op, "sin") == 0)
-		return Rsin_double;
-	if (strcmp(op, "sinpi") == 0)
-		return Rsinpi_double;
-	if (strcmp(op, "asin") == 0)
-		return Rasin_double;
-	if (strcmp(op, "tan") == 0)
-		return Rtan_double;
-	if (strcmp(op, "tanpi") == 0)
-		return Rtanpi_double;
-	if (strcmp(op, "atan") == 0)
-		return Ratan_double;
-	if (strcmp(op, "sinh") == 0)
-		return Rsinh_double;
-	if (strcmp(op, "asinh") == 0)
-		return Rasinh_double;
-	if (strcmp(op, "tanh") == 0)
-		return Rtanh_double;
-	if (strcmp(op, "atanh") == 0)
-		return Ratanh_double;
+	switch (opcode) {
+	    case ABS_OPCODE:     MATH_LOOP(fabs(v))
+	    case SIGN_OPCODE:    MATH_LOOP(sign(v))
+	    case SQRT_OPCODE:    MATH_LOOP(sqrt(v))
+	    case FLOOR_OPCODE:   MATH_LOOP(floor(v))
+	    case CEILING_OPCODE: MATH_LOOP(ceil(v))
+	    case TRUNC_OPCODE:   MATH_LOOP(trunc(v))
+	    case LOG1P_OPCODE:   MATH_LOOP(log1p(v))
+	    case EXPM1_OPCODE:   MATH_LOOP(expm1(v))
+	    case SIN_OPCODE:     MATH_LOOP(sin(v))
+	    case SINPI_OPCODE:   MATH_LOOP(sinpi(v))
+	    case ASIN_OPCODE:    MATH_LOOP(asin(v))
+	    case TAN_OPCODE:     MATH_LOOP(tan(v))
+	    case TANPI_OPCODE:   MATH_LOOP(tanpi(v))
+	    case ATAN_OPCODE:    MATH_LOOP(atan(v))
+	    case SINH_OPCODE:    MATH_LOOP(sinh(v))
+	    case ASINH_OPCODE:   MATH_LOOP(asinh(v))
+	    case TANH_OPCODE:    MATH_LOOP(tanh(v))
+	    case ATANH_OPCODE:   MATH_LOOP(atanh(v))
+	    case ROUND_OPCODE:
+		/* fround(v, 0) is nearbyint(v) (round half to even). */
+		if (digits == 0.0)
+			MATH_LOOP(nearbyint(v))
+		MATH_LOOP(fround(v, digits))
+	    case SIGNIF_OPCODE:  MATH_LOOP(fprec(v, digits))
+	    default:
+		error("SparseArray internal error in map_Math_op():\n"
+		      "    unsupported 'opcode' value: %d", opcode);
+	}
+	return;
+}
 
-	/* 'Math2' group */
-	if (strcmp(op, "round") == 0)
-		return Rround_double;
-	if (strcmp(op, "signif") == 0)
-		return Rsignif_double;
-
-	error("SparseArray internal error in _get_MathFUN():\n"
-	      "    unsupported 'Math' or 'Math2' function: \"%s\"", op);
-	return NULL;  /* will never reach this */
+/* Computes 'out[k] = op(x[k])' for 'k' in '[0, n)' and returns the number
+   of zeros in 'out'. Sets '*newNaNs' to 1 if NaNs were produced (i.e. if
+   'op(x[k])' is NaN for a non-NaN 'x[k]'), and leaves it untouched
+   otherwise. 'out' must not overlap with 'x'. Thread-safe (as long as
+   error() is not called, which can only happen with an invalid 'opcode'). */
+int _Math_doubles(int opcode, const double *x, int n, double digits,
+		double *out, int *newNaNs)
+{
+	map_Math_op(opcode, x, n, digits, out);
+	int nzeros = 0, nans = 0;
+	for (int k = 0; k < n; k++) {
+		double v = out[k];
+		nzeros += v == double0;
+		nans |= ISNAN(v) && !ISNAN(x[k]);
+	}
+	if (nans)
+		*newNaNs = 1;
+	return nzeros;
 }
 
 
@@ -119,32 +156,33 @@ MathFUN _get_MathFUN(const char *op)
  * _Math_doubleSV()
  */
 
-int _Math_doubleSV(MathFUN fun, const SparseVec *sv, double digits,
+int _Math_doubleSV(int opcode, const SparseVec *sv, double digits,
 		double *out_nzvals, int *out_nzoffs, int *newNaNs)
 {
-	set_NaNs_produced_flag(0);
-	digits0 = digits;
 	const double *nzvals_p = get_doubleSV_nzvals_p(sv);
 	if (nzvals_p == NULL) {  /* lacunar SparseVec */
-		double v = fun(1.0);
-		if (v == double0)
+		double one = 1.0;
+		if (_Math_doubles(opcode, &one, 1, digits,
+				  out_nzvals, newNaNs) != 0)
 			return 0;
-		out_nzvals[0] = v;
 		return PROPAGATE_NZOFFS;
 	}
 	/* regular SparseVec */
 	int nzcount = get_SV_nzcount(sv);
+	int nzeros = _Math_doubles(opcode, nzvals_p, nzcount, digits,
+				   out_nzvals, newNaNs);
+	if (nzeros == 0) {
+		memcpy(out_nzoffs, sv->nzoffs, sizeof(int) * nzcount);
+		return nzcount;
+	}
 	int out_nzcount = 0;
 	for (int k = 0; k < nzcount; k++) {
-		double v = fun(nzvals_p[k]);
+		double v = out_nzvals[k];
 		if (v != double0) {
 			out_nzvals[out_nzcount] = v;
 			out_nzoffs[out_nzcount] = sv->nzoffs[k];
 			out_nzcount++;
 		}
 	}
-	if (get_NaNs_produced_flag())
-		*newNaNs = 1;
 	return out_nzcount;
 }
-
@@ -5,12 +5,43 @@
 
 #include "SparseVec.h"
 
-typedef double (*MathFUN)(double);
+/* 'Math' group */
+#define	ABS_OPCODE	 1
+#define	SIGN_OPCODE	 2
+#define	SQRT_OPCODE	 3
+#define	FLOOR_OPCODE	 4
+#define	CEILING_OPCODE	 5
+#define	TRUNC_OPCODE	 6
+#define	LOG1P_OPCODE	 7
+#define	EXPM1_OPCODE	 8
+#define	SIN_OPCODE	 9
+#define	SINPI_OPCODE	10
+#define	ASIN_OPCODE	11
+#define	TAN_OPCODE	12
+#define	TANPI_OPCODE	13
+#define	ATAN_OPCODE	14
+#define	SINH_OPCODE	15
+#define	ASINH_OPCODE	16
+#define	TANH_OPCODE	17
+#define	ATANH_OPCODE	18
 
-MathFUN _get_MathFUN(const char *op);
+/* 'Math2' group */
+#define	ROUND_OPCODE	19
+#define	SIGNIF_OPCODE	20
+
+int _get_Math_opcode(SEXP op);
+
+int _Math_doubles(
+	int opcode,
+	const double *x,
+	int n,
+	double digits,
+	double *out,
+	int *newNaNs
+);
 
 int _Math_doubleSV(
-	MathFUN fun,
+	int opcode,
 	const SparseVec *sv,
 	double digits,
 	double *out_nzvals,
@@ -19,4 +50,3 @@ int _Math_doubleSV(
 );
 
 #endif  /* _SPARSEVEC_MATH_H_ */
-
@@ -5,7 +5,505 @@
 
 #include "SparseVec.h"
 
+/* The AVX2 and AVX-512 kernels below are compiled with GCC/Clang function
+   attributes so they don't require any special compilation flag, and are
+   only used if the CPU supports them (runtime dispatch).
+   They are disabled on Windows where GCC doesn't guarantee the 32-byte and
+   64-byte stack alignment needed by spilled AVX registers. Define
+   SPARSEARRAY_NO_SIMD to disable them on other platforms. */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(_WIN32) && !defined(SPARSEARRAY_NO_SIMD)
+#define USE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
+
+/****************************************************************************
+ * Gather-based kernels
+ *
+ * Used by _dotprod_doubleSV_finite_doubles() and _dotprod_intSV_noNA_ints().
+ * The "sum" kernels are for lacunar SparseVecs, where the dot product
+ * reduces to the sum of the gathered values.
+ * All the kernels use several independent accumulators to hide the latency
+ * of the floating-point additions. Note that this means that the order in
+ * which the products get summed is not the order of the offsets, and that
+ * it depends on the kernel picked at runtime (i.e. on the CPU). So results
+ * can differ in the last bits across machines. FMA is deliberately not
+ * used: it would add a second source of CPU-dependent rounding. Define
+ * SPARSEARRAY_NO_SIMD to get the portable kernels everywhere.
+ */
+
+/* Below this nb of nonzero values, the SIMD kernels don't pay off. */
+#define MIN_SIMD_NZCOUNT 16
+
+/* Portable versions. */
+
+static double sum_gathered_doubles(const double *x,
+		const int *offs, int n)
+{
+	double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0, acc3 = 0.0;
+	int k = 0;
+	for ( ; k + 4 <= n; k += 4) {
+		acc0 += x[offs[k]];
+		acc1 += x[offs[k + 1]];
+		acc2 += x[offs[k + 2]];
+		acc3 += x[offs[k + 3]];
+	}
+	for ( ; k < n; k++)
+		acc0 += x[offs[k]];
+	return (acc0 + acc1) + (acc2 + acc3);
+}
+
+static double dotprod_gathered_doubles(const double *vals,
+		const int *offs, int n, const double *x)
+{
+	double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0, acc3 = 0.0;
+	int k = 0;
+	for ( ; k + 4 <= n; k += 4) {
+		acc0 += vals[k] * x[offs[k]];
+		acc1 += vals[k + 1] * x[offs[k + 1]];
+		acc2 += vals[k + 2] * x[offs[k + 2]];
+		acc3 += vals[k + 3] * x[offs[k + 3]];
+	}
+	for ( ; k < n; k++)
+		acc0 += vals[k] * x[offs[k]];
+	return (acc0 + acc1) + (acc2 + acc3);
+}
+
+static double sum_gathered_ints(const int *x, const int *offs, int n)
+{
+	double acc0 = 0.0, acc1 = 0.0;
+	int k = 0;
+	for ( ; k + 2 <= n; k += 2) {
+		acc0 += (double) x[offs[k]];
+		acc1 += (double) x[offs[k + 1]];
+	}
+	if (k < n)
+		acc0 += (double) x[offs[k]];
+	return acc0 + acc1;
+}
+
+/* Returns NA_REAL if 'vals' contains NAs. */
+static double dotprod_gathered_ints(const int *vals,
+		const int *offs, int n, const int *x)
+{
+	double acc0 = 0.0, acc1 = 0.0;
+	int k = 0;
+	for ( ; k + 2 <= n; k += 2) {
+		int v0 = vals[k], v1 = vals[k + 1];
+		if (v0 == NA_INTEGER || v1 == NA_INTEGER)
+			return NA_REAL;
+		acc0 += (double) v0 * x[offs[k]];
+		acc1 += (double) v1 * x[offs[k + 1]];
+	}
+	if (k < n) {
+		int v0 = vals[k];
+		if (v0 == NA_INTEGER)
+			return NA_REAL;
+		acc0 += (double) v0 * x[offs[k]];
+	}
+	return acc0 + acc1;
+}
+
+#ifdef USE_X86_SIMD
+
+/* AVX2 versions. */
+
+__attribute__((target("avx2")))
+static double hsum_m256d(__m256d v)
+{
+	__m128d lo = _mm256_castpd256_pd128(v);
+	__m128d hi = _mm256_extractf128_pd(v, 1);
+	lo = _mm_add_pd(lo, hi);
+	return _mm_cvtsd_f64(lo) + _mm_cvtsd_f64(_mm_unpackhi_pd(lo, lo));
+}
+
+__attribute__((target("avx2")))
+static double sum_gathered_doubles_avx2(const double *x,
+		const int *offs, int n)
+{
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd(),
+		acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+	int k = 0;
+	for ( ; k + 16 <= n; k += 16) {
+		const __m128i *p = (const __m128i *) (offs + k);
+		acc0 = _mm256_add_pd(acc0,
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p), 8));
+		acc1 = _mm256_add_pd(acc1,
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p + 1), 8));
+		acc2 = _mm256_add_pd(acc2,
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p + 2), 8));
+		acc3 = _mm256_add_pd(acc3,
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p + 3), 8));
+	}
+	for ( ; k + 4 <= n; k += 4) {
+		const __m128i *p = (const __m128i *) (offs + k);
+		acc0 = _mm256_add_pd(acc0,
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p), 8));
+	}
+	double ans = hsum_m256d(_mm256_add_pd(_mm256_add_pd(acc0, acc1),
+					      _mm256_add_pd(acc2, acc3)));
+	for ( ; k < n; k++)
+		ans += x[offs[k]];
+	return ans;
+}
+
+__attribute__((target("avx2")))
+static double dotprod_gathered_doubles_avx2(const double *vals,
+		const int *offs, int n, const double *x)
+{
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd(),
+		acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+	int k = 0;
+	for ( ; k + 16 <= n; k += 16) {
+		const __m128i *p = (const __m128i *) (offs + k);
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(
+			_mm256_loadu_pd(vals + k),
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p), 8)));
+		acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(
+			_mm256_loadu_pd(vals + k + 4),
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p + 1), 8)));
+		acc2 = _mm256_add_pd(acc2, _mm256_mul_pd(
+			_mm256_loadu_pd(vals + k + 8),
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p + 2), 8)));
+		acc3 = _mm256_add_pd(acc3, _mm256_mul_pd(
+			_mm256_loadu_pd(vals + k + 12),
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p + 3), 8)));
+	}
+	for ( ; k + 4 <= n; k += 4) {
+		const __m128i *p = (const __m128i *) (offs + k);
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(
+			_mm256_loadu_pd(vals + k),
+			_mm256_i32gather_pd(x, _mm_loadu_si128(p), 8)));
+	}
+	double ans = hsum_m256d(_mm256_add_pd(_mm256_add_pd(acc0, acc1),
+					      _mm256_add_pd(acc2, acc3)));
+	for ( ; k < n; k++)
+		ans += vals[k] * x[offs[k]];
+	return ans;
+}
+
+__attribute__((target("avx2")))
+static double sum_gathered_ints_avx2(const int *x, const int *offs, int n)
+{
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	int k = 0;
+	for ( ; k + 8 <= n; k += 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *) (offs + k));
+		__m256i g = _mm256_i32gather_epi32(x, idx, 4);
+		acc0 = _mm256_add_pd(acc0,
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(g)));
+		acc1 = _mm256_add_pd(acc1,
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(g, 1)));
+	}
+	double ans = hsum_m256d(_mm256_add_pd(acc0, acc1));
+	for ( ; k < n; k++)
+		ans += (double) x[offs[k]];
+	return ans;
+}
+
+__attribute__((target("avx2")))
+static double dotprod_gathered_ints_avx2(const int *vals,
+		const int *offs, int n, const int *x)
+{
+	const __m256i na = _mm256_set1_epi32(NA_INTEGER);
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	int k = 0;
+	for ( ; k + 8 <= n; k += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (vals + k));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, na)))
+			return NA_REAL;
+		__m256i idx = _mm256_loadu_si256((const __m256i *) (offs + k));
+		__m256i g = _mm256_i32gather_epi32(x, idx, 4);
+		acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)),
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(g))));
+		acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)),
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(g, 1))));
+	}
+	double ans = hsum_m256d(_mm256_add_pd(acc0, acc1));
+	for ( ; k < n; k++) {
+		int v = vals[k];
+		if (v == NA_INTEGER)
+			return NA_REAL;
+		ans += (double) v * x[offs[k]];
+	}
+	return ans;
+}
+
+/* AVX-512 versions. */
+
+__attribute__((target("avx512f")))
+static double sum_gathered_doubles_avx512(const double *x,
+		const int *offs, int n)
+{
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int k = 0;
+	for ( ; k + 16 <= n; k += 16) {
+		const __m256i *p = (const __m256i *) (offs + k);
+		acc0 = _mm512_add_pd(acc0,
+			_mm512_i32gather_pd(_mm256_loadu_si256(p), x, 8));
+		acc1 = _mm512_add_pd(acc1,
+			_mm512_i32gather_pd(_mm256_loadu_si256(p + 1), x, 8));
+	}
+	double ans = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+	for ( ; k < n; k++)
+		ans += x[offs[k]];
+	return ans;
+}
+
+__attribute__((target("avx512f")))
+static double dotprod_gathered_doubles_avx512(const double *vals,
+		const int *offs, int n, const double *x)
+{
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int k = 0;
+	for ( ; k + 16 <= n; k += 16) {
+		const __m256i *p = (const __m256i *) (offs + k);
+		acc0 = _mm512_add_pd(acc0, _mm512_mul_pd(
+			_mm512_loadu_pd(vals + k),
+			_mm512_i32gather_pd(_mm256_loadu_si256(p), x, 8)));
+		acc1 = _mm512_add_pd(acc1, _mm512_mul_pd(
+			_mm512_loadu_pd(vals + k + 8),
+			_mm512_i32gather_pd(_mm256_loadu_si256(p + 1), x, 8)));
+	}
+	double ans = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+	for ( ; k < n; k++)
+		ans += vals[k] * x[offs[k]];
+	return ans;
+}
+
+__attribute__((target("avx512f")))
+static double sum_gathered_ints_avx512(const int *x, const int *offs, int n)
+{
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int k = 0;
+	for ( ; k + 16 <= n; k += 16) {
+		__m512i idx = _mm512_loadu_si512((const void *) (offs + k));
+		__m512i g = _mm512_i32gather_epi32(idx, x, 4);
+		acc0 = _mm512_add_pd(acc0,
+			_mm512_cvtepi32_pd(_mm512_castsi512_si256(g)));
+		acc1 = _mm512_add_pd(acc1,
+			_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(g, 1)));
+	}
+	double ans = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+	for ( ; k < n; k++)
+		ans += (double) x[offs[k]];
+	return ans;
+}
+
+__attribute__((target("avx512f")))
+static double dotprod_gathered_ints_avx512(const int *vals,
+		const int *offs, int n, const int *x)
+{
+	const __m512i na = _mm512_set1_epi32(NA_INTEGER);
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int k = 0;
+	for ( ; k + 16 <= n; k += 16) {
+		__m512i v = _mm512_loadu_si512((const void *) (vals + k));
+		if (_mm512_cmpeq_epi32_mask(v, na))
+			return NA_REAL;
+		__m512i idx = _mm512_loadu_si512((const void *) (offs + k));
+		__m512i g = _mm512_i32gather_epi32(idx, x, 4);
+		acc0 = _mm512_add_pd(acc0, _mm512_mul_pd(
+			_mm512_cvtepi32_pd(_mm512_castsi512_si256(v)),
+			_mm512_cvtepi32_pd(_mm512_castsi512_si256(g))));
+		acc1 = _mm512_add_pd(acc1, _mm512_mul_pd(
+			_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(v, 1)),
+			_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(g, 1))));
+	}
+	double ans = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+	for ( ; k < n; k++) {
+		int v = vals[k];
+		if (v == NA_INTEGER)
+			return NA_REAL;
+		ans += (double) v * x[offs[k]];
+	}
+	return ans;
+}
+
+#endif  /* USE_X86_SIMD */
+
+/* Runtime dispatch. */
+
+#define SIMD_LEVEL_NONE   0
+#define SIMD_LEVEL_AVX2   1
+#define SIMD_LEVEL_AVX512 2
+
+/* Set once by _init_SIMD_dispatch() when the package's shared object is
+   loaded, i.e. before any parallel region can read it. */
+static int simd_level = SIMD_LEVEL_NONE;
+
+/* Called by R_init_SparseArray(). */
+void _init_SIMD_dispatch(void)
+{
+	int level = SIMD_LEVEL_NONE;
+#ifdef USE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		level = SIMD_LEVEL_AVX512;
+	else if (__builtin_cpu_supports("avx2"))
+		level = SIMD_LEVEL_AVX2;
+#endif
+	simd_level = level;
+	return;
+}
+
+#ifdef USE_X86_SIMD
+#define DISPATCH(kernel, n, ...)					\
+{									\
+	if ((n) >= MIN_SIMD_NZCOUNT) {					\
+		switch (simd_level) {					\
+		    case SIMD_LEVEL_AVX512:				\
+			return kernel ## _avx512(__VA_ARGS__);		\
+		    case SIMD_LEVEL_AVX2:				\
+			return kernel ## _avx2(__VA_ARGS__);		\
+		}							\
+	}								\
+	return kernel(__VA_ARGS__);					\
+}
+#else
+#define DISPATCH(kernel, n, ...)					\
+{									\
+	return kernel(__VA_ARGS__);					\
+}
+#endif
+
+static double dispatch_sum_gathered_doubles(const double *x,
+		const int *offs, int n)
+DISPATCH(sum_gathered_doubles, n, x, offs, n)
+
+static double dispatch_dotprod_gathered_doubles(const double *vals,
+		const int *offs, int n, const double *x)
+DISPATCH(dotprod_gathered_doubles, n, vals, offs, n, x)
+
+static double dispatch_sum_gathered_ints(const int *x,
+		const int *offs, int n)
+DISPATCH(sum_gathered_ints, n, x, offs, n)
+
+static double dispatch_dotprod_gathered_ints(const int *vals,
+		const int *offs, int n, const int *x)
+DISPATCH(dotprod_gathered_ints, n, vals, offs, n, x)
+
+
+/****************************************************************************
+ * Sorted-offset intersection kernels
+ *
+ * Behind _dotprod_finite_doubleSV_doubleSV(). Each kernel computes the sum
+ * of 'nzvals1[k1] * nzvals2[k2]' over all the (k1, k2) pairs such that
+ * 'nzoffs1[k1] == nzoffs2[k2]'. 'nzvals1' and/or 'nzvals2' can be NULL
+ * (lacunar SparseVec).
+ * There is no SIMD kernel here: when the 2 SparseVecs have comparable
+ * nonzero counts, the crossprod() code gathers the nonzero values of one
+ * from the dense form of the other instead, which is much faster than any
+ * merge of the offsets.
+ */
+
+static inline double prod_nzvals(const double *nzvals1, int k1,
+				 const double *nzvals2, int k2)
+{
+	double v1 = nzvals1 == NULL ? double1 : nzvals1[k1];
+	double v2 = nzvals2 == NULL ? double1 : nzvals2[k2];
+	return v1 * v2;
+}
+
+/* Linear merge with branchless advance of 'k1' and 'k2'. */
+static double intersect_dotprod_merge(
+		const double *nzvals1, const int *nzoffs1, int n1,
+		const double *nzvals2, const int *nzoffs2, int n2)
+{
+	double ans = 0.0;
+	int k1 = 0, k2 = 0;
+	while (k1 < n1 && k2 < n2) {
+		int off1 = nzoffs1[k1], off2 = nzoffs2[k2];
+		if (off1 == off2) {
+			ans += prod_nzvals(nzvals1, k1, nzvals2, k2);
+			k1++;
+			k2++;
+			continue;
+		}
+		k1 += off1 < off2;
+		k2 += off1 > off2;
+	}
+	return ans;
+}
+
+/* For each offset in the small SparseVec ('n1' nonzero values), looks up
+   the offset in the big one with an exponential search followed by a
+   binary search. Cost is O(n1 * log(n2 / n1)) instead of O(n1 + n2). */
+static double intersect_dotprod_gallop(
+		const double *nzvals1, const int *nzoffs1, int n1,
+		const double *nzvals2, const int *nzoffs2, int n2)
+{
+	double ans = 0.0;
+	int k2 = 0;
+	for (int k1 = 0; k1 < n1 && k2 < n2; k1++) {
+		int target = nzoffs1[k1];
+		/* Find 'lo' and 'hi' such that all the offsets before 'lo' are
+		   < 'target' and 'hi' is n2 or the position of an offset that
+		   is >= 'target'. */
+		int lo = k2, hi = k2, step = 1;
+		while (hi < n2 && nzoffs2[hi] < target) {
+			lo = hi + 1;
+			hi += step;
+			step <<= 1;
+		}
+		if (hi > n2)
+			hi = n2;
+		/* Binary search for the first offset >= 'target'. */
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (nzoffs2[mid] < target)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		k2 = lo;
+		if (k2 < n2 && nzoffs2[k2] == target) {
+			ans += prod_nzvals(nzvals1, k1, nzvals2, k2);
+			k2++;
+		}
+	}
+	return ans;
+}
+
+/* Picks the kernel based on the relative sizes of the 2 SparseVecs. */
+static double intersect_dotprod(const SparseVec *sv1, const SparseVec *sv2)
+{
+	const double *nzvals1 = get_doubleSV_nzvals_p(sv1);
+	const double *nzvals2 = get_doubleSV_nzvals_p(sv2);
+	const int *nzoffs1 = sv1->nzoffs, *nzoffs2 = sv2->nzoffs;
+	int n1 = get_SV_nzcount(sv1), n2 = get_SV_nzcount(sv2);
+	if (n1 > n2) {
+		/* Swap so that 'sv1' is the smallest. */
+		const double *tmp_vals = nzvals1;
+		nzvals1 = nzvals2;
+		nzvals2 = tmp_vals;
+		const int *tmp_offs = nzoffs1;
+		nzoffs1 = nzoffs2;
+		nzoffs2 = tmp_offs;
+		int tmp_n = n1;
+		n1 = n2;
+		n2 = tmp_n;
+	}
+	if ((double) n1 * GALLOP_MIN_RATIO <= (double) n2)
+		return intersect_dotprod_gallop(nzvals1, nzoffs1, n1,
+						nzvals2, nzoffs2, n2);
+	return intersect_dotprod_merge(nzvals1, nzoffs1, n1,
+				       nzvals2, nzoffs2, n2);
+}
+
+
+
+/****************************************************************************
+ * Dot product functions
+ */
+
+
+/* Walks on the union of the offsets because something like Inf * 0 is NaN.
+   If 'sv1' and 'sv2' are known to be finite, use the much faster
+   _dotprod_finite_doubleSV_doubleSV() below. */
 double _dotprod_doubleSV_doubleSV(const SparseVec *sv1, const SparseVec *sv2)
 {
 	double ans = 0.0, val1, val2;
@@ -20,6 +518,31 @@ double _dotprod_doubleSV_doubleSV(const SparseVec *sv1, const SparseVec *sv2)
 	return ans;
 }
 
+/* Safe to use only if 'sv1' and 'sv2' are both finite i.e. contain no NA,
+   NaN, Inf, or -Inf. This is NOT checked! Callers that compute many dot
+   products with the same SparseVecs are expected to check this once per
+   SparseVec (e.g. with _doubleSV_is_finite()) and cache the result.
+   Only the values at common offsets contribute to the result so we only
+   walk on the intersection of the offsets. */
+double _dotprod_finite_doubleSV_doubleSV(const SparseVec *sv1,
+					 const SparseVec *sv2)
+{
+	return intersect_dotprod(sv1, sv2);
+}
+
+/* Returns 1 if 'sv' contains no NA, NaN, Inf, or -Inf, and 0 otherwise. */
+int _doubleSV_is_finite(const SparseVec *sv)
+{
+	const double *nzvals_p = get_doubleSV_nzvals_p(sv);
+	if (nzvals_p == NULL)  /* lacunar SparseVec */
+		return 1;
+	int nzcount = get_SV_nzcount(sv);
+	for (int k = 0; k < nzcount; k++)
+		if (!R_FINITE(nzvals_p[k]))
+			return 0;
+	return 1;
+}
+
 /* Safe to use only if 'x2' is finite i.e. contains no NA, NaN, Inf, or -Inf,
    or if 'sv1' and 'x2' represent the same numeric vector (in sparse and
    dense form, respectively).
@@ -28,19 +551,13 @@ double _dotprod_doubleSV_doubleSV(const SparseVec *sv1, const SparseVec *sv2)
    This is NOT checked! */
 double _dotprod_doubleSV_finite_doubles(const SparseVec *sv1, const double *x2)
 {
-	double ans = 0.0;
 	const double *nzvals1_p = get_doubleSV_nzvals_p(sv1);
 	int nzcount1 = get_SV_nzcount(sv1);
-	if (nzvals1_p == NULL) {
-		/* lacunar SparseVec */
-		for (int k1 = 0; k1 < nzcount1; k1++)
-			ans += x2[sv1->nzoffs[k1]];
-	} else {
-		/* regular SparseVec */
-		for (int k1 = 0; k1 < nzcount1; k1++)
-			ans += nzvals1_p[k1] * x2[sv1->nzoffs[k1]];
-	}
-	return ans;
+	if (nzvals1_p == NULL)  /* lacunar SparseVec */
+		return dispatch_sum_gathered_doubles(x2, sv1->nzoffs, nzcount1);
+	/* regular SparseVec */
+	return dispatch_dotprod_gathered_doubles(nzvals1_p, sv1->nzoffs,
+						 nzcount1, x2);
 }
 
 /* Like _dotprod_doubleSV_finite_doubles() above but makes no assumptions
@@ -73,23 +590,13 @@ double _dotprod_doubleSV_doubles(const SparseVec *sv1, const double *x2)
    This is NOT checked! */
 double _dotprod_intSV_noNA_ints(const SparseVec *sv1, const int *x2)
 {
-	double ans = 0.0;
 	const int *nzvals1_p = get_intSV_nzvals_p(sv1);
 	int nzcount1 = get_SV_nzcount(sv1);
-	if (nzvals1_p == NULL) {
-		/* lacunar SparseVec */
-		for (int k1 = 0; k1 < nzcount1; k1++)
-			ans += (double) x2[sv1->nzoffs[k1]];
-	} else {
-		/* regular SparseVec */
-		for (int k1 = 0; k1 < nzcount1; k1++) {
-			int v1 = nzvals1_p[k1];
-			if (v1 == NA_INTEGER)
-				return NA_REAL;
-			ans += (double) v1 * x2[sv1->nzoffs[k1]];
-		}
-	}
-	return ans;
+	if (nzvals1_p == NULL)  /* lacunar SparseVec */
+		return dispatch_sum_gathered_ints(x2, sv1->nzoffs, nzcount1);
+	/* regular SparseVec */
+	return dispatch_dotprod_gathered_ints(nzvals1_p, sv1->nzoffs,
+					      nzcount1, x2);
 }
 
 /* 'sv1' must contain ints.
@@ -3,11 +3,24 @@
 
 #include "SparseVec.h"
 
+/* _dotprod_finite_doubleSV_doubleSV() uses galloping when one SparseVec
+   has at least that many times more nonzero values than the other. */
+#define GALLOP_MIN_RATIO 32
+
+void _init_SIMD_dispatch(void);
+
 double _dotprod_doubleSV_doubleSV(
 	const SparseVec *sv1,
 	const SparseVec *sv2
 );
 
+double _dotprod_finite_doubleSV_doubleSV(
+	const SparseVec *sv1,
+	const SparseVec *sv2
+);
+
+int _doubleSV_is_finite(const SparseVec *sv);
+
 double _dotprod_doubleSV_finite_doubles(
 	const SparseVec *sv1,
 	const double *x2
@@ -527,3 +527,44 @@ SEXP _subassign_leaf_with_Rvector(SEXP leaf, SEXP index, SEXP Rvector)
 	return ans;
 }
 
+
+
+/****************************************************************************
+ * _collect_subSVTs()
+ */
+
+/* Recursive. 'nsubSVT' is the number of subSVTs to collect from 'SVT'. */
+static void REC_collect_subSVTs(SEXP SVT, const int *dim, int ndim, int d,
+		R_xlen_t nsubSVT, SEXP *subSVTs)
+{
+	if (nsubSVT == 0)
+		return;
+	if (ndim == d) {
+		*subSVTs = SVT;
+		return;
+	}
+	int SVT_len = dim[ndim - 1];
+	R_xlen_t inc = nsubSVT / SVT_len;
+	for (int i = 0; i < SVT_len; i++) {
+		SEXP subSVT = SVT == R_NilValue ? R_NilValue
+						: VECTOR_ELT(SVT, i);
+		REC_collect_subSVTs(subSVT, dim, ndim - 1, d, inc,
+				    subSVTs + inc * i);
+	}
+	return;
+}
+
+/* Stores the subSVTs of 'SVT' that represent the subarrays of 'x' that span
+   its first 'd' dimensions (i.e. 'x[ , ..., , i_{d+1}, ..., i_ndim]') in
+   'subSVTs', in the order of the tail dimensions. Empty subarrays are stored
+   as R_NilValue. With 'd' set to 1, this collects the leaves of 'SVT'.
+   'subSVTs' must have room for 'prod(dim[d:ndim-1])' SEXPs. */
+void _collect_subSVTs(SEXP SVT, const int *dim, int ndim, int d,
+		      SEXP *subSVTs)
+{
+	R_xlen_t nsubSVT = 1;
+	for (int along = d; along < ndim; along++)
+		nsubSVT *= dim[along];
+	REC_collect_subSVTs(SVT, dim, ndim, d, nsubSVT, subSVTs);
+	return;
+}
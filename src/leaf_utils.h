@@ -138,6 +138,30 @@ static inline SparseVec leaf2SV(SEXP leaf, SEXPTYPE Rtype, int len)
 	return toSparseVec(nzvals, nzoffs, Rtype, len);
 }
 
+/* Like leaf2SV() but also accepts an R_NilValue (empty leaf). */
+static inline SparseVec leaf_or_NULL_to_SV(SEXP leaf, SEXPTYPE Rtype,
+					   int len)
+{
+	if (leaf != R_NilValue)
+		return leaf2SV(leaf, Rtype, len);
+	SparseVec sv;
+	sv.Rtype = Rtype;
+	sv.nzvals = NULL;
+	sv.nzoffs = NULL;
+	sv.nzcount = 0;
+	sv.len = len;
+	return sv;
+}
+
+/* Returns column 'j' of the 2D SVT 'SVT' (which can be R_NilValue) as a
+   SparseVec. */
+static inline SparseVec get_SVT_col_as_SV(SEXP SVT, int j,
+					  SEXPTYPE Rtype, int nrow)
+{
+	SEXP leaf = SVT == R_NilValue ? R_NilValue : VECTOR_ELT(SVT, j);
+	return leaf_or_NULL_to_SV(leaf, Rtype, nrow);
+}
+
 SEXP C_lacunar_mode_is_on(void);
 
 SEXP _alloc_leaf(
@@ -228,5 +252,13 @@ SEXP _subassign_leaf_with_Rvector(
 	SEXP Rvector
 );
 
+void _collect_subSVTs(
+	SEXP SVT,
+	const int *dim,
+	int ndim,
+	int d,
+	SEXP *subSVTs
+);
+
 #endif  /* _LEAF_UTILS_H_ */
 
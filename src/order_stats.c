@@ -0,0 +1,282 @@
+/****************************************************************************
+ *                 Order statistics of padded numeric data                  *
+ ****************************************************************************/
+#include "order_stats.h"
+
+#include <float.h>   /* for DBL_EPSILON */
+#include <math.h>    /* for floor(), fabs(), fmod() */
+#include <string.h>  /* for memset() */
+
+
+/****************************************************************************
+ * About padded data
+ *
+ * The functions in this file operate on the nonzero values of a sparse
+ * vector, stored in a buffer of doubles ('x' and 'n' below), plus a number
+ * of implicit copies ('npad') of a padding value ('pad'). The padding value
+ * is the zero of the sparse vector in most cases, but not always e.g. it's
+ * '|center|' when computing the MAD. The padding values are never realized.
+ * The buffer is expected to contain no NA or NaN values.
+ *
+ * Ranks are 0-based and refer to the sorted sequence of the 'n + npad'
+ * values.
+ *
+ * All the functions below are thread-safe. They don't use the R API.
+ */
+
+#define	SWAP(i, j) { double tmp = x[i]; x[i] = x[j]; x[j] = tmp; }
+
+/* Moves the values that are < 'pad' to the beginning of 'x'. Returns their
+   number. */
+static R_xlen_t partition_by_pad(double *x, R_xlen_t n, double pad)
+{
+	R_xlen_t nlow = 0;
+	for (R_xlen_t k = 0; k < n; k++) {
+		if (x[k] < pad) {
+			SWAP(k, nlow);
+			nlow++;
+		}
+	}
+	return nlow;
+}
+
+/* Hoare's selection algorithm with median-of-3 pivot. Reorders 'x' so that
+   'x[k]' is the value of rank 'k', and returns that value. On return, all
+   the values before 'x[k]' are <= 'x[k]' and all the values after it are
+   >= 'x[k]'. */
+static double quickselect(double *x, R_xlen_t n, R_xlen_t k)
+{
+	R_xlen_t lo = 0, hi = n - 1;
+	while (hi > lo) {
+		R_xlen_t mid = lo + (hi - lo) / 2;
+		if (x[mid] < x[lo])
+			SWAP(lo, mid);
+		if (x[hi] < x[lo])
+			SWAP(lo, hi);
+		if (x[hi] < x[mid])
+			SWAP(mid, hi);
+		double pivot = x[mid];
+		R_xlen_t i = lo, j = hi;
+		while (i <= j) {
+			while (x[i] < pivot)
+				i++;
+			while (x[j] > pivot)
+				j--;
+			if (i <= j) {
+				SWAP(i, j);
+				i++;
+				j--;
+			}
+		}
+		/* 'x[lo..j]' <= pivot, 'x[i..hi]' >= pivot, and the values
+		   between 'x[j]' and 'x[i]' (if any) are equal to pivot. */
+		if (k <= j) {
+			hi = j;
+		} else if (k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+	return x[k];
+}
+
+static double min_double(const double *x, R_xlen_t n)
+{
+	double min = R_PosInf;
+	for (R_xlen_t k = 0; k < n; k++)
+		if (x[k] < min)
+			min = x[k];
+	return min;
+}
+
+
+/****************************************************************************
+ * _padded_select()
+ *
+ * Returns the value of rank 'r'. If 'next' is not NULL, also stores the
+ * value of rank 'r + 1' in it ('r + 1' must be < 'n + npad' in that case).
+ * Reorders 'x'.
+ */
+
+double _padded_select(double *x, R_xlen_t n, double pad, R_xlen_t npad,
+		      R_xlen_t r, double *next)
+{
+	/* Sorted sequence is: the values < 'pad', then the padding values,
+	   then the values >= 'pad'. */
+	R_xlen_t nlow = partition_by_pad(x, n, pad);
+	double *high = x + nlow;
+	R_xlen_t nhigh = n - nlow;
+	if (r >= nlow && r < nlow + npad) {
+		if (next != NULL)
+			*next = r + 1 < nlow + npad ? pad
+						    : min_double(high, nhigh);
+		return pad;
+	}
+	double *group;
+	R_xlen_t group_len, k;
+	if (r < nlow) {
+		group = x;
+		group_len = nlow;
+		k = r;
+	} else {
+		group = high;
+		group_len = nhigh;
+		k = r - nlow - npad;
+	}
+	double x_r = quickselect(group, group_len, k);
+	if (next != NULL) {
+		if (k + 1 < group_len) {
+			/* Smallest of the values after 'group[k]'. */
+			*next = min_double(group + k + 1, group_len - k - 1);
+		} else {
+			/* 'r' is the rank of the biggest value < 'pad'. */
+			*next = npad != 0 ? pad : min_double(high, nhigh);
+		}
+	}
+	return x_r;
+}
+
+
+/****************************************************************************
+ * _counting_padded_select()
+ *
+ * Same as _padded_select() but uses a counting sort. Meant to be used on
+ * integer data only (i.e. 'x' must contain integral values). Doesn't touch
+ * 'x'. 'counts' must be a buffer of length at least
+ * 'min(COUNTING_SELECT_MAX_RANGE, n + 1)'.
+ * Returns 0 (and does nothing) if 'pad' is not integral or if the range of
+ * the values is too big for the counting sort to be worth it, and 1
+ * otherwise.
+ */
+
+int _counting_padded_select(const double *x, R_xlen_t n,
+		double pad, R_xlen_t npad,
+		R_xlen_t r, R_xlen_t *counts, double *x_r, double *next)
+{
+	if (pad != floor(pad))
+		return 0;
+	double lo = pad, hi = pad;
+	for (R_xlen_t k = 0; k < n; k++) {
+		if (x[k] < lo)
+			lo = x[k];
+		if (x[k] > hi)
+			hi = x[k];
+	}
+	if (hi - lo >= COUNTING_SELECT_MAX_RANGE || hi - lo > (double) n)
+		return 0;
+	int range = (int) (hi - lo) + 1;
+	memset(counts, 0, sizeof(R_xlen_t) * range);
+	for (R_xlen_t k = 0; k < n; k++)
+		counts[(int) (x[k] - lo)]++;
+	counts[(int) (pad - lo)] += npad;
+	R_xlen_t cum = 0;
+	int v = 0;
+	for ( ; v < range; v++) {
+		cum += counts[v];
+		if (cum > r)
+			break;
+	}
+	*x_r = lo + v;
+	if (next != NULL) {
+		if (cum <= r + 1) {
+			/* Value of rank 'r + 1' is the next value present. */
+			do {
+				v++;
+			} while (counts[v] == 0);
+		}
+		*next = lo + v;
+	}
+	return 1;
+}
+
+
+/****************************************************************************
+ * _padded_median() and _padded_quantile()
+ *
+ * Both reorder 'x'. Both use the counting path first if 'counts' is not
+ * NULL.
+ */
+
+/* Computes the values of ranks 'r' and 'r + 1' (if 'next' is not NULL). */
+static double select2(double *x, R_xlen_t n, double pad, R_xlen_t npad,
+		      R_xlen_t r, double *next, R_xlen_t *counts)
+{
+	double x_r;
+	if (counts != NULL &&
+	    _counting_padded_select(x, n, pad, npad, r, counts, &x_r, next))
+		return x_r;
+	return _padded_select(x, n, pad, npad, r, next);
+}
+
+/* Same as 'median(c(x, rep.int(pad, npad)))'. */
+double _padded_median(double *x, R_xlen_t n, double pad, R_xlen_t npad,
+		      R_xlen_t *counts)
+{
+	R_xlen_t N = n + npad;
+	if (N == 0)
+		return NA_REAL;
+	/* More padding values than other values means that both middle
+	   values are padding values. */
+	if (npad > n)
+		return pad;
+	R_xlen_t r = (N - 1) / 2;
+	if (N % 2 == 1)
+		return select2(x, n, pad, npad, r, NULL, counts);
+	double next, x_r = select2(x, n, pad, npad, r, &next, counts);
+	return (x_r + next) / 2.0;
+}
+
+/* Same as 'quantile(c(x, rep.int(pad, npad)), prob, names=FALSE, type=type)'
+   (see 'stats:::quantile.default'). 'prob' must be in [0, 1] and 'type'
+   in [1, 9]. */
+double _padded_quantile(double *x, R_xlen_t n, double pad, R_xlen_t npad,
+		double prob, int type, R_xlen_t *counts)
+{
+	R_xlen_t N = n + npad;
+	if (N == 0)
+		return NA_REAL;
+	const double fuzz = 4.0 * DBL_EPSILON;
+	double j, h;  /* 'j' is the 1-based rank of the lower value */
+	if (type == 7) {
+		double index = 1.0 + (double) (N - 1) * prob;
+		j = floor(index);
+		h = index - j;
+	} else if (type <= 3) {
+		double nppm = type == 3 ? (double) N * prob - 0.5
+					: (double) N * prob;
+		j = floor(nppm + fuzz);
+		switch (type) {
+		    case 1: h = nppm > j; break;
+		    case 2: h = ((nppm > j) + 1) / 2.0; break;
+		    default: h = nppm != j || fmod(fabs(j), 2.0) == 1.0;
+		}
+	} else {
+		double a, b;
+		switch (type) {
+		    case 4: a = 0.0; b = 1.0; break;
+		    case 5: a = b = 0.5; break;
+		    case 6: a = b = 0.0; break;
+		    case 8: a = b = 1.0 / 3.0; break;
+		    default: a = b = 3.0 / 8.0;
+		}
+		double nppm = a + prob * ((double) N + 1.0 - a - b);
+		j = floor(nppm + fuzz);
+		h = nppm - j;
+		if (fabs(h) < fuzz)
+			h = 0.0;
+	}
+	/* 0-based ranks of the lower and upper values. Like in
+	   quantile.default(), ranks out of bounds are clamped. */
+	R_xlen_t lo = j < 1.0 ? 0 : (j > (double) N ? N - 1 : (R_xlen_t) j - 1);
+	R_xlen_t hi = j < 0.0 ? 0 : (j >= (double) N ? N - 1 : (R_xlen_t) j);
+	if (h == 0.0 || lo == hi)
+		return select2(x, n, pad, npad, lo, NULL, counts);
+	double x_hi, x_lo = select2(x, n, pad, npad, lo, &x_hi, counts);
+	if (h == 1.0)
+		return x_hi;
+	if (x_lo == x_hi)  /* for "Inf, Inf" and "-Inf, -Inf" */
+		return x_lo;
+	return (1.0 - h) * x_lo + h * x_hi;
+}
+
@@ -0,0 +1,49 @@
+#ifndef _ORDER_STATS_H_
+#define _ORDER_STATS_H_
+
+#include <Rdefines.h>
+
+/* The counting path is used on integer data only, and only when the range
+   of the values (including the padding value) is not bigger than this. */
+#define	COUNTING_SELECT_MAX_RANGE	65536
+
+double _padded_select(
+	double *x,
+	R_xlen_t n,
+	double pad,
+	R_xlen_t npad,
+	R_xlen_t r,
+	double *next
+);
+
+int _counting_padded_select(
+	const double *x,
+	R_xlen_t n,
+	double pad,
+	R_xlen_t npad,
+	R_xlen_t r,
+	R_xlen_t *counts,
+	double *x_r,
+	double *next
+);
+
+double _padded_median(
+	double *x,
+	R_xlen_t n,
+	double pad,
+	R_xlen_t npad,
+	R_xlen_t *counts
+);
+
+double _padded_quantile(
+	double *x,
+	R_xlen_t n,
+	double pad,
+	R_xlen_t npad,
+	double prob,
+	int type,
+	R_xlen_t *counts
+);
+
+#endif  /* _ORDER_STATS_H_ */
+
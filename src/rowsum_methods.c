@@ -7,8 +7,10 @@
 
 #include "Rvector_utils.h"
 #include "leaf_utils.h"
+#include "thread_control.h"  /* for _get_max_threads() */
 
 #include <limits.h>  /* for INT_MAX */
+#include <string.h>  /* for memset() */
 
 
 /* Copied from S4Arrays/src/rowsum.c */
@@ -36,6 +38,19 @@ static void check_group(SEXP group, int x_nrow, int ngroup)
 	return;
 }
 
+static void check_weights(SEXP w, int expected_len, SEXPTYPE x_Rtype,
+			  const char *fun)
+{
+	if (!IS_NUMERIC(w) || LENGTH(w) != expected_len)
+		error("SparseArray internal error in %s():\n"
+		      "    'w' must be a double vector of the expected length",
+		      fun);
+	if (x_Rtype != REALSXP && x_Rtype != INTSXP && x_Rtype != LGLSXP)
+		error("weighted sums and means are not supported on "
+		      "SVT_SparseMatrix objects\n  of type \"%s\"",
+		      type2char(x_Rtype));
+	return;
+}
 
 /****************************************************************************
  * Low-level helpers used by C_rowsum_SVT() and C_rowsum_dgCMatrix()
@@ -273,13 +288,122 @@ static void colsum_dgCMatrix(int x_nrow, int x_ncol,
 }
 
 
+/****************************************************************************
+ * Low-level helpers used for the weighted sums and means
+ *
+ * The weights only apply to the nonzero values: the zeros contribute
+ * nothing to the weighted sums so they are never visited. Like in
+ * matrixStats, the values that have a zero weight are ignored (even if
+ * they are NA or NaN).
+ */
+
+/* Adds 'w[i] * x[i]' to 'out[groups[i] - 1]' (or to 'out[0]' if 'groups'
+   is NULL), where 'x' is the dense form of 'sv'. With 'narm', the NAs and
+   NaNs are skipped and their weights are added to '*na_w' (if 'na_w' is
+   not NULL).
+   With 'skip_zero_w', the values with a zero weight are skipped, even if
+   they are NA, NaN, or infinite. This is what matrixStats::weightedMean()
+   does but not what 'rowsum(x * w)' does, so only the weighted means
+   should use it. Without it, the NA test is done on the product, like
+   'rowsum(x * w, na.rm=TRUE)' does (e.g. '0 * Inf' is NaN). */
+static void add_weighted_sparse_vec_to_groups(const SparseVec *sv,
+		const double *w, const int *groups, int narm, int skip_zero_w,
+		double *out, int out_len, double *na_w)
+{
+	for (int k = 0; k < sv->nzcount; k++) {
+		int i = sv->nzoffs[k];
+		double wi = w[i];
+		if (skip_zero_w && wi == 0.0)
+			continue;
+		double v = get_SV_nzval_as_double(sv, k);
+		double wv = wi * v;
+		if (narm && ISNAN(skip_zero_w ? v : wv)) {
+			if (na_w != NULL)
+				*na_w += wi;
+			continue;
+		}
+		int g = 1;
+		if (groups != NULL) {
+			g = groups[i];
+			if (g == NA_INTEGER)
+				g = out_len;
+		}
+		out[g - 1] += wv;
+	}
+	return;
+}
+
+/* Adds 'wj * x' to dense vector 'out', where 'x' is the dense form of
+   'sv'. With 'narm', the NAs and NaNs are skipped and 'wj' is added to
+   'na_w[i]' instead (if 'na_w' is not NULL). See
+   add_weighted_sparse_vec_to_groups() above for 'skip_zero_w'. */
+static void add_weighted_sparse_vec_to_doubles(const SparseVec *sv,
+		double wj, int narm, int skip_zero_w, double *out, double *na_w)
+{
+	if (skip_zero_w && wj == 0.0)
+		return;
+	for (int k = 0; k < sv->nzcount; k++) {
+		int i = sv->nzoffs[k];
+		double v = get_SV_nzval_as_double(sv, k);
+		double wv = wj * v;
+		if (narm && ISNAN(skip_zero_w ? v : wv)) {
+			if (na_w != NULL)
+				na_w[i] += wj;
+			continue;
+		}
+		out[i] += wv;
+	}
+	return;
+}
+
+/* Each column of the result only depends on the corresponding column
+   of 'x' so the columns are processed in parallel. */
+static void weighted_rowsum_SVT(SEXP x_SVT, SEXPTYPE x_Rtype,
+		int x_nrow, int x_ncol,
+		const int *groups, const double *w, int narm,
+		double *out, int out_nrow)
+{
+	if (x_SVT == R_NilValue)
+		return;
+	int nthread = _get_max_threads();
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(nthread)
+	for (int j = 0; j < x_ncol; j++) {
+		SparseVec sv = get_SVT_col_as_SV(x_SVT, j, x_Rtype, x_nrow);
+		add_weighted_sparse_vec_to_groups(&sv, w, groups, narm, 0,
+				out + (R_xlen_t) j * out_nrow, out_nrow, NULL);
+	}
+	return;
+}
+
+/* Several columns of 'x' can contribute to the same column of the result
+   so this one is not parallelized. */
+static void weighted_colsum_SVT(SEXP x_SVT, SEXPTYPE x_Rtype,
+		int x_nrow, int x_ncol,
+		const int *groups, const double *w, int narm,
+		double *out, int out_ncol)
+{
+	if (x_SVT == R_NilValue)
+		return;
+	for (int j = 0; j < x_ncol; j++) {
+		SparseVec sv = get_SVT_col_as_SV(x_SVT, j, x_Rtype, x_nrow);
+		int g = groups[j];
+		if (g == NA_INTEGER)
+			g = out_ncol;
+		g--;  // from 1-base to 0-base
+		add_weighted_sparse_vec_to_doubles(&sv, w[j], narm, 0,
+				out + (R_xlen_t) g * x_nrow, NULL);
+	}
+	return;
+}
+
+
 /****************************************************************************
  * C_rowsum_SVT() and C_rowsum_dgCMatrix()
  */
 
 /* --- .Call ENTRY POINT --- */
 SEXP C_rowsum_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
-		  SEXP group, SEXP ngroup, SEXP na_rm)
+		  SEXP group, SEXP ngroup, SEXP na_rm, SEXP w)
 {
 	if (LENGTH(x_dim) != 2)
 		error("input object must have 2 dimensions");
@@ -306,7 +430,13 @@ SEXP C_rowsum_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 	/* Note that base::rowsum() only supports numeric matrices i.e.
 	   matrices of type() "double" or "integer", so we do the same. */
 	SEXP ans;
-	if (x_Rtype == REALSXP) {
+	if (w != R_NilValue) {
+		check_weights(w, x_nrow, x_Rtype, "C_rowsum_SVT");
+		ans = PROTECT(_new_Rmatrix0(REALSXP, ans_nrow, x_ncol,
+					    R_NilValue));
+		weighted_rowsum_SVT(x_SVT, x_Rtype, x_nrow, x_ncol,
+			INTEGER(group), REAL(w), narm, REAL(ans), ans_nrow);
+	} else if (x_Rtype == REALSXP) {
 		ans = PROTECT(_new_Rmatrix0(REALSXP, ans_nrow, x_ncol,
 					    R_NilValue));
 		rowsum_SVT_double(x_SVT, x_nrow, x_ncol,
@@ -365,7 +495,7 @@ SEXP C_rowsum_dgCMatrix(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 
 /* --- .Call ENTRY POINT --- */
 SEXP C_colsum_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
-		  SEXP group, SEXP ngroup, SEXP na_rm)
+		  SEXP group, SEXP ngroup, SEXP na_rm, SEXP w)
 {
 	if (LENGTH(x_dim) != 2)
 		error("input object must have 2 dimensions");
@@ -392,7 +522,13 @@ SEXP C_colsum_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
 	/* Note that base::rowsum() only supports numeric matrices i.e.
 	   matrices of type() "double" or "integer", so we do the same. */
 	SEXP ans;
-	if (x_Rtype == REALSXP) {
+	if (w != R_NilValue) {
+		check_weights(w, x_ncol, x_Rtype, "C_colsum_SVT");
+		ans = PROTECT(_new_Rmatrix0(REALSXP, x_nrow, ans_ncol,
+					    R_NilValue));
+		weighted_colsum_SVT(x_SVT, x_Rtype, x_nrow, x_ncol,
+			INTEGER(group), REAL(w), narm, REAL(ans), ans_ncol);
+	} else if (x_Rtype == REALSXP) {
 		ans = PROTECT(_new_Rmatrix0(REALSXP, x_nrow, ans_ncol,
 					    R_NilValue));
 		colsum_SVT_double(x_SVT, x_nrow, x_ncol,
@@ -444,3 +580,106 @@ SEXP C_colsum_dgCMatrix(SEXP x, SEXP group, SEXP ngroup, SEXP na_rm)
 	return ans;
 }
 
+
+/****************************************************************************
+ * C_colWeightedMeans_SVT() and C_rowWeightedMeans_SVT()
+ *
+ * The denominator is the sum of all the weights, minus the weights of the
+ * NAs and NaNs when 'na_rm' is TRUE.
+ */
+
+static double sum_weights(const double *w, int n)
+{
+	double sum = 0.0;
+	for (int i = 0; i < n; i++)
+		sum += w[i];
+	return sum;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_colWeightedMeans_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			    SEXP w, SEXP na_rm)
+{
+	if (LENGTH(x_dim) != 2)
+		error("input object must have 2 dimensions");
+	int x_nrow = INTEGER(x_dim)[0];
+	int x_ncol = INTEGER(x_dim)[1];
+	int narm = LOGICAL(na_rm)[0];
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	check_weights(w, x_nrow, x_Rtype, "C_colWeightedMeans_SVT");
+	const double *w_p = REAL(w);
+	double sum_w = sum_weights(w_p, x_nrow);
+
+	SEXP ans = PROTECT(NEW_NUMERIC(x_ncol));
+	double *out = REAL(ans);
+	int nthread = _get_max_threads();
+	#pragma omp parallel for schedule(dynamic, 16) num_threads(nthread)
+	for (int j = 0; j < x_ncol; j++) {
+		SparseVec sv = get_SVT_col_as_SV(x_SVT, j, x_Rtype, x_nrow);
+		double sum = 0.0, na_w = 0.0;
+		add_weighted_sparse_vec_to_groups(&sv, w_p, NULL, narm, 1,
+				&sum, 1, &na_w);
+		out[j] = sum / (sum_w - na_w);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_rowWeightedMeans_SVT(SEXP x_dim, SEXP x_type, SEXP x_SVT,
+			    SEXP w, SEXP na_rm)
+{
+	if (LENGTH(x_dim) != 2)
+		error("input object must have 2 dimensions");
+	int x_nrow = INTEGER(x_dim)[0];
+	int x_ncol = INTEGER(x_dim)[1];
+	int narm = LOGICAL(na_rm)[0];
+	SEXPTYPE x_Rtype = _get_Rtype_from_Rstring(x_type);
+	check_weights(w, x_ncol, x_Rtype, "C_rowWeightedMeans_SVT");
+	const double *w_p = REAL(w);
+	double sum_w = sum_weights(w_p, x_ncol);
+
+	/* Each thread walks a contiguous range of columns and accumulates
+	   into its own 'sums' and 'na_ws' buffers. The buffers are merged
+	   in thread order at the end so the result only depends on the
+	   number of threads. */
+	int nthread = _get_max_threads();
+	if (nthread > x_ncol)
+		nthread = x_ncol;
+	if (nthread < 1 || x_SVT == R_NilValue)
+		nthread = 1;
+	double **sums = (double **) R_alloc(nthread, sizeof(double *));
+	double **na_ws = (double **) R_alloc(nthread, sizeof(double *));
+	for (int t = 0; t < nthread; t++) {
+		sums[t] = (double *) R_alloc(x_nrow, sizeof(double));
+		memset(sums[t], 0, sizeof(double) * x_nrow);
+		na_ws[t] = (double *) R_alloc(x_nrow, sizeof(double));
+		memset(na_ws[t], 0, sizeof(double) * x_nrow);
+	}
+	if (x_SVT != R_NilValue) {
+		#pragma omp parallel for schedule(static) num_threads(nthread)
+		for (int t = 0; t < nthread; t++) {
+			int j1 = (int) ((R_xlen_t) x_ncol * t / nthread);
+			int j2 = (int) ((R_xlen_t) x_ncol * (t + 1) / nthread);
+			for (int j = j1; j < j2; j++) {
+				SparseVec sv = get_SVT_col_as_SV(x_SVT, j,
+							x_Rtype, x_nrow);
+				add_weighted_sparse_vec_to_doubles(&sv,
+					w_p[j], narm, 1, sums[t], na_ws[t]);
+			}
+		}
+	}
+
+	SEXP ans = PROTECT(NEW_NUMERIC(x_nrow));
+	double *out = REAL(ans);
+	for (int i = 0; i < x_nrow; i++) {
+		double sum = sums[0][i], na_w = na_ws[0][i];
+		for (int t = 1; t < nthread; t++) {
+			sum += sums[t][i];
+			na_w += na_ws[t][i];
+		}
+		out[i] = sum / (sum_w - na_w);
+	}
+	UNPROTECT(1);
+	return ans;
+}
@@ -9,7 +9,8 @@ SEXP C_rowsum_SVT(
 	SEXP x_SVT,
 	SEXP group,
 	SEXP ngroup,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP w
 );
 
 SEXP C_rowsum_dgCMatrix(
@@ -25,7 +26,8 @@ SEXP C_colsum_SVT(
 	SEXP x_SVT,
 	SEXP group,
 	SEXP ngroup,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP w
 );
 
 SEXP C_colsum_dgCMatrix(
@@ -35,5 +37,21 @@ SEXP C_colsum_dgCMatrix(
 	SEXP na_rm
 );
 
+SEXP C_colWeightedMeans_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP w,
+	SEXP na_rm
+);
+
+SEXP C_rowWeightedMeans_SVT(
+	SEXP x_dim,
+	SEXP x_type,
+	SEXP x_SVT,
+	SEXP w,
+	SEXP na_rm
+);
+
 #endif  /* _ROWSUM_METHODS_H_ */
 
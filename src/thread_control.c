@@ -39,6 +39,34 @@ static void set_max_threads(int nthread)
 }
 
 
+/****************************************************************************
+ * _get_max_threads() and _get_thread_num()
+ *
+ * To be used by C code that needs to allocate one buffer per thread before
+ * entering a parallel region. Unlike get_max_threads() above,
+ * _get_max_threads() always returns a value >= 1.
+ */
+
+int _get_max_threads(void)
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+/* Returns a value >= 0 and < _get_max_threads(). */
+int _get_thread_num(void)
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+
 /****************************************************************************
  * .Call ENTRY POINTS
  */
@@ -20,6 +20,10 @@ static inline int which_max(const int *x, int x_len)
 	return max_idx;
 }
 
+int _get_max_threads(void);
+
+int _get_thread_num(void);
+
 SEXP C_get_num_procs(void);
 
 SEXP C_get_max_threads(void);